@@ -0,0 +1,215 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <ewig/packed_block.hpp>
+
+#include <immer/flex_vector_transient.hpp>
+
+#include <algorithm>
+
+using namespace ewig;
+using namespace ewig::bench;
+
+namespace {
+
+// Every edit starts from the same state, so we measure the cost of
+// one edit on a buffer of the given size.
+template <typename Fn>
+void edit(benchmark::State& state, buffer buf, Fn fn)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(fn(buf));
+}
+
+void buffer_insert_char(benchmark::State& state, corpus kind)
+{
+    edit(state, make_buffer(kind, state.range(0)),
+         [] (auto buf) { return insert_char(buf, L'x'); });
+}
+EWIG_BENCHMARK_CORPORA(buffer_insert_char);
+
+// Types at 256 cursors, in lines spread all over the buffer
+void buffer_insert_char_cursors(benchmark::State& state, corpus kind)
+{
+    auto buf     = make_buffer(kind, state.range(0));
+    auto cursors = cursor_set{}.transient();
+    auto step    = std::max<index>(buf.content.size() / 256, 1);
+    for (auto row = index{}; row < (index)buf.content.size(); row += step)
+        cursors.push_back({row, 0});
+    buf.cursors = cursors.persistent();
+    edit(state, buf, [] (auto buf) {
+        return edit_every_cursor(buf, [] (auto buf) {
+            return insert_char(buf, L'x');
+        });
+    });
+}
+EWIG_BENCHMARK_CORPORA(buffer_insert_char_cursors);
+
+void buffer_delete_char(benchmark::State& state, corpus kind)
+{
+    edit(state, make_buffer(kind, state.range(0)), delete_char);
+}
+EWIG_BENCHMARK_CORPORA(buffer_delete_char);
+
+void buffer_insert_text(benchmark::State& state, corpus kind)
+{
+    auto paste = to_text(make_corpus(kind, 1 << 14));
+    edit(state, make_buffer(kind, state.range(0)),
+         [&] (auto buf) { return insert_text(buf, paste); });
+}
+EWIG_BENCHMARK_CORPORA(buffer_insert_text);
+
+void buffer_copy_all(benchmark::State& state, corpus kind)
+{
+    edit(state, select_whole_buffer(make_buffer(kind, state.range(0))), copy);
+}
+EWIG_BENCHMARK_CORPORA(buffer_copy_all);
+
+void buffer_cut_all(benchmark::State& state, corpus kind)
+{
+    edit(state, select_whole_buffer(make_buffer(kind, state.range(0))), cut);
+}
+EWIG_BENCHMARK_CORPORA(buffer_cut_all);
+
+void buffer_cut_half(benchmark::State& state, corpus kind)
+{
+    auto buf = start_selection(make_buffer(kind, state.range(0)));
+    buf.cursor = {0, 0};
+    edit(state, buf, cut);
+}
+EWIG_BENCHMARK_CORPORA(buffer_cut_half);
+
+void buffer_undo(benchmark::State& state, corpus kind)
+{
+    // new lines interrupt the coalescing of typed characters, so each
+    // pair of edits leaves an entry in the history
+    constexpr auto num_edits = 1000;
+    auto buf = make_buffer(kind, state.range(0));
+    for (auto i = 0; i < num_edits; ++i) {
+        buf = record(buf, insert_char(buf, L'x')).first;
+        buf = record(buf, insert_new_line(buf)).first;
+    }
+    edit(state, buf, undo);
+}
+EWIG_BENCHMARK_CORPORA(buffer_undo);
+
+// Long lines are where converting between columns and bytes hurts the
+// most, so the corpus is doubled to have somewhere to move to.
+buffer make_movement_buffer(corpus kind, std::size_t bytes)
+{
+    auto buf = make_buffer(kind, bytes);
+    if (buf.content.size() == 1)
+        buf = set_content(buf, buf.content.push_back(buf.content[0]));
+    return buf;
+}
+
+void buffer_move_cursor_left(benchmark::State& state, corpus kind)
+{
+    edit(state, make_movement_buffer(kind, state.range(0)), move_cursor_left);
+}
+EWIG_BENCHMARK_CORPORA(buffer_move_cursor_left);
+
+void buffer_move_cursor_right(benchmark::State& state, corpus kind)
+{
+    edit(state, make_movement_buffer(kind, state.range(0)), move_cursor_right);
+}
+EWIG_BENCHMARK_CORPORA(buffer_move_cursor_right);
+
+void buffer_move_cursor_down(benchmark::State& state, corpus kind)
+{
+    edit(state, make_movement_buffer(kind, state.range(0)), move_cursor_down);
+}
+EWIG_BENCHMARK_CORPORA(buffer_move_cursor_down);
+
+void buffer_move_cursor_up(benchmark::State& state, corpus kind)
+{
+    auto buf = make_movement_buffer(kind, state.range(0));
+    buf.cursor.row = std::max(buf.cursor.row, ewig::index{1});
+    edit(state, buf, move_cursor_up);
+}
+EWIG_BENCHMARK_CORPORA(buffer_move_cursor_up);
+
+void buffer_move_line_end(benchmark::State& state, corpus kind)
+{
+    edit(state, make_movement_buffer(kind, state.range(0)), move_line_end);
+}
+EWIG_BENCHMARK_CORPORA(buffer_move_line_end);
+
+// Indents every line, the slices of the text being transformed by all
+// the threads
+void buffer_transform_lines(benchmark::State& state, corpus kind)
+{
+    auto workers = executor{};
+    auto buf     = make_buffer(kind, state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            transform_lines(workers, buf.content, buf.offsets,
+                            0, buf.content.size(), indent_line));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA_WITH(buffer_transform_lines, corpus_sizes_real_time);
+
+// Packs every line, like cold storage does with the ones out of sight
+void buffer_pack_lines(benchmark::State& state, corpus kind)
+{
+    auto buf = make_buffer(kind, state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(pack_lines(buf.content));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA(buffer_pack_lines);
+
+// Reads every packed line, most of them being decompressed again
+void buffer_read_packed(benchmark::State& state, corpus kind)
+{
+    auto buf = make_buffer(kind, state.range(0));
+    buf.content = pack_lines(buf.content);
+    for (auto _ : state) {
+        auto sum = std::size_t{};
+        immer::for_each(buf.content, [&] (auto&& ln) {
+            ln.for_each_chunk([&] (auto first, auto last) {
+                sum += std::count(first, last, ' ');
+            });
+        });
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA(buffer_read_packed);
+
+// Diffs the text against a copy where a few lines, spread all over it,
+// were changed, like when the file is reverted after some small edits
+void buffer_diff_lines(benchmark::State& state, corpus kind)
+{
+    auto buf     = make_buffer(kind, state.range(0));
+    auto changed = buf.content;
+    auto mark    = to_text("!")[0];
+    auto step    = std::max<std::size_t>(changed.size() / 16, 1);
+    for (auto row = std::size_t{}; row < changed.size(); row += step)
+        changed = changed.set(row, changed[row] + mark);
+    auto offsets = line_index{changed};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(diff_lines(buf.offsets, offsets));
+}
+EWIG_BENCHMARK_CORPORA(buffer_diff_lines);
+
+} // anonymous namespace
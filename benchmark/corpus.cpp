@@ -0,0 +1,119 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+
+namespace ewig {
+namespace bench {
+
+namespace {
+
+const char* const ascii_words[] = {
+    "the", "immutable", "text", "editor", "is", "eternal", "and", "a",
+    "value", "of", "lines", "that", "share", "structure", "with", "undo",
+};
+
+const char* const non_ascii_words[] = {
+    "ewig", "größe", "español", "λόγος", "редактор", "テキスト", "编辑器",
+    "😀", "\t", "ẞ", "ça", "ün",
+};
+
+template <std::size_t N>
+void append_words(std::string& str, std::size_t bytes,
+                  const char* const (&words)[N], std::size_t line_bytes)
+{
+    auto gen  = std::mt19937{42};
+    auto pick = std::uniform_int_distribution<std::size_t>{0, N - 1};
+    auto line_start = str.size();
+    while (str.size() < bytes) {
+        str += words[pick(gen)];
+        if (line_bytes && str.size() - line_start >= line_bytes) {
+            str += '\n';
+            line_start = str.size();
+        } else {
+            str += ' ';
+        }
+    }
+}
+
+} // anonymous namespace
+
+const char* corpus_name(corpus kind)
+{
+    switch (kind) {
+    case corpus::short_lines: return "short_lines";
+    case corpus::long_line:   return "long_line";
+    case corpus::non_ascii:   return "non_ascii";
+    }
+    return "unknown";
+}
+
+std::string make_corpus(corpus kind, std::size_t bytes)
+{
+    auto str = std::string{};
+    str.reserve(bytes + 32);
+    switch (kind) {
+    case corpus::short_lines:
+        append_words(str, bytes, ascii_words, 60);
+        break;
+    case corpus::long_line:
+        append_words(str, bytes, ascii_words, 0);
+        break;
+    case corpus::non_ascii:
+        append_words(str, bytes, non_ascii_words, 60);
+        break;
+    }
+    return str;
+}
+
+buffer make_buffer(corpus kind, std::size_t bytes)
+{
+    auto buf    = set_content({}, to_text(make_corpus(kind, bytes)));
+    buf.from    = existing_file{"corpus", buf.content, buf.offsets};
+    auto row    = (index)buf.content.size() / 2;
+    buf.cursor  = {row, line_length(buf.content[row]) / 2};
+    return buf;
+}
+
+std::string make_corpus_file(corpus kind, std::size_t bytes)
+{
+    auto dir   = std::getenv("TMPDIR");
+    auto fname = std::string{dir ? dir : "/tmp"} + "/ewig-bench-"
+        + corpus_name(kind) + "-" + std::to_string(bytes) + ".txt";
+    if (!std::ifstream{fname}) {
+        // written aside first so an interrupted run leaves no
+        // truncated corpus behind
+        auto temp_name = fname + ".tmp";
+        auto file = std::ofstream{temp_name};
+        file.exceptions(std::fstream::badbit | std::fstream::failbit);
+        file << make_corpus(kind, bytes);
+        file.close();
+        std::rename(temp_name.c_str(), fname.c_str());
+    }
+    return fname;
+}
+
+} // namespace bench
+} // namespace ewig
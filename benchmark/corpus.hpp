@@ -0,0 +1,81 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/buffer.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+namespace ewig {
+namespace bench {
+
+enum class corpus
+{
+    short_lines, //< many lines of prose, around 60 bytes each
+    long_line,   //< a single enormous line
+    non_ascii,   //< lines of mostly multi-byte code points and tabs
+};
+
+const char* corpus_name(corpus kind);
+
+// Returns `bytes` of synthetic contents of the given kind, always the
+// same for the same arguments.
+std::string make_corpus(corpus kind, std::size_t bytes);
+
+// Returns a buffer holding the synthetic contents, with the cursor in
+// the middle of it.
+buffer make_buffer(corpus kind, std::size_t bytes);
+
+// Writes the synthetic contents into a temporary file and returns its
+// name.  The file is reused by following calls with the same arguments.
+std::string make_corpus_file(corpus kind, std::size_t bytes);
+
+// Runs the benchmark with corpora from 64 KiB to 16 MiB.
+inline void corpus_sizes(benchmark::internal::Benchmark* b)
+{
+    b->RangeMultiplier(16)->Range(1 << 16, 1 << 24);
+}
+
+// Like `corpus_sizes`, measuring wall time, for work that happens in
+// other threads.
+inline void corpus_sizes_real_time(benchmark::internal::Benchmark* b)
+{
+    corpus_sizes(b);
+    b->UseRealTime();
+}
+
+} // namespace bench
+} // namespace ewig
+
+// Registers the benchmark `fn`, that takes a `corpus` as argument, for
+// every kind of synthetic corpus, configured by `apply`.
+#define EWIG_BENCHMARK_CORPORA_WITH(fn, apply)                          \
+    BENCHMARK_CAPTURE(fn, short_lines, ::ewig::bench::corpus::short_lines) \
+        ->Apply(apply);                                                 \
+    BENCHMARK_CAPTURE(fn, long_line, ::ewig::bench::corpus::long_line)  \
+        ->Apply(apply);                                                 \
+    BENCHMARK_CAPTURE(fn, non_ascii, ::ewig::bench::corpus::non_ascii)  \
+        ->Apply(apply)
+
+#define EWIG_BENCHMARK_CORPORA(fn)                                      \
+    EWIG_BENCHMARK_CORPORA_WITH(fn, ::ewig::bench::corpus_sizes)
@@ -0,0 +1,151 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <ewig/draw.hpp>
+
+#include <algorithm>
+#include <cstdio>
+
+extern "C" {
+#include <ncurses.h>
+}
+
+using namespace ewig;
+using namespace ewig::bench;
+
+namespace {
+
+// An ncurses screen that writes to /dev/null, so we measure the
+// drawing code and the terminal output ncurses generates for it,
+// without a terminal.
+struct headless_screen
+{
+    headless_screen(coord size)
+        : out_{std::fopen("/dev/null", "w")}
+        , in_{std::fopen("/dev/null", "r")}
+        , screen_{out_ && in_ ? ::newterm("xterm", out_, in_) : nullptr}
+    {
+        if (screen_) {
+            ::set_term(screen_);
+            ::resize_term(size.row, size.col);
+            invalidate_screen();
+        }
+    }
+
+    ~headless_screen()
+    {
+        if (screen_) {
+            ::endwin();
+            ::delscreen(screen_);
+        }
+        if (out_) std::fclose(out_);
+        if (in_) std::fclose(in_);
+    }
+
+    explicit operator bool() const { return screen_; }
+
+private:
+    std::FILE* out_;
+    std::FILE* in_;
+    SCREEN* screen_;
+};
+
+constexpr auto screen_size = coord{60, 200};
+
+void draw_frame(const buffer& buf)
+{
+    ::move(0, 0);
+    draw_text(buf, screen_size);
+    ::refresh();
+}
+
+void draw_full(benchmark::State& state, corpus kind)
+{
+    auto screen = headless_screen{screen_size};
+    if (!screen) {
+        state.SkipWithError("can't create a headless terminal");
+        return;
+    }
+    auto buf = make_buffer(kind, state.range(0));
+    buf.scroll.row = buf.cursor.row;
+    for (auto _ : state) {
+        invalidate_screen();
+        draw_frame(buf);
+    }
+}
+EWIG_BENCHMARK_CORPORA(draw_full);
+
+void draw_typing(benchmark::State& state, corpus kind)
+{
+    auto screen = headless_screen{screen_size};
+    if (!screen) {
+        state.SkipWithError("can't create a headless terminal");
+        return;
+    }
+    auto buf = make_buffer(kind, state.range(0));
+    buf.scroll.row = buf.cursor.row;
+    draw_frame(buf);
+    for (auto _ : state) {
+        buf = insert_char(buf, L'x');
+        draw_frame(buf);
+    }
+}
+EWIG_BENCHMARK_CORPORA(draw_typing);
+
+void draw_scrolling(benchmark::State& state, corpus kind)
+{
+    auto screen = headless_screen{screen_size};
+    if (!screen) {
+        state.SkipWithError("can't create a headless terminal");
+        return;
+    }
+    auto buf = make_buffer(kind, state.range(0));
+    draw_frame(buf);
+    for (auto _ : state) {
+        buf.scroll.row = (buf.scroll.row + 1) % buf.content.size();
+        draw_frame(buf);
+    }
+}
+EWIG_BENCHMARK_CORPORA(draw_scrolling);
+
+// Scrolls right a screen at a time, which for the long line means
+// drawing far from where it starts
+void draw_scrolling_right(benchmark::State& state, corpus kind)
+{
+    auto screen = headless_screen{screen_size};
+    if (!screen) {
+        state.SkipWithError("can't create a headless terminal");
+        return;
+    }
+    auto buf = make_buffer(kind, state.range(0));
+    auto& ln   = get_line(buf.content, buf.cursor.row);
+    auto width = std::max(1, expand_tabs(ln, line_length(ln)));
+    buf.scroll.row = buf.cursor.row;
+    draw_frame(buf);
+    for (auto _ : state) {
+        buf.scroll.col = (buf.scroll.col + screen_size.col) % width;
+        draw_frame(buf);
+    }
+}
+EWIG_BENCHMARK_CORPORA(draw_scrolling_right);
+
+} // anonymous namespace
@@ -0,0 +1,58 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <ewig/highlight.hpp>
+
+using namespace ewig;
+using namespace ewig::bench;
+
+namespace {
+
+highlighting highlight(const highlighting& prev, const buffer& buf)
+{
+    return rehighlight(prev, syntax::c_like, buf.content, buf.offsets,
+                       cancellation{}, [] (auto&&) {});
+}
+
+// Lexes the whole text, like when a file is loaded
+void highlight_full(benchmark::State& state, corpus kind)
+{
+    auto buf = make_buffer(kind, state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(highlight({}, buf));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA(highlight_full);
+
+// Lexes again after typing a character in the middle of the text, which
+// should only lex the line that changed
+void highlight_after_edit(benchmark::State& state, corpus kind)
+{
+    auto buf    = make_buffer(kind, state.range(0));
+    auto before = highlight({}, buf);
+    auto edited = insert_char(buf, 'x');
+    for (auto _ : state)
+        benchmark::DoNotOptimize(highlight(before, edited));
+}
+EWIG_BENCHMARK_CORPORA(highlight_after_edit);
+
+} // anonymous namespace
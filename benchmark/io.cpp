@@ -0,0 +1,123 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <ewig/executor.hpp>
+#include <ewig/state_file.hpp>
+
+#include <scelta.hpp>
+
+#include <cstdio>
+
+using namespace ewig;
+using namespace ewig::bench;
+
+namespace {
+
+// Runs the effect of an I/O operation, like the editor would, and
+// returns the last action it dispatched.
+std::optional<buffer_action> run_effect(executor& pool,
+                                        const effect<buffer_action>& eff)
+{
+    auto serv = boost::asio::io_service{};
+    auto io   = io_scheduler{pool};
+    auto last = std::optional<buffer_action>{};
+    auto ctx  = context<buffer_action>{
+        serv, pool, io, [] {},
+        [&] (auto act) { serv.post([&, act] { last = act; }); }};
+    eff(ctx);
+    serv.run();
+    return last;
+}
+
+void io_load(benchmark::State& state, corpus kind)
+{
+    auto fname = make_corpus_file(kind, state.range(0));
+    auto pool  = executor{};
+    for (auto _ : state) {
+        auto [buf, eff] = load_buffer(buffer{}, fname);
+        auto last = run_effect(pool, eff);
+        if (!last || !std::holds_alternative<load_done_action>(*last)) {
+            state.SkipWithError("could not load the corpus");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA_WITH(io_load, corpus_sizes_real_time);
+
+void io_save(benchmark::State& state, corpus kind)
+{
+    auto fname = make_corpus_file(kind, state.range(0)) + ".saved";
+    auto pool  = executor{};
+    auto buf   = make_buffer(kind, state.range(0));
+    buf.from   = existing_file{fname, buf.content, buf.offsets};
+    buf        = insert_char(buf, L'x');
+    for (auto _ : state) {
+        auto [saving, eff] = save_buffer(buf);
+        auto last = run_effect(pool, eff);
+        if (!last || !std::holds_alternative<save_done_action>(*last)) {
+            state.SkipWithError("could not save the corpus");
+            break;
+        }
+    }
+    std::remove(fname.c_str());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA_WITH(io_save, corpus_sizes_real_time);
+
+// The state of a buffer with some undo history, most of which is shared
+application make_state(corpus kind, std::size_t bytes)
+{
+    auto app    = application{};
+    app.current = make_buffer(kind, bytes);
+    auto& buf   = app.current;
+    for (auto i = 0; i < 100; ++i) {
+        buf = record(buf, insert_char(buf, L'x')).first;
+        buf = record(buf, insert_new_line(buf)).first;
+    }
+    return app;
+}
+
+void io_save_state(benchmark::State& state, corpus kind)
+{
+    auto fname = make_corpus_file(kind, state.range(0)) + ".state";
+    auto app   = make_state(kind, state.range(0));
+    for (auto _ : state)
+        save_state(fname, app);
+    std::remove(fname.c_str());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA(io_save_state);
+
+void io_restore_state(benchmark::State& state, corpus kind)
+{
+    auto fname = make_corpus_file(kind, state.range(0)) + ".state";
+    auto pool  = executor{};
+    save_state(fname, make_state(kind, state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(restore_state(pool, fname, application{}));
+    std::remove(fname.c_str());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+EWIG_BENCHMARK_CORPORA_WITH(io_restore_state, corpus_sizes_real_time);
+
+} // anonymous namespace
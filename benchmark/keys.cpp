@@ -0,0 +1,80 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/application.hpp>
+
+#include <benchmark/benchmark.h>
+
+using namespace ewig;
+
+namespace {
+
+// Bindings like the default ones, without the special keys that need
+// a terminal.  Built when first used, like the default ones.
+const key_map& bench_key_map()
+{
+    static const auto keys = make_key_map(
+    {
+        {key::seq(key::ctrl('p')), "move-up"},
+        {key::seq(key::ctrl('n')), "move-down"},
+        {key::seq(key::ctrl('b')), "move-left"},
+        {key::seq(key::ctrl('f')), "move-right"},
+        {key::seq(key::ctrl('a')), "move-beginning-of-line"},
+        {key::seq(key::ctrl('e')), "move-end-of-line"},
+        {key::seq(key::ctrl('k')), "kill-line"},
+        {key::seq(key::ctrl('w')), "cut"},
+        {key::seq(key::ctrl('y')), "paste"},
+        {key::seq(key::ctrl('x'), key::ctrl('C')), "quit"},
+        {key::seq(key::ctrl('x'), key::ctrl('S')), "save"},
+        {key::seq(key::ctrl('x'), 'h'), "select-whole-buffer"},
+        {key::seq(key::ctrl('x'), '['), "move-beginning-buffer"},
+        {key::seq(key::ctrl('x'), ']'), "move-end-buffer"},
+        {key::seq(key::alt('w')),  "copy"},
+        {key::seq(key::alt('g'), 'g'), "goto-line"},
+        {key::seq(key::alt('g'), 'c'), "goto-byte"},
+    }, find_command);
+    return keys;
+}
+
+void keys_lookup(benchmark::State& state)
+{
+    auto& map = bench_key_map();
+    auto keys = key::seq(key::alt('g'), 'g');
+    for (auto _ : state) {
+        auto n = std::optional<key_map::node>{key_map::root};
+        for (auto& k : keys)
+            n = map.next(*n, k);
+        benchmark::DoNotOptimize(map.id(*n));
+    }
+}
+BENCHMARK(keys_lookup);
+
+// A key that only starts a sequence, so nothing but the input changes
+void keys_prefix_action(benchmark::State& state)
+{
+    auto app = application{};
+    app.keys = bench_key_map();
+    auto key = key_action{key::ctrl('x')[0]};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(update(app, key));
+}
+BENCHMARK(keys_prefix_action);
+
+} // anonymous namespace
@@ -0,0 +1,104 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "corpus.hpp"
+
+#include <ewig/keys.hpp>
+#include <ewig/memory_policy.hpp>
+
+#include <immer/flex_vector.hpp>
+#include <immer/vector.hpp>
+
+#include <algorithm>
+
+using namespace ewig;
+using namespace ewig::bench;
+
+namespace {
+
+// The same work with every memory policy, to choose the
+// `EWIG_MEMORY_POLICY` that fits the machine best.
+
+template <typename MP>
+void memory_type_in_line(benchmark::State& state)
+{
+    auto str = make_corpus(corpus::long_line, state.range(0));
+    auto ln  = immer::flex_vector<char, MP>{str.begin(), str.end()};
+    auto pos = ln.size() / 2;
+    for (auto _ : state) {
+        auto r = ln;
+        for (auto i = std::size_t{}; i < 64; ++i)
+            r = r.take(pos + i).push_back('x') + r.drop(pos + i);
+        benchmark::DoNotOptimize(r);
+    }
+}
+
+template <typename MP>
+void memory_copy_lines(benchmark::State& state)
+{
+    using line_t = immer::flex_vector<char, MP>;
+    using text_t = immer::flex_vector<line_t, MP>;
+    auto str = make_corpus(corpus::short_lines, state.range(0));
+    auto txt = text_t{};
+    for (auto first = str.begin(); first != str.end();) {
+        auto last = std::find(first, str.end(), '\n');
+        txt = std::move(txt).push_back(line_t{first, last});
+        first = last == str.end() ? last : last + 1;
+    }
+    for (auto _ : state) {
+        // changing every line allocates and frees a node per line
+        auto r = txt;
+        for (auto i = std::size_t{}; i < r.size(); ++i)
+            r = std::move(r).update(i, [] (auto ln) {
+                return std::move(ln).push_back('x');
+            });
+        benchmark::DoNotOptimize(r);
+    }
+}
+
+template <typename MP>
+void memory_key_seq(benchmark::State& state)
+{
+    for (auto _ : state) {
+        auto r = immer::vector<key_code, MP>{};
+        for (auto i = 0; i < 3; ++i)
+            r = std::move(r).push_back(key_code{});
+        benchmark::DoNotOptimize(r);
+    }
+}
+
+void text_size(benchmark::internal::Benchmark* b)
+{
+    b->Arg(1 << 20);
+}
+
+void no_size(benchmark::internal::Benchmark*) {}
+
+#define EWIG_BENCHMARK_MEMORY_POLICIES(fn, apply)                       \
+    BENCHMARK_TEMPLATE(fn, immer::default_memory_policy)->Apply(apply); \
+    BENCHMARK_TEMPLATE(fn, memory::plain)->Apply(apply);                \
+    BENCHMARK_TEMPLATE(fn, memory::pooled)->Apply(apply);               \
+    BENCHMARK_TEMPLATE(fn, memory::unsafe_pooled)->Apply(apply)
+
+EWIG_BENCHMARK_MEMORY_POLICIES(memory_type_in_line, corpus_sizes);
+EWIG_BENCHMARK_MEMORY_POLICIES(memory_copy_lines, text_size);
+EWIG_BENCHMARK_MEMORY_POLICIES(memory_key_seq, no_size);
+
+} // anonymous namespace
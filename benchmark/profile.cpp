@@ -0,0 +1,55 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/profile.hpp>
+
+#include <benchmark/benchmark.h>
+
+using namespace ewig;
+
+namespace {
+
+// What every phase of every action costs when nobody is profiling
+void profile_scope_stopped(benchmark::State& state)
+{
+    profile::stop();
+    for (auto _ : state) {
+        static const auto insert_tag = profile::tag{"reduce", "insert"};
+        auto timing = profile::scope{insert_tag};
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(profile_scope_stopped);
+
+void profile_scope_running(benchmark::State& state)
+{
+    profile::reset();
+    profile::start();
+    for (auto _ : state) {
+        static const auto insert_tag = profile::tag{"reduce", "insert"};
+        auto timing = profile::scope{insert_tag};
+        benchmark::ClobberMemory();
+    }
+    profile::stop();
+    profile::reset();
+}
+BENCHMARK(profile_scope_running);
+
+} // anonymous namespace
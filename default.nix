@@ -19,6 +19,7 @@ stdenv.mkDerivation rec {
     gcc7
     ncurses
     boost
+    zlib
     deps.immer
     deps.scelta
     deps.utfcpp
@@ -20,6 +20,8 @@ stdenv.mkDerivation rec {
     cmake
     ncurses
     boost
+    zlib
+    gbenchmark
     deps.immer
     deps.scelta
     deps.utfcpp
@@ -19,8 +19,16 @@
 //
 
 #include "ewig/application.hpp"
+#include "ewig/profile.hpp"
+
+#include <boost/asio/steady_timer.hpp>
 
 #include <scelta.hpp>
+#include <utf8.h>
+
+#include <cwctype>
+#include <limits>
+#include <unordered_map>
 
 using namespace std::string_literals;
 
@@ -32,10 +40,10 @@ template <typename T>
 struct arg
 {
     template <typename Fn, typename... Args>
-    static auto invoke(Fn&& fn, const std::any& arg, Args&&... args)
+    static auto invoke(Fn&& fn, const command_arg& arg, Args&&... args)
     {
         return std::forward<Fn>(fn)(std::forward<Args>(args)...,
-                                   std::any_cast<T>(arg));
+                                   std::get<T>(arg));
     }
 };
 
@@ -43,7 +51,7 @@ template <>
 struct arg<void>
 {
     template <typename Fn, typename... Args>
-    static auto invoke(Fn&& fn, const std::any&, Args&&... args)
+    static auto invoke(Fn&& fn, const command_arg&, Args&&... args)
     {
         return std::forward<Fn>(fn)(std::forward<Args>(args)...);
     }
@@ -52,7 +60,7 @@ struct arg<void>
 template <typename Arg=void, typename Fn>
 command app_command(Fn fn)
 {
-    return [=] (application state, std::any x) {
+    return [=] (application state, command_arg x) {
         return arg<Arg>::invoke(fn, x, state);
     };
 }
@@ -60,25 +68,69 @@ command app_command(Fn fn)
 template <typename Arg=void, typename Fn>
 command edit_command(Fn fn)
 {
-    return [=] (application state, std::any x) {
+    return [=] (application state, command_arg x) {
         return apply_edit(state, arg<Arg>::invoke(fn, x, state.current));
     };
 }
 
+// Makes a command that does the edit at every cursor, in multi-cursor
+// mode, as a single edit
 template <typename Arg=void, typename Fn>
-command paste_command(Fn fn)
+command multi_edit_command(Fn fn)
+{
+    return [=] (application state, command_arg x) {
+        return apply_edit(state, edit_every_cursor(state.current, [&] (buffer buf) {
+            return arg<Arg>::invoke(fn, x, buf);
+        }));
+    };
+}
+
+// Makes a command that is refused in multi-cursor mode, for it only
+// knows how to work at one cursor
+command single_cursor_command(command cmd)
+{
+    return [=] (application state, command_arg x) -> result<application, action> {
+        if (!state.current.cursors.empty())
+            return put_message(state, "can't do that with multiple cursors, "
+                                      "C-g leaves them");
+        return cmd(state, x);
+    };
+}
+
+// Makes a command that moves every cursor, in multi-cursor mode
+template <typename Fn>
+command move_command(Fn fn)
+{
+    return [=] (application state, command_arg) {
+        return apply_edit(state, move_every_cursor(state.current, fn));
+    };
+}
+
+// Makes a command that, when called without argument, asks for it
+template <typename Fn>
+command prompt_command(std::string question, Fn fn)
+{
+    return [=] (application state, command_arg x) -> result<application, action> {
+        if (auto answer = std::get_if<std::string>(&x))
+            return fn(state, *answer);
+        state.prompt = prompt_state{question, {}, fn};
+        return state;
+    };
+}
+
+// Makes a command that transforms the selected lines, or all of them,
+// in the background
+command transform_command(std::string what, line_transform fn)
 {
-    return [=] (application state, std::any x) {
-        return apply_edit(state, arg<Arg>::invoke(fn, x,
-                                                 state.current,
-                                                 state.clipboard.back()));
+    return [=] (application state, command_arg) {
+        return transform(state, what, fn);
     };
 }
 
 template <typename Arg=arg<void>, typename Fn>
 command scroll_command(Fn fn)
 {
-    return [=] (application state, std::any arg) {
+    return [=] (application state, command_arg arg) {
         state.current = Arg::invoke(fn, arg,
                                    state.current,
                                    editor_size(state));
@@ -86,46 +138,222 @@ command scroll_command(Fn fn)
     };
 }
 
+const auto cancel_key = key::ctrl('g')[0];
+const auto escape_key = key::ctrl('[')[0];
+
 } // anonymous namespace
 
-using commands = std::unordered_map<std::string, command>;
+// The commands, their ids being their positions
+using commands = std::vector<std::pair<std::string, command>>;
 
 static const auto global_commands = commands
 {
-    {"insert",                 edit_command<wchar_t>(insert_char)},
-    {"delete-char",            edit_command(delete_char)},
-    {"delete-char-right",      edit_command(delete_char_right)},
-    {"insert-tab",             edit_command(insert_tab)},
-    {"kill-line",              edit_command(cut_rest)},
+    {"insert",                 multi_edit_command<wchar_t>(insert_char)},
+    {"insert-text",            multi_edit_command<text>(insert_text)},
+    {"delete-char",            multi_edit_command(delete_char)},
+    {"delete-char-right",      multi_edit_command(delete_char_right)},
+    {"insert-tab",             multi_edit_command(insert_tab)},
+    {"kill-line",              single_cursor_command(app_command(kill_line))},
     {"copy",                   edit_command(copy)},
-    {"cut",                    edit_command(cut)},
-    {"move-beginning-of-line", edit_command(move_line_start)},
+    {"cut",                    single_cursor_command(edit_command(cut))},
+    {"move-beginning-of-line", move_command(move_line_start)},
     {"move-beginning-buffer",  edit_command(move_buffer_start)},
     {"move-end-buffer",        edit_command(move_buffer_end)},
-    {"move-down",              edit_command(move_cursor_down)},
-    {"move-end-of-line",       edit_command(move_line_end)},
-    {"move-left",              edit_command(move_cursor_left)},
-    {"move-right",             edit_command(move_cursor_right)},
-    {"move-up",                edit_command(move_cursor_up)},
-    {"new-line",               edit_command(insert_new_line)},
+    {"move-down",              move_command(move_cursor_down)},
+    {"move-end-of-line",       move_command(move_line_end)},
+    {"move-left",              move_command(move_cursor_left)},
+    {"move-right",             move_command(move_cursor_right)},
+    {"move-up",                move_command(move_cursor_up)},
+    {"new-line",               multi_edit_command(insert_new_line)},
+    {"add-cursor-above",       edit_command(add_cursor_above)},
+    {"add-cursor-below",       edit_command(add_cursor_below)},
+    {"add-cursors-to-lines",   edit_command(add_cursors_to_lines)},
     {"page-down",              scroll_command(page_down)},
     {"page-up",                scroll_command(page_up)},
-    {"paste",                  paste_command(insert_text)},
+    {"paste",                  app_command(paste)},
+    {"yank-pop",               single_cursor_command(app_command(yank_pop))},
     {"quit",                   app_command(quit)},
     {"save",                   app_command(save)},
     {"load",                   app_command<std::string>(load)},
+    {"open",                   app_command<std::string>(open_file)},
+    {"find-file",              prompt_command("Find file: ", find_file)},
+    {"switch-to-buffer",       prompt_command("Switch to buffer: ", switch_buffer)},
+    {"next-buffer",            app_command(next_buffer)},
+    {"previous-buffer",        app_command(previous_buffer)},
+    {"kill-buffer",            app_command(kill_buffer)},
+    {"list-buffers",           app_command(list_buffers)},
+    {"toggle-debug",           app_command(toggle_debug)},
+    {"toggle-profile",         app_command(toggle_profile)},
+    {"toggle-cold-storage",    app_command(toggle_cold_storage)},
+    {"toggle-auto-revert",     app_command(toggle_auto_revert)},
+    {"profile-report",         app_command(profile_report)},
+    {"follow-mode",            app_command(follow)},
+    {"indent-region",          transform_command("indent", indent_line)},
+    {"strip-trailing-whitespace", transform_command("strip", strip_trailing_whitespace)},
+    {"untabify",               transform_command("untabify", untabify_line)},
+    {"replace-string",         prompt_command("Replace string: ", replace_string)},
     {"message",                app_command<std::string>(put_message)},
     {"undo",                   edit_command(undo)},
     {"start-selection",        edit_command(start_selection)},
     {"select-whole-buffer",    edit_command(select_whole_buffer)},
+    {"goto-line",              prompt_command("Goto line: ", goto_line)},
+    {"goto-byte",              prompt_command("Goto byte offset: ", goto_byte)},
+    {"isearch-forward",        app_command([](auto app) { return isearch(app, true, false); })},
+    {"isearch-backward",       app_command([](auto app) { return isearch(app, false, false); })},
+    {"isearch-forward-regexp", app_command([](auto app) { return isearch(app, true, true); })},
+    {"isearch-backward-regexp",app_command([](auto app) { return isearch(app, false, true); })},
     {"noop",                   [](auto app, auto...){ return app; }},
 };
 
+static const auto command_ids = [] {
+    auto result = std::unordered_map<std::string_view, command_id>{};
+    for (auto i = std::size_t{}; i < global_commands.size(); ++i)
+        result.emplace(global_commands[i].first, (command_id)i);
+    return result;
+} ();
+
+static const auto insert_command    = find_command("insert");
+static const auto kill_line_command = find_command("kill-line");
+static const auto paste_command     = find_command("paste");
+static const auto yank_pop_command  = find_command("yank-pop");
+
+command_id find_command(std::string_view name)
+{
+    auto it = command_ids.find(name);
+    return it != command_ids.end() ? it->second : no_command;
+}
+
+const std::string& command_name(command_id id)
+{
+    return global_commands.at(id).first;
+}
+
+namespace {
+
+// Runs `a` and then `b`
+effect<action> sequence(effect<action> a, effect<action> b)
+{
+    return [=] (auto&& ctx) {
+        a(ctx);
+        b(ctx);
+    };
+}
+
+// Dispatches `ev` once `interval` has passed
+template <typename Duration>
+effect<action> dispatch_after(Duration interval, action ev)
+{
+    return [=] (auto&& ctx) {
+        auto timer = std::make_shared<boost::asio::steady_timer>(
+            ctx.service.get(), interval);
+        timer->async_wait([timer, ev, dispatch = ctx.dispatch] (auto ec) {
+            if (!ec)
+                dispatch(ev);
+        });
+    };
+}
+
+// Dispatches the next `cold_storage_action`
+effect<action> cold_storage_timer(cancellation token)
+{
+    return dispatch_after(cold_storage_interval, cold_storage_action{token});
+}
+
+// Dispatches the next `auto_revert_action`
+effect<action> auto_revert_timer(cancellation token)
+{
+    return dispatch_after(auto_revert_interval, auto_revert_action{token});
+}
+
+// Converts an effect of the buffer `id`, such that its actions get back
+// to it even when it is not the current buffer anymore.
+effect<action> route(buffer_id id, effect<buffer_action> eff)
+{
+    return [=] (const context<action>& ctx) {
+        auto dispatch = ctx.dispatch;
+        eff(context<buffer_action>{ctx, [=] (buffer_action act) {
+            dispatch(routed_buffer_action{id, std::move(act)});
+        }});
+    };
+}
+
+// Makes `buf` the current buffer, the previous one becoming the most
+// recent of the others.  Its pending I/O goes before that of the
+// others.
+result<application, action> show_buffer(application state, buffer buf)
+{
+    state.buffers = state.buffers.push_front(state.current);
+    state.current = scroll_to_cursor(buf, editor_size(state));
+    return {state, [id = buf.id] (auto&& ctx) { ctx.io.get().focus(id); }};
+}
+
+std::optional<std::size_t> find_buffer(const application& state,
+                                       const std::string& name)
+{
+    for (auto i = std::size_t{}; i < state.buffers.size(); ++i)
+        if (buffer_name(state.buffers[i]).get() == name)
+            return i;
+    return std::nullopt;
+}
+
+// Removes the buffer at `pos` from the others, returning it
+std::pair<application, buffer> take_buffer(application state, std::size_t pos)
+{
+    auto buf = state.buffers[pos];
+    state.buffers = state.buffers.take(pos) + state.buffers.drop(pos + 1);
+    return {state, buf};
+}
+
+// Starts loading `fname` in a new buffer, returning it too
+std::pair<result<application, action>, buffer>
+new_file_buffer(application state, const std::string& fname)
+{
+    auto buf = buffer{};
+    buf.id   = ++state.last_buffer_id;
+    buf.history.budget = state.current.history.budget;
+    auto [loading, effect] = load_buffer(buf, fname);
+    return {{state, route(loading.id, effect)}, loading};
+}
+
+} // anonymous namespace
+
+result<application, action> reload_buffer(application state, buffer_id id)
+{
+    auto reload = [&] (const buffer& buf) -> result<buffer, buffer_action> {
+        auto fresh = buffer{};
+        fresh.id   = buf.id;
+        fresh.history.budget = buf.history.budget;
+        if (auto file = std::get_if<no_file>(&buf.from)) {
+            fresh.from = no_file{file->name, {}, {}};
+            return fresh;
+        }
+        return load_buffer(fresh, buffer_name(buf).get());
+    };
+    if (state.current.id == id) {
+        auto [loading, effect] = reload(state.current);
+        state.current = loading;
+        return {state, route(id, effect)};
+    }
+    for (auto i = std::size_t{}; i < state.buffers.size(); ++i) {
+        if (state.buffers[i].id == id) {
+            auto [loading, effect] = reload(state.buffers[i]);
+            state.buffers = state.buffers.set(i, loading);
+            return {state, route(id, effect)};
+        }
+    }
+    return state;
+}
+
 result<application, action> quit(application app)
 {
+    // there is no point in finishing a load, but saves must complete
     return {
         put_message(app, "quitting... (waiting for operations to finish)"),
-        [] (auto&& ctx) { ctx.finish(); }
+        [buf = app.current, bufs = app.buffers] (auto&& ctx) {
+            abandon_io(buf);
+            immer::for_each(bufs, abandon_io);
+            ctx.finish();
+        }
     };
 }
 
@@ -133,23 +361,511 @@ result<application, action> save(application state)
 {
     if (!is_dirty(state.current)) {
         return put_message(state, "nothing to save");
+    } else if (std::holds_alternative<no_file>(state.current.from)) {
+        return put_message(state, "the buffer has no file to save to");
     } else if (io_in_progress(state.current)) {
         return put_message(state, "can't save while saving or loading the file");
     } else {
         auto [buffer, effect] = save_buffer(state.current);
         state.current = buffer;
-        return {state, effect};
+        return {state, route(buffer.id, effect)};
     }
 }
 
 result<application, action> load(application state, const std::string& fname)
 {
-    if (io_in_progress(state.current)) {
-        return put_message(state, "can't load while saving or loading the file");
+    if (io_in_progress(state.current) && !load_in_progress(state.current)) {
+        return put_message(state, "can't load while saving the file");
     } else {
         auto [buffer, effect] = load_buffer(state.current, fname);
         state.current = buffer;
-        return {state, effect};
+        return {state, route(buffer.id, effect)};
+    }
+}
+
+result<application, action> find_file(application state,
+                                      const std::string& fname)
+{
+    if (fname.empty()) {
+        return state;
+    } else if (buffer_name(state.current).get() == fname) {
+        return state;
+    } else if (auto pos = find_buffer(state, fname)) {
+        auto [rest, buf] = take_buffer(state, *pos);
+        return show_buffer(rest, buf);
+    } else {
+        auto [loading, buf] = new_file_buffer(state, fname);
+        auto [shown, focus] = show_buffer(loading.first, buf);
+        return {shown, sequence(focus, loading.second)};
+    }
+}
+
+result<application, action> open_file(application state,
+                                      const std::string& fname)
+{
+    if (buffer_name(state.current).get() == fname || find_buffer(state, fname))
+        return state;
+    auto [loading, buf] = new_file_buffer(state, fname);
+    loading.first.buffers = loading.first.buffers.push_back(buf);
+    return loading;
+}
+
+result<application, action> switch_buffer(application state,
+                                          const std::string& name)
+{
+    // like in emacs, no name means the most recent other buffer
+    auto pos = name.empty() && !state.buffers.empty()
+        ? std::optional<std::size_t>{0}
+        : find_buffer(state, name);
+    if (!pos)
+        return put_message(state, name.empty()
+                           ? "no other buffer"
+                           : "no such buffer: " + name);
+    auto [rest, buf] = take_buffer(state, *pos);
+    return show_buffer(rest, buf);
+}
+
+result<application, action> next_buffer(application state)
+{
+    if (state.buffers.empty())
+        return put_message(state, "no other buffer");
+    auto [rest, buf] = take_buffer(state, 0);
+    auto [shown, focus] = show_buffer(rest, buf);
+    // the buffer we leave is the last one we get back to
+    shown.buffers = shown.buffers.drop(1).push_back(shown.buffers[0]);
+    return {shown, focus};
+}
+
+result<application, action> previous_buffer(application state)
+{
+    if (state.buffers.empty())
+        return put_message(state, "no other buffer");
+    auto [rest, buf] = take_buffer(state, state.buffers.size() - 1);
+    return show_buffer(rest, buf);
+}
+
+result<application, action> transform(application state,
+                                      std::string what,
+                                      line_transform fn)
+{
+    auto [buffer, effect] = transform_buffer(state.current, what, fn);
+    state.current = buffer;
+    return {state, route(buffer.id, effect)};
+}
+
+result<application, action> replace_string(application state,
+                                           const std::string& from)
+{
+    if (from.empty())
+        return put_message(state, "nothing to replace");
+    state.prompt = prompt_state{
+        "Replace " + from + " with: ", {},
+        [from] (application state, std::string to) {
+            return transform(state, "replace", replace_in_line(from, to));
+        }};
+    return state;
+}
+
+result<application, action> follow(application state)
+{
+    if (state.current.follow) {
+        auto [buffer, effect] = unfollow_buffer(state.current);
+        state.current = buffer;
+        return {put_message(state, "stopped following"),
+                route(buffer.id, effect)};
+    } else if (!std::holds_alternative<existing_file>(state.current.from)) {
+        return put_message(state, "can't follow the file before it is loaded");
+    } else {
+        auto [buffer, effect] = follow_buffer(state.current);
+        state.current = scroll_to_cursor(move_buffer_end(buffer),
+                                         editor_size(state));
+        return {put_message(state, "following: " + buffer_name(buffer).get()),
+                route(buffer.id, effect)};
+    }
+}
+
+namespace {
+
+// Forgets the current buffer, showing the most recent of the others,
+// or a new empty one when there are none.
+result<application, action> do_kill_buffer(application state)
+{
+    auto killed = state.current;
+    auto next   = buffer{};
+    if (!state.buffers.empty()) {
+        std::tie(state, next) = take_buffer(state, 0);
+    } else {
+        next.id = ++state.last_buffer_id;
+        next.history.budget = killed.history.budget;
+    }
+    state.current = scroll_to_cursor(next, editor_size(state));
+    state = put_message(state, "killed: " + buffer_name(killed).get());
+    return {state, [=] (auto&& ctx) {
+        abandon_io(killed);
+        ctx.io.get().focus(next.id);
+    }};
+}
+
+} // anonymous namespace
+
+result<application, action> kill_buffer(application state)
+{
+    if (io_in_progress(state.current) && !load_in_progress(state.current)) {
+        return put_message(state, "can't kill the buffer while saving it");
+    } else if (is_dirty(state.current)) {
+        state.prompt = prompt_state{
+            "Buffer modified; kill anyway? (yes or no) ", {},
+            [] (application state, std::string answer)
+                -> result<application, action> {
+                if (answer == "yes")
+                    return do_kill_buffer(state);
+                return put_message(state, "buffer not killed");
+            }};
+        return state;
+    } else {
+        return do_kill_buffer(state);
+    }
+}
+
+application list_buffers(application state)
+{
+    auto names = std::string{"buffers: "} + buffer_name(state.current).get();
+    immer::for_each(state.buffers, [&] (auto&& buf) {
+        names += ", " + buffer_name(buf).get();
+        if (is_dirty(buf))
+            names += "*";
+    });
+    return put_message(state, names);
+}
+
+application toggle_debug(application state)
+{
+    state.debug = !state.debug;
+    return put_message(state, state.debug ? "debug messages on"
+                                          : "debug messages off");
+}
+
+application toggle_profile(application state)
+{
+    if (profile::enabled()) {
+        profile::stop();
+        return put_message(state, "profiling stopped");
+    } else {
+        profile::start();
+        return put_message(state, "profiling");
+    }
+}
+
+result<application, action> toggle_cold_storage(application state)
+{
+    if (state.cold_storage) {
+        state.cold_storage = std::nullopt;
+        return put_message(state, "cold storage disabled");
+    } else {
+        auto token = cancellation{};
+        state.cold_storage = token;
+        return {put_message(state, "cold storage enabled"),
+                cold_storage_timer(token)};
+    }
+}
+
+result<application, action> toggle_auto_revert(application state)
+{
+    if (state.auto_revert) {
+        state.auto_revert = std::nullopt;
+        return put_message(state, "auto revert disabled");
+    } else {
+        auto token = cancellation{};
+        state.auto_revert = token;
+        return {put_message(state, "auto revert enabled"),
+                auto_revert_timer(token)};
+    }
+}
+
+namespace {
+
+// Checks whether the files of every buffer changed on disk
+result<application, action> check_files(application state)
+{
+    auto effect = auto_revert_timer(*state.auto_revert);
+    auto check  = [&] (buffer buf) {
+        auto [next, checking] = check_file_buffer(buf);
+        effect = sequence(effect, route(next.id, checking));
+        return next;
+    };
+    state.current = check(state.current);
+    for (auto i = std::size_t{}; i < state.buffers.size(); ++i)
+        state.buffers = state.buffers.set(i, check(state.buffers[i]));
+    return {state, effect};
+}
+
+// Packs the lines of every buffer that are far from its screen
+result<application, action> freeze_buffers(application state)
+{
+    auto effect = cold_storage_timer(*state.cold_storage);
+    auto freeze = [&] (buffer buf) {
+        auto [next, freezing] = freeze_buffer(
+            buf,
+            buf.scroll.row - cold_storage_margin,
+            buf.scroll.row + editor_size(state).row + cold_storage_margin);
+        effect = sequence(effect, route(next.id, freezing));
+        return next;
+    };
+    state.current = freeze(state.current);
+    for (auto i = std::size_t{}; i < state.buffers.size(); ++i)
+        state.buffers = state.buffers.set(i, freeze(state.buffers[i]));
+    return {state, effect};
+}
+
+} // anonymous namespace
+
+// The report goes to the buffer *profile*, replacing what it had
+result<application, action> profile_report(application state)
+{
+    static const auto name = immer::box<std::string>{"*profile*"};
+    auto content = to_text(profile::report());
+    auto report  = buffer{};
+    report.from  = no_file{name, content, line_index{content}};
+    report.content = content;
+    report.offsets = std::get<no_file>(report.from).offsets;
+    if (buffer_name(state.current).get() == name.get()) {
+        report.id = state.current.id;
+        state.current = report;
+        return state;
+    }
+    report.id = ++state.last_buffer_id;
+    if (auto pos = find_buffer(state, name))
+        state = take_buffer(state, *pos).first;
+    return show_buffer(state, report);
+}
+
+namespace {
+
+// Starts searching for the query from `from`, superseding the search
+// that was running before, if any.
+result<application, action> run_search(application state,
+                                       coord from,
+                                       bool inclusive)
+{
+    auto& srch    = *state.search;
+    auto previous = srch.token;
+    srch.token    = {};
+    srch.error    = {};
+    srch.progress = 0;
+    srch.running  = false;
+    if (srch.query->empty())
+        return {state, [=] (auto&&) { previous.cancel(); }};
+
+    auto pat = std::optional<pattern>{};
+    try {
+        pat = srch.regex
+            ? pattern::regex(*srch.query)
+            : pattern::literal(*srch.query);
+    } catch (const std::runtime_error& err) {
+        // most likely the regexp is still being typed
+        srch.error = std::string{err.what()};
+        return {state, [=] (auto&&) { previous.cancel(); }};
+    }
+
+    srch.running = true;
+    return {
+        state,
+        [=,
+         content = state.current.content,
+         forward = srch.forward,
+         token   = srch.token,
+         pat     = std::move(*pat)] (auto&& ctx) {
+            previous.cancel();
+            ctx.async([=] {
+                auto progress = [&] (float p) {
+                    ctx.dispatch(search_progress_action{token, p});
+                };
+                auto res = search(content, pat, from, forward, inclusive,
+                                  token, progress);
+                if (!token.cancelled())
+                    ctx.dispatch(search_done_action{token, res});
+            });
+        }
+    };
+}
+
+// Searches again after the query changed.  When it was made longer,
+// the current match may still be good, otherwise we start over from
+// where the search began.
+result<application, action> refine_search(application state, bool longer)
+{
+    auto& srch = *state.search;
+    if (longer && srch.match) {
+        return run_search(state, srch.match->first, true);
+    } else {
+        state.current.cursor = srch.origin;
+        state.current.selection_start = srch.origin_selection;
+        state.current = scroll_to_cursor(state.current, editor_size(state));
+        srch.match   = {};
+        srch.failing = false;
+        srch.wrapped = false;
+        return run_search(state, srch.origin, !srch.forward);
+    }
+}
+
+// Ends the search, leaving the cursor at the match unless it was
+// `aborted`.  The effect stops the search if it is still running.
+result<application, action> exit_search(application state, bool aborted)
+{
+    auto srch = *state.search;
+    state.search = std::nullopt;
+    if (!srch.query->empty())
+        state.last_search = srch.query;
+    if (aborted) {
+        state.current.cursor = srch.origin;
+        state.current = scroll_to_cursor(state.current, editor_size(state));
+    }
+    state.current.selection_start = srch.origin_selection;
+    return {state, [token = srch.token] (auto&&) { token.cancel(); }};
+}
+
+// Runs `cmd` after ending the search, such that the effects of both
+// take place.
+result<application, action> exit_search_and(application state,
+                                            const command& cmd,
+                                            command_arg arg)
+{
+    auto [exited, stop] = exit_search(state, false);
+    auto [next, effect] = cmd(exited, std::move(arg));
+    return {next, sequence(stop, effect)};
+}
+
+// Returns the command bound to `key` alone, if any.
+std::string key_command(const application& state, key_code key)
+{
+    auto n = state.keys.next(key_map::root, key);
+    return n ? state.keys.command(*n).get() : std::string{};
+}
+
+// Edits the `input` typed in the message line with `key`.  Returns
+// nothing when the key does not edit it.
+std::optional<std::string> edit_input(const application& state,
+                                      std::string input,
+                                      key_code key)
+{
+    auto cmd = key_command(state, key);
+    if (cmd == "delete-char") {
+        if (!input.empty()) {
+            // drop the last character, with all of its utf-8 bytes
+            auto pos = input.size() - 1;
+            while (pos > 0 && (input[pos] & 0xc0) == 0x80)
+                --pos;
+            input.erase(pos);
+        }
+        return input;
+    } else if (cmd.empty()) {
+        auto [kres, kkey] = key;
+        if (kres || std::iswcntrl(kkey))
+            return std::nullopt;
+        utf8::append(kkey, std::back_inserter(input));
+        return input;
+    }
+    return std::nullopt;
+}
+
+// Handles the keys that edit the query.  Returns nothing when the key
+// does not belong to the search, which then has to be ended.
+std::optional<result<application, action>>
+search_key(application state, key_code key)
+{
+    auto& query = state.search->query;
+    if (key_command(state, key) == "new-line") {
+        return exit_search(state, false);
+    } else if (auto input = edit_input(state, query, key)) {
+        auto longer = input->size() > query->size();
+        query = std::move(*input);
+        return refine_search(state, longer);
+    }
+    return std::nullopt;
+}
+
+// Handles the keys while the user is answering a prompt.  Other keys
+// are ignored.
+result<application, action> prompt_key(application state, key_code key)
+{
+    auto& answer = state.prompt->answer;
+    if (key_command(state, key) == "new-line") {
+        auto prompt  = *state.prompt;
+        state.prompt = std::nullopt;
+        return prompt.then(state, prompt.answer);
+    } else if (auto input = edit_input(state, answer, key)) {
+        answer = std::move(*input);
+    }
+    return state;
+}
+
+std::optional<std::size_t> parse_number(const std::string& str)
+{
+    if (str.empty() || str.find_first_not_of("0123456789") != str.npos)
+        return std::nullopt;
+    try {
+        return std::stoull(str);
+    } catch (const std::out_of_range&) {
+        return std::nullopt;
+    }
+}
+
+} // anonymous namespace
+
+result<application, action> goto_line(application state,
+                                      const std::string& line)
+{
+    auto number = parse_number(line);
+    if (!number)
+        return put_message(state, "not a line number: " + line);
+    // the first line is the line 1, like in compiler errors
+    auto row = (index)std::min<std::size_t>(
+        std::max<std::size_t>(*number, 1) - 1,
+        std::numeric_limits<index>::max());
+    state.current = scroll_to_cursor(move_to_line(state.current, row),
+                                     editor_size(state));
+    return state;
+}
+
+result<application, action> goto_byte(application state,
+                                      const std::string& offset)
+{
+    auto number = parse_number(offset);
+    if (!number)
+        return put_message(state, "not a byte offset: " + offset);
+    state.current = scroll_to_cursor(move_to_byte(state.current, *number),
+                                     editor_size(state));
+    return state;
+}
+
+result<application, action> isearch(application state,
+                                    bool forward,
+                                    bool regex)
+{
+    if (!state.search) {
+        state.search = search_state{};
+        state.search->forward = forward;
+        state.search->regex   = regex;
+        state.search->origin  = state.current.cursor;
+        state.search->origin_selection = state.current.selection_start;
+        return state;
+    }
+
+    // like in emacs, searching again with an empty query repeats the
+    // last search, and otherwise it goes to the next match
+    auto& srch = *state.search;
+    srch.forward = forward;
+    if (srch.query->empty()) {
+        if (state.last_search->empty())
+            return state;
+        srch.query = state.last_search;
+        return refine_search(state, false);
+    } else if (srch.match) {
+        return forward
+            ? run_search(state, srch.match->last, true)
+            : run_search(state, srch.match->first, false);
+    } else {
+        return refine_search(state, false);
     }
 }
 
@@ -169,71 +885,207 @@ coord editor_size(application app)
 
 application clear_input(application state)
 {
-    state.input = {};
+    state.input = key_map::root;
     return state;
 }
 
-result<application, action> update(application state, action ev)
+namespace {
+
+result<application, action> update_state(application state, action ev)
 {
     using result_t = result<application, action>;
 
     return scelta::match(
         [&](const command_action& ev) -> result_t
         {
-            auto it = global_commands.find(ev.name);
-            if (it != global_commands.end()) {
-                state = put_message(state, "calling command: "s + *ev.name);
-                return it->second(state, ev.arg);
-            } else {
-                return put_message(state, "unknown command: "s + *ev.name);
-            }
+            if (ev.id >= global_commands.size())
+                return put_message(state, "unknown command");
+            auto& [name, cmd] = global_commands[ev.id];
+            if (state.debug)
+                state = put_message(state, "calling command: "s + name);
+            // keys are only tagged as such by the store, so the commands
+            // they call are told apart here
+            auto timing = profile::scope{"command", name};
+            auto result = state.search && name.compare(0, 8, "isearch-") != 0
+                ? exit_search_and(state, cmd, ev.arg)
+                : cmd(state, ev.arg);
+            result.first.last_command = ev.id;
+            return result;
         },
-        [&](const buffer_action& ev) -> result_t
+        [&](const routed_buffer_action& ev) -> result_t
         {
-            auto [buffer, msg] = update_buffer(state.current, ev);
-            state.current = buffer;
-            return put_message(state, msg);
+            if (state.current.id == ev.id) {
+                auto [buffer, msg] = update_buffer(state.current, ev.action);
+                state.current = scroll_to_cursor(buffer, editor_size(state));
+                return put_message(state, msg);
+            }
+            for (auto i = std::size_t{}; i < state.buffers.size(); ++i) {
+                if (state.buffers[i].id == ev.id) {
+                    auto [buffer, msg] =
+                        update_buffer(state.buffers[i], ev.action);
+                    state.buffers = state.buffers.set(i, buffer);
+                    return put_message(state, msg);
+                }
+            }
+            // the buffer was killed
+            return state;
         },
         [&](const resize_action& ev) -> result_t
         {
             state.window_size = ev.size;
             return state;
         },
+        [&](const search_progress_action& ev) -> result_t
+        {
+            if (state.search && state.search->token == ev.token)
+                state.search->progress = ev.progress;
+            return state;
+        },
+        [&](const cold_storage_action& ev) -> result_t
+        {
+            if (!state.cold_storage || *state.cold_storage != ev.token)
+                return state;
+            return freeze_buffers(state);
+        },
+        [&](const auto_revert_action& ev) -> result_t
+        {
+            if (!state.auto_revert || *state.auto_revert != ev.token)
+                return state;
+            return check_files(state);
+        },
+        [&](const search_done_action& ev) -> result_t
+        {
+            if (!state.search || state.search->token != ev.token)
+                return state;
+            auto& srch   = *state.search;
+            srch.running = false;
+            srch.failing = !ev.result.match;
+            srch.wrapped = srch.wrapped || ev.result.wrapped;
+            if (auto match = ev.result.match) {
+                // the match is shown selected, with the cursor at the
+                // end the search goes to
+                srch.match = match;
+                state.current.selection_start =
+                    srch.forward ? match->first : match->last;
+                state.current.cursor =
+                    srch.forward ? match->last : match->first;
+                state.current =
+                    scroll_to_cursor(state.current, editor_size(state));
+            }
+            return state;
+        },
         [&](const key_action& ev) -> result_t
         {
-            if (key_seq{ev.key} == key::ctrl('g')) {
+            auto at_root = state.input == key_map::root;
+            if (state.prompt && at_root) {
+                if (ev.key == cancel_key) {
+                    state.prompt = std::nullopt;
+                    return put_message(state, "cancel");
+                }
+                return prompt_key(state, ev.key);
+            }
+            if (state.search && at_root) {
+                if (ev.key == cancel_key) {
+                    auto [next, effect] = exit_search(state, true);
+                    return {put_message(next, "cancel"), effect};
+                } else if (auto result = search_key(state, ev.key)) {
+                    return *result;
+                }
+            }
+            if (ev.key == cancel_key) {
                 // like in emacs, ctrl-g always stops the current
                 // input sequence.  ideally this should be part of the
                 // key-map?
+                state.last_command = no_command;
+                state.current = clear_cursors(state.current);
                 return clear_input(put_message(state, "cancel"));
-            } else {
-                state.input = state.input.push_back(ev.key);
-                const auto& map = state.keys.get();
-                auto it = map.find(state.input);
-                if (it != map.end()) {
-                    if (!it->second->empty()) {
-                        auto cmd = it->second;
-                        auto result = update(state, command_action{cmd, {}});
-                        return {clear_input(result.first), result.second};
-                    }
-                } else if (key_seq{ev.key} != key::ctrl('[')) {
-                    using std::get;
-                    auto is_single_char = state.input.size() == 1;
-                    auto [kres, kkey] = ev.key;
-                    if (is_single_char && !kres && !std::iscntrl(kkey)) {
-                        auto result = update(
-                            state, command_action{"insert", (wchar_t)kkey});
-                        return {clear_input(result.first), result.second};
-                    } else {
-                        return clear_input(
-                            put_message(state, "unbound key sequence"));
-                    }
+            } else if (auto next = state.keys.next(state.input, ev.key)) {
+                const auto& cmd = state.keys.command(*next);
+                if (cmd->empty()) {
+                    state.input = *next;
+                    return state;
                 }
+                auto id = state.keys.id(*next);
+                if (id == no_command)
+                    return clear_input(
+                        put_message(state, "unknown command: "s + *cmd));
+                auto result = update_state(state, command_action{id});
+                return {clear_input(result.first), result.second};
+            } else if (ev.key == escape_key) {
+                // an escape that does not continue the sequence starts
+                // another one, like meta keys do
+                state.input = state.keys.next(key_map::root, ev.key)
+                    .value_or(key_map::root);
                 return state;
+            } else {
+                auto [kres, kkey] = ev.key;
+                if (at_root && !kres && !std::iscntrl(kkey)) {
+                    auto result = update_state(
+                        state, command_action{insert_command, (wchar_t)kkey});
+                    return {clear_input(result.first), result.second};
+                } else {
+                    return clear_input(
+                        put_message(state, "unbound key sequence"));
+                }
             }
         })(ev);
 }
 
+} // anonymous namespace
+
+result<application, action> update(application state, action ev)
+{
+    // the current buffer is highlighted again after every change
+    auto [next, effect] = update_state(std::move(state), std::move(ev));
+    if (next.current.lexing)
+        return {next, effect};
+    auto [buf, lex] = highlight_buffer(next.current);
+    next.current = buf;
+    return {next, buf.lexing ? sequence(effect, route(buf.id, lex)) : effect};
+}
+
+std::string_view profile_tag(const action& ev)
+{
+    return scelta::match(
+        [](const command_action& ev) -> std::string_view {
+            return ev.id < global_commands.size()
+                ? std::string_view{command_name(ev.id)}
+                : "unknown-command";
+        },
+        [](const key_action&) -> std::string_view { return "key"; },
+        [](const resize_action&) -> std::string_view { return "resize"; },
+        [](const routed_buffer_action&) -> std::string_view { return "buffer"; },
+        [](const search_progress_action&) -> std::string_view {
+            return "search-progress";
+        },
+        [](const search_done_action&) -> std::string_view {
+            return "search-done";
+        },
+        [](const cold_storage_action&) -> std::string_view {
+            return "cold-storage";
+        },
+        [](const auto_revert_action&) -> std::string_view {
+            return "auto-revert";
+        })(ev);
+}
+
+std::string_view profile_tag(const application& state, const action& ev)
+{
+    auto key = std::get_if<key_action>(&ev);
+    auto at_root = state.input == key_map::root;
+    // keys typed in prompts and searches mostly edit their input
+    if (!key || (at_root && (state.prompt || state.search)))
+        return profile_tag(ev);
+    if (auto next = state.keys.next(state.input, key->key)) {
+        auto id = state.keys.id(*next);
+        return id != no_command ? std::string_view{command_name(id)} : "key";
+    }
+    auto [kres, kkey] = key->key;
+    return at_root && !kres && !std::iscntrl(kkey)
+        ? std::string_view{command_name(insert_command)}
+        : "key";
+}
+
 application apply_edit(application state, buffer edit)
 {
     auto msg = std::string{};
@@ -250,11 +1102,114 @@ application apply_edit(application state, std::pair<buffer, text> edit)
     return put_message(put_clipboard(state, edit.second), msg);
 }
 
+namespace {
+
+kill_ring push_kill(kill_ring ring, text content)
+{
+    auto bytes   = sliced_bytes(content);
+    ring.bytes  += bytes;
+    ring.entries = std::move(ring.entries).push_back({content, bytes});
+    auto pruned  = std::size_t{};
+    while (ring.bytes > ring.budget && pruned + 1 < ring.entries.size())
+        ring.bytes -= ring.entries[pruned++].bytes;
+    if (pruned > 0)
+        ring.entries = ring.entries.drop(pruned);
+    return ring;
+}
+
+// Joins `b` at the end of `a`, its first line continuing the last one
+text join_text(const text& a, const text& b)
+{
+    if (a.empty() || b.empty())
+        return a.empty() ? b : a;
+    auto last = a.size() - 1;
+    return a.set(last, a[last] + b[0]) + b.drop(1);
+}
+
+// Pastes the entry `entry` of the kill ring, the result being a single
+// edit with `before`, whose rows from `first` are replaced
+application yank_entry(application state, buffer before, buffer pasted,
+                       std::size_t entry, index first)
+{
+    auto start = pasted.cursor;
+    pasted = insert_text(pasted, state.clipboard.entries[entry].content);
+    pasted = scroll_to_cursor(pasted, editor_size(state));
+    auto bytes = unshared_bytes(before.content, first, before.cursor.row + 1,
+                                pasted.content);
+    auto msg   = std::string{};
+    std::tie(state.current, msg) = record(before, pasted, bytes);
+    if (!identical(state.current.content, before.content))
+        state.yank = yank_state{entry, state.current.id, start,
+                                state.current.content};
+    return put_message(state, msg);
+}
+
+} // anonymous namespace
+
 application put_clipboard(application state, text content)
 {
     if (!content.empty())
-        state.clipboard = state.clipboard.push_back(content);
+        state.clipboard = push_kill(state.clipboard, std::move(content));
     return state;
 }
 
+application append_clipboard(application state, text content)
+{
+    auto& ring = state.clipboard;
+    if (ring.entries.empty())
+        return put_clipboard(state, content);
+    auto last   = ring.entries.back();
+    ring.bytes -= last.bytes;
+    ring.entries = ring.entries.take(ring.entries.size() - 1);
+    ring = push_kill(ring, join_text(last.content, content));
+    return state;
+}
+
+application paste(application state)
+{
+    if (state.clipboard.entries.empty())
+        return put_message(state, "the kill ring is empty");
+    if (!state.current.cursors.empty()) {
+        // the same text is pasted at every cursor, which yank-pop can
+        // not take back, so it is not remembered as a yank
+        auto content = state.clipboard.entries.back().content;
+        state.yank = std::nullopt;
+        return apply_edit(state, edit_every_cursor(state.current, [&] (buffer buf) {
+            return insert_text(buf, content);
+        }));
+    }
+    return yank_entry(state, state.current, state.current,
+                      state.clipboard.entries.size() - 1,
+                      state.current.cursor.row);
+}
+
+application yank_pop(application state)
+{
+    auto& yank = state.yank;
+    auto& buf  = state.current;
+    if (!yank ||
+        (state.last_command != paste_command &&
+         state.last_command != yank_pop_command) ||
+        yank->id != buf.id ||
+        !identical(yank->content, buf.content))
+        return put_message(state, "the previous command was not a paste");
+    // the previous paste is cut and the entry before it pasted instead
+    auto entry = (yank->entry == 0 ? state.clipboard.entries.size()
+                                   : yank->entry) - 1;
+    auto region = buf;
+    region.selection_start = yank->start;
+    auto pasted = cut(region).first;
+    pasted.selection_start = buf.selection_start;
+    return yank_entry(state, buf, pasted, entry, yank->start.row);
+}
+
+application kill_line(application state)
+{
+    // consecutive kills make a single entry, like in emacs
+    auto [buf, killed] = cut_rest(state.current);
+    if (state.last_command != kill_line_command)
+        return apply_edit(state, std::pair{buf, killed});
+    return append_clipboard(apply_edit(state, buf), killed);
+}
+
 } // namespace ewig
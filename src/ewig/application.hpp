@@ -22,27 +22,86 @@
 
 #include <ewig/keys.hpp>
 #include <ewig/buffer.hpp>
+#include <ewig/search.hpp>
 #include <ewig/store.hpp>
 
+#include <chrono>
+#include <cstdint>
 #include <ctime>
+#include <limits>
+#include <string_view>
 #include <variant>
-#include <any>
 
 namespace ewig {
 
 struct key_action { key_code key; };
 struct resize_action { coord size; };
 
+/**
+ * The argument of a command: a character, a text, a string, like a file
+ * name or the answer to a prompt, or nothing.
+ */
+using command_arg = std::variant<std::monostate, wchar_t, std::string, text>;
+
+/** Returns the id of the command called `name`, or `no_command`. */
+command_id find_command(std::string_view name);
+
+/** Returns the name of the command `id`. */
+const std::string& command_name(command_id id);
+
 struct command_action
 {
-    immer::box<std::string> name;
-    std::any arg;
+    command_action(command_id id = no_command, command_arg arg = {})
+        : id{id}, arg{std::move(arg)} {}
+
+    // Looks up the command by name, for scripts and the command line
+    command_action(std::string_view name, command_arg arg = {})
+        : command_action{find_command(name), std::move(arg)} {}
+
+    command_id id;
+    command_arg arg;
+};
+
+// An action of the buffer `id`, which may not be the current one
+// anymore by the time it arrives
+struct routed_buffer_action
+{
+    buffer_id id;
+    buffer_action action;
+};
+
+struct search_progress_action
+{
+    cancellation token;
+    float progress;
+};
+
+struct search_done_action
+{
+    cancellation token;
+    search_result result;
+};
+
+// Time to freeze the buffers again, in cold storage mode
+struct cold_storage_action
+{
+    cancellation token;
+};
+
+// Time to check whether the files changed on disk, in auto revert mode
+struct auto_revert_action
+{
+    cancellation token;
 };
 
 using action = std::variant<command_action,
                            key_action,
                            resize_action,
-                           buffer_action>;
+                           routed_buffer_action,
+                           search_progress_action,
+                           search_done_action,
+                           cold_storage_action,
+                           auto_revert_action>;
 
 struct message
 {
@@ -50,31 +109,169 @@ struct message
     immer::box<std::string> content;
 };
 
+/**
+ * An incremental search in progress.  The keys typed while it lasts
+ * refine the query, and the cursor and the selection show the current
+ * match.  The search itself runs in the background, `token` belonging
+ * to the latest one started.
+ */
+struct search_state
+{
+    immer::box<std::string> query;
+    bool forward = true;
+    bool regex   = false;
+    coord origin;
+    std::optional<coord> origin_selection;
+    std::optional<search_match> match;
+    cancellation token;
+    bool running   = false;
+    float progress = 0;
+    bool failing   = false;
+    bool wrapped   = false;
+    immer::box<std::string> error;
+};
+
+/**
+ * A text in the kill ring, with the estimate of the memory it uses.
+ */
+struct kill_entry
+{
+    text content;
+    std::size_t bytes = 0;
+};
+
+constexpr auto default_kill_ring_budget = std::size_t{16} << 20;
+
+/**
+ * The texts that were cut or copied, the most recent last.  Like with
+ * the undo history, the oldest ones are forgotten when the estimated
+ * memory used by the entries exceeds `budget`, but for the last one.
+ */
+struct kill_ring
+{
+    immer::flex_vector<kill_entry, ui_memory_policy> entries;
+    std::size_t bytes  = 0;
+    std::size_t budget = default_kill_ring_budget;
+};
+
+/**
+ * What the last paste did, such that `yank-pop` can replace it: the
+ * entry of the kill ring pasted at `start` in the buffer `id`, whose
+ * content became `content`.
+ */
+struct yank_state
+{
+    std::size_t entry;
+    buffer_id id;
+    coord start;
+    text content;
+};
+
+struct application;
+
+/**
+ * A question asked in the message line.  Once the answer is typed, it
+ * is passed to `then`.
+ */
+struct prompt_state
+{
+    immer::box<std::string> question;
+    immer::box<std::string> answer;
+    std::function<result<application, action>(application, std::string)> then;
+};
+
 struct application
 {
     coord window_size;
     key_map keys;
-    key_seq input;
+    key_map::node input = key_map::root;
     buffer current;
-    immer::vector<text> clipboard;
-    immer::vector<message> messages;
+    // the other buffers, the most recently shown first
+    immer::flex_vector<buffer> buffers;
+    buffer_id last_buffer_id = 0;
+    kill_ring clipboard;
+    std::optional<yank_state> yank;
+    // the command that was called before, for those that carry on
+    // with what it did
+    command_id last_command = no_command;
+    immer::vector<message, ui_memory_policy> messages;
+    std::optional<search_state> search;
+    std::optional<prompt_state> prompt;
+    immer::box<std::string> last_search;
+    // whether every command called is told in the messages
+    bool debug = false;
+    // set in cold storage mode, where the lines that are not looked at
+    // are packed every `cold_storage_interval`
+    std::optional<cancellation> cold_storage;
+    // set in auto revert mode, where the files of the buffers are
+    // checked for changes every `auto_revert_interval`
+    std::optional<cancellation> auto_revert;
 };
 
+constexpr auto cold_storage_interval = std::chrono::seconds{10};
+// the rows around the screen that are never packed
+constexpr auto cold_storage_margin   = index{1} << 12;
+
+constexpr auto auto_revert_interval  = std::chrono::seconds{2};
+
 using command =
-    std::function<result<application, action>(application, std::any)>;
+    std::function<result<application, action>(application, command_arg)>;
 
 coord editor_size(application app);
 
-application paste(application app, coord size);
 application put_message(application state, immer::box<std::string> str);
+
+/** Pushes `content` to the kill ring, when it is not empty. */
 application put_clipboard(application state, text content);
+
+/**
+ * Appends `content` to the most recent entry of the kill ring, like
+ * the text was cut at once with it.
+ */
+application append_clipboard(application state, text content);
 application clear_input(application state);
 
+application paste(application app);
+application yank_pop(application app);
+application kill_line(application app);
+
 result<application, action> quit(application app);
 result<application, action> save(application app);
 result<application, action> load(application app, const std::string& fname);
+result<application, action> find_file(application app, const std::string& fname);
+result<application, action> open_file(application app, const std::string& fname);
+result<application, action> switch_buffer(application app, const std::string& name);
+result<application, action> next_buffer(application app);
+result<application, action> previous_buffer(application app);
+result<application, action> kill_buffer(application app);
+result<application, action> follow(application app);
+result<application, action> transform(application app, std::string what, line_transform fn);
+result<application, action> replace_string(application app, const std::string& from);
+application list_buffers(application app);
+application toggle_debug(application app);
+application toggle_profile(application app);
+result<application, action> toggle_cold_storage(application app);
+result<application, action> toggle_auto_revert(application app);
+result<application, action> profile_report(application app);
+result<application, action> goto_line(application app, const std::string& line);
+result<application, action> goto_byte(application app, const std::string& offset);
+result<application, action> isearch(application app, bool forward, bool regex);
 result<application, action> update(application state, action ev);
 
+/**
+ * Loads the file of the buffer `id` again, forgetting its contents and
+ * its undo history.  A buffer without a file is emptied.
+ */
+result<application, action> reload_buffer(application app, buffer_id id);
+
+// The kind of action, or the command called, which lives as long as
+// the program does
+std::string_view profile_tag(const action& ev);
+
+// Like the other `profile_tag`, but keys are told apart by the command
+// that they call when typed in `state`
+std::string_view profile_tag(const application& state, const action& ev);
+
 application apply_edit(application state, coord size, buffer edit);
 application apply_edit(application state, coord size, std::pair<buffer, text> edit);
 
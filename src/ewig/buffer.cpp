@@ -19,6 +19,12 @@
 //
 
 #include "ewig/buffer.hpp"
+#include "ewig/file_watcher.hpp"
+#include "ewig/file_writer.hpp"
+#include "ewig/mapped_file.hpp"
+#include "ewig/packed_block.hpp"
+#include "ewig/profile.hpp"
+#include "ewig/scan.hpp"
 
 #include <immer/flex_vector_transient.hpp>
 #include <immer/algorithm.hpp>
@@ -26,15 +32,32 @@
 #include <scelta.hpp>
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <string>
+#include <system_error>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
 
 namespace ewig {
 
-immer::box<std::string> no_file::name = "*unnamed*";
-text no_file::content = {};
+immer::box<std::string> no_file::unnamed = "*unnamed*";
+
+immer::box<std::string> buffer_name(const buffer& buf)
+{
+    return scelta::match([](auto&& f) { return f.name; })(buf.from);
+}
 
 bool load_in_progress(const buffer& buf)
 {
@@ -48,23 +71,160 @@ bool io_in_progress(const buffer& buf)
         !std::holds_alternative<no_file>(buf.from);
 }
 
+namespace {
+
+// Appends the lines of `loaded` that the buffer does not have yet.  The
+// buffer may have been edited meanwhile, but never at its end, where
+// the lines go.  They are also added to the undo history, such that
+// undoing an edit done while loading does not forget them.
+buffer merge_loaded(buffer buf, const text& loaded,
+                    const line_index& loaded_offsets)
+{
+    auto& current = std::get<loading_file>(buf.from).content;
+    auto lines    = loaded.drop(current.size());
+    if (!lines.empty()) {
+        auto offsets  = loaded_offsets.drop(current.size());
+        buf.content   = buf.content + lines;
+        buf.offsets   = buf.offsets + offsets;
+        auto& entries = buf.history.entries;
+        for (auto i = std::size_t{}; i < entries.size(); ++i) {
+            entries = entries.update(i, [&] (auto entry) {
+                entry.content = entry.content + lines;
+                entry.offsets = entry.offsets + offsets;
+                return entry;
+            });
+        }
+    }
+    return buf;
+}
+
+// Appends the lines written at the end of a followed file to the buffer,
+// its file and its history.  A cursor at the last line moves to the
+// end, such that the view follows the file.
+buffer append_followed(buffer buf, const follow_append_action& act)
+{
+    auto append = [&] (text& content, line_index& offsets) {
+        if (act.continues && !content.empty() && !act.lines.empty()) {
+            auto last   = content.size() - 1;
+            auto joined = content[last] + act.lines[0];
+            content = content.set(last, joined) + act.lines.drop(1);
+            offsets = offsets.splice(last, 1, text{joined})
+                + act.offsets.drop(1);
+        } else {
+            content = content + act.lines;
+            offsets = offsets + act.offsets;
+        }
+    };
+    auto at_end = buf.cursor.row + 1 >= (index)buf.content.size();
+    append(buf.content, buf.offsets);
+    if (auto file = std::get_if<existing_file>(&buf.from))
+        append(file->content, file->offsets);
+    else if (auto file = std::get_if<saving_file>(&buf.from))
+        append(file->content, file->offsets);
+    auto& entries = buf.history.entries;
+    for (auto i = std::size_t{}; i < entries.size(); ++i) {
+        entries = entries.update(i, [&] (auto entry) {
+            append(entry.content, entry.offsets);
+            return entry;
+        });
+    }
+    return at_end ? move_buffer_end(buf) : buf;
+}
+
+// Returns where the text at `row` is after replacing the rows of
+// `hunks`.  Rows in a hunk keep their distance to its start, as long
+// as there are lines for that.
+index revert_row(index row, const std::vector<line_hunk>& hunks)
+{
+    auto delta = index{};
+    for (auto& h : hunks) {
+        if (row < h.first)
+            break;
+        else if (row < h.first + h.removed)
+            return h.first + delta +
+                std::min(row - h.first, std::max(h.added - 1, index{}));
+        delta += h.added - h.removed;
+    }
+    return row + delta;
+}
+
+// Replaces the rows of the hunks of the checked file in the buffer,
+// which has the same contents as the file had.  They are replaced from
+// the last, so the rows of the others do not move.
+std::pair<buffer, std::string> revert_changes(buffer buf,
+                                              const file_check_action& act)
+{
+    using namespace std::string_literals;
+    auto next    = buf;
+    auto bytes   = std::size_t{};
+    auto changed = index{};
+    for (auto h = act.hunks.rbegin(); h != act.hunks.rend(); ++h) {
+        auto last     = h->first + h->removed;
+        auto new_last = h->new_first + h->added;
+        bytes   += unshared_bytes(next.content, h->first, last);
+        changed += std::max(h->removed, h->added);
+        next.content = next.content.take(h->first)
+            + act.lines.take(new_last).drop(h->new_first)
+            + next.content.drop(last);
+        next.offsets = next.offsets.take(h->first)
+            + act.offsets.take(new_last).drop(h->new_first)
+            + next.offsets.drop(last);
+    }
+    auto name  = std::get<existing_file>(buf.from).name;
+    auto clamp = [&] (coord pos) {
+        pos.row = std::min(revert_row(pos.row, act.hunks),
+                           (index)next.content.size());
+        if (pos.row < (index)next.content.size())
+            pos.col = std::min(pos.col, line_length(next.content[pos.row]));
+        return pos;
+    };
+    next.cursor = clamp(next.cursor);
+    next.selection_start = optional_map(next.selection_start, clamp);
+    next.scroll.row = std::min(revert_row(next.scroll.row, act.hunks),
+                               next.cursor.row);
+    // the buffer shares its lines with the file, so it is not dirty
+    next.from = existing_file{name, next.content, next.offsets, act.stamp};
+    auto [result, msg] = record(buf, next, bytes);
+    return std::pair{result, msg.empty()
+            ? "reverted: "s + name.get() + ", " + std::to_string(changed) +
+              " lines changed"
+            : msg};
+}
+
+} // anonymous
+
 std::pair<buffer, std::string> update_buffer(buffer buf, buffer_action act)
 {
     using namespace std::string_literals;
 
+    // actions of an abandoned load may still be queued
+    auto is_current = [&] (const cancellation& token) {
+        auto file = std::get_if<loading_file>(&buf.from);
+        return file && file->token == token;
+    };
+    auto is_following = [&] (const cancellation& token) {
+        return buf.follow && *buf.follow == token;
+    };
+
     return scelta::match(
         [&] (load_progress_action& act) {
-            buf.content = act.file.content;
+            if (!is_current(act.file.token))
+                return std::pair{buf, ""s};
+            buf = merge_loaded(buf, act.file.content, act.file.offsets);
             buf.from = act.file;
             return std::pair{buf, ""s};
         },
         [&] (load_done_action& act) {
-            buf.content = act.file.content;
+            if (!is_current(act.token))
+                return std::pair{buf, ""s};
+            buf = merge_loaded(buf, act.file.content, act.file.offsets);
             buf.from = act.file;
             return std::pair{buf, "loaded: "s + act.file.name.get()};
         },
         [&] (load_error_action& act) {
-            buf.content = act.file.content;
+            if (!is_current(act.token))
+                return std::pair{buf, ""s};
+            buf = merge_loaded(buf, act.file.content, act.file.offsets);
             buf.from = act.file;
             return std::pair{buf, "error while loading: "s + act.file.name.get()};
         },
@@ -79,6 +239,103 @@ std::pair<buffer, std::string> update_buffer(buffer buf, buffer_action act)
         [&] (save_error_action& act) {
             buf.from = act.file;
             return std::pair{buf, "error while saving: "s + act.file.name.get()};
+        },
+        [&] (follow_append_action& act) {
+            if (!is_following(act.token))
+                return std::pair{buf, ""s};
+            return std::pair{append_followed(buf, act), ""s};
+        },
+        [&] (follow_reset_action& act) {
+            if (!is_following(act.token) ||
+                !std::holds_alternative<existing_file>(buf.from))
+                return std::pair{buf, ""s};
+            auto file = std::get_if<existing_file>(&buf.from);
+            // when the contents are the same, the file was most likely
+            // replaced by saving it
+            if (file->offsets == act.offsets)
+                return std::pair{buf, ""s};
+            else if (is_dirty(buf))
+                return std::pair{buf, "changed on disk, but not reloaded "
+                                      "since it is modified: "s +
+                                      file->name.get()};
+            auto history   = undo_history{};
+            history.budget = buf.history.budget;
+            buf.from    = existing_file{file->name, act.lines, act.offsets};
+            buf.content = act.lines;
+            buf.offsets = act.offsets;
+            buf.history = history;
+            buf.selection_start = std::nullopt;
+            buf = move_buffer_end(buf);
+            return std::pair{buf, "reloaded: "s + buffer_name(buf).get()};
+        },
+        [&] (highlight_action& act) {
+            if (buf.lexing && *buf.lexing == act.token) {
+                buf.highlight = act.result;
+                if (act.done)
+                    buf.lexing = std::nullopt;
+            }
+            return std::pair{buf, ""s};
+        },
+        [&] (transform_done_action& act) {
+            auto what = act.what.get();
+            if (!identical(buf.content, act.original))
+                return std::pair{buf, what + ": the buffer changed meanwhile"};
+            else if (act.result.changed == 0)
+                return std::pair{buf, what + ": nothing to change"};
+            auto next    = buf;
+            next.content = act.result.content;
+            next.offsets = act.result.offsets;
+            // lines may have become shorter
+            auto clamp   = [&] (coord pos) {
+                if (pos.row < (index)next.content.size())
+                    pos.col = std::min(pos.col,
+                                       line_length(next.content[pos.row]));
+                return pos;
+            };
+            next.cursor  = clamp(next.cursor);
+            next.selection_start = optional_map(next.selection_start, clamp);
+            auto [result, msg] = record(buf, next, act.result.bytes);
+            return std::pair{result, msg.empty()
+                    ? what + ": " + std::to_string(act.result.changed) +
+                      " lines changed"
+                    : msg};
+        },
+        [&] (freeze_done_action& act) {
+            if (!buf.freezing || *buf.freezing != act.token)
+                return std::pair{buf, ""s};
+            buf.freezing = std::nullopt;
+            // when it was edited meanwhile, it is frozen again later
+            if (identical(buf.content, act.original)) {
+                buf.content   = act.content;
+                buf.history   = act.history;
+                buf.highlight = act.highlight;
+                buf.frozen    = act.content;
+                if (auto file = std::get_if<existing_file>(&buf.from)) {
+                    if (file->offsets == buf.offsets)
+                        file->content = buf.content;
+                    else if (identical(file->content, act.original_saved))
+                        file->content = act.saved;
+                }
+            }
+            return std::pair{buf, ""s};
+        },
+        [&] (file_check_action& act) {
+            if (!buf.reverting || *buf.reverting != act.token)
+                return std::pair{buf, ""s};
+            buf.reverting = std::nullopt;
+            auto file = std::get_if<existing_file>(&buf.from);
+            // it was loaded or saved again meanwhile
+            if (!file || file->stamp != act.known ||
+                !identical(file->content, act.original))
+                return std::pair{buf, ""s};
+            file->stamp = act.stamp;
+            if (!act.changed)
+                return std::pair{buf, ""s};
+            else if (is_dirty(buf))
+                return std::pair{buf, "changed on disk, but not reverted "
+                                      "since it is modified: "s +
+                                      file->name.get()};
+            return revert_changes(buf, act);
         })(act);
 }
 
@@ -93,149 +350,1182 @@ std::streamoff stream_size(std::istream& file)
     return endp - begp;
 }
 
-auto load_file_effect(immer::box<std::string> file_name)
+// Returns a line with the bytes in `[first, last)`, which only need to
+// be repaired when they are not `ascii` and contain invalid UTF-8.
+line decode_line(const char* first, const char* last, bool ascii)
+{
+    if (ascii || find_invalid_utf8(first, last) == last) {
+        return {first, last};
+    } else {
+        auto repaired = std::string{};
+        utf8::replace_invalid(first, last, std::back_inserter(repaired));
+        return {begin(repaired), end(repaired)};
+    }
+}
+
+// Updates the `content` of the file being loaded, indexing the lines
+// that were not there yet.
+loading_file index_loaded(loading_file file, text content)
+{
+    file.offsets = file.offsets + line_index{
+        content.drop(file.offsets.size())};
+    file.content = std::move(content);
+    return file;
+}
+
+template <typename Context>
+void load_stream_file(const Context& ctx,
+                      immer::box<std::string> file_name,
+                      cancellation token)
 {
     constexpr auto progress_report_rate_bytes = 1 << 20;
+    constexpr auto block_size = std::size_t{1} << 16;
+
+    auto content = text{}.transient();
+    auto file = std::ifstream{};
+    file.exceptions(std::fstream::badbit | std::fstream::failbit);
+    try {
+        file.open(file_name);
+        file.exceptions(std::fstream::badbit);
+        auto file_size = stream_size(file);
+        auto progress  = loading_file{ file_name, {}, {}, 0, file_size, token };
+        auto block     = std::vector<char>(block_size);
+        auto partial   = std::string{};
+        // the first block is reported right away, to show something
+        auto lastp = -std::streamoff{progress_report_rate_bytes};
+        while (file.read(block.data(), block.size()) || file.gcount() > 0) {
+            if (token.cancelled())
+                return;
+            auto first = static_cast<const char*>(block.data());
+            auto last  = first + file.gcount();
+            while (first != last) {
+                auto scan = scan_line(first, last);
+                if (scan.end == last) {
+                    // the line continues in the next block
+                    partial.append(first, last);
+                    break;
+                } else if (partial.empty()) {
+                    content.push_back(decode_line(first, scan.end, scan.ascii));
+                } else {
+                    partial.append(first, scan.end);
+                    content.push_back(decode_line(
+                        partial.data(), partial.data() + partial.size(), false));
+                    partial.clear();
+                }
+                first = scan.end + 1;
+            }
+            progress.loaded_bytes += file.gcount();
+            if (progress.loaded_bytes - lastp >
+                progress_report_rate_bytes) {
+                progress = index_loaded(progress, content.persistent());
+                ctx.dispatch(load_progress_action{progress});
+                lastp = progress.loaded_bytes;
+            }
+        }
+        if (!partial.empty())
+            content.push_back(decode_line(
+                partial.data(), partial.data() + partial.size(), false));
+        progress = index_loaded(progress, content.persistent());
+        ctx.dispatch(load_done_action{
+                {file_name, progress.content, progress.offsets}, token});
+    } catch (...) {
+        auto lines = content.persistent();
+        ctx.dispatch(load_error_action{{file_name, lines, line_index{lines}},
+                                       std::current_exception(),
+                                       token});
+    }
+}
 
+// Returns the lines in the range `[first, last)` of `file`, which is
+// expected to end at a line boundary.  When `as_views` is true, the
+// valid lines are views to the file instead of copies.
+text load_lines(const std::shared_ptr<const mapped_file>& file,
+                const char* first, const char* last,
+                bool as_views)
+{
+    auto content = text{}.transient();
+    while (first != last) {
+        auto [nl, ascii] = scan_line(first, last);
+        if (as_views && (ascii || find_invalid_utf8(first, nl) == nl)) {
+            content.push_back(line::view(file, first - file->begin(),
+                                         nl - first));
+        } else {
+            content.push_back(decode_line(first, nl, ascii));
+        }
+        first = nl == last ? nl : nl + 1;
+    }
+    return content.persistent();
+}
+
+// Splits `[first, last)` in ranges of roughly `chunk_size` bytes, each
+// of them ending right after a new line character.
+std::vector<std::pair<const char*, const char*>>
+split_lines(const char* first, const char* last, std::size_t chunk_size)
+{
+    auto chunks = std::vector<std::pair<const char*, const char*>>{};
+    while (first != last) {
+        auto split = std::size_t(last - first) > chunk_size
+            ? std::find(first + chunk_size, last, '\n')
+            : last;
+        split = split == last ? last : split + 1;
+        chunks.push_back({first, split});
+        first = split;
+    }
+    return chunks;
+}
+
+constexpr auto min_chunk_bytes   = std::size_t{1} << 22;
+constexpr auto min_view_bytes    = std::size_t{1} << 28;
+constexpr auto chunks_per_thread = 4;
+
+// Loads a memory mapped file.  The file is split in new line aligned
+// chunks that are decoded concurrently by the worker pool.  The
+// resulting texts are joined in order, using the logarithmic
+// concatenation of `flex_vector`, and progress is reported as soon as
+// every chunk is ready.  Huge files are not copied, instead their
+// lines become views of the mapping.
+template <typename Context>
+void load_mapped_file(const Context& ctx,
+                      immer::box<std::string> file_name,
+                      std::shared_ptr<const mapped_file> file,
+                      cancellation token)
+{
+    constexpr auto first_chunk_bytes = std::size_t{1} << 16;
+
+    auto& workers    = ctx.workers.get();
+    auto as_views    = file->size() >= min_view_bytes;
+    auto chunk_size  = std::max(min_chunk_bytes,
+                                file->size() / (workers.size() * chunks_per_thread));
+    // the first chunk is small, so the beginning of the file shows up,
+    // and can be edited, right away
+    auto head_end    = file->size() > first_chunk_bytes
+        ? std::find(file->begin() + first_chunk_bytes, file->end(), '\n')
+        : file->end();
+    head_end         = head_end == file->end() ? head_end : head_end + 1;
+    auto chunks      = split_lines(head_end, file->end(), chunk_size);
+    if (head_end != file->begin())
+        chunks.insert(chunks.begin(), {file->begin(), head_end});
+    using chunk_t    = std::pair<text, line_index>;
+    auto results     = std::vector<std::future<chunk_t>>{};
+    // the chunks left behind when we stop early must not keep working
+    auto stop        = cancellation{};
+    for (auto [first, last] : chunks) {
+        auto task = std::make_shared<std::packaged_task<chunk_t()>>(
+            [=, first=first, last=last] {
+                if (stop.cancelled() || token.cancelled())
+                    return chunk_t{};
+                auto lines = load_lines(file, first, last, as_views);
+                return chunk_t{lines, line_index{lines}};
+            });
+        results.push_back(task->get_future());
+        workers.post([task] { (*task)(); });
+    }
+
+    auto progress = loading_file{ file_name, {}, {}, 0,
+                                  (std::streamoff) file->size(), token };
+    try {
+        for (auto i = std::size_t{}; i < chunks.size(); ++i) {
+            auto [lines, offsets] = workers.get(std::move(results[i]));
+            if (token.cancelled()) {
+                stop.cancel();
+                return;
+            }
+            progress.content = progress.content + lines;
+            progress.offsets = progress.offsets + offsets;
+            progress.loaded_bytes = chunks[i].second - file->begin();
+            if (i + 1 < chunks.size())
+                ctx.dispatch(load_progress_action{progress});
+        }
+        ctx.dispatch(load_done_action{
+                {file_name, progress.content, progress.offsets,
+                 file->stamp()},
+                token});
+    } catch (...) {
+        stop.cancel();
+        ctx.dispatch(load_error_action{{file_name, progress.content,
+                                        progress.offsets},
+                                       std::current_exception(),
+                                       token});
+    }
+}
+
+// Reads all the lines of `file` at once, in chunks that `workers`
+// decode concurrently, like `load_mapped_file` does.
+std::pair<text, line_index>
+read_mapped_file(executor& workers, std::shared_ptr<const mapped_file> file)
+{
+    auto as_views   = file->size() >= min_view_bytes;
+    auto chunk_size = std::max(min_chunk_bytes,
+                               file->size() / (workers.size() * chunks_per_thread));
+    using chunk_t   = std::pair<text, line_index>;
+    auto results    = std::vector<std::future<chunk_t>>{};
+    for (auto [first, last] : split_lines(file->begin(), file->end(), chunk_size)) {
+        auto task = std::make_shared<std::packaged_task<chunk_t()>>(
+            [=, first=first, last=last] {
+                auto lines = load_lines(file, first, last, as_views);
+                return chunk_t{lines, line_index{lines}};
+            });
+        results.push_back(task->get_future());
+        workers.post([task] { (*task)(); });
+    }
+    auto result = chunk_t{};
+    for (auto& chunk : results) {
+        auto [lines, offsets] = workers.get(std::move(chunk));
+        result.first  = result.first + lines;
+        result.second = result.second + offsets;
+    }
+    return result;
+}
+
+auto load_file_effect(buffer_id owner,
+                      immer::box<std::string> file_name,
+                      cancellation token,
+                      cancellation abandoned)
+{
     return [=] (auto& ctx) {
-        ctx.async([=] {
-            auto content = text{}.transient();
-            auto file = std::ifstream{};
-            file.exceptions(std::fstream::badbit | std::fstream::failbit);
+        abandoned.cancel();
+        ctx.async_io(owner, false, [=] {
+            if (token.cancelled())
+                return;
+            static const auto load_tag = profile::tag{"io", "load"};
+            auto timing = profile::scope{load_tag};
+            auto file = std::shared_ptr<const mapped_file>{};
             try {
-                file.open(file_name);
-                file.exceptions(std::fstream::badbit);
-                auto file_size = stream_size(file);
-                auto progress  = loading_file{ file_name, {}, 0, file_size };
-                auto ln1       = std::string{};
-                auto ln2       = std::string{};
-                auto lastp = progress.loaded_bytes;
-                // work-around gcc-7 bug
-                // https://www.mail-archive.com/gcc-bugs@gcc.gnu.org/msg533664.html
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-                while (std::getline(file, ln1)) {
-#pragma GCC diagnostic pop
-                    ln2.clear();
-                    utf8::replace_invalid(ln1.begin(), ln1.end(),
-                                         std::back_inserter(ln2));
-                    content.push_back({begin(ln2), end(ln2)});
-                    progress.loaded_bytes += ln1.size();
-                    if (progress.loaded_bytes - lastp >
-                        progress_report_rate_bytes) {
-                        progress.content = content.persistent();
-                        ctx.dispatch(load_progress_action{progress});
-                        lastp = progress.loaded_bytes;
-                    }
-                }
-                ctx.dispatch(load_done_action{{file_name, content.persistent()}});
-            } catch (...) {
-                ctx.dispatch(load_error_action{{file_name, content.persistent()},
-                                               std::current_exception()});
+                file = map_file(file_name);
+            } catch (const std::system_error&) {
+                // not something we can map, like a pipe, or the file
+                // is not there at all, let the stream loader deal
+                // with it
+                load_stream_file(ctx, file_name, token);
+                return;
             }
+            load_mapped_file(ctx, file_name, std::move(file), token);
         });
     };
 }
 
-auto save_file_effect(immer::box<std::string> file_name,
-                      text old_content,
-                      text new_content)
+// Returns the path where `fname` is actually stored, following
+// symbolic links, such that replacing it keeps the links in place.
+std::string resolve_path(const std::string& fname)
+{
+    auto path = std::unique_ptr<char, void(*)(void*)>{
+        ::realpath(fname.c_str(), nullptr), &std::free};
+    return path ? std::string{path.get()} : fname;
+}
+
+// Returns the number of lines at the beginning of `new_content` that
+// did not change since `old_file` was saved as `fname` or loaded from
+// it, and their size in the file.  Nothing is reused when the file
+// does not have the stamp it had then, or not the size it should, since
+// then it changed behind our back, maybe keeping its size.
+std::pair<std::size_t, std::size_t>
+unchanged_prefix(const std::string& fname,
+                 const existing_file& old_file,
+                 const text& new_content)
+{
+    auto stamp = stamp_file(fname);
+    if (!stamp || !old_file.stamp || *stamp != *old_file.stamp ||
+        old_file.offsets.bytes() != stamp->size)
+        return {0, 0};
+    auto& old_content = old_file.content;
+    auto lines = std::size_t{};
+    auto bytes = std::size_t{};
+    auto last  = std::min(old_content.size(), new_content.size());
+    for (; lines < last && identical(old_content[lines], new_content[lines]);
+         ++lines)
+        bytes += new_content[lines].size() + 1;
+    return {lines, bytes};
+}
+
+// The file is written to a temporary that then replaces the original.
+// Lines may be views of the previous version of the file, so it can
+// never be truncated while we are writing it.  The lines that did not
+// change at the beginning are copied from the previous version by the
+// kernel, and the rest are written in batches of chunks.
+auto save_file_effect(buffer_id owner,
+                      existing_file old_file,
+                      existing_file new_file)
 {
     constexpr auto progress_report_rate_lines = (1 << 20) / 40;
+    static const char new_line = '\n';
 
     return [=] (auto& ctx) {
-        ctx.async([=] {
-            auto progress = saving_file{ file_name, new_content, 0 };
-            auto file = std::ofstream{};
-            file.exceptions(std::fstream::badbit | std::fstream::failbit);
+        ctx.async_io(owner, true, [=] {
+            static const auto save_tag = profile::tag{"io", "save"};
+            auto timing = profile::scope{save_tag};
+            auto& file_name   = new_file.name;
+            auto& new_content = new_file.content;
+            auto progress  = saving_file{
+                file_name, new_content, new_file.offsets, 0 };
+            auto target    = resolve_path(file_name);
+            auto temp_name = std::string{};
             try {
-                file.open(file_name);
-                auto lastp = std::size_t{};
-                immer::for_each(new_content, [&] (auto l) {
-                    immer::for_each_chunk(l, [&] (auto first, auto last) {
-                        file.write(first, last - first);
+                auto file = file_writer::next_to(target);
+                temp_name = file.name();
+                auto [lines, bytes] =
+                    unchanged_prefix(target, old_file, new_content);
+                if (lines > 0 && file.copy(target, bytes))
+                    progress.saved_lines = lines;
+                auto lastp = progress.saved_lines;
+                immer::for_each(
+                    new_content.drop(progress.saved_lines), [&] (auto&& l) {
+                        // the bytes of packed lines do not outlive the call
+                        l.for_each_chunk([&] (auto first, auto last) {
+                            if (l.is_packed())
+                                file.write_copy(first, last - first);
+                            else
+                                file.write(first, last - first);
+                        });
+                        file.write(&new_line, 1);
+                        ++progress.saved_lines;
+                        if (progress.saved_lines - lastp >
+                            progress_report_rate_lines) {
+                            ctx.dispatch(save_progress_action{progress});
+                            lastp = progress.saved_lines;
+                        }
                     });
-                    file.put('\n');
-                    ++progress.saved_lines;
-                    if (progress.saved_lines - lastp > progress_report_rate_lines) {
-                        ctx.dispatch(save_progress_action{progress});
-                        lastp = progress.saved_lines;
-                    }
-                });
-                ctx.dispatch(save_done_action{{file_name, new_content}});
+                file.close(target);
+                replace_file(temp_name, target);
+                auto saved  = new_file;
+                saved.stamp = stamp_file(target);
+                ctx.dispatch(save_done_action{saved});
             } catch (...) {
-                auto content = new_content.take(progress.saved_lines)
-                             + old_content.drop(progress.saved_lines);
-                ctx.dispatch(save_error_action{{file_name, content},
+                // the original file was left untouched
+                if (!temp_name.empty())
+                    std::remove(temp_name.c_str());
+                ctx.dispatch(save_error_action{old_file,
                                                std::current_exception()});
             }
         });
     };
 }
 
+// Where a followed file was read up to.  Until the file is `known`,
+// `offset` is the size the buffer expects it to have.  `partial` is set
+// when the last line read did not end in a new line yet.
+struct follow_position
+{
+    bool known = false;
+    dev_t device = {};
+    ino_t inode = {};
+    std::size_t offset = 0;
+    bool partial = false;
+};
+
+// Splits the bytes read from a followed file in lines.  Unlike
+// `to_text`, a new line at the end does not start another line.
+text split_followed(const char* first, const char* last)
+{
+    auto content = text{}.transient();
+    while (first != last) {
+        auto scan = scan_line(first, last);
+        content.push_back(decode_line(first, scan.end, scan.ascii));
+        first = scan.end == last ? last : scan.end + 1;
+    }
+    return content.persistent();
+}
+
+struct file_closer
+{
+    int fd;
+    ~file_closer() { ::close(fd); }
+};
+
+// Reads the bytes that are written at the end of a file.  Only one read
+// is happening at a time, and the changes noticed meanwhile make it
+// read again once it is done.
+template <typename Context>
+struct follower : std::enable_shared_from_this<follower<Context>>
+{
+    static constexpr auto max_read_bytes = std::size_t{1} << 24;
+
+    follower(Context ctx, immer::box<std::string> name,
+             std::size_t expected_bytes, cancellation token)
+        : ctx{std::move(ctx)}
+        , name{std::move(name)}
+        , token{std::move(token)}
+    {
+        position.offset = expected_bytes;
+    }
+
+    // Called in the event loop
+    void changed()
+    {
+        if (busy) {
+            again = true;
+            return;
+        }
+        busy = true;
+        ctx.async([self = this->shared_from_this()] {
+            auto more = self->read();
+            self->ctx.service.get().post([self, more] {
+                self->busy = false;
+                if (std::exchange(self->again, false) || more)
+                    self->changed();
+            });
+        });
+    }
+
+    // Called in a worker.  Returns whether there is more to read.
+    bool read()
+    {
+        if (token.cancelled())
+            return false;
+        auto fd = ::open(name->c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false; // it may still be created again
+        auto closer = file_closer{fd};
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+            return false;
+
+        auto& pos  = position;
+        auto size  = std::size_t(st.st_size);
+        auto reset = false;
+        if (!pos.known) {
+            // the last loaded line may not have ended in a new line,
+            // but the index counts one after every line
+            pos = {true, st.st_dev, st.st_ino, pos.offset, false};
+            auto last = char{};
+            if (pos.offset > size + 1)
+                reset = true;
+            else if (pos.offset > 0 &&
+                     (pos.offset > size ||
+                      ::pread(fd, &last, 1, pos.offset - 1) != 1 ||
+                      last != '\n')) {
+                --pos.offset;
+                pos.partial = true;
+            }
+        } else {
+            reset = st.st_dev != pos.device
+                || st.st_ino != pos.inode
+                || size < pos.offset;
+        }
+        if (reset)
+            pos = {true, st.st_dev, st.st_ino, 0, false};
+        else if (size == pos.offset)
+            return false;
+
+        auto data = std::vector<char>(std::min(size - pos.offset,
+                                               max_read_bytes));
+        auto read = std::size_t{};
+        while (read < data.size()) {
+            auto r = ::pread(fd, data.data() + read, data.size() - read,
+                             pos.offset + read);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            read += r;
+        }
+        auto lines   = split_followed(data.data(), data.data() + read);
+        auto offsets = line_index{lines};
+        if (reset)
+            ctx.dispatch(follow_reset_action{lines, offsets, token});
+        else if (read > 0)
+            ctx.dispatch(follow_append_action{lines, offsets, pos.partial,
+                                              token});
+        if (read > 0) {
+            pos.offset += read;
+            pos.partial = data[read - 1] != '\n';
+        }
+        return read > 0 && pos.offset < size;
+    }
+
+    Context ctx;
+    immer::box<std::string> name;
+    cancellation token;
+    follow_position position;
+    bool busy  = false;
+    bool again = false;
+};
+
+// Follows the file `name`, of which the buffer has `bytes` already
+auto follow_file_effect(immer::box<std::string> name,
+                        std::size_t bytes,
+                        cancellation token)
+{
+    return [=] (auto& ctx) {
+        using context_t = std::decay_t<decltype(ctx)>;
+        auto f = std::make_shared<follower<context_t>>(ctx, name, bytes,
+                                                       token);
+        watch_file(ctx.service, name, token, [f] { f->changed(); });
+    };
+}
+
+// Returns the lines of `mapped` when it is `file` with some lines
+// appended, reading only those, or nothing when the last line that the
+// file had is not there anymore.  The lines before it are taken to be
+// untouched, and the last one is read again, since it may have been
+// continued.
+std::optional<std::pair<text, line_index>>
+read_appended(const existing_file& file,
+              const std::shared_ptr<const mapped_file>& mapped)
+{
+    auto& known = *file.stamp;
+    auto& st    = mapped->stamp();
+    if (st.device != known.device || st.inode != known.inode ||
+        st.size <= known.size || file.content.empty())
+        return std::nullopt;
+    // compared by their hashes, to not read the old line again
+    auto last  = file.offsets.size() - 1;
+    auto start = file.offsets.offset(last);
+    auto size  = file.content[last].size();
+    if (start + size > known.size ||
+        file.offsets.drop(last) !=
+            line_index{text{line::view(mapped, start, size)}})
+        return std::nullopt;
+    auto tail = load_lines(mapped, mapped->begin() + start, mapped->end(),
+                           mapped->size() >= min_view_bytes);
+    return std::pair{file.content.take(last) + tail,
+                     file.offsets.take(last) + line_index{tail}};
+}
+
+// Checks whether `file` changed on disk.  It is only read when its
+// stamp changed, and only diffed when its fingerprint did too, since it
+// may have just been touched.  While it is being replaced it may fail
+// to map, and then it is checked again later.
+auto check_file_effect(buffer_id owner,
+                       existing_file file,
+                       cancellation token)
+{
+    return [=] (auto& ctx) {
+        ctx.async_io(owner, false, [=] {
+            auto result = file_check_action{file.content, file.stamp,
+                                            file.stamp, token};
+            auto stamp  = stamp_file(file.name);
+            if (!token.cancelled() && stamp && stamp != file.stamp) {
+                static const auto check_tag = profile::tag{"io", "check"};
+                auto timing = profile::scope{check_tag};
+                try {
+                    auto mapped   = map_file(file.name);
+                    auto appended = file.stamp
+                        ? read_appended(file, mapped)
+                        : std::nullopt;
+                    auto [lines, offsets] = appended
+                        ? *appended
+                        : read_mapped_file(ctx.workers.get(), mapped);
+                    result.stamp = mapped->stamp();
+                    if (offsets != file.offsets) {
+                        result.changed = true;
+                        result.lines   = lines;
+                        result.offsets = offsets;
+                        result.hunks   = diff_lines(file.offsets, offsets);
+                    }
+                } catch (const std::exception&) {}
+            }
+            ctx.dispatch(result);
+        });
+    };
+}
+
 } // anonymous
 
 result<buffer, buffer_action> save_buffer(buffer buf)
 {
-    auto file = std::get<existing_file>(buf.from);
-    buf.from = saving_file{file.name, buf.content, {}};
-    return { buf, save_file_effect(file.name, file.content, buf.content) };
+    auto file  = std::get<existing_file>(buf.from);
+    auto saved = existing_file{file.name, buf.content, buf.offsets};
+    buf.from = saving_file{file.name, buf.content, buf.offsets, {}};
+    return { buf, save_file_effect(buf.id, file, saved) };
 }
 
 result<buffer, buffer_action> load_buffer(buffer buf, const std::string& fname)
 {
-    buf.from = loading_file{fname, {}, {}, 1};
-    return { buf, load_file_effect(fname) };
+    // loading again stops following the file
+    auto loading   = std::get_if<loading_file>(&buf.from);
+    auto abandoned = loading ? loading->token : cancellation{};
+    auto followed  = buf.follow;
+    auto lexing    = buf.lexing;
+    auto freezing  = buf.freezing;
+    auto reverting = buf.reverting;
+    auto token     = cancellation{};
+    auto history   = undo_history{};
+    history.budget = buf.history.budget;
+    buf.from    = loading_file{fname, {}, {}, {}, 1, token};
+    buf.content = {};
+    buf.offsets = {};
+    buf.cursor  = {};
+    buf.scroll  = {};
+    buf.history = history;
+    buf.selection_start = std::nullopt;
+    buf.cursors = {};
+    buf.follow  = std::nullopt;
+    buf.highlight = {};
+    buf.lexing  = std::nullopt;
+    buf.frozen  = {};
+    buf.freezing = std::nullopt;
+    buf.reverting = std::nullopt;
+    return {
+        buf,
+        [=, effect = load_file_effect(buf.id, fname, token, abandoned)] (
+            auto& ctx) {
+            if (followed)
+                followed->cancel();
+            if (lexing)
+                lexing->cancel();
+            if (freezing)
+                freezing->cancel();
+            if (reverting)
+                reverting->cancel();
+            effect(ctx);
+        }
+    };
+}
+
+void abandon_io(const buffer& buf)
+{
+    if (auto loading = std::get_if<loading_file>(&buf.from))
+        loading->token.cancel();
+    if (buf.follow)
+        buf.follow->cancel();
+    if (buf.lexing)
+        buf.lexing->cancel();
+    if (buf.freezing)
+        buf.freezing->cancel();
+    if (buf.reverting)
+        buf.reverting->cancel();
+}
+
+result<buffer, buffer_action> follow_buffer(buffer buf)
+{
+    auto& file    = std::get<existing_file>(buf.from);
+    auto previous = buf.follow;
+    auto token    = cancellation{};
+    buf.follow    = token;
+    return {
+        buf,
+        [=, effect = follow_file_effect(file.name, file.offsets.bytes(),
+                                        token)] (auto& ctx) {
+            if (previous)
+                previous->cancel();
+            effect(ctx);
+        }
+    };
+}
+
+result<buffer, buffer_action> unfollow_buffer(buffer buf)
+{
+    auto previous = buf.follow;
+    buf.follow    = std::nullopt;
+    return {buf, [=] (auto&&) {
+        if (previous)
+            previous->cancel();
+    }};
+}
+
+result<buffer, buffer_action> check_file_buffer(buffer buf)
+{
+    auto file = std::get_if<existing_file>(&buf.from);
+    if (!file || buf.follow || buf.reverting)
+        return buf;
+    auto token    = cancellation{};
+    buf.reverting = token;
+    return {buf, check_file_effect(buf.id, *file, token)};
+}
+
+result<buffer, buffer_action> highlight_buffer(buffer buf)
+{
+    if (buf.lexing || identical(buf.content, buf.highlight.content))
+        return buf;
+    auto lang = syntax_for(buffer_name(buf));
+    if (lang == syntax::none) {
+        buf.highlight = {lang, buf.content, buf.offsets, {}};
+        return buf;
+    }
+    auto token = cancellation{};
+    buf.lexing = token;
+    return {
+        buf,
+        [=, prev = buf.highlight, content = buf.content,
+         offsets = buf.offsets] (auto& ctx) {
+            ctx.async([=] {
+                static const auto highlight_tag =
+                    profile::tag{"lex", "highlight"};
+                auto timing = profile::scope{highlight_tag};
+                auto report = [&] (const highlighting& partial) {
+                    ctx.dispatch(highlight_action{partial, false, token});
+                };
+                auto result = rehighlight(prev, lang, content, offsets,
+                                          token, report);
+                if (!token.cancelled())
+                    ctx.dispatch(highlight_action{result, true, token});
+            });
+        }
+    };
+}
+
+namespace {
+
+// Some rows of a text, starting at `first`, with their lines packed
+struct frozen_segment
+{
+    index first;
+    text lines;
+};
+
+using frozen_segments = std::vector<frozen_segment>;
+
+// Packs the segments of `content` out of the hot rows, concurrently
+frozen_segments freeze_segments(executor& workers,
+                                const text& content,
+                                index hot_first, index hot_last,
+                                const cancellation& token)
+{
+    constexpr auto tasks_per_thread = 4;
+
+    auto num_segments = ((index)content.size() + cold_segment_rows - 1)
+        / cold_segment_rows;
+    auto num_tasks    = std::min(num_segments,
+                                 (index)workers.size() * tasks_per_thread);
+    auto results      = std::vector<std::future<frozen_segments>>{};
+    for (auto i = index{}; i < num_tasks; ++i) {
+        auto task = std::make_shared<std::packaged_task<frozen_segments()>>(
+            [=] {
+                auto result = frozen_segments{};
+                auto first  = num_segments * i / num_tasks;
+                auto last   = num_segments * (i + 1) / num_tasks;
+                for (auto s = first; s < last && !token.cancelled(); ++s) {
+                    auto begin = s * cold_segment_rows;
+                    auto end   = std::min(begin + cold_segment_rows,
+                                          (index)content.size());
+                    if (begin < hot_last && end > hot_first)
+                        continue;
+                    auto lines = content.take(end).drop(begin);
+                    if (owned_bytes(lines) >= min_cold_bytes)
+                        result.push_back({begin, pack_lines(lines)});
+                }
+                return result;
+            });
+        results.push_back(task->get_future());
+        workers.post([task] { (*task)(); });
+    }
+    auto segments = frozen_segments{};
+    for (auto& r : results) {
+        auto part = workers.get(std::move(r));
+        segments.insert(segments.end(), part.begin(), part.end());
+    }
+    return segments;
+}
+
+// Puts the frozen `segments` of `original` in `txt`, another version of
+// it, where it has the same lines.  These are looked for at the same
+// rows, and shifted by the rows that were added or removed, which finds
+// them around an edit.
+text refreeze(text txt, const line_index& offsets,
+              const text& original, const line_index& original_offsets,
+              const frozen_segments& segments)
+{
+    auto same  = identical(txt, original);
+    auto delta = (index)txt.size() - (index)original.size();
+    for (auto& seg : segments) {
+        auto first = seg.first;
+        auto last  = first + (index)seg.lines.size();
+        for (auto d : { index{}, delta }) {
+            auto at = first + d;
+            if (!same && (at < 0 || at + (last - first) > (index)txt.size() ||
+                          !identical(txt[at], original[first]) ||
+                          !identical(txt[at + last - first - 1],
+                                     original[last - 1]) ||
+                          offsets.take(at + last - first).drop(at) !=
+                          original_offsets.take(last).drop(first)))
+                continue;
+            txt = txt.take(at) + seg.lines + txt.drop(at + last - first);
+            break;
+        }
+    }
+    return txt;
+}
+
+// Puts the frozen lines in the rows of the highlighting of `original`
+highlighting refreeze(highlighting hl,
+                      const text& original,
+                      const text& content,
+                      const frozen_segments& segments)
+{
+    if (!identical(hl.content, original))
+        return hl;
+    for (auto& seg : segments) {
+        auto first = std::min(seg.first, (index)hl.rows.size());
+        auto last  = std::min(first + (index)seg.lines.size(),
+                              (index)hl.rows.size());
+        auto rows  = hl.rows.take(first).transient();
+        for (auto row = first; row < last; ++row) {
+            auto lexed = hl.rows[row];
+            if (identical(lexed.content, original[row]))
+                lexed.content = content[row];
+            rows.push_back(std::move(lexed));
+        }
+        hl.rows = rows.persistent() + hl.rows.drop(last);
+    }
+    hl.content = content;
+    return hl;
+}
+
+} // anonymous
+
+result<buffer, buffer_action> freeze_buffer(buffer buf,
+                                            index hot_first,
+                                            index hot_last)
+{
+    // the saved lines are shared when they are the same
+    auto file = std::get_if<existing_file>(&buf.from);
+    if (file && file->offsets == buf.offsets)
+        file->content = buf.content;
+    // the highlighting is up to date, so it does not change meanwhile
+    if (buf.freezing || buf.lexing || io_in_progress(buf) ||
+        !identical(buf.highlight.content, buf.content) ||
+        identical(buf.content, buf.frozen))
+        return buf;
+    auto token = cancellation{};
+    buf.freezing = token;
+    return {
+        buf,
+        [=, prev = buf] (auto& ctx) {
+            ctx.async([=] {
+                static const auto freeze_tag = profile::tag{"cold", "freeze"};
+                auto timing   = profile::scope{freeze_tag};
+                auto& content = prev.content;
+                auto& offsets = prev.offsets;
+                auto segments = freeze_segments(ctx.workers.get(), content,
+                                                hot_first, hot_last, token);
+                auto frozen   = refreeze(content, offsets, content, offsets,
+                                         segments);
+                auto history  = prev.history;
+                for (auto i = std::size_t{}; i < history.entries.size() &&
+                         !token.cancelled(); ++i) {
+                    auto entry    = history.entries[i];
+                    entry.content = refreeze(entry.content, entry.offsets,
+                                             content, offsets, segments);
+                    history.entries = history.entries.set(i, entry);
+                }
+                auto saved        = text{};
+                auto saved_frozen = text{};
+                if (auto file = std::get_if<existing_file>(&prev.from)) {
+                    saved        = file->content;
+                    saved_frozen = refreeze(saved, file->offsets,
+                                            content, offsets, segments);
+                }
+                auto highlight = refreeze(prev.highlight, content, frozen,
+                                          segments);
+                if (!token.cancelled())
+                    ctx.dispatch(freeze_done_action{
+                            content, frozen, saved, saved_frozen,
+                            history, highlight, token});
+            });
+        }
+    };
+}
+
+namespace {
+
+// Transforms the slice `lines` of a text, whose index is `offsets`.
+// The transient is only started at the first line that changes, so the
+// lines before it are shared with the slice.
+transformed_text transform_slice(const text& lines,
+                                 const line_index& offsets,
+                                 const line_transform& fn)
+{
+    auto result = transformed_text{};
+    auto next   = std::optional<text::transient_type>{};
+    auto row    = std::size_t{};
+    immer::for_each(lines, [&] (auto&& ln) {
+        auto changed = fn(ln);
+        if (!identical(changed, ln)) {
+            if (!next)
+                next = lines.take(row).transient();
+            ++result.changed;
+            result.bytes += ln.is_view() || ln.is_packed() ? 0 : ln.size();
+        }
+        if (next)
+            next->push_back(std::move(changed));
+        ++row;
+    });
+    if (next) {
+        result.content = next->persistent();
+        result.offsets = line_index{result.content};
+    } else {
+        result.content = lines;
+        result.offsets = offsets;
+    }
+    return result;
+}
+
+} // anonymous
+
+transformed_text transform_lines(executor& workers,
+                                 const text& content,
+                                 const line_index& offsets,
+                                 index first, index last,
+                                 line_transform fn)
+{
+    constexpr auto min_slice_rows    = index{1} << 14;
+    constexpr auto slices_per_thread = 4;
+
+    last  = std::min(last, (index)content.size());
+    first = std::min(first, last);
+    auto rows       = last - first;
+    auto num_slices = std::clamp(rows / min_slice_rows, index{1},
+                                 (index)workers.size() * slices_per_thread);
+    auto slice = [&] (index i) {
+        auto begin = first + (std::int64_t)rows * i / num_slices;
+        auto end   = first + (std::int64_t)rows * (i + 1) / num_slices;
+        return std::pair{content.take(end).drop(begin),
+                         offsets.take(end).drop(begin)};
+    };
+    auto results = std::vector<std::future<transformed_text>>{};
+    for (auto i = index{1}; i < num_slices; ++i) {
+        auto task = std::make_shared<std::packaged_task<transformed_text()>>(
+            [=, slice = slice(i)] {
+                return transform_slice(slice.first, slice.second, fn);
+            });
+        results.push_back(task->get_future());
+        workers.post([task] { (*task)(); });
+    }
+
+    // the first slice is done here while the others are in the workers
+    auto head   = slice(0);
+    auto result = transform_slice(head.first, head.second, fn);
+    result.content = content.take(first) + result.content;
+    result.offsets = offsets.take(first) + result.offsets;
+    for (auto& r : results) {
+        auto part = workers.get(std::move(r));
+        result.content = result.content + part.content;
+        result.offsets = result.offsets + part.offsets;
+        result.changed += part.changed;
+        result.bytes   += part.bytes;
+    }
+    result.content = result.content + content.drop(last);
+    result.offsets = result.offsets + offsets.drop(last);
+    return result;
+}
+
+result<buffer, buffer_action> transform_buffer(buffer buf,
+                                               std::string what,
+                                               line_transform fn)
+{
+    auto first = index{};
+    auto last  = (index)buf.content.size();
+    if (buf.selection_start) {
+        // like in emacs, a region ending at the start of a line does
+        // not include that line
+        auto [starts, ends] = selected_region(buf);
+        first = starts.row;
+        last  = ends.col > 0 || ends.row == starts.row ? ends.row + 1 : ends.row;
+    }
+    return {
+        buf,
+        [=, content = buf.content, offsets = buf.offsets,
+         what = immer::box<std::string>{what}] (auto& ctx) {
+            ctx.async([=] {
+                auto timing = profile::scope{"edit", what.get()};
+                auto result = transform_lines(ctx.workers.get(), content,
+                                              offsets, first, last, fn);
+                ctx.dispatch(transform_done_action{content, result, what});
+            });
+        }
+    };
+}
+
+line indent_line(const line& ln)
+{
+    static const auto tab = std::string{"\t"};
+    return ln.empty() ? ln : line{tab.begin(), tab.end()} + ln;
+}
+
+line strip_trailing_whitespace(const line& ln)
+{
+    // iterators keep the bytes of packed lines decompressed
+    auto first = ln.begin();
+    auto last  = ln.end();
+    while (last != first && (*(last - 1) == ' ' || *(last - 1) == '\t'))
+        --last;
+    auto size = std::size_t(last - first);
+    return size == ln.size() ? ln : ln.take(size);
+}
+
+line untabify_line(const line& ln)
+{
+    auto tabs = false;
+    ln.for_each_chunk([&] (auto first, auto last) {
+        tabs = tabs || std::find(first, last, '\t') != last;
+    });
+    if (!tabs)
+        return ln;
+    auto str   = std::string{};
+    auto col   = index{};
+    auto first = utf8::unchecked::iterator(ln.begin());
+    auto last  = utf8::unchecked::iterator(ln.end());
+    for (; first != last; ++first) {
+        auto cp = *first;
+        if (cp == '\t') {
+            auto spaces = tab_width - (col % tab_width);
+            str.append(spaces, ' ');
+            col += spaces;
+        } else {
+            utf8::unchecked::append(cp, std::back_inserter(str));
+            col += char_width(cp);
+        }
+    }
+    return line{str.begin(), str.end()};
+}
+
+line_transform replace_in_line(std::string from, std::string to)
+{
+    return [=] (const line& ln) {
+        if (from.empty() || ln.size() < from.size())
+            return ln;
+        thread_local auto str = std::string{};
+        str.clear();
+        ln.for_each_chunk([&] (auto first, auto last) {
+            str.append(first, last);
+        });
+        auto pos = str.find(from);
+        if (pos == std::string::npos)
+            return ln;
+        auto result = std::string{};
+        auto prev   = std::size_t{};
+        for (; pos != std::string::npos; pos = str.find(from, prev)) {
+            result.append(str, prev, pos - prev);
+            result.append(to);
+            prev = pos + from.size();
+        }
+        result.append(str, prev, std::string::npos);
+        return line{result.begin(), result.end()};
+    };
 }
 
 bool is_dirty(const buffer& buf)
 {
     return scelta::match(
-        [&](auto&& x) { return buf.content != x.content; })
-        (buf.from);
+        [&](auto&& x) {
+            return !identical(buf.content, x.content)
+                && buf.offsets != x.offsets;
+        })(buf.from);
 }
 
-line get_line(const text& txt, index row)
+const line& get_line(const text& txt, index row)
 {
-    return row >= 0 && row < (index)txt.size() ? txt[row] : line{};
+    static const auto empty = line{};
+    return row >= 0 && row < (index)txt.size() ? txt[row] : empty;
+}
+
+std::size_t byte_offset(const buffer& buf, coord pos)
+{
+    if (pos.row >= buf.offsets.size())
+        return buf.offsets.bytes();
+    return buf.offsets.offset(pos.row)
+        + line_char(buf.content[pos.row], pos.col);
+}
+
+coord byte_position(const buffer& buf, std::size_t pos)
+{
+    auto row = buf.offsets.row(pos);
+    if (row >= (index)buf.content.size())
+        return {(index)buf.content.size(), 0};
+    auto col = line_char_index(buf.content[row], pos - buf.offsets.offset(row));
+    return {row, col};
+}
+
+buffer set_content(buffer buf, text content)
+{
+    buf.offsets = line_index{content};
+    buf.content = std::move(content);
+    return buf;
+}
+
+text to_text(const std::string& str)
+{
+    auto content = text{}.transient();
+    auto first   = str.data();
+    auto last    = first + str.size();
+    while (true) {
+        auto scan = scan_line(first, last);
+        content.push_back(decode_line(first, scan.end, scan.ascii));
+        if (scan.end == last)
+            break;
+        first = scan.end + 1;
+    }
+    return content.persistent();
 }
 
 index line_length(const line& ln)
 {
-    return utf8::unchecked::distance(ln.begin(), ln.end());
+    return ln.info().length;
 }
 
 std::size_t line_char(const line& ln, index col)
 {
-    auto fst = ln.begin();
-    auto lst = ln.end();
-    while (col --> 0 && fst != lst)
-        utf8::unchecked::next(fst);
-    return fst.index();
+    const auto& info = ln.info();
+    if (col <= 0)
+        return 0;
+    else if (col >= info.length)
+        return ln.size();
+    else if (info.ascii)
+        return col;
+    else {
+        // walk from the closest checkpoint before the character
+        auto& points = info.checkpoints;
+        auto point   = std::upper_bound(
+            points.begin(), points.end(), col,
+            [] (auto col, auto& p) { return col < p.code; }) - 1;
+        auto fst = ln.begin() + point->byte;
+        for (auto n = col - point->code; n > 0; --n)
+            utf8::unchecked::next(fst);
+        return fst.index();
+    }
+}
+
+index line_char_index(const line& ln, std::size_t pos)
+{
+    const auto& info = ln.info();
+    pos = std::min(pos, ln.size());
+    if (info.ascii)
+        return pos;
+    // count the characters from the closest checkpoint before it
+    auto& points = info.checkpoints;
+    auto point   = std::upper_bound(
+        points.begin(), points.end(), pos,
+        [] (auto pos, auto& p) { return pos < p.byte; }) - 1;
+    auto col = point->code;
+    for (auto it = ln.begin() + point->byte, last = ln.begin() + pos;
+         it != last; ++it)
+        col += (*it & 0xc0) != 0x80;
+    return col;
 }
 
 std::pair<std::size_t, std::size_t> line_char_region(const line& ln, index col)
 {
-    auto fst = ln.begin();
-    auto lst = ln.end();
-    while (col --> 0 && fst != lst)
-        utf8::unchecked::next(fst);
-    auto prv = fst;
-    if (fst != lst)
-        utf8::unchecked::next(fst);
-    return { prv.index(), fst.index() };
+    auto fst = line_char(ln, col);
+    if (fst == ln.size())
+        return { fst, fst };
+    else if (ln.info().ascii)
+        return { fst, fst + 1 };
+    else {
+        auto it = ln.begin() + fst;
+        utf8::unchecked::next(it);
+        return { fst, it.index() };
+    }
 }
 
 index expand_tabs(const line& ln, index col)
 {
-    using namespace std;
-    auto cur_col = index{};
-    for (auto c : line_range(ln)) {
-        if (col-- <= 0) break;
-        if (c == '\t') {
+    const auto& info = ln.info();
+    col = std::clamp(col, 0, info.length);
+    if (!info.tabs && !info.wide)
+        return col;
+    else if (col == info.length)
+        return info.width;
+    auto& points = info.checkpoints;
+    auto point   = std::upper_bound(
+        points.begin(), points.end(), col,
+        [] (auto col, auto& p) { return col < p.code; }) - 1;
+    auto cur_col = point->column;
+    auto fst     = utf8::unchecked::iterator(ln.begin() + point->byte);
+    for (auto n = col - point->code; n > 0; --n, ++fst) {
+        if (*fst == '\t') {
             cur_col += tab_width - (cur_col % tab_width);
         } else
-            ++cur_col;
+            cur_col += char_width(*fst);
     }
     return cur_col;
 }
@@ -305,10 +1595,22 @@ buffer move_buffer_end(buffer buf)
     return buf;
 }
 
+buffer move_to_line(buffer buf, index row)
+{
+    buf.cursor = {std::clamp(row, 0, (index)buf.content.size()), 0};
+    return buf;
+}
+
+buffer move_to_byte(buffer buf, std::size_t pos)
+{
+    buf.cursor = byte_position(buf, pos);
+    return buf;
+}
+
 buffer move_cursor_left(buffer buf)
 {
     auto cur = buf.cursor;
-    auto ln  = get_line(buf.content, cur.row);
+    auto& ln = get_line(buf.content, cur.row);
     auto chr = line_char(ln, cur.col);
     if (chr == 0) {
         if (cur.row > 0) {
@@ -327,7 +1629,7 @@ buffer move_cursor_left(buffer buf)
 buffer move_cursor_right(buffer buf)
 {
     auto cur     = buf.cursor;
-    auto ln      = get_line(buf.content, cur.row);
+    auto& ln     = get_line(buf.content, cur.row);
     auto chr     = line_char(ln, cur.col);
     auto new_chr = line_char(ln, cur.col + 1);
     if (chr == new_chr) {
@@ -356,11 +1658,25 @@ buffer scroll_to_cursor(buffer buf, coord wsize)
     return buf;
 }
 
+namespace {
+
+// Updates the line index after the `count` lines at `row` became the
+// `lines` lines that are there now.
+buffer reindex(buffer buf, index row, index count, index lines)
+{
+    buf.offsets = buf.offsets.splice(
+        row, count, buf.content.drop(row).take(lines));
+    return buf;
+}
+
+} // anonymous
+
 buffer insert_new_line(buffer buf)
 {
     auto cur = buf.cursor;
     if (cur.row == (index)buf.content.size()) {
         buf.content = buf.content.push_back({});
+        buf = reindex(buf, cur.row, 0, 1);
         return move_cursor_down(buf);
     } else {
         auto ln = buf.content[cur.row];
@@ -369,6 +1685,7 @@ buffer insert_new_line(buffer buf)
             buf.content = buf.content
                 .set(cur.row, ln.take(chr))
                 .insert(cur.row + 1, ln.drop(chr));
+            buf = reindex(buf, cur.row, 1, 2);
         }
         buf = move_cursor_down(buf);
         buf.cursor.col = 0;
@@ -385,16 +1702,18 @@ buffer insert_char(buffer buf, wchar_t value)
 {
     auto cur   = buf.cursor;
     auto ln    = [&] {
-        auto ln = line{}.transient();
+        auto ln = line_chars{}.transient();
         utf8::append(value, std::back_inserter(ln));
-        return ln.persistent();
+        return line{ln.persistent()};
     } ();
     if (cur.row == (index)buf.content.size()) {
         buf.content = buf.content.push_back(ln);
+        buf = reindex(buf, cur.row, 0, 1);
     } else {
         buf.content = buf.content.update(cur.row, [&] (auto l) {
             return l.insert(line_char(l, cur.col), ln);
         });
+        buf = reindex(buf, cur.row, 1, 1);
     }
     buf.cursor.col = cur.col + 1;
     return buf;
@@ -409,12 +1728,14 @@ buffer delete_char(buffer buf)
             auto [fst, lst] = line_char_region(l, buf.cursor.col);
             return l.erase(fst, lst);
         });
+        buf = reindex(buf, cur.row, 1, 1);
     } else if (cur.row > 0) {
         auto ln1 = buf.content[cur.row - 1];
         if (cur.row < (index)buf.content.size()) {
             buf.content = buf.content
                 .update(cur.row, [&] (auto ln2) { return ln1 + ln2; })
                 .erase(cur.row - 1);
+            buf = reindex(buf, cur.row - 1, 2, 1);
         }
     }
     return buf;
@@ -434,6 +1755,7 @@ std::pair<buffer, text> cut_rest(buffer buf)
         auto chr = line_char(ln, buf.cursor.col);
         if (chr < ln.size()) {
             buf.content = buf.content.set(buf.cursor.row, ln.take(chr));
+            buf = reindex(buf, buf.cursor.row, 1, 1);
             return {buf, {ln.drop(chr)}};
         } else {
             // Delete the end of line to join with previous line
@@ -457,8 +1779,10 @@ buffer insert_text(buffer buf, text paste)
         auto ln2 = buf.content[cur.row + paste.size() - 1];
         buf.content = buf.content.set(cur.row + paste.size() - 1,
                                       ln2 + ln1.drop(chr));
+        buf = reindex(buf, cur.row, 1, paste.size());
     } else {
         buf.content = buf.content + paste;
+        buf = reindex(buf, cur.row, 0, paste.size());
     }
     buf.cursor.row = cur.row + paste.size() - 1;
     buf.cursor.col = paste.size() > 1
@@ -494,6 +1818,8 @@ std::pair<buffer, text> cut(buffer buf)
     auto [starts, ends] = selected_region(buf);
     if (starts != ends) {
         if (starts.row != ends.row) {
+            auto lines = std::min(ends.row + 1, (index)buf.content.size())
+                - starts.row;
             auto content =
                 ends.row == (index)buf.content.size()
                 ? buf.content.push_back({}) // add the imaginary line
@@ -506,13 +1832,17 @@ std::pair<buffer, text> cut(buffer buf)
                         +  l2.drop(line_char(l2, ends.col));
                 })
               + buf.content.drop(ends.row + 1);
+            buf = reindex(buf, starts.row, lines, 1);
         } else {
             buf.content = buf.content.update(starts.row, [&] (auto l) {
                 return l.take(line_char(l, starts.col))
                     +  l.drop(line_char(l, ends.col));
             });
+            buf = reindex(buf, starts.row, 1, 1);
         }
         buf.cursor = starts;
+        // the other cursors do not follow the region that is removed
+        buf.cursors = {};
     }
 
     buf.selection_start = std::nullopt;
@@ -560,30 +1890,430 @@ std::tuple<coord, coord> selected_region(buffer buf)
     }
 }
 
+namespace {
+
+// Returns the cursors `others`, sorted, but for those at `main`
+cursor_set make_cursors(coord main, std::vector<coord> others)
+{
+    std::sort(others.begin(), others.end());
+    others.erase(std::unique(others.begin(), others.end()), others.end());
+    auto result = cursor_set{}.transient();
+    for (auto pos : others)
+        if (pos != main)
+            result.push_back(pos);
+    return result.persistent();
+}
+
+// Leaves a cursor where the cursor is, and moves the latter to `pos`,
+// which takes the place of the cursor that may have been there.
+buffer add_cursor(buffer buf, coord pos)
+{
+    auto prev = buf.cursor;
+    if (pos == prev)
+        return buf;
+    auto& cursors = buf.cursors;
+    auto at = std::lower_bound(cursors.begin(), cursors.end(), prev)
+        - cursors.begin();
+    if (at == (std::ptrdiff_t)cursors.size() || cursors[at] != prev)
+        cursors = cursors.insert(at, prev);
+    auto it = std::lower_bound(cursors.begin(), cursors.end(), pos);
+    if (it != cursors.end() && *it == pos)
+        cursors = cursors.erase(it - cursors.begin());
+    buf.cursor = pos;
+    return buf;
+}
+
+} // anonymous
+
+buffer add_cursor_above(buffer buf)
+{
+    return add_cursor(buf, move_cursor_up(buf).cursor);
+}
+
+buffer add_cursor_below(buffer buf)
+{
+    return add_cursor(buf, move_cursor_down(buf).cursor);
+}
+
+buffer add_cursors_to_lines(buffer buf)
+{
+    if (!buf.selection_start)
+        return buf;
+    auto [starts, ends] = selected_region(buf);
+    auto others = std::vector<coord>(buf.cursors.begin(), buf.cursors.end());
+    auto last   = std::min(ends.row, (index)buf.content.size() - 1);
+    for (auto row = starts.row; row <= last; ++row)
+        others.push_back({row, buf.cursor.col});
+    buf.cursors = make_cursors(buf.cursor, std::move(others));
+    buf.selection_start = std::nullopt;
+    return buf;
+}
+
+buffer clear_cursors(buffer buf)
+{
+    buf.cursors = {};
+    return buf;
+}
+
+buffer edit_every_cursor(buffer buf, const cursor_edit& edit)
+{
+    if (buf.cursors.empty())
+        return edit(buf);
+    auto clamp = [&] (coord pos) {
+        pos.row = std::clamp(pos.row, 0, (index)buf.content.size());
+        pos.col = std::clamp(pos.col, 0,
+                             line_length(get_line(buf.content, pos.row)));
+        return pos;
+    };
+    auto main   = clamp(buf.cursor);
+    auto points = std::vector<coord>{};
+    points.reserve(buf.cursors.size() + 1);
+    for (auto pos : buf.cursors)
+        points.push_back(clamp(pos));
+    points.push_back(main);
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    auto main_at = std::lower_bound(points.begin(), points.end(), main)
+        - points.begin();
+
+    // The edits are done from the last cursor, in a window with the rows
+    // around it only, so each costs the same as with a single cursor.
+    // The rows before `next` are still untouched, and those after the
+    // window are done, in `done`.  Every edit only looks at the rows next
+    // to its cursor, which are moved into the window first.
+    auto window = buf;
+    window.content = {};
+    window.offsets = {};
+    window.cursors = {};
+    window.selection_start = std::nullopt;
+    auto done         = text{};
+    auto done_offsets = line_index{};
+    auto next         = (index)buf.content.size();
+    // the rows from `last` on are done, and those from `first` enter
+    auto move_window = [&] (index first, index last) {
+        if (last < next) {
+            done = buf.content.drop(last).take(next - last)
+                + window.content + std::move(done);
+            done_offsets = buf.offsets.drop(last).take(next - last)
+                + window.offsets + done_offsets;
+            window.content = {};
+            window.offsets = {};
+            next = last;
+        } else if (last - next < (index)window.content.size()) {
+            done = window.content.drop(last - next) + std::move(done);
+            done_offsets = window.offsets.drop(last - next) + done_offsets;
+            window.content = window.content.take(last - next);
+            window.offsets = window.offsets.take(last - next);
+        }
+        if (first < next) {
+            window.content = buf.content.drop(first).take(next - first)
+                + std::move(window.content);
+            window.offsets = buf.offsets.drop(first).take(next - first)
+                + window.offsets;
+            next = first;
+        }
+        // the previous edit may have removed rows of the window
+        while (next + (index)window.content.size() < last && !done.empty()) {
+            window.content = std::move(window.content) + done.take(1);
+            window.offsets = window.offsets + done_offsets.take(1);
+            done           = done.drop(1);
+            done_offsets   = done_offsets.drop(1);
+        }
+    };
+
+    // The cursors already edited are after the one being edited.  Those
+    // in other rows only move by the lines that it inserts or removes,
+    // which are accumulated in `shift`, so their rows are kept relative
+    // to it, and only those in its row, at the end, are looked at.
+    auto moved = std::vector<coord>{};
+    moved.reserve(points.size());
+    auto shift = index{};
+    for (auto i = points.size(); i-- > 0;) {
+        auto pos = points[i];
+        move_window(std::max(pos.row - 1, index{}), pos.row + 2);
+        auto lines    = (index)window.content.size();
+        window.cursor = {pos.row - next, pos.col};
+        window        = edit(std::move(window));
+        auto to    = coord{window.cursor.row + next, window.cursor.col};
+        auto delta = (index)window.content.size() - lines;
+        for (auto m = moved.rbegin();
+             m != moved.rend() && m->row + shift == pos.row; ++m) {
+            m->row  = to.row - shift - delta;
+            m->col += to.col - pos.col;
+        }
+        shift += delta;
+        moved.push_back({to.row - shift, to.col});
+    }
+    for (auto& m : moved)
+        m.row += shift;
+    buf.content = buf.content.take(next) + window.content + done;
+    buf.offsets = buf.offsets.take(next) + window.offsets + done_offsets;
+    buf.cursor  = moved[points.size() - 1 - main_at];
+    buf.cursors = make_cursors(buf.cursor, std::move(moved));
+    buf.selection_start = std::nullopt;
+    return buf;
+}
+
+buffer move_every_cursor(buffer buf, const cursor_edit& move)
+{
+    if (buf.cursors.empty())
+        return move(buf);
+    auto others = std::vector<coord>{};
+    others.reserve(buf.cursors.size());
+    for (auto pos : buf.cursors) {
+        auto moved   = buf;
+        moved.cursor = pos;
+        others.push_back(move(moved).cursor);
+    }
+    buf = move(buf);
+    buf.cursors = make_cursors(buf.cursor, std::move(others));
+    return buf;
+}
+
 buffer undo(buffer buf)
 {
-    auto idx = buf.history_pos.value_or(buf.history.size());
+    auto idx = buf.history.position.value_or(buf.history.entries.size());
     if (idx > 0) {
-        auto restore = buf.history[--idx];
+        auto restore = buf.history.entries[--idx];
         buf.content = restore.content;
+        buf.offsets = restore.offsets;
         buf.cursor = restore.cursor;
-        buf.history_pos = idx;
+        buf.cursors = restore.cursors;
+        buf.history.position = idx;
     }
     return buf;
 }
 
+namespace {
+
+// Whether the last line of `before`, after which the lines that are
+// still being loaded go, is still the last one in `after`.
+bool keeps_loading_end(const buffer& before, const buffer& after)
+{
+    return !before.content.empty()
+        && !after.content.empty()
+        && identical(before.content.back(), after.content.back())
+        && after.cursor.row + 1 < (index)after.content.size();
+}
+
+// Whether `after` results from typing one character in `before`
+bool is_insert(const buffer& before, const buffer& after)
+{
+    auto row = before.cursor.row;
+    if (after.cursor.row != row || after.cursor.col != before.cursor.col + 1)
+        return false;
+    else if (row == (index)before.content.size())
+        // typing at the imaginary line after the end of the buffer
+        return after.content.size() == before.content.size() + 1
+            && line_length(after.content[row]) == 1;
+    else
+        return after.content.size() == before.content.size()
+            && line_length(after.content[row]) ==
+               line_length(before.content[row]) + 1;
+}
+
+} // anonymous
+
+namespace {
+
+constexpr auto node_bytes = 32 * sizeof(void*);
+constexpr auto leaf_bytes = 32 * sizeof(line);
+
+// The nodes of the tree of `txt` on the path to one of its leaves
+std::size_t path_bytes(const text& txt)
+{
+    auto bytes = leaf_bytes;
+    for (auto n = txt.size(); n > 32; n /= 32)
+        bytes += node_bytes;
+    return bytes;
+}
+
+// The inner nodes of the tree of the bytes of `ln` on the path to one
+// of its chunks
+std::size_t chunk_path_bytes(const line& ln)
+{
+    auto bytes = std::size_t{};
+    for (auto n = ln.size(); n > 256; n /= 32)
+        bytes += node_bytes;
+    return bytes;
+}
+
+} // anonymous
+
+std::size_t unshared_bytes(const text& txt, index first, index last)
+{
+    last = std::min(last, (index)txt.size());
+    auto bytes = path_bytes(txt);
+    for (auto row = first; row < last; ++row) {
+        auto ln = txt[row];
+        if (!ln.is_view() && !ln.is_packed())
+            bytes += ln.size();
+    }
+    return bytes;
+}
+
+std::size_t unshared_bytes(const text& txt, index first, index last,
+                           const text& other)
+{
+    last = std::min(last, (index)txt.size());
+    if (first >= last)
+        return path_bytes(txt);
+    // the rows of `other` that the edit made of those of `txt`, which
+    // moved by at most the number of rows added or removed
+    auto delta       = (index)other.size() - (index)txt.size();
+    auto other_first = std::max(first + std::min(delta, index{}), index{});
+    auto other_last  = std::min(last + std::max(delta, index{}),
+                                (index)other.size());
+    auto shared = std::unordered_set<const char*>{};
+    for (auto row = other_first; row < other_last; ++row) {
+        auto ln = other[row];
+        if (!ln.is_view() && !ln.is_packed())
+            ln.for_each_chunk([&] (auto chunk, auto) {
+                shared.insert(&*chunk);
+            });
+    }
+    auto bytes = path_bytes(txt);
+    for (auto row = first; row < last; ++row) {
+        auto ln = txt[row];
+        if (ln.is_view() || ln.is_packed())
+            continue;
+        auto owned = std::size_t{};
+        ln.for_each_chunk([&] (auto chunk, auto chunk_last) {
+            if (!shared.count(&*chunk))
+                owned += chunk_last - chunk;
+        });
+        if (owned > 0)
+            bytes += owned + chunk_path_bytes(ln);
+    }
+    return bytes;
+}
+
+std::size_t sliced_bytes(const text& txt)
+{
+    // the tree shares its leaves but for those at both ends
+    auto bytes = 2 * path_bytes(txt);
+    auto edge  = [&] (const line& ln) {
+        if (!ln.is_view() && !ln.is_packed())
+            bytes += std::min(ln.size(), 256 + chunk_path_bytes(ln));
+    };
+    if (!txt.empty())
+        edge(txt.front());
+    if (txt.size() > 1)
+        edge(txt.back());
+    return bytes;
+}
+
+namespace {
+
+// Makes a snapshot of `before` that can restore it after the
+// transition to `after`.  All edits touch the rows between the
+// cursors and selection marks of both states only.
+snapshot make_snapshot(const buffer& before, const buffer& after)
+{
+    auto first = std::min(before.cursor.row, after.cursor.row);
+    auto last  = std::max(before.cursor.row, after.cursor.row);
+    for (auto mark : { before.selection_start, after.selection_start }) {
+        if (mark) {
+            first = std::min(first, mark->row);
+            last  = std::max(last, mark->row);
+        }
+    }
+    auto insert = is_insert(before, after);
+    auto bytes  = unshared_bytes(before.content, first, last + 1,
+                                 after.content);
+    // the other cursors may have joined their row with the one above
+    for (auto pos : before.cursors)
+        bytes += unshared_bytes(before.content, std::max(pos.row - 1, 0),
+                                pos.row + 1, after.content);
+    return {
+        before.content,
+        before.offsets,
+        before.cursor,
+        bytes,
+        insert ? std::optional<coord>{after.cursor} : std::nullopt,
+        insert ? 1 : 0,
+        before.cursors,
+    };
+}
+
+// Forgets the oldest entries of `history` while it exceeds its budget
+undo_history prune_history(undo_history history)
+{
+    auto pruned = std::size_t{};
+    while (history.bytes > history.budget &&
+           pruned + 1 < history.entries.size())
+        history.bytes -= history.entries[pruned++].bytes;
+    if (pruned > 0) {
+        history.entries = history.entries.drop(pruned);
+        history.position = optional_map(history.position, [&] (auto pos) {
+            return pos > pruned ? pos - pruned : 0;
+        });
+    }
+    return history;
+}
+
+undo_history push_snapshot(undo_history history, snapshot entry)
+{
+    history.bytes  += entry.bytes;
+    history.entries = std::move(history.entries).push_back(std::move(entry));
+    return prune_history(std::move(history));
+}
+
+} // anonymous
+
 std::pair<buffer, std::string> record(buffer before, buffer after)
 {
-    if (before.content != after.content) {
-        if (load_in_progress(before)) {
-            return {before, "can't edit while loading"};
+    if (!identical(before.content, after.content)) {
+        if (load_in_progress(before) && !keeps_loading_end(before, after)) {
+            return {before, "can't edit the end of the file while loading"};
+        }
+        auto& entries = after.history.entries;
+        auto coalesce =
+            !before.history.position &&
+            !after.history.position &&
+            !entries.empty() &&
+            entries.back().insert_run == before.cursor &&
+            entries.back().inserts < max_coalesced_inserts &&
+            is_insert(before, after);
+        if (coalesce) {
+            // the typed chunks of the row that the snapshot does not
+            // share anymore, most of the time none or a new one
+            auto& kept = entries.back().content;
+            auto row   = after.cursor.row;
+            auto now   = unshared_bytes(kept, row, row + 1, after.content);
+            auto was   = unshared_bytes(kept, row, row + 1, before.content);
+            auto bytes = now > was ? now - was : std::size_t{};
+            entries = entries.update(entries.size() - 1, [&] (auto entry) {
+                entry.insert_run = after.cursor;
+                entry.bytes += bytes;
+                ++entry.inserts;
+                return entry;
+            });
+            after.history.bytes += bytes;
+            after.history = prune_history(std::move(after.history));
         } else {
-            after.history = after.history.push_back({before.content, before.cursor});
-            if (before.history_pos == after.history_pos)
-                after.history_pos = std::nullopt;
+            after.history = push_snapshot(after.history,
+                                          make_snapshot(before, after));
+            if (before.history.position == after.history.position)
+                after.history.position = std::nullopt;
         }
     }
     return {after, ""};
 }
 
+std::pair<buffer, std::string> record(buffer before, buffer after,
+                                      std::size_t bytes)
+{
+    if (identical(before.content, after.content))
+        return {after, ""};
+    else if (load_in_progress(before) && !keeps_loading_end(before, after))
+        return {before, "can't edit the end of the file while loading"};
+    auto entry    = make_snapshot(before, after);
+    entry.bytes   = bytes;
+    after.history = push_snapshot(after.history, std::move(entry));
+    if (before.history.position == after.history.position)
+        after.history.position = std::nullopt;
+    return {after, ""};
+}
+
 } // namespace ewig
@@ -21,7 +21,13 @@
 #pragma once
 
 #include <ewig/coord.hpp>
+#include <ewig/diff.hpp>
+#include <ewig/highlight.hpp>
+#include <ewig/line.hpp>
+#include <ewig/line_index.hpp>
+#include <ewig/mapped_file.hpp>
 #include <ewig/store.hpp>
+#include <ewig/utils.hpp>
 
 #include <immer/box.hpp>
 #include <immer/flex_vector.hpp>
@@ -30,39 +36,54 @@
 #include <utf8.h>
 #include <boost/range/iterator_range.hpp>
 
+#include <functional>
 #include <optional>
 #include <variant>
 
 namespace ewig {
 
-using line = immer::flex_vector<char>;
-using text = immer::flex_vector<line>;
-
+// Files also keep the index of their `content`, such that we can tell
+// whether the buffer is dirty by comparing fingerprints.  Buffers
+// without a file are unnamed and start empty, but for those showing
+// some report.
 struct no_file
 {
-    static immer::box<std::string> name;
-    static text content;
+    static immer::box<std::string> unnamed;
+    immer::box<std::string> name = unnamed;
+    text content = {};
+    line_index offsets = {};
 };
 
+// The `stamp` is that of the file when `content` was loaded from it or
+// saved to it, when we know it.
 struct existing_file
 {
     immer::box<std::string> name;
     text content;
+    line_index offsets;
+    std::optional<file_stamp> stamp = std::nullopt;
 };
 
 struct saving_file
 {
     immer::box<std::string> name;
     text content;
+    line_index offsets;
     std::size_t saved_lines;
 };
 
+// `content` has the lines loaded so far, as they are in the file, while
+// the buffer may already have edits in them.  `token` is shared with
+// the loader, so the load can be abandoned, and tells the actions of
+// this load apart from those of an earlier one.
 struct loading_file
 {
     immer::box<std::string> name;
     text content;
+    line_index offsets;
     std::streamoff loaded_bytes;
     std::streamoff total_bytes;
+    cancellation token;
 };
 
 using file = std::variant<no_file,
@@ -70,38 +91,137 @@ using file = std::variant<no_file,
                           loading_file,
                           saving_file>;
 
+// The other cursors, in multi-cursor mode, in order
+using cursor_set = immer::flex_vector<coord, memory_policy>;
+
+/**
+ * A state of the buffer before some edit.  `bytes` estimates the
+ * memory that this snapshot does not share with the following one.
+ * When the edit was typing, `insert_run` is the cursor after the last
+ * of the `inserts` characters typed in a row, which are all undone at
+ * once.  In multi-cursor mode, `cursors` has the other cursors.
+ */
 struct snapshot
 {
     text content;
+    line_index offsets;
     coord cursor;
+    std::size_t bytes = 0;
+    std::optional<coord> insert_run = std::nullopt;
+    int inserts = 0;
+    cursor_set cursors = {};
 };
 
+constexpr auto default_history_budget = std::size_t{64} << 20;
+constexpr auto max_coalesced_inserts  = 20;
+
+/**
+ * The undo history.  When the estimated memory used by the entries
+ * exceeds `budget`, the oldest ones are forgotten.  `position` is set
+ * while undoing, to the entry that is to be restored next.
+ */
+struct undo_history
+{
+    immer::flex_vector<snapshot, memory_policy> entries;
+    std::optional<std::size_t> position;
+    std::size_t bytes  = 0;
+    std::size_t budget = default_history_budget;
+};
+
+using buffer_id = std::size_t;
+
+// `offsets` indexes the lines of `content`, and has to be kept in sync
+// with it by every function that changes it.  In multi-cursor mode,
+// `cursors` has the cursors other than `cursor`.  The `id` tells buffers
+// apart while they are being loaded or saved in the background.  While
+// the file is followed, `follow` is shared with its watcher.  The
+// `highlight` is computed in the background too, `lexing` being set
+// while it is.  In cold storage mode, `frozen` is the content when its
+// lines were last packed, and `freezing` is set while they are.  While
+// its file is checked for changes on disk, `reverting` is set.
 struct buffer
 {
+    buffer_id id = 0;
     file from;
     text content;
+    line_index offsets;
     coord cursor;
     coord scroll;
     std::optional<coord> selection_start;
-    immer::vector<snapshot> history;
-    std::optional<std::size_t> history_pos;
+    cursor_set cursors;
+    undo_history history;
+    std::optional<cancellation> follow;
+    highlighting highlight;
+    std::optional<cancellation> lexing;
+    text frozen;
+    std::optional<cancellation> freezing;
+    std::optional<cancellation> reverting;
 };
 
 struct load_progress_action { loading_file file; };
-struct load_done_action { existing_file file; };
-struct load_error_action { existing_file file; std::exception_ptr err; };
+struct load_done_action { existing_file file; cancellation token; };
+struct load_error_action { existing_file file; std::exception_ptr err;
+                           cancellation token; };
 struct save_progress_action { saving_file file; };
 struct save_done_action { existing_file file; };
 struct save_error_action { existing_file file; std::exception_ptr err; };
 
+// Lines written at the end of a followed file.  When `continues`, the
+// first of them is the rest of the last line of the buffer.
+struct follow_append_action { text lines; line_index offsets; bool continues;
+                              cancellation token; };
+// The followed file was truncated or replaced, and has now `lines`.
+struct follow_reset_action { text lines; line_index offsets;
+                             cancellation token; };
+
+// Some more of the buffer was highlighted, or all of it when `done`
+struct highlight_action { highlighting result; bool done;
+                          cancellation token; };
+
+/** The lines of a text after some of them were transformed. */
+struct transformed_text
+{
+    text content;
+    line_index offsets;
+    index changed     = 0; //< the number of lines that changed
+    std::size_t bytes = 0; //< the memory of the lines that were replaced
+};
+
+// A `freeze_buffer` of the content `original`, with the saved content
+// `original_saved`, finished
+struct freeze_done_action { text original; text content;
+                            text original_saved; text saved;
+                            undo_history history; highlighting highlight;
+                            cancellation token; };
+
+// The file of the buffer, that had `known` as stamp and `original` as
+// content when its check started, has now `stamp`.  When it `changed`,
+// it has `lines`, which differ from `original` in `hunks`.
+struct file_check_action { text original;
+                           std::optional<file_stamp> known;
+                           std::optional<file_stamp> stamp;
+                           cancellation token;
+                           bool changed = false;
+                           text lines = {};
+                           line_index offsets = {};
+                           std::vector<line_hunk> hunks = {}; };
+
+// A `transform_buffer` of the content `original` finished
+struct transform_done_action { text original; transformed_text result;
+                               immer::box<std::string> what; };
+
 using buffer_action = std::variant<load_progress_action,
                                    load_done_action,
                                    load_error_action,
                                    save_progress_action,
                                    save_done_action,
-                                   save_error_action>;
-
-constexpr auto tab_width = 8;
+                                   save_error_action,
+                                   follow_append_action,
+                                   follow_reset_action,
+                                   highlight_action,
+                                   transform_done_action,
+                                   freeze_done_action,
+                                   file_check_action>;
 
 /** Returns the number of actual characters in the line `ln` */
 index line_length(const line& ln);
@@ -109,6 +229,9 @@ index line_length(const line& ln);
 /** Returns the offsets where character `col` is located in `ln` */
 std::size_t line_char(const line& ln, index col);
 
+/** Returns the character at the byte offset `pos` of the line `ln` */
+index line_char_index(const line& ln, std::size_t pos);
+
 /**
  * Returns the [begin, end) offsets where character `col` is located
  * in the line `ln`.
@@ -125,17 +248,138 @@ inline auto line_range(const line& ln)
         utf8::unchecked::iterator(ln.end()));
 }
 
-line get_line(const text& txt, index row);
+/**
+ * Returns the line at `row`, or an empty one past the end.  It is the
+ * line stored in `txt`, so the metadata that it caches is kept for
+ * every other version of the text that shares it.
+ */
+const line& get_line(const text& txt, index row);
+
+/** Returns the byte offset of the cursor `pos` in the saved file. */
+std::size_t byte_offset(const buffer& buf, coord pos);
+
+/** Returns the position of the byte at offset `pos` in the saved file. */
+coord byte_position(const buffer& buf, std::size_t pos);
+
+/** Returns a buffer with `content`, and its line index. */
+buffer set_content(buffer buf, text content);
+
+/**
+ * Splits the UTF-8 string `str` in lines.  The result has always at
+ * least one line, and invalid UTF-8 is replaced.
+ */
+text to_text(const std::string& str);
+
+/** Returns the name of the file of the buffer. */
+immer::box<std::string> buffer_name(const buffer& buf);
 
 bool io_in_progress(const buffer&);
 bool load_in_progress(const buffer&);
+
+/**
+ * Whether the content of the buffer differs from that of its file.  It
+ * compares the fingerprints of their indexes, in constant time.
+ */
 bool is_dirty(const buffer& buf);
 
 std::pair<buffer, std::string> update_buffer(buffer buf, buffer_action ac);
 
+/**
+ * Starts loading `fname` into the buffer, abandoning the load that is
+ * in progress, if any.
+ */
 result<buffer, buffer_action> load_buffer(buffer, const std::string& fname);
 result<buffer, buffer_action> save_buffer(buffer buf);
 
+/**
+ * Asks the work reading the file of `buf` in the background, loading or
+ * following it, to stop, and its highlighting too.  Saves are never
+ * abandoned.
+ */
+void abandon_io(const buffer& buf);
+
+/**
+ * Starts following the file of `buf`, like `tail -f`: what gets
+ * written at its end is appended to the buffer, which is reloaded when
+ * the file is truncated or replaced, like when logs are rotated.
+ */
+result<buffer, buffer_action> follow_buffer(buffer buf);
+
+/** Stops following the file of `buf`. */
+result<buffer, buffer_action> unfollow_buffer(buffer buf);
+
+/**
+ * Starts highlighting the buffer again in the background, when it
+ * changed since it was last and it is not being highlighted already.
+ */
+result<buffer, buffer_action> highlight_buffer(buffer buf);
+
+/**
+ * Starts packing, in the background, the lines of `buf` that are not
+ * in the rows `[hot_first, hot_last)`, which should be around what is
+ * being looked at and edited.  The lines are only packed in groups of
+ * `cold_segment_rows` that own at least `min_cold_bytes`, which are
+ * also packed in the undo history and the saved content, where these
+ * have the same lines, so no memory is used twice.  Nothing is done
+ * when the content did not change since it was last frozen.
+ */
+result<buffer, buffer_action> freeze_buffer(buffer buf,
+                                            index hot_first,
+                                            index hot_last);
+
+/**
+ * Starts checking, in the background, whether the file of `buf` changed
+ * on disk since it was loaded or saved.  Only when its stamp changed is
+ * it read again, and when its fingerprint differs too, the lines that
+ * changed, as found by `diff_lines`, replace those of the buffer, as a
+ * single edit in the undo history.  The rest of the lines keep sharing
+ * their nodes, and the cursor, selection and scroll stay on the lines
+ * they were.  When the file only grew, like logs do, only what was
+ * appended is read.  Buffers that were modified are not reverted, but a
+ * message tells the file changed.  Nothing is done while the file is
+ * followed, or loaded or saved.
+ */
+result<buffer, buffer_action> check_file_buffer(buffer buf);
+
+constexpr auto cold_segment_rows = index{1} << 12;
+constexpr auto min_cold_bytes    = std::size_t{1} << 14;
+
+/**
+ * Changes a line, returning the same one when there is nothing to
+ * change, so it keeps sharing its contents.  It is called from many
+ * threads at once.
+ */
+using line_transform = std::function<line(const line&)>;
+
+/**
+ * Applies `fn` to the rows `[first, last)` of `content`, whose index is
+ * `offsets`.  The rows are split in slices that `workers` transform
+ * concurrently, each one into a transient, which are then joined with
+ * the logarithmic concatenation of `flex_vector`.  Slices where no line
+ * changed are kept as they were, and so is their index.
+ */
+transformed_text transform_lines(executor& workers,
+                                 const text& content,
+                                 const line_index& offsets,
+                                 index first, index last,
+                                 line_transform fn);
+
+/**
+ * Starts applying `fn`, in the background, to the lines of the
+ * selection of `buf`, or to all of them when nothing is selected.  The
+ * result replaces the content as a single edit in the undo history,
+ * unless the buffer changed in the meantime.  Messages call the change
+ * `what`.
+ */
+result<buffer, buffer_action> transform_buffer(buffer buf,
+                                               std::string what,
+                                               line_transform fn);
+
+line indent_line(const line& ln);
+line strip_trailing_whitespace(const line& ln);
+line untabify_line(const line& ln);
+line_transform replace_in_line(std::string from, std::string to);
+
 index expand_tabs(const line& ln, index col);
 
 buffer page_up(buffer buf, coord size);
@@ -145,6 +389,8 @@ buffer move_line_start(buffer buf);
 buffer move_line_end(buffer buf);
 buffer move_buffer_start(buffer buf);
 buffer move_buffer_end(buffer buf);
+buffer move_to_line(buffer buf, index row);
+buffer move_to_byte(buffer buf, std::size_t pos);
 
 buffer move_cursor_up(buffer buf);
 buffer move_cursor_down(buffer buf);
@@ -162,6 +408,8 @@ buffer insert_char(buffer buf, wchar_t value);
 buffer insert_text(buffer buf, text value);
 
 std::pair<buffer, text> copy(buffer buf);
+
+/** Cuts the selection, which leaves multi-cursor mode. */
 std::pair<buffer, text> cut(buffer buf);
 std::pair<buffer, text> cut_rest(buffer buf);
 
@@ -170,7 +418,73 @@ buffer start_selection(buffer buf);
 buffer clear_selection(buffer buf);
 std::tuple<coord, coord> selected_region(buffer buf);
 
+/**
+ * Adds a cursor where the cursor is, moving the latter to the line
+ * above or below, which starts multi-cursor mode.
+ */
+buffer add_cursor_above(buffer buf);
+buffer add_cursor_below(buffer buf);
+
+/**
+ * Puts a cursor in every line of the selection, at the column of the
+ * cursor, which stays where it is.
+ */
+buffer add_cursors_to_lines(buffer buf);
+
+/** Leaves multi-cursor mode, keeping only the cursor. */
+buffer clear_cursors(buffer buf);
+
+/** An edit done at the cursor of a buffer. */
+using cursor_edit = std::function<buffer(buffer)>;
+
+/**
+ * Does `edit` at every cursor of `buf`, in one pass, from the last one
+ * to the first, such that the content before the cursors that are left
+ * does not move.  Each edit sees only the rows around its cursor, which
+ * are spliced in and out of the text, so it costs about the same as
+ * with a single cursor.  The cursors after each edit are moved by the
+ * lines it inserted or removed, or by the columns it inserted or
+ * removed in its row.  This works for edits that only change the text
+ * around their cursor, like `insert_char`, `delete_char`,
+ * `insert_new_line` and `insert_text`.  Cursors that end up at the same
+ * position become one.
+ */
+buffer edit_every_cursor(buffer buf, const cursor_edit& edit);
+
+/** Like `edit_every_cursor`, for movements, that change no text. */
+buffer move_every_cursor(buffer buf, const cursor_edit& move);
+
 buffer undo(buffer);
 std::pair<buffer, std::string> record(buffer before, buffer after);
 
+/**
+ * Estimates the memory used by the rows `[first, last)` of `txt`, plus
+ * the tree nodes on the path to them.  Views of mapped files and packed
+ * lines do not occupy memory of their own.
+ */
+std::size_t unshared_bytes(const text& txt, index first, index last);
+
+/**
+ * Like the other `unshared_bytes`, counting only the chunks of the rows
+ * that are not shared with `other`, the text after an edit of them.
+ * This way typing in a long row costs a chunk and not the whole row.
+ */
+std::size_t unshared_bytes(const text& txt, index first, index last,
+                           const text& other);
+
+/**
+ * Estimates the memory used by `txt`, cut from some other text, that it
+ * does not share with it: the path to the leaves at its ends and the
+ * last chunks of its first and last rows.
+ */
+std::size_t sliced_bytes(const text& txt);
+
+/**
+ * Like `record`, for edits that change more than the lines between the
+ * cursors and selection marks.  `bytes` is the memory used by the lines
+ * of `before` that `after` does not share.
+ */
+std::pair<buffer, std::string> record(buffer before, buffer after,
+                                      std::size_t bytes);
+
 } // namespace ewig
@@ -0,0 +1,127 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/diff.hpp"
+
+#include <algorithm>
+#include <optional>
+
+namespace ewig {
+
+namespace {
+
+using entry = line_index::entry;
+
+bool same_line(const entry& a, const entry& b)
+{
+    return a.size == b.size && a.hash == b.hash;
+}
+
+// A run of `size` lines that are the same at `a` and `b`
+struct snake
+{
+    index a;
+    index b;
+    index size;
+};
+
+// Myers' O((N+M)D) algorithm, keeping the furthest reaching paths of
+// every step to trace the snakes back from the end.  Returns nothing
+// when it takes more than `max_edits` steps.
+std::optional<std::vector<snake>> shortest_edit(const std::vector<entry>& a,
+                                                const std::vector<entry>& b,
+                                                index max_edits)
+{
+    auto n      = static_cast<index>(a.size());
+    auto m      = static_cast<index>(b.size());
+    auto max    = std::min(n + m, max_edits);
+    auto offset = max + 1;
+    auto v      = std::vector<index>(2 * max + 3, 0);
+    auto trace  = std::vector<std::vector<index>>{};
+    for (auto d = index{}; d <= max; ++d) {
+        trace.push_back(v);
+        for (auto k = -d; k <= d; k += 2) {
+            auto x = k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])
+                ? v[offset + k + 1]
+                : v[offset + k - 1] + 1;
+            auto y = x - k;
+            while (x < n && y < m && same_line(a[x], b[y]))
+                ++x, ++y;
+            v[offset + k] = x;
+            if (x < n || y < m)
+                continue;
+            auto snakes = std::vector<snake>{};
+            for (auto e = d; e >= 0; --e) {
+                auto& pv     = trace[e];
+                auto  at     = x - y;
+                auto  prev_k = at == -e || (at != e && pv[offset + at - 1] < pv[offset + at + 1])
+                    ? at + 1
+                    : at - 1;
+                auto prev_x = e > 0 ? pv[offset + prev_k] : index{};
+                auto prev_y = e > 0 ? prev_x - prev_k : index{};
+                // the diagonal starts after the edit of this step
+                auto start_x = e > 0 ? (prev_k == at + 1 ? prev_x : prev_x + 1) : index{};
+                if (x > start_x)
+                    snakes.push_back({start_x, y - (x - start_x), x - start_x});
+                x = prev_x;
+                y = prev_y;
+            }
+            std::reverse(snakes.begin(), snakes.end());
+            return snakes;
+        }
+    }
+    return std::nullopt;
+}
+
+} // anonymous namespace
+
+std::vector<line_hunk> diff_lines(const line_index& a,
+                                  const line_index& b,
+                                  index max_edits)
+{
+    auto common = std::min(a.size(), b.size());
+    auto prefix = common_prefix(a, b, common);
+    auto suffix = common_suffix(a, b, common - prefix);
+    auto a_last = a.size() - suffix;
+    auto b_last = b.size() - suffix;
+    auto result = std::vector<line_hunk>{};
+    if (prefix == a_last && prefix == b_last)
+        return result;
+    auto snakes = shortest_edit(a.entries(prefix, a_last),
+                                b.entries(prefix, b_last),
+                                max_edits);
+    auto pos_a = prefix;
+    auto pos_b = prefix;
+    auto add   = [&] (index next_a, index next_b) {
+        if (next_a > pos_a || next_b > pos_b)
+            result.push_back({pos_a, next_a - pos_a, pos_b, next_b - pos_b});
+    };
+    if (snakes) {
+        for (auto& s : *snakes) {
+            add(prefix + s.a, prefix + s.b);
+            pos_a = prefix + s.a + s.size;
+            pos_b = prefix + s.b + s.size;
+        }
+    }
+    add(a_last, b_last);
+    return result;
+}
+
+} // namespace ewig
@@ -0,0 +1,55 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/line_index.hpp>
+
+#include <vector>
+
+namespace ewig {
+
+/**
+ * The rows `[first, first + removed)` of a text, that are replaced by
+ * the rows `[new_first, new_first + added)` of another.
+ */
+struct line_hunk
+{
+    index first;
+    index removed;
+    index new_first;
+    index added;
+};
+
+constexpr auto default_max_edits = index{1} << 10;
+
+/**
+ * Returns, in order, the hunks that turn the lines indexed by `a` into
+ * those indexed by `b`, which are compared by their sizes and hashes.
+ * The common prefix and suffix are found comparing fingerprints, in
+ * logarithmic time, and the rest with Myers' algorithm.  When more than
+ * `max_edits` lines would need to be inserted or removed, the whole rest
+ * is returned as a single hunk instead.
+ */
+std::vector<line_hunk> diff_lines(const line_index& a,
+                                  const line_index& b,
+                                  index max_edits = default_max_edits);
+
+} // namespace ewig
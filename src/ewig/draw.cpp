@@ -19,9 +19,15 @@
 //
 
 #include "ewig/draw.hpp"
+#include "ewig/scan.hpp"
 
 #include <scelta.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <vector>
+
 extern "C" {
 #include <ncurses.h>
 }
@@ -30,31 +36,88 @@ namespace ewig{
 
 namespace {
 
+// Takes the column after a wide character in the strings of the rows,
+// where it is not drawn
+constexpr auto wide_filler = L'\0';
+
 // Fills the string `str` with the display contents of the line `ln`
 // between the display columns `first_col` and `first_col + num_col`.
 // It takes into account tabs, expanding them correctly, and fills the
-// remaining until num_col with spaces.
+// remaining until num_col with spaces.  Wide characters are followed by
+// a `wide_filler`, and zero width ones are not shown.
+//
+// Decoding starts from the last checkpoint before `first_col`, and ends
+// at the first one after the last column, so scrolling a long line does
+// not decode all of it, and runs of plain ASCII are copied at once.
 void display_line_fill(const line& ln, int first_col, int num_col,
                        std::wstring& str)
 {
-    using namespace std;
-    auto cur_col = index{};
-    for (auto c : line_range(ln)) {
-        if (num_col == cur_col - first_col)
-            return;
-        else if (c == '\t') {
-            auto next_col = cur_col + tab_width - (cur_col % tab_width);
-            auto to_fill  = std::min(next_col, first_col + num_col) -
-                            std::max(cur_col, first_col);
-            std::fill_n(back_inserter(str), to_fill, ' ');
-            cur_col = next_col;
-        } else if (cur_col >= first_col) {
-            str.push_back(c);
-            ++cur_col;
-        } else
-            ++cur_col;
+    const auto& info = ln.info();
+    auto start = str.size();
+    str.resize(start + num_col, L' ');
+    auto out      = [&] (index col) { return &str[start + col - first_col]; };
+    auto last_col = first_col + num_col;
+
+    auto col  = index{};
+    auto byte = std::size_t{};
+    auto end  = ln.size();
+    if (info.checkpoints.empty()) {
+        col = byte = std::min<std::size_t>(first_col, ln.size());
+        end = std::min<std::size_t>(last_col, ln.size());
+    } else {
+        auto& points = info.checkpoints;
+        auto point   = std::upper_bound(
+            points.begin(), points.end(), first_col,
+            [] (auto col, auto& p) { return col < p.column; }) - 1;
+        auto next    = std::lower_bound(
+            point, points.end(), last_col,
+            [] (auto& p, auto col) { return p.column < col; });
+        col  = point->column;
+        byte = point->byte;
+        if (next != points.end())
+            end = next->byte;
     }
-    std::fill_n(back_inserter(str), num_col - (cur_col - first_col), ' ');
+    auto put = [&] (wchar_t code, index width) {
+        if (col >= first_col && width > 0) {
+            *out(col) = code;
+            if (width > 1 && col + 1 < last_col)
+                *out(col + 1) = wide_filler;
+        }
+        col += width;
+    };
+    auto code    = std::uint32_t{};
+    auto pending = 0;
+    ln.for_each_chunk(byte, end, [&] (const char* first, const char* last) {
+        while (first != last && col < last_col) {
+            auto c = static_cast<unsigned char>(*first);
+            if (c < 0x80 && c != '\t') {
+                auto run = skip_plain_ascii(first, last);
+                if (col < first_col) {
+                    auto skip = std::min<index>(run - first, first_col - col);
+                    first += skip;
+                    col   += skip;
+                }
+                auto n = std::min<index>(run - first, last_col - col);
+                widen_ascii(first, first + n, out(col));
+                first  += n;
+                col    += n;
+                pending = 0;
+                continue;
+            } else if (c == '\t') {
+                col += tab_width - (col % tab_width);
+                pending = 0;
+            } else if ((c & 0xc0) == 0x80) {
+                // code points may be split across chunks
+                code = (code << 6) | (c & 0x3f);
+                if (pending > 0 && --pending == 0)
+                    put(code, char_width(code));
+            } else {
+                pending = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+                code    = c & (0x3f >> pending);
+            }
+            ++first;
+        }
+    });
 }
 
 std::pair<coord, coord> display_selected_region(const buffer& buf)
@@ -69,8 +132,141 @@ std::pair<coord, coord> display_selected_region(const buffer& buf)
     return {starts, ends};
 }
 
+// What is shown in a row of the text area: the line, with the
+// highlighted columns of the selection, as seen from a given scroll
+// column, and the columns of the other cursors in multi-cursor mode.
+struct drawn_row
+{
+    std::optional<line> content;
+    index scroll_col = 0;
+    index hl_first   = 0;
+    index hl_last    = 0;
+    std::optional<face_spans> faces;
+    std::vector<index> cursors;
+};
+
+bool operator==(const drawn_row& a, const drawn_row& b)
+{
+    return a.scroll_col == b.scroll_col
+        && a.hl_first   == b.hl_first
+        && a.hl_last    == b.hl_last
+        && a.cursors    == b.cursors
+        && (a.faces
+            ? b.faces && &a.faces->get() == &b.faces->get()
+            : !b.faces)
+        && (a.content
+            ? b.content && identical(*a.content, *b.content)
+            : !b.content);
+}
+
+// What was drawn in the previous frame.  Thanks to structural sharing,
+// lines that did not change are still identical to the ones drawn
+// then, so we can find which rows need to be drawn again in constant
+// time per row.
+struct drawn_screen
+{
+    coord window_size;
+    std::vector<drawn_row> rows;
+    std::string mode_line;
+    std::optional<message> last_message;
+    std::string prompt;
+};
+
+drawn_screen last_screen;
+
+attr_t face_attrs(face kind)
+{
+    switch (kind) {
+    case face::keyword:      return COLOR_PAIR(color::keyword) | A_BOLD;
+    case face::string:       return COLOR_PAIR(color::string);
+    case face::comment:      return COLOR_PAIR(color::comment);
+    case face::number:       return COLOR_PAIR(color::number);
+    case face::preprocessor: return COLOR_PAIR(color::preprocessor);
+    default:                 return A_NORMAL;
+    }
+}
+
+// Writes the text `str` of the row, in segments with the faces of the
+// syntax, the selection going on top of them.
+void draw_row(const std::wstring& str, const drawn_row& row)
+{
+    auto size = (index)str.size();
+    auto at   = index{};
+    auto put  = [&] (index last, attr_t attrs) {
+        last = std::min(last, size);
+        if (at < last)
+            ::attrset(attrs);
+        while (at < last) {
+            auto filler = std::find(str.begin() + at, str.begin() + last,
+                                    wide_filler) - str.begin();
+            if (at < filler)
+                ::addnwstr(str.c_str() + at, filler - at);
+            at = std::min<index>(filler + 1, last);
+        }
+    };
+    auto put_faces = [&] (index last) {
+        if (row.faces) {
+            for (auto& span : row.faces->get()) {
+                auto first = span.first - row.scroll_col;
+                if (first >= last)
+                    break;
+                put(first, A_NORMAL);
+                put(std::min(span.last - row.scroll_col, last),
+                    face_attrs(span.kind));
+            }
+        }
+        put(last, A_NORMAL);
+    };
+    if (row.hl_first < row.hl_last) {
+        put_faces(row.hl_first);
+        put(row.hl_last, COLOR_PAIR(color::selection));
+    }
+    put_faces(size);
+    ::attrset(A_NORMAL);
+}
+
+// Formats a size in bytes, like emacs' size-indication-mode.
+std::string format_size(std::size_t bytes)
+{
+    if (bytes < 1024)
+        return std::to_string(bytes);
+    auto size  = bytes / 1024.0;
+    auto units = "kMGT";
+    for (; size >= 1024 && units[1]; ++units)
+        size /= 1024;
+    char str[16];
+    std::snprintf(str, sizeof(str), size < 10 ? "%.1f%c" : "%.0f%c",
+                  size, *units);
+    return str;
+}
+
+std::string search_prompt(const search_state& srch)
+{
+    // like emacs' "Failing wrapped regexp I-search backward: foo"
+    auto prompt = std::string{};
+    if (srch.failing && !srch.running)
+        prompt += "failing ";
+    if (srch.wrapped)
+        prompt += "wrapped ";
+    if (srch.regex)
+        prompt += "regexp ";
+    prompt += srch.forward ? "I-search: " : "I-search backward: ";
+    prompt[0] = std::toupper(prompt[0]);
+    prompt += srch.query.get();
+    if (!srch.error->empty())
+        prompt += "  [" + srch.error.get() + "]";
+    else if (srch.running && srch.progress > 0)
+        prompt += "  [" + std::to_string(int(srch.progress * 100)) + "%]";
+    return prompt;
+}
+
 } // anonymous namespace
 
+void invalidate_screen()
+{
+    last_screen = {};
+}
+
 void draw_text(const buffer& buf, coord size)
 {
     using namespace std;
@@ -79,77 +275,154 @@ void draw_text(const buffer& buf, coord size)
     getyx(stdscr, col, row);
 
     auto str      = std::wstring{};
-    auto first_ln = begin(buf.content) + min(buf.scroll.row,
-                                             (index)buf.content.size());
-    auto last_ln  = begin(buf.content) + min(size.row + buf.scroll.row,
-                                             (index)buf.content.size());
+    auto first_ln = min(buf.scroll.row, (index)buf.content.size());
+    auto last_ln  = min(size.row + buf.scroll.row, (index)buf.content.size());
     auto [starts, ends] = display_selected_region(buf);
+    auto& drawn = last_screen.rows;
+    drawn.resize(size.row);
+
+    // the cursors are sorted, so only those on the screen are looked at
+    auto cursors = std::vector<std::vector<index>>(size.row);
+    auto first_cursor = std::lower_bound(buf.cursors.begin(), buf.cursors.end(),
+                                         coord{first_ln, 0});
+    for (auto it = first_cursor; it != buf.cursors.end() &&
+             it->row < first_ln + size.row; ++it) {
+        auto cur_col = expand_tabs(get_line(buf.content, it->row), it->col)
+            - buf.scroll.col;
+        if (cur_col >= 0 && cur_col < size.col)
+            cursors[it->row - first_ln].push_back(cur_col);
+    }
+
+    // the lines above the screen are taken to be as highlighted
+    auto state = row_state(buf.highlight, first_ln);
+    for (auto i = 0; i < size.row; ++i, ++row) {
+        auto next = drawn_row{};
+        // the metadata of the line is cached in the stored one, and not
+        // in the copy that remembers what was drawn
+        auto stored = static_cast<const line*>(nullptr);
+        next.scroll_col = buf.scroll.col + col;
+        if (first_ln + i < last_ln) {
+            stored       = &buf.content[first_ln + i];
+            next.content = *stored;
+            if (auto lexed = highlighted_row(buf.highlight, first_ln + i,
+                                             *stored, state)) {
+                next.faces = lexed->spans;
+                state      = lexed->out;
+            }
+            if (row >= starts.row && row <= ends.row) {
+                next.hl_first = row == starts.row ? std::max(starts.col, 0) : 0;
+                next.hl_last  = row == ends.row   ? std::max(ends.col, 0) : size.col;
+                next.hl_last  = std::min(next.hl_last, size.col);
+            }
+        }
+        next.cursors = std::move(cursors[i]);
+        if (next == drawn[i])
+            continue;
 
-    immer::for_each(first_ln, last_ln, [&] (auto ln) {
         str.clear();
-        display_line_fill(ln, buf.scroll.col + col, 2*size.col, str);
+        if (stored)
+            display_line_fill(*stored, next.scroll_col, size.col, str);
         ::move(row, col);
-        auto in_selection = row >= starts.row && row <= ends.row;
-        if (in_selection) {
-            auto hl_first = row == starts.row ? std::max(starts.col, 0) : 0;
-            auto hl_last  = row == ends.row   ? std::max(ends.col, 0) : str.size();
-            ::addnwstr(str.c_str(), hl_first);
-            ::attron(COLOR_PAIR(color::selection));
-            ::addnwstr(str.c_str() + hl_first, hl_last - hl_first);
-            ::attroff(COLOR_PAIR(color::selection));
-            ::addnwstr(str.c_str() + hl_last, str.size() - hl_last);
-        } else {
-            ::addwstr(str.c_str());
+        ::clrtoeol();
+        draw_row(str, next);
+        // wide characters may overflow into the following row, which
+        // then has to be drawn again too
+        if (getcury(stdscr) > row + 1 ||
+            (getcury(stdscr) == row + 1 && getcurx(stdscr) > 0)) {
+            if (i + 1 < size.row)
+                drawn[i + 1] = {};
+            else
+                last_screen.mode_line.clear();
         }
-        row++;
-    });
+        for (auto cur_col : next.cursors)
+            mvchgat(row, col + cur_col, 1, A_REVERSE, 0, nullptr);
+        drawn[i] = std::move(next);
+    }
 }
 
 void draw_mode_line(const buffer& buf, index maxcol)
 {
-    attrset(A_REVERSE);
     auto dirty_mark = is_dirty(buf) ? "**" : "--";
-    auto file_name = scelta::match([](auto&& f) { return f.name; })(buf.from);
+    auto file_name = buffer_name(buf);
     auto cur = buf.cursor;
     cur.col = expand_tabs(get_line(buf.content, cur.row), cur.col);
-    ::printw(" %s %s  (%d, %d)",
-            dirty_mark,
-            file_name.get().c_str(),
-            cur.col, cur.row);
-    ::hline(' ', maxcol);
 
-    scelta::match(
+    auto format = [] (auto... args) {
+        auto str = std::string(std::snprintf(nullptr, 0, args...), '\0');
+        std::snprintf(str.data(), str.size() + 1, args...);
+        return str;
+    };
+    auto cursors  = buf.cursors.empty()
+        ? std::string{}
+        : format("  %zu cursors", buf.cursors.size() + 1);
+    auto status   = format(" %s %s  %s  (%d, %d)%s%s",
+                           dirty_mark,
+                           file_name.get().c_str(),
+                           format_size(buf.offsets.bytes()).c_str(),
+                           cur.col, cur.row,
+                           cursors.c_str(),
+                           buf.follow ? "  following" : "");
+    auto progress = scelta::match(
         [&] (const saving_file& file) {
-            auto str        = std::string{"saving..."};
             auto size       = std::max(file.content.size(), std::size_t{1});
             auto progress   = (float)file.saved_lines / size;
             auto percentage = int(progress * 100);
-            ::move(getcury(stdscr), maxcol - str.size() - 6);
-            attrset(A_NORMAL | A_BOLD);
-            ::attron(COLOR_PAIR(color::mode_line_message));
-            ::printw(" %s %*d%% ", str.c_str(), 2, percentage);
+            return format(" %s %*d%% ", "saving...", 2, percentage);
         },
         [&] (const loading_file& file) {
-            auto str        = std::string{"loading..."};
             auto progress   = (float)file.loaded_bytes / file.total_bytes;
             auto percentage = int(progress * 100);
-            ::move(getcury(stdscr), maxcol - str.size() - 6);
-            attrset(A_NORMAL | A_BOLD);
-            ::attron(COLOR_PAIR(color::mode_line_message));
-            ::printw(" %s %*d%% ", str.c_str(), 2, percentage);
+            return format(" %s %*d%% ", "loading...", 2, percentage);
         },
-        [](auto&&) {})(buf.from);
+        [](auto&&) { return std::string{}; })(buf.from);
+
+    auto key = status + '\n' + progress + '\n' + std::to_string(maxcol);
+    if (key == last_screen.mode_line)
+        return;
+    last_screen.mode_line = std::move(key);
+
+    attrset(A_REVERSE);
+    ::addstr(status.c_str());
+    ::hline(' ', maxcol);
+    if (!progress.empty()) {
+        ::move(getcury(stdscr), maxcol - progress.size());
+        attrset(A_NORMAL | A_BOLD);
+        ::attron(COLOR_PAIR(color::mode_line_message));
+        ::addstr(progress.c_str());
+    }
 }
 
 void draw_message(const message& msg)
 {
+    auto& last = last_screen.last_message;
+    if (last && &last->content.get() == &msg.content.get())
+        return;
+    last = msg;
+
     attrset(A_NORMAL);
+    ::clrtoeol();
     ::attron(COLOR_PAIR(color::message));
     ::addstr(" ");
     ::addstr(msg.content.get().c_str());
     ::attroff(COLOR_PAIR(color::message));
 }
 
+void draw_prompt(const std::string& prompt)
+{
+    auto& last = last_screen.prompt;
+    if (prompt == last)
+        return;
+    last = prompt;
+    last_screen.last_message = std::nullopt;
+
+    attrset(A_NORMAL);
+    ::clrtoeol();
+    ::attron(COLOR_PAIR(color::message));
+    ::addstr(" ");
+    ::addstr(prompt.c_str());
+    ::attroff(COLOR_PAIR(color::message));
+}
+
 void draw_text_cursor(const buffer& buf, coord window_size)
 {
     auto cur = buf.cursor;
@@ -163,7 +436,11 @@ void draw_text_cursor(const buffer& buf, coord window_size)
 
 void draw(const application& app)
 {
-    ::erase();
+    if (app.window_size != last_screen.window_size) {
+        ::erase();
+        invalidate_screen();
+        last_screen.window_size = app.window_size;
+    }
 
     auto size = editor_size(app);
     ::move(0, 0);
@@ -172,12 +449,30 @@ void draw(const application& app)
     ::move(size.row, 0);
     draw_mode_line(app.current, size.col);
 
-    if (!app.messages.empty()) {
-        ::move(size.row + 1, 0);
-        draw_message(app.messages.back());
+    auto prompt =
+        app.prompt ? app.prompt->question.get() + app.prompt->answer.get() :
+        app.search ? search_prompt(*app.search) :
+        std::string{};
+    ::move(size.row + 1, 0);
+    if (!prompt.empty()) {
+        draw_prompt(prompt);
+    } else {
+        if (!last_screen.prompt.empty()) {
+            last_screen.prompt.clear();
+            ::clrtoeol();
+        }
+        if (!app.messages.empty())
+            draw_message(app.messages.back());
     }
 
-    draw_text_cursor(app.current, size);
+    if (app.prompt) {
+        // the answer is typed in the message line
+        auto col = utf8::unchecked::distance(prompt.begin(), prompt.end());
+        ::move(size.row + 1, 1 + col);
+        ::curs_set(1);
+    } else {
+        draw_text_cursor(app.current, size);
+    }
     ::refresh();
 }
 
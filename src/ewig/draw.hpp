@@ -29,11 +29,27 @@ enum class color
     message = 1,
     selection,
     mode_line_message,
+    keyword,
+    string,
+    comment,
+    number,
+    preprocessor,
 };
 
+/**
+ * Draws the application.  Only the parts of the screen that changed
+ * since the last call are drawn again.
+ */
 void draw(const application& app);
 void draw_text(const buffer& buf, coord size);
 void draw_mode_line(const buffer& buffer, index maxcol);
 void draw_message(const message& msg);
+void draw_prompt(const std::string& prompt);
+
+/**
+ * Forgets what was drawn before, such that the next `draw` repaints
+ * the whole screen.
+ */
+void invalidate_screen();
 
 } // namespace ewig
@@ -0,0 +1,176 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/executor.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace ewig {
+
+namespace {
+
+constexpr auto no_queue = std::numeric_limits<std::size_t>::max();
+
+// Tasks posted from any parent, when popping
+constexpr auto any_parent = std::uint64_t{};
+
+thread_local const executor* current_executor = nullptr;
+thread_local std::size_t current_queue = no_queue;
+
+// The task that runs in this thread, tasks and the code outside of them
+// being told apart by an id that is only taken when needed
+std::atomic<std::uint64_t> next_task_id{any_parent};
+thread_local std::uint64_t current_task = any_parent;
+
+std::uint64_t current_task_id()
+{
+    if (current_task == any_parent)
+        current_task = ++next_task_id;
+    return current_task;
+}
+
+} // anonymous namespace
+
+std::size_t executor::default_concurrency()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+executor::executor(std::size_t num_threads)
+{
+    num_threads = std::max(num_threads, std::size_t{1});
+    for (auto i = std::size_t{}; i < num_threads; ++i)
+        queues_.push_back(std::make_unique<queue>());
+    for (auto i = std::size_t{}; i < num_threads; ++i)
+        threads_.emplace_back([this, i] { work_(i); });
+}
+
+executor::~executor()
+{
+    {
+        auto lock = std::lock_guard<std::mutex>{idle_mutex_};
+        stopping_ = true;
+    }
+    idle_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+void executor::post(task t)
+{
+    auto i = current_executor == this
+        ? current_queue
+        : next_queue_++ % queues_.size();
+    {
+        // counted with the queue locked, so it can not be popped, and
+        // the count decremented, before it is incremented
+        auto lock = std::lock_guard<std::mutex>{queues_[i]->mutex};
+        queues_[i]->tasks.push_back({std::move(t), current_task_id()});
+        ++pending_;
+    }
+    {
+        // a worker that just found nothing to do is then waiting
+        auto lock = std::lock_guard<std::mutex>{idle_mutex_};
+    }
+    idle_.notify_one();
+}
+
+bool executor::run_one()
+{
+    auto t = task{};
+    if (!pop_(current_executor == this ? current_queue : no_queue,
+              any_parent, t))
+        return false;
+    run_(t);
+    return true;
+}
+
+bool executor::run_child_()
+{
+    auto t = task{};
+    if (!pop_(current_executor == this ? current_queue : no_queue,
+              current_task_id(), t))
+        return false;
+    run_(t);
+    return true;
+}
+
+void executor::run_(task& t)
+{
+    auto parent  = current_task;
+    current_task = ++next_task_id;
+    t();
+    current_task = parent;
+}
+
+bool executor::pop_(std::size_t self, std::uint64_t parent, task& t)
+{
+    auto matches = [&] (const queued& q) {
+        return parent == any_parent || q.parent == parent;
+    };
+    // the most recent task of our own queue is the likeliest to have
+    // its data still in cache, while thieves take the oldest ones
+    if (self != no_queue) {
+        auto& q = *queues_[self];
+        auto lock = std::lock_guard<std::mutex>{q.mutex};
+        auto it = std::find_if(q.tasks.rbegin(), q.tasks.rend(), matches);
+        if (it != q.tasks.rend()) {
+            t = std::move(it->fn);
+            q.tasks.erase(std::next(it).base());
+            --pending_;
+            return true;
+        }
+    }
+    auto n = queues_.size();
+    auto first = self == no_queue ? 0 : self + 1;
+    for (auto k = std::size_t{}; k < n; ++k) {
+        auto& q = *queues_[(first + k) % n];
+        auto lock = std::lock_guard<std::mutex>{q.mutex};
+        auto it = std::find_if(q.tasks.begin(), q.tasks.end(), matches);
+        if (it != q.tasks.end()) {
+            t = std::move(it->fn);
+            q.tasks.erase(it);
+            --pending_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void executor::work_(std::size_t self)
+{
+    current_executor = this;
+    current_queue = self;
+    auto t = task{};
+    while (true) {
+        if (pop_(self, any_parent, t)) {
+            run_(t);
+            t = {};
+        } else {
+            auto lock = std::unique_lock<std::mutex>{idle_mutex_};
+            idle_.wait(lock, [&] { return pending_ > 0 || stopping_; });
+            if (stopping_ && pending_ == 0)
+                return;
+        }
+    }
+}
+
+} // namespace ewig
@@ -0,0 +1,126 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ewig {
+
+/**
+ * A flag shared by whoever starts some background work and the work
+ * itself, which should check it every now and then and stop early
+ * once it is cancelled.  Copies refer to the same flag.
+ */
+class cancellation
+{
+public:
+    void cancel() const { flag_->store(true); }
+    bool cancelled() const { return flag_->load(); }
+
+    friend bool operator==(const cancellation& a, const cancellation& b)
+    { return a.flag_ == b.flag_; }
+    friend bool operator!=(const cancellation& a, const cancellation& b)
+    { return a.flag_ != b.flag_; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag_ =
+        std::make_shared<std::atomic<bool>>(false);
+};
+
+/**
+ * A fixed set of threads running the tasks posted to it.  Each thread
+ * has its own queue, where the tasks it posts go, and steals from the
+ * others when it runs out of work.  The destructor waits for all tasks
+ * to finish.
+ */
+class executor
+{
+public:
+    using task = std::function<void()>;
+
+    static std::size_t default_concurrency();
+
+    explicit executor(std::size_t num_threads = default_concurrency());
+    ~executor();
+
+    executor(const executor&) = delete;
+    executor& operator=(const executor&) = delete;
+
+    std::size_t size() const { return threads_.size(); }
+
+    void post(task t);
+
+    // Runs a pending task in the calling thread.  Returns false when
+    // there was none.
+    bool run_one();
+
+    // Waits for the result of `f`, running meanwhile the tasks that the
+    // calling task posted, so tasks can wait on the tasks they post
+    // without exhausting the threads.  Unrelated tasks are left to the
+    // other threads, since they may take much longer than `f`.
+    template <typename T>
+    T get(std::future<T> f)
+    {
+        using namespace std::chrono_literals;
+        while (f.wait_for(0s) != std::future_status::ready)
+            if (!run_child_())
+                f.wait_for(100us);
+        return f.get();
+    }
+
+private:
+    struct queued
+    {
+        task fn;
+        std::uint64_t parent; //< the task that posted it
+    };
+
+    struct queue
+    {
+        std::mutex mutex;
+        std::deque<queued> tasks;
+    };
+
+    bool run_child_();
+    bool pop_(std::size_t self, std::uint64_t parent, task& t);
+    void run_(task& t);
+    void work_(std::size_t self);
+
+    std::vector<std::unique_ptr<queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> next_queue_{0};
+    std::atomic<std::size_t> pending_{0};
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+    bool stopping_ = false;
+};
+
+} // namespace ewig
@@ -0,0 +1,155 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/file_watcher.hpp"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+
+extern "C" {
+#include <sys/inotify.h>
+#include <unistd.h>
+}
+
+namespace ewig {
+
+namespace {
+
+constexpr auto poll_interval  = std::chrono::milliseconds{250};
+constexpr auto check_interval = std::chrono::seconds{1};
+
+constexpr auto watched_events =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+struct watcher : std::enable_shared_from_this<watcher>
+{
+    watcher(boost::asio::io_service& serv,
+            std::string path,
+            cancellation token,
+            std::function<void()> changed)
+        : path{std::move(path)}
+        , token{std::move(token)}
+        , changed{std::move(changed)}
+        , timer{serv}
+    {
+        auto fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0)
+            notify.emplace(serv, fd);
+        add_watch();
+    }
+
+    void start()
+    {
+        if (notify)
+            next_event();
+        next_tick();
+        changed();
+    }
+
+    // The watch goes away with the file, so it is added again for the
+    // one that may replace it
+    void add_watch()
+    {
+        if (notify) {
+            if (wd >= 0)
+                ::inotify_rm_watch(notify->native_handle(), wd);
+            wd = ::inotify_add_watch(notify->native_handle(),
+                                     path.c_str(), watched_events);
+        }
+    }
+
+    void next_event()
+    {
+        using namespace boost::asio;
+        notify->async_read_some(null_buffers(), [self=shared_from_this()] (
+                                    auto ec, auto) {
+            if (ec || self->stop_if_cancelled())
+                return;
+            alignas(inotify_event) char events[4096];
+            auto gone = false;
+            auto size = ssize_t{};
+            while ((size = ::read(self->notify->native_handle(),
+                                  events, sizeof(events))) > 0) {
+                // removing a watch also sends an event, which only
+                // matters when it is the current one
+                for (auto p = events; p < events + size;) {
+                    auto ev = reinterpret_cast<const inotify_event*>(p);
+                    gone = gone || (ev->wd == self->wd &&
+                                    (ev->mask & (IN_MOVE_SELF |
+                                                 IN_DELETE_SELF |
+                                                 IN_IGNORED)));
+                    p += sizeof(inotify_event) + ev->len;
+                }
+            }
+            if (gone)
+                self->add_watch();
+            self->changed();
+            self->next_event();
+        });
+    }
+
+    void next_tick()
+    {
+        timer.expires_from_now(notify && wd >= 0
+                               ? std::chrono::milliseconds{check_interval}
+                               : poll_interval);
+        timer.async_wait([self=shared_from_this()] (auto ec) {
+            if (ec || self->stop_if_cancelled())
+                return;
+            if (self->notify && self->wd < 0)
+                self->add_watch();
+            self->changed();
+            self->next_tick();
+        });
+    }
+
+    bool stop_if_cancelled()
+    {
+        if (!token.cancelled())
+            return false;
+        timer.cancel();
+        if (notify)
+            notify->close();
+        return true;
+    }
+
+    std::string path;
+    cancellation token;
+    std::function<void()> changed;
+    boost::asio::steady_timer timer;
+    std::optional<boost::asio::posix::stream_descriptor> notify;
+    int wd = -1;
+};
+
+} // anonymous namespace
+
+void watch_file(boost::asio::io_service& serv,
+                const std::string& path,
+                cancellation token,
+                std::function<void()> changed)
+{
+    std::make_shared<watcher>(serv, path, token, std::move(changed))->start();
+}
+
+} // namespace ewig
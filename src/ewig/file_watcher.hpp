@@ -0,0 +1,46 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/executor.hpp>
+
+#include <boost/asio/io_service.hpp>
+
+#include <functional>
+#include <string>
+
+namespace ewig {
+
+/**
+ * Calls `changed` in the event loop of `serv` whenever the file at
+ * `path` may have changed, and once right away.  Changes are noticed
+ * through inotify, when available, and otherwise by polling the file
+ * several times per second.  Even with inotify, `changed` is also
+ * called every second, since a file replacing the watched one is only
+ * noticed by looking at the path again.  The watch stops, soon after,
+ * once `token` is cancelled.
+ */
+void watch_file(boost::asio::io_service& serv,
+                const std::string& path,
+                cancellation token,
+                std::function<void()> changed);
+
+} // namespace ewig
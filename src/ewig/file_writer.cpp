@@ -0,0 +1,230 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/file_writer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+namespace ewig {
+
+namespace {
+
+std::system_error errno_error(const std::string& what)
+{
+    return {errno, std::system_category(), what};
+}
+
+#ifdef IOV_MAX
+constexpr auto max_pieces = std::size_t{IOV_MAX};
+#else
+constexpr auto max_pieces = std::size_t{1024};
+#endif
+
+// The permissions that `open` gives to new files, which `mkstemp`
+// does not.  The mask can only be read by setting it, so that is done
+// once.
+::mode_t new_file_mode()
+{
+    static const auto mode = [] {
+        auto mask = ::umask(0);
+        ::umask(mask);
+        return 0666 & ~mask;
+    }();
+    return mode;
+}
+
+} // anonymous
+
+file_writer::file_writer(const std::string& fname)
+    : file_writer{fname, ::open(fname.c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                0666)}
+{}
+
+file_writer::file_writer(std::string fname, int fd)
+    : name_{std::move(fname)}
+    , fd_{fd}
+{
+    if (fd_ < 0)
+        throw errno_error("can't open: " + name_);
+    staging_.reserve(staging_size);
+    pieces_.reserve(max_pieces);
+}
+
+file_writer file_writer::next_to(const std::string& target)
+{
+    auto mode = new_file_mode();
+    auto name = target + ".ewig-XXXXXX";
+    auto fd   = ::mkostemp(name.data(), O_CLOEXEC);
+    if (fd < 0)
+        throw errno_error("can't create a file next to: " + target);
+    ::fchmod(fd, mode);
+    return file_writer{std::move(name), fd};
+}
+
+file_writer::~file_writer()
+{
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+void file_writer::write(const char* data, std::size_t size)
+{
+    if (size == 0)
+        return;
+    if (pieces_.size() == max_pieces ||
+        (size <= max_copied && staging_.size() + size > staging_size))
+        flush();
+    if (size > max_copied)
+        pieces_.push_back({const_cast<char*>(data), size});
+    else
+        stage(data, size);
+}
+
+void file_writer::write_copy(const char* data, std::size_t size)
+{
+    while (size > 0) {
+        if (pieces_.size() == max_pieces || staging_.size() == staging_size)
+            flush();
+        auto n = std::min(size, staging_size - staging_.size());
+        stage(data, n);
+        data += n;
+        size -= n;
+    }
+}
+
+void file_writer::stage(const char* data, std::size_t size)
+{
+    // contiguous copies are merged in a single piece, the staging area
+    // never reallocates so the pieces stay valid
+    auto dest = staging_.data() + staging_.size();
+    staging_.insert(staging_.end(), data, data + size);
+    if (!pieces_.empty() &&
+        static_cast<char*>(pieces_.back().iov_base) +
+        pieces_.back().iov_len == dest)
+        pieces_.back().iov_len += size;
+    else
+        pieces_.push_back({dest, size});
+}
+
+bool file_writer::copy(const std::string& source, std::size_t size)
+{
+#ifdef __linux__
+    auto in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return false;
+    flush();
+    auto left = size;
+    while (left > 0) {
+        auto n = ::copy_file_range(in, nullptr, fd_, nullptr, left, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && left == size &&
+            (errno == EXDEV || errno == ENOSYS ||
+             errno == EINVAL || errno == EOPNOTSUPP)) {
+            ::close(in);
+            return false;
+        }
+        if (n <= 0) {
+            auto err = n < 0
+                ? errno_error("can't copy: " + source)
+                : std::system_error{std::make_error_code(std::errc::io_error),
+                                    "file got shorter: " + source};
+            ::close(in);
+            throw err;
+        }
+        left -= n;
+    }
+    ::close(in);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void file_writer::flush()
+{
+    auto piece = pieces_.data();
+    auto count = pieces_.size();
+    while (count > 0) {
+        auto n = ::writev(fd_, piece, std::min(count, max_pieces));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw errno_error("can't write: " + name_);
+        // skip what was written, which may end in the middle of a piece
+        for (; count > 0 && std::size_t(n) >= piece->iov_len; ++piece, --count)
+            n -= piece->iov_len;
+        if (count > 0) {
+            piece->iov_base = static_cast<char*>(piece->iov_base) + n;
+            piece->iov_len -= n;
+        }
+    }
+    pieces_.clear();
+    staging_.clear();
+}
+
+void file_writer::sync()
+{
+    flush();
+    if (::fsync(fd_) < 0)
+        throw errno_error("can't sync: " + name_);
+}
+
+void file_writer::close(const std::string& mode_from)
+{
+    struct stat st;
+    if (!mode_from.empty() && ::stat(mode_from.c_str(), &st) == 0)
+        ::fchmod(fd_, st.st_mode & 07777);
+    sync();
+    auto fd = fd_;
+    fd_ = -1;
+    if (::close(fd) < 0)
+        throw errno_error("can't close: " + name_);
+}
+
+void replace_file(const std::string& source, const std::string& target)
+{
+    if (std::rename(source.c_str(), target.c_str()) != 0)
+        throw errno_error("can't replace: " + target);
+    // the rename itself only survives a crash once the directory
+    // holding it reaches the disk
+    auto slash = target.rfind('/');
+    auto dir   = slash == std::string::npos ? std::string{"."}
+               : slash == 0                 ? std::string{"/"}
+               : target.substr(0, slash);
+    auto fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+} // namespace ewig
@@ -0,0 +1,93 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/uio.h>
+}
+
+namespace ewig {
+
+/**
+ * Writes a new file, gathering the written pieces in batches that are
+ * written with a single `writev` call each.  Small pieces are copied
+ * in a staging area, but large ones are only referenced, so they must
+ * stay alive until the next `flush`.  Errors throw `std::system_error`.
+ */
+struct file_writer
+{
+    // Creates the file `fname`, truncating it when it already exists
+    explicit file_writer(const std::string& fname);
+    ~file_writer();
+
+    // Creates a new file with a unique name in the directory of
+    // `target`, with the permissions of new files, to be moved over it
+    // with `replace_file` once written
+    static file_writer next_to(const std::string& target);
+
+    const std::string& name() const { return name_; }
+
+    file_writer(const file_writer&) = delete;
+    file_writer& operator=(const file_writer&) = delete;
+
+    void write(const char* data, std::size_t size);
+
+    // Like `write`, but the bytes are always copied, for data that does
+    // not outlive the call, like the bytes of a thawed packed line.
+    void write_copy(const char* data, std::size_t size);
+
+    // Appends the first `size` bytes of the file `source`, letting the
+    // kernel copy or even share them.  Returns false without writing
+    // anything when the file systems do not support it.
+    bool copy(const std::string& source, std::size_t size);
+
+    void flush();
+    // Flushes and waits for the contents to reach the disk.
+    void sync();
+    // Flushes, syncs and closes the file, copying the permissions of
+    // `mode_from` first when it exists.
+    void close(const std::string& mode_from = {});
+
+private:
+    static constexpr auto staging_size = std::size_t{1} << 16;
+    static constexpr auto max_copied   = std::size_t{1} << 9;
+
+    std::string name_;
+    int fd_ = -1;
+    std::vector<char> staging_;
+    std::vector<::iovec> pieces_;
+
+    file_writer(std::string fname, int fd);
+
+    // Copies to the staging area, which must have room for `size` bytes
+    void stage(const char* data, std::size_t size);
+};
+
+/**
+ * Atomically replaces `target` with the file `source`, and makes the
+ * change durable.
+ */
+void replace_file(const std::string& source, const std::string& target);
+
+} // namespace ewig
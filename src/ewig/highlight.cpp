@@ -0,0 +1,320 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/highlight.hpp"
+
+#include <utf8.h>
+
+#include <algorithm>
+#include <cctype>
+#include <string_view>
+
+namespace ewig {
+
+namespace {
+
+using namespace std::string_view_literals;
+
+// Sorted, to binary search them
+constexpr std::string_view c_keywords[] = {
+    "alignas"sv, "alignof"sv, "auto"sv, "bool"sv, "break"sv, "case"sv,
+    "catch"sv, "char"sv, "class"sv, "const"sv, "constexpr"sv,
+    "continue"sv, "decltype"sv, "default"sv, "delete"sv, "do"sv,
+    "double"sv, "else"sv, "enum"sv, "explicit"sv, "extern"sv, "false"sv,
+    "float"sv, "for"sv, "friend"sv, "goto"sv, "if"sv, "inline"sv,
+    "int"sv, "long"sv, "mutable"sv, "namespace"sv, "new"sv,
+    "noexcept"sv, "nullptr"sv, "operator"sv, "private"sv,
+    "protected"sv, "public"sv, "return"sv, "short"sv, "signed"sv,
+    "sizeof"sv, "static"sv, "static_assert"sv, "struct"sv, "switch"sv,
+    "template"sv, "this"sv, "throw"sv, "true"sv, "try"sv, "typedef"sv,
+    "typename"sv, "union"sv, "unsigned"sv, "using"sv, "virtual"sv,
+    "void"sv, "volatile"sv, "while"sv,
+};
+
+constexpr std::string_view script_keywords[] = {
+    "and"sv, "as"sv, "break"sv, "case"sv, "class"sv, "continue"sv,
+    "def"sv, "do"sv, "done"sv, "elif"sv, "else"sv, "esac"sv,
+    "except"sv, "fi"sv, "finally"sv, "for"sv, "from"sv, "function"sv,
+    "if"sv, "import"sv, "in"sv, "lambda"sv, "let"sv, "local"sv,
+    "not"sv, "or"sv, "pass"sv, "raise"sv, "return"sv, "then"sv,
+    "try"sv, "while"sv, "with"sv, "yield"sv,
+};
+
+bool is_keyword(syntax lang, std::string_view word)
+{
+    return lang == syntax::c_like
+        ? std::binary_search(std::begin(c_keywords), std::end(c_keywords), word)
+        : std::binary_search(std::begin(script_keywords),
+                             std::end(script_keywords), word);
+}
+
+bool is_word(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// Walks the bytes of a line, keeping track of the display column, and
+// collects the spans of the faces
+struct lexer
+{
+    std::string_view str;
+    std::vector<face_span> spans;
+    std::size_t pos = 0;
+    index col = 0;
+
+    bool done() const { return pos >= str.size(); }
+    char peek(std::size_t n = 0) const
+    { return pos + n < str.size() ? str[pos + n] : '\0'; }
+
+    void advance_to(std::size_t last)
+    {
+        last = std::min(last, str.size());
+        while (pos < last) {
+            auto c = static_cast<unsigned char>(str[pos]);
+            if (c == '\t') {
+                col += tab_width - (col % tab_width);
+                ++pos;
+            } else if (c < 0x80 || (c & 0xc0) == 0x80) {
+                col += c < 0x80;
+                ++pos;
+            } else if (pos + (c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2) > str.size()) {
+                ++col; // truncated code point
+                ++pos;
+            } else {
+                auto it = str.begin() + pos;
+                col += char_width(utf8::unchecked::next(it));
+                pos  = it - str.begin();
+            }
+        }
+    }
+
+    // Advances to `last`, showing what is in between as `kind`
+    void emit_to(std::size_t last, face kind)
+    {
+        auto first = col;
+        advance_to(last);
+        if (first == col)
+            return;
+        if (!spans.empty() && spans.back().kind == kind &&
+            spans.back().last == first)
+            spans.back().last = col;
+        else
+            spans.push_back({first, col, kind});
+    }
+
+    void string_literal()
+    {
+        auto quote = peek();
+        auto last  = pos + 1;
+        for (; last < str.size() && str[last] != quote; ++last)
+            if (str[last] == '\\')
+                ++last;
+        emit_to(last + 1, face::string);
+    }
+};
+
+} // anonymous namespace
+
+syntax syntax_for(const std::string& fname)
+{
+    auto slash = fname.find_last_of('/');
+    auto base  = fname.substr(slash == std::string::npos ? 0 : slash + 1);
+    if (base == "CMakeLists.txt" || base == "Makefile" ||
+        base == "makefile" || base == "Dockerfile")
+        return syntax::script;
+    auto dot = base.find_last_of('.');
+    if (dot == std::string::npos)
+        return syntax::none;
+    auto ext = base.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [] (unsigned char c) { return std::tolower(c); });
+    static const std::string c_like_exts[] = {
+        "c", "cc", "cpp", "cs", "cxx", "go", "h", "hh", "hpp", "hxx",
+        "inl", "ipp", "java", "js", "m", "mm", "rs", "ts",
+    };
+    static const std::string script_exts[] = {
+        "bash", "cmake", "conf", "mk", "nix", "pl", "py", "rb", "sh",
+        "toml", "yaml", "yml", "zsh",
+    };
+    if (std::find(std::begin(c_like_exts), std::end(c_like_exts), ext)
+        != std::end(c_like_exts))
+        return syntax::c_like;
+    if (std::find(std::begin(script_exts), std::end(script_exts), ext)
+        != std::end(script_exts))
+        return syntax::script;
+    return syntax::none;
+}
+
+lexed_line lex_line(syntax lang, const line& ln, lexer_state in)
+{
+    if (lang == syntax::none || ln.size() > max_lexed_line)
+        return {ln, in, in, {}};
+
+    auto str = std::string{};
+    str.reserve(ln.size());
+    ln.for_each_chunk([&] (auto first, auto last) { str.append(first, last); });
+
+    auto lex   = lexer{str};
+    auto state = in;
+    auto first_token = true;
+    while (!lex.done()) {
+        auto c = lex.peek();
+        if (state == lexer_state::block_comment) {
+            auto end = str.find("*/", lex.pos);
+            lex.emit_to(end == std::string::npos ? str.size() : end + 2,
+                        face::comment);
+            if (end != std::string::npos)
+                state = lexer_state::normal;
+            continue;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            lex.advance_to(lex.pos + 1);
+            continue;
+        } else if (lang == syntax::c_like && c == '/' && lex.peek(1) == '/') {
+            lex.emit_to(str.size(), face::comment);
+        } else if (lang == syntax::c_like && c == '/' && lex.peek(1) == '*') {
+            lex.emit_to(lex.pos + 2, face::comment);
+            state = lexer_state::block_comment;
+        } else if (lang == syntax::script && c == '#') {
+            lex.emit_to(str.size(), face::comment);
+        } else if (lang == syntax::c_like && c == '#' && first_token) {
+            // up to the comment that may follow the directive
+            auto end = std::min(str.find("//", lex.pos),
+                                str.find("/*", lex.pos));
+            lex.emit_to(end, face::preprocessor);
+        } else if (c == '"' || c == '\'') {
+            lex.string_literal();
+        } else if (std::isdigit(static_cast<unsigned char>(c))) {
+            auto last = lex.pos;
+            while (last < str.size() && (is_word(str[last]) || str[last] == '.'))
+                ++last;
+            lex.emit_to(last, face::number);
+        } else if (is_word(c)) {
+            auto last = lex.pos;
+            while (last < str.size() && is_word(str[last]))
+                ++last;
+            auto word = std::string_view{str}.substr(lex.pos, last - lex.pos);
+            if (is_keyword(lang, word))
+                lex.emit_to(last, face::keyword);
+            else
+                lex.advance_to(last);
+        } else {
+            lex.advance_to(lex.pos + 1);
+        }
+        first_token = false;
+    }
+    return {ln, in, state, std::move(lex.spans)};
+}
+
+std::optional<lexed_line> highlighted_row(const highlighting& hl,
+                                          index row,
+                                          const line& ln,
+                                          lexer_state in)
+{
+    if (row >= (index)hl.rows.size())
+        return std::nullopt;
+    auto& lexed = hl.rows[row];
+    if (identical(lexed.content, ln) && lexed.in == in)
+        return lexed;
+    return lex_line(hl.lang, ln, in);
+}
+
+lexer_state row_state(const highlighting& hl, index row)
+{
+    return row > 0 && row <= (index)hl.rows.size()
+        ? hl.rows[row - 1].out
+        : lexer_state::normal;
+}
+
+namespace {
+
+// The number of lines at the beginning of both texts that are the
+// same, comparing the fingerprints of their indexes.
+index common_prefix(const line_index& a, const line_index& b)
+{
+    auto lo = index{};
+    auto hi = std::min(a.size(), b.size());
+    if (a.take(hi) == b.take(hi))
+        return hi;
+    while (lo + 1 < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (a.take(mid) == b.take(mid))
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+} // anonymous namespace
+
+highlighting rehighlight(const highlighting& prev,
+                         syntax lang,
+                         text content,
+                         line_index offsets,
+                         const cancellation& token,
+                         const std::function<void(const highlighting&)>& progress)
+{
+    auto result = highlighting{lang, content, offsets, {}};
+    if (lang == syntax::none)
+        return result;
+
+    auto old   = prev.lang == lang ? prev : highlighting{};
+    auto first = std::min(common_prefix(old.offsets, offsets),
+                          (index)old.rows.size());
+    auto rows  = old.rows.take(first);
+    auto delta = (index)content.size() - (index)old.content.size();
+    // after a failed attempt to converge, the next chance is after the
+    // next line that changed
+    auto may_converge = true;
+    auto converged    = false;
+    auto reported     = first;
+    for (auto row = first; row < (index)content.size(); ++row) {
+        if (token.cancelled())
+            break;
+        auto state    = rows.empty() ? lexer_state::normal : rows.back().out;
+        auto& ln      = content[row];
+        auto prev_row = row - delta;
+        if (!converged && prev_row >= 0 && prev_row < (index)old.rows.size()) {
+            auto& lexed = old.rows[prev_row];
+            if (!identical(lexed.content, ln)) {
+                may_converge = true;
+            } else if (may_converge && lexed.in == state) {
+                if (offsets.drop(row) == old.offsets.drop(prev_row)) {
+                    // the old rows may not reach the end, though
+                    rows      = rows + old.rows.drop(prev_row);
+                    row       = (index)rows.size() - 1;
+                    converged = true;
+                    continue;
+                }
+                may_converge = false;
+            }
+        }
+        rows = std::move(rows).push_back(lex_line(lang, ln, state));
+        if (row + 1 - reported >= highlight_report_rows) {
+            reported = row + 1;
+            result.rows = rows;
+            progress(result);
+        }
+    }
+    result.rows = rows;
+    return result;
+}
+
+} // namespace ewig
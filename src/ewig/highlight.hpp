@@ -0,0 +1,140 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/executor.hpp>
+#include <ewig/line.hpp>
+#include <ewig/line_index.hpp>
+
+#include <immer/box.hpp>
+#include <immer/flex_vector.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ewig {
+
+/** How some piece of text is shown. */
+enum class face : std::uint8_t
+{
+    plain,
+    keyword,
+    string,
+    comment,
+    number,
+    preprocessor,
+};
+
+/** The display columns `[first, last)` of a line are shown as `kind`. */
+struct face_span
+{
+    index first;
+    index last;
+    face kind;
+};
+
+using face_spans = immer::box<std::vector<face_span>>;
+
+/** The languages that we know how to highlight. */
+enum class syntax : std::uint8_t
+{
+    none,
+    c_like, //< C, C++ and friends, with `//` and `/* */` comments
+    script, //< shells, Python, CMake... with `#` comments
+};
+
+/** Guesses the syntax of a file from its name. */
+syntax syntax_for(const std::string& fname);
+
+/** What the lexer carries from the end of a line to the next. */
+enum class lexer_state : std::uint8_t
+{
+    normal,
+    block_comment,
+};
+
+constexpr auto max_lexed_line = std::size_t{1} << 16;
+
+/**
+ * A line, lexed starting in the state `in`.  It keeps the line, so it
+ * can tell whether some other line is the same one in constant time.
+ * Lines longer than `max_lexed_line` are shown plain.
+ */
+struct lexed_line
+{
+    line content;
+    lexer_state in  = lexer_state::normal;
+    lexer_state out = lexer_state::normal;
+    face_spans spans;
+};
+
+lexed_line lex_line(syntax lang, const line& ln, lexer_state in);
+
+/**
+ * The highlighting of `content`.  The `rows` are lexed in order, so
+ * while the work is in progress there are fewer of them than lines in
+ * the text.
+ */
+struct highlighting
+{
+    syntax lang = syntax::none;
+    text content;
+    line_index offsets;
+    immer::flex_vector<lexed_line, memory_policy> rows;
+};
+
+/**
+ * Returns the line `ln` of the row `row`, lexed starting in the state
+ * `in`, or nothing when the highlighting did not get to that row yet.
+ * The highlighting may be of some older version of the text: what it
+ * has for the row is used when it is the identical line, lexed in the
+ * same state, and the line is lexed again otherwise.  Thus, the lines
+ * on the screen are right even while it catches up with the edits.
+ */
+std::optional<lexed_line> highlighted_row(const highlighting& hl,
+                                          index row,
+                                          const line& ln,
+                                          lexer_state in);
+
+/** Returns the state of the lexer at the start of the row `row`. */
+lexer_state row_state(const highlighting& hl, index row);
+
+constexpr auto highlight_report_rows = index{1} << 14;
+
+/**
+ * Highlights `content`, with the index `offsets`, reusing what it can
+ * from `prev`.  Only the lines from the first one that changed are
+ * lexed, until the state of the lexer is the one it had there before
+ * and the rest of the text is the same.  `progress` is called with
+ * what is done every `highlight_report_rows`.  When `token` is
+ * cancelled, it returns what it has done so far.
+ */
+highlighting rehighlight(const highlighting& prev,
+                         syntax lang,
+                         text content,
+                         line_index offsets,
+                         const cancellation& token,
+                         const std::function<void(const highlighting&)>& progress);
+
+} // namespace ewig
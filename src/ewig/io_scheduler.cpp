@@ -0,0 +1,77 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/io_scheduler.hpp"
+
+#include <algorithm>
+
+namespace ewig {
+
+io_scheduler::io_scheduler(executor& workers, std::size_t max_running)
+    : workers_{workers}
+    , max_running_{std::max(max_running, std::size_t{1})}
+{}
+
+io_scheduler::~io_scheduler()
+{
+    auto lock = std::unique_lock<std::mutex>{mutex_};
+    idle_.wait(lock, [&] { return running_ == 0 && pending_.empty(); });
+}
+
+void io_scheduler::post(std::size_t owner, bool write, task t)
+{
+    auto lock = std::unique_lock<std::mutex>{mutex_};
+    pending_.push_back({owner, write, std::move(t)});
+    run_next_(lock);
+}
+
+void io_scheduler::focus(std::size_t owner)
+{
+    auto lock = std::lock_guard<std::mutex>{mutex_};
+    focus_ = owner;
+}
+
+void io_scheduler::run_next_(std::unique_lock<std::mutex>& lock)
+{
+    while (running_ < max_running_ && !pending_.empty()) {
+        auto it = std::find_if(pending_.begin(), pending_.end(),
+                               [] (auto& e) { return e.write; });
+        if (it == pending_.end())
+            it = std::find_if(pending_.begin(), pending_.end(),
+                              [&] (auto& e) { return e.owner == focus_; });
+        if (it == pending_.end())
+            it = pending_.begin();
+        auto fn = std::move(it->fn);
+        pending_.erase(it);
+        ++running_;
+        lock.unlock();
+        workers_.post([this, fn = std::move(fn)] {
+            fn();
+            auto lock = std::unique_lock<std::mutex>{mutex_};
+            --running_;
+            run_next_(lock);
+            if (running_ == 0 && pending_.empty())
+                idle_.notify_all();
+        });
+        lock.lock();
+    }
+}
+
+} // namespace ewig
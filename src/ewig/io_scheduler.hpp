@@ -0,0 +1,80 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/executor.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace ewig {
+
+/**
+ * Queues the tasks that read or write files, running at most
+ * `max_running` of them at a time in the worker pool, such that opening
+ * many files at once does not make them all crawl.  Every task belongs
+ * to an `owner`, usually a buffer.  Writes go first, since someone is
+ * waiting for them, then the tasks of the owner in `focus`, then the
+ * rest in the order they came.  The destructor waits for all tasks to
+ * finish.
+ */
+class io_scheduler
+{
+public:
+    using task = std::function<void()>;
+
+    static constexpr auto default_max_running = std::size_t{2};
+
+    explicit io_scheduler(executor& workers,
+                          std::size_t max_running = default_max_running);
+    ~io_scheduler();
+
+    io_scheduler(const io_scheduler&) = delete;
+    io_scheduler& operator=(const io_scheduler&) = delete;
+
+    void post(std::size_t owner, bool write, task t);
+
+    // Makes the pending tasks of `owner` run before the others.
+    void focus(std::size_t owner);
+
+private:
+    struct entry
+    {
+        std::size_t owner;
+        bool write;
+        task fn;
+    };
+
+    void run_next_(std::unique_lock<std::mutex>& lock);
+
+    executor& workers_;
+    std::size_t max_running_;
+    std::size_t running_ = 0;
+    std::size_t focus_   = 0;
+    std::deque<entry> pending_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+};
+
+} // namespace ewig
@@ -19,7 +19,10 @@
 //
 
 #include "ewig/keys.hpp"
+
+#include <algorithm>
 #include <cassert>
+#include <map>
 
 extern "C" {
 #include <ncurses.h>
@@ -29,20 +32,83 @@ using namespace std::string_literals;
 
 namespace ewig {
 
-key_map make_key_map(std::initializer_list<std::pair<key_seq, std::string>> args)
+std::optional<key_map::node> key_map::next(node from,
+                                           const key_code& key) const
+{
+    const auto& t = tables_.get();
+    const auto& n = t.nodes[from];
+    auto first = t.edges.begin() + n.first_edge;
+    auto last  = first + n.num_edges;
+    auto it = std::lower_bound(first, last, key, [] (auto& e, auto& k) {
+        return e.key < k;
+    });
+    if (it != last && it->key == key)
+        return it->target;
+    return std::nullopt;
+}
+
+const immer::box<std::string>& key_map::command(node n) const
+{
+    return tables_->nodes[n].command;
+}
+
+command_id key_map::id(node n) const
 {
-    auto map = typename key_map::value_type{};
-    for (auto item : args) {
-        auto kseq = key_seq{};
-        for (auto kcode : item.first) {
-            if (!map[kseq]->empty())
+    return tables_->nodes[n].id;
+}
+
+key_map make_key_map(std::initializer_list<std::pair<key_seq, std::string>> args,
+                     command_id (*resolve)(std::string_view))
+{
+    // the bindings are first put in a tree of maps, that is then laid
+    // out breadth first, such that the children of a node are together
+    struct tree
+    {
+        std::map<key_code, std::size_t> children;
+        std::string command;
+    };
+    auto nodes = std::vector<tree>(1);
+    for (auto& item : args) {
+        auto n = std::size_t{};
+        for (auto& kcode : item.first) {
+            if (!nodes[n].command.empty())
                 throw std::runtime_error{"ambiguous bindings"};
-            kseq = kseq.push_back(kcode);
+            auto it = nodes[n].children.find(kcode);
+            if (it == nodes[n].children.end()) {
+                it = nodes[n].children.emplace(kcode, nodes.size()).first;
+                nodes.emplace_back();
+            }
+            n = it->second;
         }
-        auto res = map.emplace(std::move(kseq), std::move(item.second));
-        if (!res.second)
+        if (!nodes[n].command.empty())
             throw std::runtime_error{"dupplicate binding"};
+        if (!nodes[n].children.empty())
+            throw std::runtime_error{"ambiguous bindings"};
+        nodes[n].command = item.second;
+    }
+
+    auto result = key_map::tables{};
+    auto order  = std::vector<std::size_t>{0};
+    auto ids    = std::vector<key_map::node>(nodes.size());
+    result.nodes.clear();
+    for (auto i = std::size_t{}; i < order.size(); ++i) {
+        for (auto& [kcode, child] : nodes[order[i]].children) {
+            ids[child] = order.size();
+            order.push_back(child);
+        }
+    }
+    for (auto n : order) {
+        auto e = key_map::entry{};
+        e.first_edge = result.edges.size();
+        e.num_edges  = nodes[n].children.size();
+        e.command    = nodes[n].command;
+        e.id         = e.command->empty() ? no_command : resolve(*e.command);
+        for (auto& [kcode, child] : nodes[n].children)
+            result.edges.push_back({kcode, ids[child]});
+        result.nodes.push_back(std::move(e));
     }
+    auto map = key_map{};
+    map.tables_ = immer::box<key_map::tables>{std::move(result)};
     return map;
 }
 
@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include <ewig/memory_policy.hpp>
 #include <ewig/utils.hpp>
 
 #include <immer/vector.hpp>
@@ -27,20 +28,87 @@
 #include <immer/box.hpp>
 #include <immer/algorithm.hpp>
 
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <tuple>
-#include <unordered_map>
 #include <vector>
 
 namespace ewig {
 
 using key_code = std::tuple<int, wint_t>;
-using key_seq  = immer::vector<key_code>;
-using key_map  = immer::box<std::unordered_map<key_seq, immer::box<std::string>>>;
+using key_seq  = immer::vector<key_code, ui_memory_policy>;
 
-// Builds a keymap from `args`.  It also associates all key sequence
-// prefixes to the empty string, and checks for ambiguous key command
-// sequences.
-key_map make_key_map(std::initializer_list<std::pair<key_seq, std::string>>);
+/**
+ * Commands are known by their position in the table of commands, so
+ * calling them does not need to look up their names.
+ */
+using command_id = std::uint16_t;
+
+constexpr auto no_command = std::numeric_limits<command_id>::max();
+
+/**
+ * Key bindings compiled in a trie.  Its nodes are plain numbers, so the
+ * keys typed so far are just the node they lead to, starting from
+ * `root`.  The children of every node are stored together and sorted,
+ * such that following a key is a binary search over a few of them, and
+ * copying the map only copies a reference.  The commands are resolved
+ * when the map is built, so typing them does not look up their names.
+ */
+class key_map
+{
+public:
+    using node = std::uint32_t;
+
+    static constexpr node root = 0;
+
+    /** Returns the node reached by typing `key` at `from`, if any. */
+    std::optional<node> next(node from, const key_code& key) const;
+
+    /** Returns the command bound at `n`, empty when it is a prefix. */
+    const immer::box<std::string>& command(node n) const;
+
+    /**
+     * Returns the id of the command bound at `n`, or `no_command` when
+     * it is a prefix or the command does not exist.
+     */
+    command_id id(node n) const;
+
+private:
+    friend key_map make_key_map(
+        std::initializer_list<std::pair<key_seq, std::string>>,
+        command_id (*)(std::string_view));
+
+    struct edge
+    {
+        key_code key;
+        node target;
+    };
+
+    struct entry
+    {
+        std::uint32_t first_edge = 0;
+        std::uint32_t num_edges  = 0;
+        immer::box<std::string> command;
+        command_id id = no_command;
+    };
+
+    struct tables
+    {
+        std::vector<entry> nodes = {entry{}};
+        std::vector<edge> edges;
+    };
+
+    immer::box<tables> tables_;
+};
+
+// Builds a keymap from `args`, checking for ambiguous key command
+// sequences.  The names of the commands are turned into ids with
+// `resolve`.
+key_map make_key_map(std::initializer_list<std::pair<key_seq, std::string>> args,
+                     command_id (*resolve)(std::string_view));
 
 std::string to_string(const key_code& k);
 std::string to_string(const key_seq& keys);
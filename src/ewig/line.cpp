@@ -0,0 +1,627 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/line.hpp"
+#include "ewig/packed_block.hpp"
+#include "ewig/scan.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace ewig {
+
+namespace {
+
+// Code points taking two columns and none, from the East Asian Width
+// and General Category properties of Unicode, for the most used scripts
+constexpr std::pair<std::uint32_t, std::uint32_t> wide_chars[] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},
+    {0x23e9, 0x23ec},   {0x23f0, 0x23f0},   {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267f, 0x267f},   {0x2693, 0x2693},   {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},   {0x26f5, 0x26f5},   {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},
+    {0x2728, 0x2728},   {0x274c, 0x274c},   {0x274e, 0x274e},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},   {0x2b55, 0x2b55},   {0x2e80, 0x303e},
+    {0x3041, 0x33ff},   {0x3400, 0x4dbf},   {0x4e00, 0x9fff},
+    {0xa000, 0xa4cf},   {0xa960, 0xa97f},   {0xac00, 0xd7a3},
+    {0xf900, 0xfaff},   {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},
+    {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4},
+    {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a},
+    {0x1f200, 0x1f202}, {0x1f210, 0x1f23b}, {0x1f240, 0x1f248},
+    {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393},
+    {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0},
+    {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440},
+    {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e},
+    {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596},
+    {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5},
+    {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6d7},
+    {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff},
+    {0x1fa70, 0x1faff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+constexpr std::pair<std::uint32_t, std::uint32_t> zero_width_chars[] = {
+    {0x0300, 0x036f},   {0x0483, 0x0489},   {0x0591, 0x05bd},
+    {0x05bf, 0x05bf},   {0x05c1, 0x05c2},   {0x05c4, 0x05c5},
+    {0x05c7, 0x05c7},   {0x0610, 0x061a},   {0x064b, 0x065f},
+    {0x0670, 0x0670},   {0x06d6, 0x06dc},   {0x06df, 0x06e4},
+    {0x06e7, 0x06e8},   {0x06ea, 0x06ed},   {0x0900, 0x0902},
+    {0x093a, 0x093a},   {0x093c, 0x093c},   {0x0941, 0x0948},
+    {0x094d, 0x094d},   {0x0951, 0x0957},   {0x0e31, 0x0e31},
+    {0x0e34, 0x0e3a},   {0x0e47, 0x0e4e},   {0x1160, 0x11ff},
+    {0x1ab0, 0x1aff},   {0x1dc0, 0x1dff},   {0x200b, 0x200f},
+    {0x202a, 0x202e},   {0x2060, 0x2064},   {0x20d0, 0x20ff},
+    {0x302a, 0x302d},   {0x3099, 0x309a},   {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f},   {0xfeff, 0xfeff},   {0x1f3fb, 0x1f3ff},
+    {0xe0001, 0xe0001}, {0xe0020, 0xe007f}, {0xe0100, 0xe01ef},
+};
+
+template <std::size_t N>
+bool in_ranges(const std::pair<std::uint32_t, std::uint32_t> (&ranges)[N],
+               std::uint32_t cp)
+{
+    auto it = std::upper_bound(
+        std::begin(ranges), std::end(ranges), cp,
+        [] (auto cp, auto& range) { return cp < range.first; });
+    return it != std::begin(ranges) && cp <= (it - 1)->second;
+}
+
+// Accumulates the metadata of a line from its bytes, starting at a
+// code point boundary.  While the line is still plain the checkpoints
+// are implicit, being at every `checkpoint_step` bytes, and they are
+// only filled when it stops being so.
+class info_scanner
+{
+public:
+    using checkpoint = line_info::checkpoint;
+
+    info_scanner() = default;
+
+    // Continues after `points`, the checkpoints of a line with the
+    // flags of `flags`, from the code point at `pos`
+    info_scanner(const line_info& flags,
+                 std::vector<checkpoint> points,
+                 checkpoint pos)
+        : info_{flags}
+        , pos_{pos}
+    {
+        info_.checkpoints = std::move(points);
+        plain_ = info_.checkpoints.empty();
+        if (!plain_)
+            last_point_ = info_.checkpoints.back().code;
+    }
+
+    const checkpoint& position()
+    {
+        finish_code_point();
+        return pos_;
+    }
+
+    void scan(const line& ln, std::size_t first, std::size_t last)
+    {
+        ln.for_each_chunk(first, last, [&] (auto first, auto last) {
+            scan(first, last);
+        });
+    }
+
+    void scan(const char* first, const char* last)
+    {
+        while (first != last) {
+            auto c = static_cast<unsigned char>(*first);
+            if ((c & 0xc0) == 0x80) {
+                // code points may be split across chunks, and stray
+                // continuation bytes take no column
+                if (pending_ > 0) {
+                    code_ = (code_ << 6) | (c & 0x3f);
+                    if (--pending_ == 0)
+                        end_code_point(char_width(code_));
+                }
+                ++first;
+                ++pos_.byte;
+                continue;
+            } else if (pending_ > 0) {
+                end_code_point(1); // truncated code point
+            }
+            if (c < 0x80 && c != '\t') {
+                auto run = index(skip_plain_ascii(first, last) - first);
+                while (run > 0) {
+                    if (!plain_ && pos_.code - last_point_ >= step)
+                        add_checkpoint();
+                    auto n = plain_
+                        ? run
+                        : std::min(run, last_point_ + step - pos_.code);
+                    first       += n;
+                    run         -= n;
+                    pos_.code   += n;
+                    pos_.byte   += n;
+                    pos_.column += n;
+                }
+                continue;
+            }
+            if (plain_)
+                fill_checkpoints();
+            if (pos_.code - last_point_ >= step)
+                add_checkpoint();
+            if (c == '\t') {
+                info_.tabs     = true;
+                info_.last_tab = pos_.code;
+                pos_.column   += tab_width - (pos_.column % tab_width);
+                ++pos_.code;
+            } else {
+                info_.ascii = false;
+                pending_    = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+                code_       = c & (0x3f >> pending_);
+            }
+            ++first;
+            ++pos_.byte;
+        }
+    }
+
+    // Ends with the rest of the line `from`, where the scanning is,
+    // starting at its checkpoint `*first`, which moves by `shift`.  Its
+    // checkpoints from there are reused, moved as well.
+    template <typename Iter>
+    void reuse(const line_info& from, Iter first, Iter last, checkpoint shift)
+    {
+        // the first may be where the last scanned checkpoint is
+        auto& points = info_.checkpoints;
+        auto push    = [&] (checkpoint p) {
+            p = {p.code + shift.code, p.byte + shift.byte,
+                 p.column + shift.column};
+            if (points.empty() || points.back().code != p.code)
+                points.push_back(p);
+        };
+        if (!from.checkpoints.empty()) {
+            if (plain_)
+                fill_checkpoints();
+            for (; first != last; ++first)
+                push(*first);
+        } else if (!plain_) {
+            // the rest of `from` is plain, with implicit checkpoints
+            for (auto code = pos_.code - shift.code; code < from.length;
+                 code += step)
+                push({code, std::size_t(code), code});
+        }
+        info_.ascii = info_.ascii && from.ascii;
+        info_.wide  = info_.wide || from.wide;
+        if (from.last_tab + shift.code >= pos_.code) {
+            info_.tabs     = true;
+            info_.last_tab = from.last_tab + shift.code;
+        }
+        pos_.code   = from.length + shift.code;
+        pos_.column = from.width + shift.column;
+    }
+
+    line_info finish()
+    {
+        finish_code_point();
+        info_.length = pos_.code;
+        info_.width  = pos_.column;
+        if (info_.ascii && !info_.tabs)
+            info_.checkpoints = {};
+        return std::move(info_);
+    }
+
+private:
+    static constexpr auto step = line_info::checkpoint_step;
+
+    void finish_code_point()
+    {
+        if (pending_ > 0)
+            end_code_point(1);
+    }
+
+    void end_code_point(int width)
+    {
+        pending_     = 0;
+        info_.wide   = info_.wide || width != 1;
+        pos_.column += width;
+        ++pos_.code;
+    }
+
+    void add_checkpoint()
+    {
+        info_.checkpoints.push_back(pos_);
+        last_point_ = pos_.code;
+    }
+
+    // The line stops being plain, where the code points are the bytes
+    // and the columns
+    void fill_checkpoints()
+    {
+        plain_ = false;
+        for (auto code = last_point_ + step; code < pos_.code; code += step)
+            info_.checkpoints.push_back({code, std::size_t(code), code});
+        if (!info_.checkpoints.empty())
+            last_point_ = info_.checkpoints.back().code;
+    }
+
+    line_info info_;
+    checkpoint pos_ = {0, 0, 0};
+    index last_point_ = -step;
+    bool plain_ = true;
+    int pending_ = 0;
+    std::uint32_t code_ = 0;
+};
+
+line_info compute_info(const line& ln)
+{
+    auto scanner = info_scanner{};
+    scanner.scan(ln, 0, ln.size());
+    return scanner.finish();
+}
+
+// Returns the metadata of `from.take(first) + middle + from.drop(last)`,
+// knowing `info`, the one of `from`.  The bytes between the checkpoints
+// around the edit are scanned again, the others being moved.  After a
+// tab, the columns move by a multiple of the tab width, so moving the
+// checkpoints after one keeps the tabs as wide as they were.
+line_info splice_info(const line& from, const line_info& info,
+                      std::size_t first, std::size_t last,
+                      const line& middle)
+{
+    using checkpoint = line_info::checkpoint;
+    auto& points = info.checkpoints;
+    auto prefix  = std::upper_bound(
+        points.begin(), points.end(), first,
+        [] (auto byte, auto& p) { return byte < p.byte; });
+    // plain lines have no checkpoints, the edit itself is one
+    auto start   = prefix == points.begin()
+        ? checkpoint{index(first), first, index(first)}
+        : *(prefix - 1);
+    // the tabs before `start`, if any, come before its code point
+    auto flags     = line_info{};
+    flags.ascii    = info.ascii;
+    flags.wide     = info.wide;
+    flags.last_tab = std::min(info.last_tab, start.code - 1);
+    flags.tabs     = flags.last_tab >= 0;
+    auto scanner   = info_scanner{flags, {points.begin(), prefix}, start};
+    scanner.scan(from, start.byte, first);
+    scanner.scan(middle, 0, middle.size());
+
+    auto suffix = std::lower_bound(
+        prefix, points.end(), last,
+        [] (auto& p, auto byte) { return p.byte < byte; });
+    auto byte = last;
+    if (points.empty()) {
+        auto pos   = scanner.position();
+        auto shift = checkpoint{pos.code - index(last),
+                                pos.byte - last,
+                                pos.column - index(last)};
+        scanner.reuse(info, suffix, suffix, shift);
+        return scanner.finish();
+    }
+    for (; suffix != points.end(); ++suffix) {
+        scanner.scan(from, byte, suffix->byte);
+        byte = suffix->byte;
+        auto pos   = scanner.position();
+        auto shift = checkpoint{pos.code - suffix->code,
+                                pos.byte - suffix->byte,
+                                pos.column - suffix->column};
+        if (info.last_tab < suffix->code || shift.column % tab_width == 0) {
+            scanner.reuse(info, suffix, points.end(), shift);
+            return scanner.finish();
+        }
+    }
+    scanner.scan(from, byte, from.size());
+    return scanner.finish();
+}
+
+// The metadata shared by the copies of a line, with their count
+struct shared_info : line_info
+{
+    explicit shared_info(line_info info)
+        : line_info{std::move(info)}
+    {}
+
+    mutable std::atomic<std::size_t> refs{1};
+};
+
+const line_info* retain(const line_info* info)
+{
+    if (info)
+        static_cast<const shared_info*>(info)->refs.fetch_add(
+            1, std::memory_order_relaxed);
+    return info;
+}
+
+void release(const line_info* info)
+{
+    if (info && static_cast<const shared_info*>(info)->refs.fetch_sub(
+            1, std::memory_order_acq_rel) == 1)
+        delete static_cast<const shared_info*>(info);
+}
+
+} // anonymous
+
+int char_width(std::uint32_t cp)
+{
+    return cp < 0x300 ? 1
+        :  in_ranges(zero_width_chars, cp) ? 0
+        :  in_ranges(wide_chars, cp) ? 2
+        :  1;
+}
+
+line::line(line_chars chars)
+    : data_{std::move(chars)}
+{}
+
+line::line(const line& other)
+    : data_{other.data_}
+    , info_{retain(other.info_.load(std::memory_order_acquire))}
+{}
+
+line::line(line&& other) noexcept
+    : data_{std::move(other.data_)}
+    , info_{other.info_.exchange(nullptr, std::memory_order_relaxed)}
+{}
+
+line& line::operator=(const line& other)
+{
+    if (this != &other) {
+        data_ = other.data_;
+        release(info_.exchange(retain(other.info_.load(std::memory_order_acquire)),
+                               std::memory_order_relaxed));
+    }
+    return *this;
+}
+
+line& line::operator=(line&& other) noexcept
+{
+    if (this != &other) {
+        data_ = std::move(other.data_);
+        release(info_.exchange(
+                    other.info_.exchange(nullptr, std::memory_order_relaxed),
+                    std::memory_order_relaxed));
+    }
+    return *this;
+}
+
+line::~line()
+{
+    release(info_.load(std::memory_order_relaxed));
+}
+
+const line_info& line::info() const
+{
+    auto info = info_.load(std::memory_order_acquire);
+    if (!info) {
+        auto computed = static_cast<const line_info*>(
+            new shared_info{compute_info(*this)});
+        // other threads may be computing it too, only one wins and the
+        // cached value never changes after that
+        if (info_.compare_exchange_strong(info, computed,
+                                          std::memory_order_acq_rel))
+            info = computed;
+        else
+            release(computed);
+    }
+    return *info;
+}
+
+// Returns this line, which nobody else sees yet, with `info` as its
+// metadata
+line line::with_info(line_info info) const
+{
+    auto result = *this;
+    release(result.info_.exchange(new shared_info{std::move(info)},
+                                  std::memory_order_release));
+    return result;
+}
+
+// Returns this line, which is `from.take(first) + middle +
+// from.drop(last)`, with its metadata derived from the one of `from`,
+// when that is known already.
+line line::with_splice_info(const line& from, size_type first,
+                            size_type last, const line& middle) const
+{
+    auto info = from.info_.load(std::memory_order_acquire);
+    return info
+        ? with_info(splice_info(from, *info, first, last, middle))
+        : *this;
+}
+
+line line::view(std::shared_ptr<const mapped_file> file,
+                std::size_t offset,
+                std::size_t size)
+{
+    auto result = line{};
+    if (size > 0)
+        result.data_ = slice_of_file{std::move(file), offset, size};
+    return result;
+}
+
+line line::packed(std::shared_ptr<const packed_block> block,
+                  std::size_t offset,
+                  std::size_t size)
+{
+    auto result = line{};
+    if (size > 0)
+        result.data_ = slice_of_block{std::move(block), offset, size};
+    return result;
+}
+
+line line::pack(std::shared_ptr<const packed_block> block,
+                std::size_t offset) const
+{
+    auto result  = packed(std::move(block), offset, size());
+    result.info_ = retain(info_.load(std::memory_order_acquire));
+    return result;
+}
+
+const std::shared_ptr<const mapped_file>& line::viewed_file() const
+{
+    static const auto none = std::shared_ptr<const mapped_file>{};
+    auto view = std::get_if<slice_of_file>(&data_);
+    return view ? view->file : none;
+}
+
+std::size_t line::offset() const
+{
+    auto view   = std::get_if<slice_of_file>(&data_);
+    auto packed = std::get_if<slice_of_block>(&data_);
+    return view ? view->offset : packed ? packed->offset : 0;
+}
+
+std::size_t line::slice_size() const
+{
+    auto view = std::get_if<slice_of_file>(&data_);
+    return view ? view->size : std::get<slice_of_block>(data_).size;
+}
+
+std::shared_ptr<const char> line::thaw() const
+{
+    auto& packed = std::get<slice_of_block>(data_);
+    auto data    = packed.block->thaw();
+    return {data, data.get() + packed.offset};
+}
+
+std::tuple<const void*, std::uintptr_t, std::size_t> line::identity() const
+{
+    using key = std::tuple<const void*, std::uintptr_t, std::size_t>;
+    if (auto chars = std::get_if<line_chars>(&data_))
+        return key{chars->impl().root,
+                   reinterpret_cast<std::uintptr_t>(chars->impl().tail),
+                   chars->size()};
+    else if (auto view = std::get_if<slice_of_file>(&data_))
+        return key{view->file.get(), view->offset, view->size};
+    else {
+        auto& packed = std::get<slice_of_block>(data_);
+        return key{packed.block.get(), packed.offset, packed.size};
+    }
+}
+
+line::iterator line::begin() const
+{
+    if (auto chars = std::get_if<line_chars>(&data_))
+        return iterator{chars->begin()};
+    else if (auto view = std::get_if<slice_of_file>(&data_))
+        return iterator{view_data(*view), 0};
+    else
+        return iterator{thaw(), 0};
+}
+
+line::iterator line::end() const
+{
+    if (auto chars = std::get_if<line_chars>(&data_))
+        return iterator{chars->end()};
+    else if (auto view = std::get_if<slice_of_file>(&data_))
+        return iterator{view_data(*view), view->size};
+    else
+        return iterator{thaw(), slice_size()};
+}
+
+line_chars line::chars() const
+{
+    if (auto chars = std::get_if<line_chars>(&data_)) {
+        return *chars;
+    } else if (auto view = std::get_if<slice_of_file>(&data_)) {
+        return line_chars{view_data(*view), view_data(*view) + view->size};
+    } else {
+        auto data = thaw();
+        return line_chars{data.get(), data.get() + slice_size()};
+    }
+}
+
+line line::take(size_type n) const
+{
+    auto result = line{};
+    if (auto chars = std::get_if<line_chars>(&data_))
+        result = line{chars->take(n)};
+    else if (n >= slice_size())
+        return *this;
+    else if (n == 0)
+        return {};
+    else if (auto view = std::get_if<slice_of_file>(&data_))
+        result.data_ = slice_of_file{view->file, view->offset, n};
+    else {
+        auto& packed = std::get<slice_of_block>(data_);
+        result.data_ = slice_of_block{packed.block, packed.offset, n};
+    }
+    return result.with_splice_info(*this, std::min(n, size()), size(), {});
+}
+
+line line::drop(size_type n) const
+{
+    auto result = line{};
+    if (auto chars = std::get_if<line_chars>(&data_))
+        result = line{chars->drop(n)};
+    else if (n >= slice_size())
+        return {};
+    else if (auto view = std::get_if<slice_of_file>(&data_))
+        result.data_ = slice_of_file{view->file, view->offset + n,
+                                     view->size - n};
+    else {
+        auto& packed = std::get<slice_of_block>(data_);
+        result.data_ = slice_of_block{packed.block, packed.offset + n,
+                                      packed.size - n};
+    }
+    return result.with_splice_info(*this, 0, std::min(n, size()), {});
+}
+
+line line::insert(size_type pos, const line& ln) const
+{
+    return ln.empty()
+        ? *this
+        : line{chars().insert(pos, ln.chars())}
+            .with_splice_info(*this, pos, pos, ln);
+}
+
+line line::erase(size_type first, size_type last) const
+{
+    return first == last
+        ? *this
+        : line{chars().erase(first, last)}
+            .with_splice_info(*this, first, last, {});
+}
+
+line operator+(const line& a, const line& b)
+{
+    if (a.empty())
+        return b;
+    else if (b.empty())
+        return a;
+    // the metadata of the longer one is moved, the other scanned
+    auto result = line{a.chars() + b.chars()};
+    auto a_info = a.info_.load(std::memory_order_acquire);
+    auto b_info = b.info_.load(std::memory_order_acquire);
+    return b_info && (!a_info || b.size() > a.size())
+        ? result.with_splice_info(b, 0, 0, a)
+        : result.with_splice_info(a, a.size(), a.size(), b);
+}
+
+bool operator==(const line& a, const line& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+bool operator!=(const line& a, const line& b)
+{
+    return !(a == b);
+}
+
+} // namespace ewig
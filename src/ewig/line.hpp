@@ -0,0 +1,378 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/coord.hpp>
+#include <ewig/mapped_file.hpp>
+#include <ewig/memory_policy.hpp>
+#include <ewig/utils.hpp>
+
+#include <immer/flex_vector.hpp>
+#include <immer/algorithm.hpp>
+
+#include <boost/iterator/iterator_facade.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+namespace ewig {
+
+using line_chars = immer::flex_vector<char, memory_policy>;
+
+constexpr auto tab_width = 8;
+
+/**
+ * Returns the number of display columns taken by the code point `cp`,
+ * when it is not a tab: two for wide East Asian characters and emoji,
+ * none for combining marks and other zero width ones, one otherwise.
+ */
+int char_width(std::uint32_t cp);
+
+/**
+ * Metadata about the contents of a line: its `length` in code points
+ * and its `width` in display columns, tabs expanded.  For lines that
+ * are not plain ASCII without tabs, the checkpoints record the index,
+ * the byte offset and the display column of code points no more than
+ * `checkpoint_step` apart, starting with the first one.
+ *
+ * The metadata of lines made by editing others is derived from theirs,
+ * looking only at the bytes around the edit.  The flags may then stay
+ * set after removing the characters they tell about, which only makes
+ * using the metadata slower.
+ */
+struct line_info
+{
+    static constexpr index checkpoint_step = 256;
+
+    struct checkpoint
+    {
+        index code;
+        std::size_t byte;
+        index column;
+    };
+
+    index length = 0;
+    index width  = 0;
+    bool ascii   = true;
+    bool tabs    = false;
+    // some characters take other than one column, there may be no
+    // tabs after the code point `last_tab`
+    bool wide      = false;
+    index last_tab = -1;
+    std::vector<checkpoint> checkpoints;
+};
+
+class line;
+class packed_block;
+
+/**
+ * Random access iterator over the bytes of a `line`.  The iterators of
+ * packed lines keep their decompressed bytes alive.
+ */
+class line_iterator
+    : public boost::iterator_facade<line_iterator,
+                                    const char,
+                                    std::random_access_iterator_tag,
+                                    const char&>
+{
+public:
+    line_iterator() = default;
+
+    /** Returns the offset of the byte the iterator points to. */
+    std::size_t index() const
+    { return view_ ? view_index_ : chars_iter_.index(); }
+
+private:
+    friend class line;
+    friend class boost::iterator_core_access;
+
+    line_iterator(line_chars::iterator it)
+        : chars_iter_{it}
+    {}
+
+    line_iterator(const char* view, std::size_t idx)
+        : view_{view}
+        , view_index_{idx}
+    {}
+
+    line_iterator(std::shared_ptr<const char> pin, std::size_t idx)
+        : view_{pin.get()}
+        , view_index_{idx}
+        , pin_{std::move(pin)}
+    {}
+
+    const char& dereference() const
+    { return view_ ? view_[view_index_] : *chars_iter_; }
+
+    bool equal(const line_iterator& other) const
+    { return index() == other.index(); }
+
+    void increment()
+    { if (view_) ++view_index_; else ++chars_iter_; }
+
+    void decrement()
+    { if (view_) --view_index_; else --chars_iter_; }
+
+    void advance(std::ptrdiff_t n)
+    { if (view_) view_index_ += n; else chars_iter_ += n; }
+
+    std::ptrdiff_t distance_to(const line_iterator& other) const
+    { return std::ptrdiff_t(other.index()) - std::ptrdiff_t(index()); }
+
+    line_chars::iterator chars_iter_ = {};
+    const char* view_ = nullptr;
+    std::size_t view_index_ = 0;
+    std::shared_ptr<const char> pin_;
+};
+
+/**
+ * A line of text, as a sequence of UTF-8 encoded bytes.
+ *
+ * Normally a line owns its bytes in a `flex_vector`.  A line can also
+ * be a *view* on a slice of a `mapped_file`: it then keeps the mapping
+ * alive, but does not hold a copy of its contents, which never change
+ * even when the file does.  Taking or dropping a part of a view
+ * produces a smaller view, any other change copies the bytes into a
+ * `flex_vector` first.  This way, editing a few lines of a huge file
+ * costs memory proportional to the edits only.
+ *
+ * Lines that are not touched for long can also be *packed*, as a slice
+ * of a block of consecutive lines that is kept compressed.  Their bytes
+ * are decompressed again when something reads them, going to a cache
+ * of recently read blocks.  Changes copy the bytes, like with views.
+ *
+ * The kinds share their storage, so every line takes the size of a
+ * `flex_vector` and two words, and the metadata, once computed, is
+ * shared by all the copies of the line.
+ */
+class line
+{
+public:
+    using value_type      = char;
+    using size_type       = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference       = const char&;
+    using const_reference = const char&;
+    using iterator        = line_iterator;
+    using const_iterator  = line_iterator;
+
+    line() = default;
+    line(line_chars chars);
+    line(const line& other);
+    line(line&& other) noexcept;
+    line& operator=(const line& other);
+    line& operator=(line&& other) noexcept;
+    ~line();
+
+    template <typename Iter, typename Sent>
+    line(Iter first, Sent last)
+        : data_{std::in_place_type<line_chars>, first, last}
+    {}
+
+    /**
+     * Returns a line that views the `size` bytes at `offset` in the
+     * mapped `file`, without copying them.
+     */
+    static line view(std::shared_ptr<const mapped_file> file,
+                     std::size_t offset,
+                     std::size_t size);
+
+    /**
+     * Returns a line that is the `size` bytes at `offset` in the
+     * decompressed `block`.
+     */
+    static line packed(std::shared_ptr<const packed_block> block,
+                       std::size_t offset,
+                       std::size_t size);
+
+    /**
+     * Returns this line packed as the bytes at `offset` in `block`,
+     * which have to be the same ones.  Its metadata is kept, so packing
+     * does not make them be computed again.
+     */
+    line pack(std::shared_ptr<const packed_block> block,
+              std::size_t offset) const;
+
+    bool is_view() const { return std::holds_alternative<slice_of_file>(data_); }
+    bool is_packed() const { return std::holds_alternative<slice_of_block>(data_); }
+
+    /** Returns the file that a view is a slice of, or null. */
+    const std::shared_ptr<const mapped_file>& viewed_file() const;
+
+    /**
+     * Returns where the bytes of a view or a packed line start, in
+     * their file or their block.
+     */
+    std::size_t offset() const;
+
+    /**
+     * Returns a key that is the same for lines that are `identical`,
+     * and different for those that are not, while they are alive.
+     */
+    std::tuple<const void*, std::uintptr_t, std::size_t> identity() const;
+
+    size_type size() const
+    {
+        auto chars = std::get_if<line_chars>(&data_);
+        return chars ? chars->size() : slice_size();
+    }
+    bool empty() const { return size() == 0; }
+
+    iterator begin() const;
+    iterator end() const;
+
+    // Every call looks up the bytes of packed lines, which may have to
+    // be decompressed again, so iterate over those instead
+    char operator[](size_type idx) const
+    {
+        if (auto chars = std::get_if<line_chars>(&data_))
+            return (*chars)[idx];
+        else if (auto view = std::get_if<slice_of_file>(&data_))
+            return view_data(*view)[idx];
+        else
+            return thaw().get()[idx];
+    }
+
+    line take(size_type n) const;
+    line drop(size_type n) const;
+    line insert(size_type pos, const line& ln) const;
+    line erase(size_type first, size_type last) const;
+
+    friend line operator+(const line& a, const line& b);
+    friend bool identical(const line& a, const line& b);
+
+    /**
+     * Returns the contents of the line as `flex_vector`, copying them
+     * if this is a view.
+     */
+    line_chars chars() const;
+
+    /**
+     * Returns the metadata of the line.  It is computed the first
+     * time it is needed and then cached, this is thread-safe.
+     */
+    const line_info& info() const;
+
+    /**
+     * Calls `fn` with every contiguous `[first, last)` range of bytes
+     * in the line, in order.
+     */
+    template <typename Fn>
+    void for_each_chunk(Fn&& fn) const
+    {
+        if (auto chars = std::get_if<line_chars>(&data_)) {
+            immer::for_each_chunk(*chars, std::forward<Fn>(fn));
+        } else if (auto view = std::get_if<slice_of_file>(&data_)) {
+            auto data = view_data(*view);
+            std::forward<Fn>(fn)(data, data + view->size);
+        } else {
+            auto data = thaw();
+            std::forward<Fn>(fn)(data.get(), data.get() + slice_size());
+        }
+    }
+
+    /**
+     * Like the other `for_each_chunk`, for the bytes in `[first, last)`
+     * only.
+     */
+    template <typename Fn>
+    void for_each_chunk(size_type first, size_type last, Fn&& fn) const
+    {
+        if (first >= last)
+            return;
+        else if (auto chars = std::get_if<line_chars>(&data_))
+            immer::for_each_chunk(chars->begin() + first,
+                                  chars->begin() + last,
+                                  std::forward<Fn>(fn));
+        else if (auto view = std::get_if<slice_of_file>(&data_))
+            std::forward<Fn>(fn)(view_data(*view) + first,
+                                 view_data(*view) + last);
+        else
+            for_each_chunk([&] (auto data, auto) {
+                std::forward<Fn>(fn)(data + first, data + last);
+            });
+    }
+
+private:
+    struct slice_of_file
+    {
+        std::shared_ptr<const mapped_file> file;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    struct slice_of_block
+    {
+        std::shared_ptr<const packed_block> block;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    line with_info(line_info info) const;
+    line with_splice_info(const line& from, size_type first,
+                          size_type last, const line& middle) const;
+
+    // Returns the bytes of a packed line, decompressing them if needed
+    std::shared_ptr<const char> thaw() const;
+
+    // Returns the size of a view or a packed line
+    std::size_t slice_size() const;
+
+    static const char* view_data(const slice_of_file& view)
+    { return view.file->data() + view.offset; }
+
+    std::variant<line_chars, slice_of_file, slice_of_block> data_;
+    // shared by the copies, it changes once only, from null
+    mutable std::atomic<const line_info*> info_{nullptr};
+};
+
+bool operator==(const line& a, const line& b);
+bool operator!=(const line& a, const line& b);
+
+/**
+ * Returns whether `a` and `b` share their contents, in constant time.
+ */
+inline bool identical(const line& a, const line& b)
+{
+    if (auto chars = std::get_if<line_chars>(&a.data_)) {
+        auto other = std::get_if<line_chars>(&b.data_);
+        return other && identical(*chars, *other);
+    } else if (auto view = std::get_if<line::slice_of_file>(&a.data_)) {
+        auto other = std::get_if<line::slice_of_file>(&b.data_);
+        return other && view->file == other->file
+            && view->offset == other->offset
+            && view->size == other->size;
+    } else {
+        auto packed = std::get_if<line::slice_of_block>(&a.data_);
+        auto other  = std::get_if<line::slice_of_block>(&b.data_);
+        return other && packed->block == other->block
+            && packed->offset == other->offset
+            && packed->size == other->size;
+    }
+}
+
+using text = immer::flex_vector<line, memory_policy>;
+
+} // namespace ewig
@@ -0,0 +1,413 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/line_index.hpp"
+
+#include <immer/algorithm.hpp>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace ewig {
+
+namespace {
+
+using entry   = line_index::entry;
+using chunk_t = std::vector<entry>;
+
+} // anonymous namespace
+
+// The index is a treap, with the lines grouped in chunks of up to
+// `chunk_size` consecutive ones per node, such that loading a huge
+// file does not need a node per line.  The sums are those of the whole
+// subtree, and `power` is the base of the fingerprint to the number
+// of lines in it.
+struct line_index::node
+{
+    std::shared_ptr<const node> left;
+    std::shared_ptr<const node> right;
+    std::uint32_t priority;
+    chunk_t chunk;
+    index count;
+    std::size_t bytes;
+    std::uint64_t hash;
+    std::uint64_t power;
+};
+
+namespace {
+
+using node_ptr = std::shared_ptr<const line_index::node>;
+
+constexpr auto chunk_size = std::size_t{64};
+
+// Fingerprints are computed modulo the Mersenne prime 2^61 - 1
+constexpr auto modulus = (std::uint64_t{1} << 61) - 1;
+
+std::uint64_t mul_mod(std::uint64_t a, std::uint64_t b)
+{
+    auto r = (unsigned __int128){a} * b;
+    auto x = (std::uint64_t(r) & modulus) + std::uint64_t(r >> 61);
+    return x >= modulus ? x - modulus : x;
+}
+
+std::uint64_t add_mod(std::uint64_t a, std::uint64_t b)
+{
+    auto x = a + b;
+    return x >= modulus ? x - modulus : x;
+}
+
+const std::uint64_t base = [] {
+    auto seed = std::random_device{};
+    auto dist = std::uniform_int_distribution<std::uint64_t>{256, modulus - 1};
+    return dist(seed);
+} ();
+
+std::uint64_t fmix(std::uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hashes the bytes of a line eight at a time.  The words are the same
+// no matter how the bytes are split in chunks.  It is the same in every
+// process, as state files keep the hashes, so it is not meant to stand
+// collisions crafted on purpose.
+std::uint64_t hash_line(const line& ln)
+{
+    constexpr auto k = 0x9e3779b97f4a7c15ull;
+    auto h    = std::uint64_t{ln.size()} * k;
+    auto word = std::uint64_t{};
+    auto fill = 0;
+    auto mix  = [&] (std::uint64_t w) {
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    };
+    ln.for_each_chunk([&] (auto first, auto last) {
+        for (; fill > 0 && first != last; ++first) {
+            word |= std::uint64_t{(unsigned char)*first} << (8 * fill);
+            if (++fill == 8) {
+                mix(word);
+                word = fill = 0;
+            }
+        }
+        for (; last - first >= 8; first += 8) {
+            auto w = std::uint64_t{};
+            for (auto i = 0; i < 8; ++i)
+                w |= std::uint64_t{(unsigned char)first[i]} << (8 * i);
+            mix(w);
+        }
+        for (; first != last; ++first)
+            word |= std::uint64_t{(unsigned char)*first} << (8 * fill++);
+    });
+    if (fill > 0)
+        mix(word);
+    return fmix(h) % modulus;
+}
+
+std::uint32_t random_priority()
+{
+    thread_local auto engine = std::minstd_rand{};
+    return engine();
+}
+
+index count(const node_ptr& n) { return n ? n->count : 0; }
+std::size_t bytes(const node_ptr& n) { return n ? n->bytes : 0; }
+std::uint64_t hash(const node_ptr& n) { return n ? n->hash : 0; }
+std::uint64_t power(const node_ptr& n) { return n ? n->power : 1; }
+
+node_ptr make_node(node_ptr left, node_ptr right,
+                   std::uint32_t priority, chunk_t chunk)
+{
+    auto count_ = count(left) + (index)chunk.size() + count(right);
+    auto bytes_ = bytes(left) + bytes(right);
+    auto hash_  = hash(left);
+    auto power_ = power(left);
+    for (auto& e : chunk) {
+        bytes_ += e.size + 1;
+        hash_   = add_mod(mul_mod(hash_, base), e.hash);
+        power_  = mul_mod(power_, base);
+    }
+    hash_  = add_mod(mul_mod(hash_, power(right)), hash(right));
+    power_ = mul_mod(power_, power(right));
+    return std::make_shared<line_index::node>(line_index::node{
+            std::move(left), std::move(right), priority, std::move(chunk),
+            count_, bytes_, hash_, power_});
+}
+
+node_ptr join(const node_ptr& a, const node_ptr& b)
+{
+    if (!a)
+        return b;
+    else if (!b)
+        return a;
+    else if (a->priority > b->priority)
+        return make_node(a->left, join(a->right, b), a->priority, a->chunk);
+    else
+        return make_node(join(a, b->left), b->right, b->priority, b->chunk);
+}
+
+// The result of splitting a tree at a row: the nodes before and after
+// the chunk where the row is, and the chunk itself, that has the row at
+// position `at`.  When splitting at the end, the chunk is empty.
+struct split_result
+{
+    node_ptr left;
+    chunk_t chunk;
+    std::size_t at = 0;
+    node_ptr right;
+};
+
+split_result split(const node_ptr& n, index row)
+{
+    if (!n)
+        return {};
+    auto left_count = count(n->left);
+    if (row < left_count) {
+        auto r  = split(n->left, row);
+        r.right = make_node(r.right, n->right, n->priority, n->chunk);
+        return r;
+    }
+    auto at = std::size_t(row - left_count);
+    if (at < n->chunk.size())
+        return {n->left, n->chunk, at, n->right};
+    auto r = split(n->right, at - n->chunk.size());
+    r.left = make_node(n->left, r.left, n->priority, n->chunk);
+    return r;
+}
+
+// Builds a tree with the chunks of `entries`, in linear time, by making
+// the Cartesian tree of their random priorities.
+node_ptr build(const chunk_t& entries)
+{
+    auto num_chunks = (entries.size() + chunk_size - 1) / chunk_size;
+    auto priorities = std::vector<std::uint32_t>(num_chunks);
+    auto lefts      = std::vector<std::ptrdiff_t>(num_chunks, -1);
+    auto rights     = std::vector<std::ptrdiff_t>(num_chunks, -1);
+    auto stack      = std::vector<std::ptrdiff_t>{};
+    for (auto i = std::ptrdiff_t{}; i < (std::ptrdiff_t)num_chunks; ++i) {
+        priorities[i] = random_priority();
+        auto last = std::ptrdiff_t{-1};
+        while (!stack.empty() && priorities[stack.back()] < priorities[i]) {
+            last = stack.back();
+            stack.pop_back();
+        }
+        lefts[i] = last;
+        if (!stack.empty())
+            rights[stack.back()] = i;
+        stack.push_back(i);
+    }
+
+    auto make = [&] (auto& self, std::ptrdiff_t i) -> node_ptr {
+        if (i < 0)
+            return {};
+        auto first = entries.begin() + i * chunk_size;
+        auto last  = entries.begin() +
+            std::min(entries.size(), (i + 1) * chunk_size);
+        return make_node(self(self, lefts[i]), self(self, rights[i]),
+                         priorities[i], chunk_t(first, last));
+    };
+    return stack.empty() ? node_ptr{} : make(make, stack.front());
+}
+
+void append_entries(chunk_t& entries, const text& lines)
+{
+    immer::for_each(lines, [&] (auto&& ln) {
+        entries.push_back({ln.size(), hash_line(ln)});
+    });
+}
+
+// Appends the entries of the rows `[first, last)` of the tree `n`
+void collect_entries(const node_ptr& n, index first, index last,
+                     chunk_t& entries)
+{
+    if (!n || first >= last)
+        return;
+    auto chunk_first = count(n->left);
+    auto chunk_last  = chunk_first + (index)n->chunk.size();
+    if (first < chunk_first)
+        collect_entries(n->left, first, std::min(last, chunk_first), entries);
+    for (auto row = std::max(first, chunk_first);
+         row < std::min(last, chunk_last); ++row)
+        entries.push_back(n->chunk[row - chunk_first]);
+    if (last > chunk_last)
+        collect_entries(n->right, std::max(first, chunk_last) - chunk_last,
+                        last - chunk_last, entries);
+}
+
+} // anonymous namespace
+
+line_index::line_index(const text& lines)
+{
+    auto entries = chunk_t{};
+    entries.reserve(lines.size());
+    append_entries(entries, lines);
+    root_ = build(entries);
+}
+
+line_index::line_index(const std::vector<entry>& entries)
+    : root_{build(entries)}
+{}
+
+std::vector<line_index::entry> line_index::entries(index first,
+                                                   index last) const
+{
+    auto result = chunk_t{};
+    result.reserve(std::max(last - first, index{}));
+    collect_entries(root_, first, last, result);
+    return result;
+}
+
+index line_index::size() const
+{
+    return count(root_);
+}
+
+std::size_t line_index::bytes() const
+{
+    return ewig::bytes(root_);
+}
+
+std::uint64_t line_index::hash() const
+{
+    return ewig::hash(root_);
+}
+
+std::size_t line_index::offset(index row) const
+{
+    auto result = std::size_t{};
+    for (auto n = root_.get(); n;) {
+        auto left_count = count(n->left);
+        if (row < left_count) {
+            n = n->left.get();
+            continue;
+        }
+        result += ewig::bytes(n->left);
+        row    -= left_count;
+        auto lines = std::min((std::size_t)row, n->chunk.size());
+        for (auto i = std::size_t{}; i < lines; ++i)
+            result += n->chunk[i].size + 1;
+        if (lines < n->chunk.size())
+            break;
+        row -= lines;
+        n = n->right.get();
+    }
+    return result;
+}
+
+index line_index::row(std::size_t pos) const
+{
+    auto result = index{};
+    for (auto n = root_.get(); n;) {
+        auto left_bytes = ewig::bytes(n->left);
+        if (pos < left_bytes) {
+            n = n->left.get();
+            continue;
+        }
+        result += count(n->left);
+        pos    -= left_bytes;
+        for (auto& e : n->chunk) {
+            if (pos <= e.size)
+                return result;
+            pos -= e.size + 1;
+            ++result;
+        }
+        n = n->right.get();
+    }
+    return result;
+}
+
+line_index line_index::splice(index row, index count_,
+                              const text& lines) const
+{
+    // the chunks where the replaced lines begin and end are rebuilt,
+    // together with the new lines, so they do not get fragmented
+    auto first   = split(root_, row);
+    auto entries = chunk_t(first.chunk.begin(),
+                           first.chunk.begin() + first.at);
+    append_entries(entries, lines);
+    auto rest  = first.chunk.size() - first.at;
+    auto right = node_ptr{};
+    if ((std::size_t)count_ < rest) {
+        entries.insert(entries.end(),
+                       first.chunk.begin() + first.at + count_,
+                       first.chunk.end());
+        right = first.right;
+    } else {
+        auto last = split(first.right, count_ - rest);
+        entries.insert(entries.end(),
+                       last.chunk.begin() + last.at,
+                       last.chunk.end());
+        right = last.right;
+    }
+    return join(join(first.left, build(entries)), right);
+}
+
+line_index operator+(const line_index& a, const line_index& b)
+{
+    return join(a.root_, b.root_);
+}
+
+bool operator==(const line_index& a, const line_index& b)
+{
+    return a.root_ == b.root_
+        || (a.size() == b.size()
+            && a.bytes() == b.bytes()
+            && a.hash() == b.hash());
+}
+
+bool operator!=(const line_index& a, const line_index& b)
+{
+    return !(a == b);
+}
+
+index common_prefix(const line_index& a, const line_index& b, index count)
+{
+    auto lo = index{};
+    auto hi = count;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo + 1) / 2;
+        if (a.take(mid) == b.take(mid))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+index common_suffix(const line_index& a, const line_index& b, index count)
+{
+    auto lo = index{};
+    auto hi = count;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo + 1) / 2;
+        if (a.drop(a.size() - mid) == b.drop(b.size() - mid))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+} // namespace ewig
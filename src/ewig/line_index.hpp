@@ -0,0 +1,119 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/line.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ewig {
+
+/**
+ * The byte sizes of the lines of a text, with their sums, in a
+ * persistent balanced tree.  It maps rows to byte offsets and back in
+ * logarithmic time, counting a new line character after every line,
+ * like they are saved.  Every change produces a new index that shares
+ * most of its nodes with the old one.
+ *
+ * The tree also keeps a fingerprint of the contents of the lines: a
+ * polynomial hash of their hashes, that does not depend on the shape of
+ * the tree, so indexes of equal texts compare equal in constant time.
+ * The base of the polynomial is chosen at random when the program
+ * starts, so reordering lines does not make different texts compare
+ * equal but by chance.  The hashes of the lines are not seeded though,
+ * since state files keep them, so texts with different lines that were
+ * made to have the same hash, on purpose, do compare equal.
+ */
+class line_index
+{
+public:
+    /** What the index knows about a line. */
+    struct entry
+    {
+        std::size_t size;
+        std::uint64_t hash;
+    };
+
+    line_index() = default;
+    explicit line_index(const text& lines);
+
+    /**
+     * Returns the index of lines with the given `entries`, as returned
+     * by `entries()`, without having to look at the lines themselves.
+     */
+    explicit line_index(const std::vector<entry>& entries);
+
+    /** Returns the entries of the rows `[first, last)`. */
+    std::vector<entry> entries(index first, index last) const;
+
+    /** Returns the number of lines. */
+    index size() const;
+
+    /** Returns the number of bytes of all the lines. */
+    std::size_t bytes() const;
+
+    /** Returns the byte offset where the line `row` starts. */
+    std::size_t offset(index row) const;
+
+    /**
+     * Returns the line where the byte at offset `pos` is, or `size()`
+     * when it is past the end.
+     */
+    index row(std::size_t pos) const;
+
+    /** Returns the fingerprint of the contents of the lines. */
+    std::uint64_t hash() const;
+
+    /** Returns an index where the `count` lines at `row` are `lines`. */
+    line_index splice(index row, index count, const text& lines) const;
+
+    /** Returns the index without the first `count` lines. */
+    line_index drop(index count) const { return splice(0, count, {}); }
+
+    /** Returns the index of the first `count` lines only. */
+    line_index take(index count) const
+    { return splice(count, size() - count, {}); }
+
+    friend line_index operator+(const line_index& a, const line_index& b);
+    friend bool operator==(const line_index& a, const line_index& b);
+    friend bool operator!=(const line_index& a, const line_index& b);
+
+    struct node;
+
+private:
+    line_index(std::shared_ptr<const node> root) : root_{std::move(root)} {}
+
+    std::shared_ptr<const node> root_;
+};
+
+/**
+ * Returns how many of the first `count` lines of `a` and `b` have the
+ * same contents, bisecting with the fingerprints of their prefixes.
+ */
+index common_prefix(const line_index& a, const line_index& b, index count);
+
+/** Like `common_prefix`, for the last `count` lines. */
+index common_suffix(const line_index& a, const line_index& b, index count);
+
+} // namespace ewig
@@ -20,56 +20,148 @@
 
 #include "ewig/terminal.hpp"
 #include "ewig/draw.hpp"
+#include "ewig/replay.hpp"
+#include "ewig/state_file.hpp"
 
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 namespace ewig {
 namespace {
 
-const auto key_map_emacs = make_key_map(
+// Built when first used, since resolving the commands needs their
+// table, which is initialized in another translation unit
+const key_map& key_map_emacs()
 {
-    {key::seq(key::ctrl('p')), "move-up"},
-    {key::seq(key::up),        "move-up"},
-    {key::seq(key::down),      "move-down"},
-    {key::seq(key::ctrl('n')), "move-down"},
-    {key::seq(key::ctrl('b')), "move-left"},
-    {key::seq(key::left),      "move-left"},
-    {key::seq(key::ctrl('f')), "move-right"},
-    {key::seq(key::right),     "move-right"},
-    {key::seq(key::page_down), "page-down"},
-    {key::seq(key::page_up),   "page-up"},
-    {key::seq(key::backspace), "delete-char"},
-    {key::seq(key::backspace_),"delete-char"},
-    {key::seq(key::delete_),   "delete-char-right"},
-    {key::seq(key::home),      "move-beginning-of-line"},
-    {key::seq(key::ctrl('a')), "move-beginning-of-line"},
-    {key::seq(key::end),       "move-end-of-line"},
-    {key::seq(key::ctrl('e')), "move-end-of-line"},
-    {key::seq(key::ctrl('i')), "insert-tab"}, // tab
-    {key::seq(key::ctrl('j')), "new-line"}, // enter
-    {key::seq(key::ctrl('k')), "kill-line"},
-    {key::seq(key::ctrl('w')), "cut"},
-    {key::seq(key::ctrl('y')), "paste"},
-    {key::seq(key::ctrl('@')), "start-selection"}, // ctrl-space
-    {key::seq(key::ctrl('_')), "undo"},
-    {key::seq(key::ctrl('x'), key::ctrl('C')), "quit"},
-    {key::seq(key::ctrl('x'), key::ctrl('S')), "save"},
-    {key::seq(key::ctrl('x'), 'h'), "select-whole-buffer"},
-    {key::seq(key::ctrl('x'), '['), "move-beginning-buffer"},
-    {key::seq(key::ctrl('x'), ']'), "move-end-buffer"},
-    {key::seq(key::alt('w')),  "copy"},
-});
+    static const auto keys = make_key_map(
+    {
+        {key::seq(key::ctrl('p')), "move-up"},
+        {key::seq(key::up),        "move-up"},
+        {key::seq(key::down),      "move-down"},
+        {key::seq(key::ctrl('n')), "move-down"},
+        {key::seq(key::ctrl('b')), "move-left"},
+        {key::seq(key::left),      "move-left"},
+        {key::seq(key::ctrl('f')), "move-right"},
+        {key::seq(key::right),     "move-right"},
+        {key::seq(key::page_down), "page-down"},
+        {key::seq(key::page_up),   "page-up"},
+        {key::seq(key::backspace), "delete-char"},
+        {key::seq(key::backspace_),"delete-char"},
+        {key::seq(key::delete_),   "delete-char-right"},
+        {key::seq(key::home),      "move-beginning-of-line"},
+        {key::seq(key::ctrl('a')), "move-beginning-of-line"},
+        {key::seq(key::end),       "move-end-of-line"},
+        {key::seq(key::ctrl('e')), "move-end-of-line"},
+        {key::seq(key::ctrl('i')), "insert-tab"}, // tab
+        {key::seq(key::ctrl('j')), "new-line"}, // enter
+        {key::seq(key::ctrl('k')), "kill-line"},
+        {key::seq(key::ctrl('w')), "cut"},
+        {key::seq(key::ctrl('y')), "paste"},
+        {key::seq(key::alt('y')),  "yank-pop"},
+        {key::seq(key::ctrl('@')), "start-selection"}, // ctrl-space
+        {key::seq(key::ctrl('_')), "undo"},
+        {key::seq(key::ctrl('x'), key::ctrl('C')), "quit"},
+        {key::seq(key::ctrl('x'), key::ctrl('S')), "save"},
+        {key::seq(key::ctrl('x'), key::ctrl('F')), "find-file"},
+        {key::seq(key::ctrl('x'), key::ctrl('B')), "list-buffers"},
+        {key::seq(key::ctrl('x'), 'b'), "switch-to-buffer"},
+        {key::seq(key::ctrl('x'), 'k'), "kill-buffer"},
+        {key::seq(key::ctrl('x'), key::right), "next-buffer"},
+        {key::seq(key::ctrl('x'), key::left), "previous-buffer"},
+        {key::seq(key::ctrl('x'), key::up), "add-cursor-above"},
+        {key::seq(key::ctrl('x'), key::down), "add-cursor-below"},
+        {key::seq(key::ctrl('x'), 'l'), "add-cursors-to-lines"},
+        {key::seq(key::ctrl('x'), 't'), "follow-mode"},
+        {key::seq(key::ctrl('x'), 'd'), "toggle-debug"},
+        {key::seq(key::ctrl('x'), 'p'), "profile-report"},
+        {key::seq(key::ctrl('x'), 'P'), "toggle-profile"},
+        {key::seq(key::ctrl('x'), 'c'), "toggle-cold-storage"},
+        {key::seq(key::ctrl('x'), 'a'), "toggle-auto-revert"},
+        {key::seq(key::ctrl('x'), 'h'), "select-whole-buffer"},
+        {key::seq(key::ctrl('x'), key::ctrl('i')), "indent-region"},
+        {key::seq(key::ctrl('x'), 'w'), "strip-trailing-whitespace"},
+        {key::seq(key::ctrl('x'), 'U'), "untabify"},
+        {key::seq(key::alt('%')), "replace-string"},
+        {key::seq(key::ctrl('x'), '['), "move-beginning-buffer"},
+        {key::seq(key::ctrl('x'), ']'), "move-end-buffer"},
+        {key::seq(key::alt('w')),  "copy"},
+        {key::seq(key::alt('g'), 'g'), "goto-line"},
+        {key::seq(key::alt('g'), 'c'), "goto-byte"},
+        {key::seq(key::ctrl('s')), "isearch-forward"},
+        {key::seq(key::ctrl('r')), "isearch-backward"},
+        {key::seq(key::ctrl('['), key::ctrl('s')), "isearch-forward-regexp"},
+        {key::seq(key::ctrl('['), key::ctrl('r')), "isearch-backward-regexp"},
+    }, find_command);
+    return keys;
+}
+
+constexpr auto max_frames_per_second = 60;
 
-void run(const std::string& fname)
+// The first file is shown, the others are loaded in the background.
+// When `record` is given, the input is written there as a session.
+// When `state` is given, the buffers are restored from it, when it
+// exists, and saved there when quitting.
+void run(const std::vector<std::string>& fnames,
+         const std::string& record,
+         const std::string& state)
 {
+    profile::start_from_environment();
     auto serv = boost::asio::io_service{};
+    auto pool = executor{};
+    auto io   = io_scheduler{pool};
     auto term = terminal{serv};
     auto quit = [&] { term.stop(); };
-    auto init = application{term.size(), key_map_emacs};
-    auto st   = store<application, action>{serv, init, update, draw, quit};
-    term.start([&] (auto ev) { st.dispatch (ev); });
-    st.dispatch(command_action{"load", fname});
+    auto init = application{term.size(), key_map_emacs()};
+    if (auto budget = std::getenv("EWIG_KILL_RING_BYTES"))
+        init.clipboard.budget = std::strtoull(budget, nullptr, 10);
+    auto restored = false;
+    auto reload   = effect<action>{noop};
+    if (!state.empty() && stamp_file(state)) {
+        try {
+            std::tie(init, reload) = restore_state(pool, state, init);
+            restored = true;
+        } catch (const std::exception& err) {
+            init = put_message(
+                init, std::string{"state not restored: "} + err.what());
+        }
+    }
+    auto st   = store<application, action>{
+        serv, pool, io, init, update, draw, quit};
+    st.batch(std::chrono::milliseconds{1000 / max_frames_per_second});
+    reload(st);
+    auto session = std::ofstream{};
+    if (!record.empty()) {
+        session.open(record);
+        record_action(session, resize_action{init.window_size});
+    }
+    term.start([&] (auto ev) {
+        if (session.is_open())
+            record_action(session, ev);
+        st.dispatch (ev);
+    });
+    // the restored buffers are kept, and the first file shown among them
+    if (!fnames.empty())
+        st.dispatch(command_action{restored ? "find-file" : "load",
+                                   fnames.front()});
+    for (auto& fname : fnames)
+        if (&fname != &fnames.front())
+            st.dispatch(command_action{"open", fname});
+    if (std::getenv("EWIG_COLD_STORAGE"))
+        st.dispatch(command_action{"toggle-cold-storage"});
+    if (std::getenv("EWIG_AUTO_REVERT"))
+        st.dispatch(command_action{"toggle-auto-revert"});
     serv.run();
+    profile::write_trace();
+    if (!state.empty()) {
+        try {
+            save_state(state, st.current());
+        } catch (const std::exception& err) {
+            std::cerr << "can't save the state: " << err.what() << std::endl;
+        }
+    }
 }
 
 } // anonymous
@@ -80,11 +172,42 @@ int main(int argc, char* argv[])
     std::locale::global(std::locale(""));
     ::setlocale(LC_ALL, "");
 
-    if (argc != 2) {
+    auto fnames = std::vector<std::string>{};
+    auto record = std::string{};
+    auto replay = std::string{};
+    auto state  = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg == "--record" && i + 1 < argc)
+            record = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc)
+            replay = argv[++i];
+        else if (arg == "--state" && i + 1 < argc)
+            state = argv[++i];
+        else
+            fnames.push_back(arg);
+    }
+
+    if (!replay.empty()) {
+        try {
+            auto file = std::ifstream{replay};
+            if (!file)
+                throw std::runtime_error{"can not open " + replay};
+            std::cout << ewig::replay(ewig::read_session(file), fnames,
+                                      ewig::key_map_emacs())
+                      << std::endl;
+        } catch (const std::exception& err) {
+            std::cerr << err.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (fnames.empty() && state.empty()) {
         std::cerr << "give me a file name" << std::endl;
         return 1;
     }
 
-    ewig::run(argv[1]);
+    ewig::run(fnames, record, state);
     return 0;
 }
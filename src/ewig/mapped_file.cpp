@@ -0,0 +1,313 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/mapped_file.hpp"
+
+#include <cstring>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+extern "C" {
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+namespace ewig {
+
+namespace {
+
+std::system_error errno_error(const std::string& what)
+{
+    return {errno, std::system_category(), what};
+}
+
+file_stamp to_stamp(const struct stat& st)
+{
+    return {
+        std::uint64_t(st.st_dev),
+        std::uint64_t(st.st_ino),
+        std::uint64_t(st.st_size),
+        std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec
+    };
+}
+
+#ifdef __linux__
+
+// Where the signal handler writes the files whose leases are broken
+int lease_pipe = -1;
+
+void lease_broken(int, siginfo_t* info, void*)
+{
+    auto saved = errno;
+    auto fd    = info->si_fd;
+    if (::write(lease_pipe, &fd, sizeof(fd)) < 0) {}
+    errno = saved;
+}
+
+#endif // __linux__
+
+} // anonymous
+
+#ifdef __linux__
+
+// Copies the pages of the pinned files whose leases are broken, and
+// then releases them.  This happens in a thread of its own, since the
+// signal that tells about it can only write to a pipe.  Meanwhile, the
+// process that wants to write the file waits, up to the time in
+// `/proc/sys/fs/lease-break-time`.
+struct lease_keeper
+{
+    static lease_keeper& get()
+    {
+        // never destroyed, the thread is still waiting at exit
+        static auto keeper = new lease_keeper{};
+        return *keeper;
+    }
+
+    // Takes a lease on `fd` to map it as `file`.  Returns false when it
+    // can not be pinned.
+    bool pin(mapped_file& file, int fd)
+    {
+        if (lease_pipe < 0)
+            return false;
+        // a broken lease is not looked at until it is mapped
+        auto lock = std::lock_guard<std::mutex>{mutex_};
+        if (::fcntl(fd, F_SETSIG, SIGRTMIN) < 0 ||
+            ::fcntl(fd, F_SETLEASE, F_RDLCK) < 0)
+            return false;
+        // the stamp is only known for sure once it is pinned
+        struct stat st;
+        auto addr = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+            addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::fcntl(fd, F_SETLEASE, F_UNLCK);
+            return false;
+        }
+        ::madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        file.data_  = static_cast<const char*>(addr);
+        file.size_  = st.st_size;
+        file.stamp_ = to_stamp(st);
+        file.fd_    = fd;
+        files_[fd]  = &file;
+        return true;
+    }
+
+    void unpin(mapped_file& file)
+    {
+        auto lock = std::lock_guard<std::mutex>{mutex_};
+        if (file.fd_ >= 0) {
+            files_.erase(file.fd_);
+            release(file);
+        }
+    }
+
+private:
+    lease_keeper()
+    {
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) < 0)
+            return;
+        // the signal handler must never block
+        ::fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        read_end_  = fds[0];
+        lease_pipe = fds[1];
+        struct sigaction action = {};
+        action.sa_sigaction = &lease_broken;
+        action.sa_flags     = SA_SIGINFO | SA_RESTART;
+        ::sigemptyset(&action.sa_mask);
+        if (::sigaction(SIGRTMIN, &action, nullptr) < 0) {
+            lease_pipe = -1;
+            return;
+        }
+        std::thread{[this] { run(); }}.detach();
+    }
+
+    void run()
+    {
+        auto fd = int{};
+        while (true) {
+            auto r = ::read(read_end_, &fd, sizeof(fd));
+            if (r < 0 && errno == EINTR)
+                continue;
+            else if (r != sizeof(fd))
+                return;
+            auto lock = std::lock_guard<std::mutex>{mutex_};
+            auto it   = files_.find(fd);
+            if (it != files_.end()) {
+                it->second->detach_();
+                release(*it->second);
+                files_.erase(it);
+            }
+        }
+    }
+
+    static void release(mapped_file& file)
+    {
+        ::fcntl(file.fd_, F_SETLEASE, F_UNLCK);
+        ::close(file.fd_);
+        file.fd_ = -1;
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<int, mapped_file*> files_;
+    int read_end_ = -1;
+};
+
+#endif // __linux__
+
+bool operator==(const file_stamp& a, const file_stamp& b)
+{
+    return a.device == b.device
+        && a.inode == b.inode
+        && a.size == b.size
+        && a.mtime == b.mtime;
+}
+
+bool operator!=(const file_stamp& a, const file_stamp& b)
+{
+    return !(a == b);
+}
+
+std::optional<file_stamp> stamp_file(const std::string& fname)
+{
+    struct stat st;
+    if (::stat(fname.c_str(), &st) < 0)
+        return std::nullopt;
+    return to_stamp(st);
+}
+
+std::optional<file_stamp> stamp_file(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+        return std::nullopt;
+    return to_stamp(st);
+}
+
+mapped_file::mapped_file(const std::string& fname)
+    : name_{fname}
+{
+    // check before opening, opening special files like pipes may
+    // block or consume their input
+    struct stat st;
+    if (::stat(fname.c_str(), &st) < 0)
+        throw errno_error("can't stat: " + fname);
+    if (!S_ISREG(st.st_mode))
+        throw std::system_error{std::make_error_code(std::errc::not_supported),
+                                "not a regular file: " + fname};
+    auto fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw errno_error("can't open: " + fname);
+#ifdef __linux__
+    if (lease_keeper::get().pin(*this, fd))
+        return;
+#endif
+    try {
+        read_(fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+mapped_file::~mapped_file()
+{
+#ifdef __linux__
+    lease_keeper::get().unpin(*this);
+#endif
+    if (data_)
+        ::munmap(const_cast<char*>(data_), size_);
+}
+
+// Reads the whole file in private memory.  The stamp is taken first,
+// so the changes that happen while reading are noticed later.
+void mapped_file::read_(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+        throw errno_error("can't stat: " + name_);
+    size_  = st.st_size;
+    stamp_ = to_stamp(st);
+    if (size_ == 0)
+        return;
+    auto addr = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        throw errno_error("can't read: " + name_);
+    auto data = static_cast<char*>(addr);
+    auto done = std::size_t{};
+    while (done < size_) {
+        auto r = ::pread(fd, data + done, size_ - done, done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            auto err = r < 0
+                ? errno_error("can't read: " + name_)
+                : std::system_error{std::make_error_code(std::errc::io_error),
+                                    "file got shorter: " + name_};
+            ::munmap(addr, size_);
+            throw err;
+        }
+        done += r;
+    }
+    ::mprotect(addr, size_, PROT_READ);
+    data_ = data;
+    in_memory_ = true;
+}
+
+#ifdef __linux__
+
+// Copies the mapping into private memory, that takes its place at the
+// same address, so it does not see the changes to the file anymore.
+// Writing to the pages of a private mapping of the file would copy
+// them too, but those are still dropped when the file is truncated.
+void mapped_file::detach_()
+{
+    if (!data_)
+        return;
+    auto copy = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // without memory for the copy, it sees the changes anyway
+    if (copy == MAP_FAILED)
+        return;
+    std::memcpy(copy, data_, size_);
+    ::mprotect(copy, size_, PROT_READ);
+    if (::mremap(copy, size_, size_, MREMAP_MAYMOVE | MREMAP_FIXED,
+                 const_cast<char*>(data_)) == MAP_FAILED)
+        ::munmap(copy, size_);
+    else
+        in_memory_ = true;
+}
+
+#endif // __linux__
+
+std::shared_ptr<const mapped_file> map_file(const std::string& fname)
+{
+    return std::make_shared<const mapped_file>(fname);
+}
+
+} // namespace ewig
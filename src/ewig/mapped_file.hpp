@@ -0,0 +1,112 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace ewig {
+
+/**
+ * What tells the versions of a file apart: a file is taken to have
+ * changed when it was replaced, or when its size or its modification
+ * time are not the same anymore.
+ */
+struct file_stamp
+{
+    std::uint64_t device = 0;
+    std::uint64_t inode  = 0;
+    std::uint64_t size   = 0;
+    std::int64_t mtime   = 0; //< in nanoseconds
+};
+
+bool operator==(const file_stamp& a, const file_stamp& b);
+bool operator!=(const file_stamp& a, const file_stamp& b);
+
+/** Returns the stamp of `fname`, or nothing when it can not be stat'ed. */
+std::optional<file_stamp> stamp_file(const std::string& fname);
+
+/** Returns the stamp of the open file `fd`, or nothing on error. */
+std::optional<file_stamp> stamp_file(int fd);
+
+/**
+ * The contents of a whole regular file, as they were when it was
+ * opened, which never change after that.  Use `map_file` to obtain a
+ * shared handle, the memory is released when the last reference to it
+ * goes away.
+ *
+ * The file is memory mapped only while it can be *pinned*, by a lease
+ * that makes the kernel tell us before anybody else opens it for
+ * writing or truncates it.  Then, the pages are copied into private
+ * memory before the lease is released, so the other process goes on
+ * and the mapping still sees what was there.  When the file can not
+ * be pinned, because it is open for writing already or because it is
+ * not ours, it is read into memory instead.  Note that leases only
+ * protect the file from the processes in this machine.
+ */
+struct mapped_file
+{
+    explicit mapped_file(const std::string& fname);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    // Whether the bytes are in our own memory, because the file was
+    // read or could not stay pinned, rather than in the page cache
+    bool in_memory() const { return in_memory_; }
+
+    const std::string& name() const { return name_; }
+    // The version of the file that was mapped
+    const file_stamp& stamp() const { return stamp_; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+private:
+    friend struct lease_keeper;
+
+    void read_(int fd);
+    void detach_();
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::string name_;
+    file_stamp stamp_;
+    std::atomic<bool> in_memory_{false};
+    // the file holding the lease, while it is pinned
+    int fd_ = -1;
+};
+
+/**
+ * Maps or reads the file `fname` in memory.  Throws `std::system_error`
+ * when the file can not be opened, or when it is not a regular file and
+ * thus can not be mapped.
+ */
+std::shared_ptr<const mapped_file> map_file(const std::string& fname);
+
+} // namespace ewig
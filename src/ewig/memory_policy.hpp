@@ -0,0 +1,73 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <immer/memory_policy.hpp>
+
+#include <cstddef>
+
+namespace ewig {
+
+/**
+ * Memory policies for the immer containers, chosen when building with
+ * the `EWIG_MEMORY_POLICY` CMake option:
+ *
+ *   - `default` uses the immer defaults, thread-safe everywhere.
+ *
+ *   - `pooled` keeps bigger free lists of nodes, such that typing and
+ *     undoing recycle the nodes of the lines most of the time.  Data
+ *     that never leaves the UI thread, like key sequences or messages,
+ *     uses free lists without synchronization and non-atomic reference
+ *     counts.
+ *
+ *   - `plain` allocates every node from the heap, which is mostly
+ *     useful to compare the others against.
+ */
+namespace memory {
+
+constexpr auto pool_size = std::size_t{1} << 14;
+
+using plain = immer::memory_policy<
+    immer::heap_policy<immer::cpp_heap>,
+    immer::refcount_policy>;
+
+using pooled = immer::memory_policy<
+    immer::free_list_heap_policy<immer::cpp_heap, pool_size>,
+    immer::refcount_policy>;
+
+using unsafe_pooled = immer::memory_policy<
+    immer::unsafe_free_list_heap_policy<immer::cpp_heap, pool_size>,
+    immer::unsafe_refcount_policy>;
+
+} // namespace memory
+
+#if defined(EWIG_MEMORY_POLICY_POOLED)
+using memory_policy    = memory::pooled;
+using ui_memory_policy = memory::unsafe_pooled;
+#elif defined(EWIG_MEMORY_POLICY_PLAIN)
+using memory_policy    = memory::plain;
+using ui_memory_policy = memory::plain;
+#else
+using memory_policy    = immer::default_memory_policy;
+using ui_memory_policy = immer::default_memory_policy;
+#endif
+
+} // namespace ewig
@@ -0,0 +1,154 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/packed_block.hpp"
+
+#include <immer/flex_vector_transient.hpp>
+
+#include <zlib.h>
+
+#include <deque>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+namespace ewig {
+
+namespace {
+
+// The blocks that were decompressed most recently, the oldest first
+struct thawed_cache
+{
+    std::mutex mutex;
+    std::deque<std::pair<std::shared_ptr<const char>, std::size_t>> blocks;
+    std::size_t bytes = 0;
+
+    void keep(std::shared_ptr<const char> data, std::size_t size)
+    {
+        auto lock = std::lock_guard<std::mutex>{mutex};
+        blocks.push_back({std::move(data), size});
+        bytes += size;
+        while (bytes > thawed_cache_bytes && blocks.size() > 1) {
+            bytes -= blocks.front().second;
+            blocks.pop_front();
+        }
+    }
+};
+
+thawed_cache& recently_thawed()
+{
+    static auto cache = thawed_cache{};
+    return cache;
+}
+
+} // anonymous namespace
+
+packed_block::packed_block(const char* first, const char* last)
+    : size_{std::size_t(last - first)}
+{
+    auto size = compressBound(size_);
+    compressed_.resize(size);
+    auto err = compress2(reinterpret_cast<Bytef*>(compressed_.data()), &size,
+                         reinterpret_cast<const Bytef*>(first), size_,
+                         Z_BEST_SPEED);
+    if (err != Z_OK)
+        throw std::bad_alloc{};
+    compressed_.resize(size);
+    compressed_.shrink_to_fit();
+}
+
+std::shared_ptr<const char> packed_block::thaw() const
+{
+    auto lock = std::lock_guard<std::mutex>{mutex_};
+    if (auto data = thawed_.lock())
+        return data;
+    auto data = std::shared_ptr<char>{new char[size_],
+                                      std::default_delete<char[]>{}};
+    auto size = uLongf{size_};
+    auto err  = uncompress(reinterpret_cast<Bytef*>(data.get()), &size,
+                           reinterpret_cast<const Bytef*>(compressed_.data()),
+                           compressed_.size());
+    if (err != Z_OK || size != size_)
+        throw std::runtime_error{"corrupt packed lines"};
+    thawed_ = data;
+    recently_thawed().keep(data, size_);
+    return data;
+}
+
+namespace {
+
+// The bytes of views are in the page cache, not in our memory, unless
+// their file had to be copied
+bool packable(const line& ln)
+{
+    return !ln.empty() && !ln.is_packed()
+        && (!ln.is_view() || ln.viewed_file()->in_memory());
+}
+
+} // anonymous namespace
+
+text pack_lines(const text& lines)
+{
+    // the lines are pushed once the block where they go is done
+    auto result  = text{}.transient();
+    auto pending = std::vector<std::pair<line, std::size_t>>{};
+    auto bytes   = std::string{};
+    auto packed  = false;
+    auto flush   = [&] {
+        auto block = bytes.empty()
+            ? nullptr
+            : std::make_shared<const packed_block>(
+                bytes.data(), bytes.data() + bytes.size());
+        for (auto& [ln, offset] : pending) {
+            result.push_back(offset == std::string::npos
+                             ? std::move(ln)
+                             : ln.pack(block, offset));
+        }
+        pending.clear();
+        bytes.clear();
+    };
+    immer::for_each(lines, [&] (auto&& ln) {
+        if (!packable(ln)) {
+            pending.push_back({ln, std::string::npos});
+        } else {
+            pending.push_back({ln, bytes.size()});
+            ln.for_each_chunk([&] (auto first, auto last) {
+                bytes.append(first, last);
+            });
+            packed = true;
+            if (bytes.size() >= packed_block_bytes)
+                flush();
+        }
+    });
+    flush();
+    return packed ? result.persistent() : lines;
+}
+
+std::size_t owned_bytes(const text& lines)
+{
+    auto bytes = std::size_t{};
+    immer::for_each(lines, [&] (auto&& ln) {
+        if (packable(ln))
+            bytes += ln.size();
+    });
+    return bytes;
+}
+
+} // namespace ewig
@@ -0,0 +1,81 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/line.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ewig {
+
+/**
+ * The bytes of some consecutive lines, compressed with zlib.  They are
+ * decompressed when read, and the blocks that were read most recently
+ * are kept decompressed, up to `thawed_cache_bytes` for all of them.
+ */
+class packed_block
+{
+public:
+    /** Compresses the bytes in `[first, last)`. */
+    packed_block(const char* first, const char* last);
+
+    packed_block(const packed_block&) = delete;
+    packed_block& operator=(const packed_block&) = delete;
+
+    std::size_t size() const { return size_; }
+    std::size_t compressed_size() const { return compressed_.size(); }
+
+    /**
+     * Returns the decompressed bytes, which stay valid while the result
+     * is kept.  It is thread-safe.
+     */
+    std::shared_ptr<const char> thaw() const;
+
+private:
+    std::vector<char> compressed_;
+    std::size_t size_;
+    mutable std::mutex mutex_;
+    mutable std::weak_ptr<const char> thawed_;
+};
+
+constexpr auto packed_block_bytes = std::size_t{1} << 16;
+constexpr auto thawed_cache_bytes = std::size_t{1} << 24;
+
+/**
+ * Returns `lines` with the lines that keep their bytes in our memory
+ * packed, in blocks of about `packed_block_bytes`, keeping their
+ * metadata.  Those are the lines that own their bytes, and the views of
+ * files that were read in memory, or copied there when they could not
+ * stay pinned.  The views of mapped files are kept as they are, since
+ * the kernel can drop their pages and read them again from the file,
+ * so they cost little memory already.  So are packed lines, and so is
+ * `lines` when there is nothing to pack.  Note that the memory of a
+ * file is only released once none of its lines views it anymore.
+ */
+text pack_lines(const text& lines);
+
+/** Returns the bytes of the lines in `lines` that `pack_lines` packs. */
+std::size_t owned_bytes(const text& lines);
+
+} // namespace ewig
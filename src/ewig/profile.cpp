@@ -0,0 +1,399 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/profile.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ewig {
+namespace profile {
+
+std::atomic<bool> detail::running{false};
+
+namespace {
+
+// The histograms have four buckets per power of two nanoseconds, such
+// that the percentiles are within 25% of the actual values
+constexpr auto sub_buckets = 4;
+constexpr auto num_buckets = 4 * 42;
+
+std::size_t bucket(std::uint64_t ns)
+{
+    if (ns < sub_buckets)
+        return ns;
+    auto e   = 63 - __builtin_clzll(ns);
+    auto sub = (ns >> (e - 2)) & (sub_buckets - 1);
+    return std::min<std::size_t>(sub_buckets * (e - 1) + sub,
+                                 num_buckets - 1);
+}
+
+// The biggest duration of the bucket `b`
+std::uint64_t bucket_limit(std::size_t b)
+{
+    if (b < sub_buckets)
+        return b;
+    auto e   = b / sub_buckets + 1;
+    auto sub = b % sub_buckets;
+    return ((sub_buckets + sub + 1) << (e - 2)) - 1;
+}
+
+struct stats
+{
+    std::array<std::uint64_t, num_buckets> buckets = {};
+    std::uint64_t count = 0;
+    std::uint64_t total = 0;
+    std::uint64_t max   = 0;
+
+    stats& operator+=(const stats& other)
+    {
+        for (auto b = std::size_t{}; b < num_buckets; ++b)
+            buckets[b] += other.buckets[b];
+        count += other.count;
+        total += other.total;
+        max    = std::max(max, other.max);
+        return *this;
+    }
+};
+
+struct event
+{
+    std::uint32_t tag;
+    clock_t::time_point first;
+    clock_t::duration duration;
+};
+
+// What a thread records.  Only that thread writes into it, so the lock
+// is only waited for while a report or a trace is being written
+struct thread_buffer
+{
+    std::mutex mutex;
+    std::vector<stats> by_tag;
+    std::vector<event> events;
+    int thread;
+};
+
+// The names of the tags, which are never forgotten, such that the ids
+// kept in static variables stay valid.  The deque does not move them
+// when growing, so they can be read without the lock through pointers
+// taken with it
+struct tag_names
+{
+    std::mutex mutex;
+    std::deque<std::pair<std::string, std::string>> all;
+    std::unordered_map<std::string, std::uint32_t> index;
+};
+
+struct profiler
+{
+    std::mutex mutex;
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    std::string trace_path;
+    std::atomic<bool> tracing{false};
+    std::atomic<std::size_t> trace_events{0};
+    std::atomic<std::size_t> dropped_events{0};
+    clock_t::time_point epoch = clock_t::now();
+};
+
+tag_names& the_tag_names()
+{
+    static auto n = tag_names{};
+    return n;
+}
+
+profiler& the_profiler()
+{
+    static auto p = profiler{};
+    return p;
+}
+
+// The buffer of the current thread, made on the first timing.  The
+// profiler shares it, so that it outlives the thread
+thread_buffer& local_buffer()
+{
+    static auto next = std::atomic<int>{0};
+    thread_local auto buffer = [] {
+        auto b    = std::make_shared<thread_buffer>();
+        b->thread = next++;
+        auto& p   = the_profiler();
+        auto lock = std::lock_guard<std::mutex>{p.mutex};
+        p.buffers.push_back(b);
+        return b;
+    }();
+    return *buffer;
+}
+
+double to_usecs(std::uint64_t ns) { return ns / 1000.0; }
+
+// The duration under which there are `q` of the timings
+std::uint64_t percentile(const stats& s, double q)
+{
+    auto target = std::uint64_t(q * s.count);
+    auto seen   = std::uint64_t{};
+    for (auto b = std::size_t{}; b < num_buckets; ++b) {
+        seen += s.buckets[b];
+        if (seen > target)
+            return std::min(bucket_limit(b), s.max);
+    }
+    return s.max;
+}
+
+void write_escaped(std::ostream& os, const std::string& str)
+{
+    for (auto c : str) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if ((unsigned char) c < 0x20)
+            os << ' ';
+        else
+            os << c;
+    }
+}
+
+} // anonymous namespace
+
+void start()
+{
+    detail::running = true;
+}
+
+void stop()
+{
+    detail::running = false;
+}
+
+void reset()
+{
+    auto& p   = the_profiler();
+    auto lock = std::lock_guard<std::mutex>{p.mutex};
+    for (auto& b : p.buffers) {
+        auto buffer_lock = std::lock_guard<std::mutex>{b->mutex};
+        b->by_tag.clear();
+        b->events.clear();
+    }
+    p.trace_events   = 0;
+    p.dropped_events = 0;
+}
+
+tag::tag(std::string_view phase, std::string_view name)
+{
+    auto key = std::string{phase};
+    key += '\0';
+    key += name;
+
+    auto& n   = the_tag_names();
+    auto lock = std::lock_guard<std::mutex>{n.mutex};
+    auto it   = n.index.find(key);
+    if (it == n.index.end()) {
+        it = n.index.emplace(std::move(key), n.all.size()).first;
+        n.all.emplace_back(std::string{phase}, std::string{name});
+    }
+    id_ = it->second;
+}
+
+tag find_tag(std::string_view phase, std::string_view name)
+{
+    // The names come mostly from literals and long lived tables, so
+    // where they are stored tells well which tag they are, but that
+    // has to be checked against the names themselves
+    struct entry
+    {
+        const char* phase = nullptr;
+        const char* name  = nullptr;
+        const std::pair<std::string, std::string>* names = nullptr;
+        std::uint32_t id  = 0;
+    };
+    constexpr auto cache_size = std::size_t{64};
+    thread_local auto cache = std::array<entry, cache_size>{};
+
+    auto slot = (reinterpret_cast<std::uintptr_t>(phase.data()) * 31
+                 + reinterpret_cast<std::uintptr_t>(name.data()))
+        % cache_size;
+    auto& e = cache[slot];
+    if (e.phase == phase.data() && e.name == name.data()
+        && e.names->first == phase && e.names->second == name)
+        return tag{e.id};
+    auto result = tag{phase, name};
+    auto& n     = the_tag_names();
+    auto lock   = std::lock_guard<std::mutex>{n.mutex};
+    e = {phase.data(), name.data(), &n.all[result.id()], result.id()};
+    return result;
+}
+
+void record(tag what, clock_t::time_point first, clock_t::time_point last)
+{
+    auto duration = last - first;
+    auto ns   = (std::uint64_t) std::max<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            duration).count(), 0);
+
+    auto& b   = local_buffer();
+    auto lock = std::lock_guard<std::mutex>{b.mutex};
+    if (b.by_tag.size() <= what.id())
+        b.by_tag.resize(what.id() + 1);
+    auto& s = b.by_tag[what.id()];
+    s.buckets[bucket(ns)]++;
+    s.count++;
+    s.total += ns;
+    s.max    = std::max(s.max, ns);
+
+    auto& p = the_profiler();
+    if (p.tracing.load(std::memory_order_relaxed)) {
+        if (p.trace_events.fetch_add(1, std::memory_order_relaxed)
+            < max_trace_events)
+            b.events.push_back({what.id(), first, duration});
+        else
+            p.dropped_events.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void record(std::string_view phase, std::string_view name,
+            clock_t::time_point first, clock_t::time_point last)
+{
+    record(find_tag(phase, name), first, last);
+}
+
+std::string report()
+{
+    auto totals = std::vector<stats>{};
+    auto& p = the_profiler();
+    {
+        auto lock = std::lock_guard<std::mutex>{p.mutex};
+        for (auto& b : p.buffers) {
+            auto buffer_lock = std::lock_guard<std::mutex>{b->mutex};
+            if (totals.size() < b->by_tag.size())
+                totals.resize(b->by_tag.size());
+            for (auto i = std::size_t{}; i < b->by_tag.size(); ++i)
+                totals[i] += b->by_tag[i];
+        }
+    }
+    auto rows = std::vector<std::uint32_t>{};
+    for (auto i = std::uint32_t{}; i < totals.size(); ++i)
+        if (totals[i].count > 0)
+            rows.push_back(i);
+    std::sort(rows.begin(), rows.end(), [&] (auto a, auto b) {
+        return totals[a].total > totals[b].total;
+    });
+
+    auto& names = the_tag_names();
+    auto names_lock = std::lock_guard<std::mutex>{names.mutex};
+    auto result = std::string{};
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "%-8s %-24s %8s %10s %10s %10s %10s %10s\n",
+                  "phase", "name", "count", "mean", "p50", "p90", "p99",
+                  "max");
+    result += line;
+    for (auto id : rows) {
+        auto& s = totals[id];
+        auto& n = names.all[id];
+        std::snprintf(line, sizeof(line),
+                      "%-8s %-24s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                      n.first.c_str(), n.second.c_str(),
+                      (unsigned long long) s.count,
+                      to_usecs(s.total / s.count),
+                      to_usecs(percentile(s, 0.5)),
+                      to_usecs(percentile(s, 0.9)),
+                      to_usecs(percentile(s, 0.99)),
+                      to_usecs(s.max));
+        result += line;
+    }
+    result += "(times in microseconds)";
+    if (auto dropped = p.dropped_events.load(); dropped > 0)
+        result += "\n(the trace is full, "
+            + std::to_string(dropped) + " events were dropped)";
+    return result;
+}
+
+void start_trace(std::string path)
+{
+    auto& p = the_profiler();
+    {
+        auto lock = std::lock_guard<std::mutex>{p.mutex};
+        p.trace_path = std::move(path);
+    }
+    p.tracing = true;
+    start();
+}
+
+void write_trace()
+{
+    struct thread_event
+    {
+        event ev;
+        int thread;
+    };
+    auto& p   = the_profiler();
+    if (!p.tracing)
+        return;
+    auto lock   = std::lock_guard<std::mutex>{p.mutex};
+    auto events = std::vector<thread_event>{};
+    for (auto& b : p.buffers) {
+        auto buffer_lock = std::lock_guard<std::mutex>{b->mutex};
+        for (auto& ev : b->events)
+            events.push_back({ev, b->thread});
+    }
+    std::stable_sort(events.begin(), events.end(), [] (auto& a, auto& b) {
+        return a.ev.first < b.ev.first;
+    });
+
+    auto& names = the_tag_names();
+    auto names_lock = std::lock_guard<std::mutex>{names.mutex};
+    auto os = std::ofstream{p.trace_path};
+    os << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    auto first = true;
+    for (auto& [ev, thread] : events) {
+        auto& n  = names.all[ev.tag];
+        auto ts  = std::chrono::duration<double, std::micro>(
+            ev.first - p.epoch).count();
+        auto dur = std::chrono::duration<double, std::micro>(
+            ev.duration).count();
+        os << (first ? "\n" : ",\n") << "{\"name\":\"";
+        write_escaped(os, n.second);
+        os << "\",\"cat\":\"";
+        write_escaped(os, n.first);
+        os << "\",\"ph\":\"X\",\"ts\":" << ts
+           << ",\"dur\":" << dur
+           << ",\"pid\":1,\"tid\":" << thread << "}";
+        first = false;
+    }
+    os << "\n]}\n";
+}
+
+void start_from_environment()
+{
+    if (auto path = std::getenv("EWIG_TRACE"); path && *path)
+        start_trace(path);
+    else if (auto flag = std::getenv("EWIG_PROFILE"); flag && *flag)
+        start();
+}
+
+} // namespace profile
+} // namespace ewig
@@ -0,0 +1,171 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace ewig {
+
+/**
+ * Timings of the phases of the work done by the editor, collected in
+ * latency histograms.  Each timing has a `phase`, like "reduce" or
+ * "view", and a `name` telling what was done, like the command called.
+ * Nothing is measured while the profiler is stopped, when the only cost
+ * of a `profile::scope` is checking whether it is running.
+ *
+ * Every thread records in its own buffers, so threads do not wait for
+ * each other, and the pairs of phase and name are interned once as a
+ * `tag`, so recording does not build or hash strings either.
+ *
+ * When tracing too, every timing is also kept, to be written as a
+ * trace in the Chrome trace event format, that `chrome://tracing` and
+ * similar viewers can open.
+ */
+namespace profile {
+
+using clock_t = std::chrono::steady_clock;
+
+namespace detail {
+extern std::atomic<bool> running;
+} // namespace detail
+
+/** Returns whether the timings are being recorded. */
+inline bool enabled()
+{
+    return detail::running.load(std::memory_order_relaxed);
+}
+
+void start();
+void stop();
+
+/** Forgets everything recorded so far. */
+void reset();
+
+/**
+ * A phase and a name, interned, such that recording their timings is
+ * cheap.  Interning takes a lock, so tags are best made once, in a
+ * static variable.
+ */
+class tag
+{
+public:
+    tag(std::string_view phase, std::string_view name);
+
+    std::uint32_t id() const { return id_; }
+
+private:
+    friend tag find_tag(std::string_view phase, std::string_view name);
+    explicit tag(std::uint32_t id) : id_{id} {}
+
+    std::uint32_t id_;
+};
+
+/**
+ * Returns the tag of `phase` and `name`, looking it up first among the
+ * ones that the calling thread used recently, without taking a lock.
+ */
+tag find_tag(std::string_view phase, std::string_view name);
+
+/** Records that `what` took from `first` to `last`. */
+void record(tag what, clock_t::time_point first, clock_t::time_point last);
+void record(std::string_view phase, std::string_view name,
+            clock_t::time_point first, clock_t::time_point last);
+
+/**
+ * Measures the time until it is destroyed, when the profiler is
+ * running.  The strings are not looked at unless something is recorded.
+ */
+class scope
+{
+public:
+    scope(tag what)
+        : what_{what}, active_{enabled()}
+    {
+        if (active_)
+            start_ = clock_t::now();
+    }
+
+    scope(std::string_view phase, std::string_view name)
+        : phase_{phase}, name_{name}, active_{enabled()}
+    {
+        if (active_)
+            start_ = clock_t::now();
+    }
+
+    ~scope()
+    {
+        if (!active_)
+            return;
+        auto last = clock_t::now();
+        record(what_ ? *what_ : find_tag(phase_, name_), start_, last);
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+private:
+    std::optional<tag> what_;
+    std::string_view phase_;
+    std::string_view name_;
+    bool active_;
+    clock_t::time_point start_;
+};
+
+/**
+ * Returns a table with the number of timings of every phase and name,
+ * and their mean, percentiles and maximum, the slowest first.
+ */
+std::string report();
+
+/**
+ * Starts the profiler and keeps every timing, to be written to `path`
+ * by `write_trace`.  Only the first `max_trace_events` are kept, in
+ * buffers that grow as they are needed.
+ */
+void start_trace(std::string path);
+void write_trace();
+
+constexpr auto max_trace_events = std::size_t{1} << 20;
+
+/**
+ * Starts the profiler when `EWIG_PROFILE` is set, and tracing to the
+ * file named by `EWIG_TRACE` when that one is.
+ */
+void start_from_environment();
+
+} // namespace profile
+
+/**
+ * Tells what an action is in the profile.  Stores call it for their
+ * actions, and models give it a better overload for theirs.
+ */
+template <typename Action>
+std::string_view profile_tag(const Action&)
+{
+    return "action";
+}
+
+} // namespace ewig
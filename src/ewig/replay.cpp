@@ -0,0 +1,217 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/replay.hpp"
+#include "ewig/profile.hpp"
+
+#include <scelta.hpp>
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace ewig {
+
+namespace {
+
+constexpr auto replay_rows = 24;
+constexpr auto replay_cols = 80;
+
+void write_escaped(std::ostream& os, const std::string& str)
+{
+    for (auto c : str) {
+        if (c == '\n')
+            os << "\\n";
+        else if (c == '\\')
+            os << "\\\\";
+        else
+            os << c;
+    }
+}
+
+std::string read_escaped(const std::string& str)
+{
+    auto result = std::string{};
+    for (auto it = str.begin(); it != str.end(); ++it) {
+        if (*it == '\\' && it + 1 != str.end()) {
+            ++it;
+            result += *it == 'n' ? '\n' : *it;
+        } else {
+            result += *it;
+        }
+    }
+    return result;
+}
+
+std::string join_lines(const text& txt)
+{
+    auto result = std::string{};
+    for (auto i = std::size_t{}; i < txt.size(); ++i) {
+        if (i > 0)
+            result += '\n';
+        result.append(txt[i].begin(), txt[i].end());
+    }
+    return result;
+}
+
+void write_arg(std::ostream& os, const command_arg& arg)
+{
+    scelta::match(
+        [&](std::monostate) {},
+        [&](wchar_t c) { os << " c " << (unsigned long) c; },
+        [&](const std::string& s) { os << " s "; write_escaped(os, s); },
+        [&](const text& t) { os << " t "; write_escaped(os, join_lines(t)); })(
+            arg);
+}
+
+command_arg read_arg(std::istream& is)
+{
+    auto kind = std::string{};
+    if (!(is >> kind))
+        return {};
+    if (kind == "c") {
+        auto c = (unsigned long) 0;
+        if (!(is >> c))
+            throw std::runtime_error{"bad character"};
+        return (wchar_t) c;
+    }
+    is.get();
+    auto rest = std::string{};
+    std::getline(is, rest);
+    if (kind == "s")
+        return read_escaped(rest);
+    else if (kind == "t")
+        return to_text(read_escaped(rest));
+    throw std::runtime_error{"bad argument: " + kind};
+}
+
+action read_action(const std::string& ln)
+{
+    auto is   = std::istringstream{ln};
+    auto kind = std::string{};
+    is >> kind;
+    if (kind == "key") {
+        auto mod  = 0;
+        auto code = (unsigned long) 0;
+        if (!(is >> mod >> code))
+            throw std::runtime_error{"bad key"};
+        return key_action{{mod, (wint_t) code}};
+    } else if (kind == "resize") {
+        auto size = coord{};
+        if (!(is >> size.row >> size.col))
+            throw std::runtime_error{"bad size"};
+        return resize_action{size};
+    } else if (kind == "command") {
+        auto name = std::string{};
+        if (!(is >> name))
+            throw std::runtime_error{"missing command name"};
+        return command_action{name, read_arg(is)};
+    }
+    throw std::runtime_error{"unknown action: " + kind};
+}
+
+} // anonymous namespace
+
+void record_action(std::ostream& os, const action& ev)
+{
+    scelta::match(
+        [&](const key_action& ev) {
+            os << "key " << std::get<0>(ev.key)
+               << " " << (unsigned long) std::get<1>(ev.key) << "\n";
+        },
+        [&](const resize_action& ev) {
+            os << "resize " << ev.size.row << " " << ev.size.col << "\n";
+        },
+        [&](const command_action& ev) {
+            os << "command " << command_name(ev.id);
+            write_arg(os, ev.arg);
+            os << "\n";
+        },
+        [&](auto&&) {})(ev);
+}
+
+session read_session(std::istream& is)
+{
+    auto result = session{};
+    auto ln     = std::string{};
+    for (auto row = 1; std::getline(is, ln); ++row) {
+        if (ln.empty())
+            continue;
+        try {
+            result.push_back(read_action(ln));
+        } catch (const std::runtime_error& err) {
+            throw std::runtime_error{
+                "session line " + std::to_string(row) + ": " + err.what()};
+        }
+    }
+    return result;
+}
+
+std::string replay(const session& events,
+                   const std::vector<std::string>& fnames,
+                   key_map keys)
+{
+    auto serv = boost::asio::io_service{};
+    auto pool = executor{};
+    auto io   = io_scheduler{pool};
+    auto done = false;
+    auto init = application{{replay_rows, replay_cols}, keys};
+    auto st   = store<application, action>{
+        serv, pool, io, init, update, [] (auto&&) {}, [&] { done = true; }};
+
+    profile::reset();
+    profile::start();
+    // the files are loaded before the session starts, like when the
+    // user waits for them before typing
+    for (auto& fname : fnames)
+        st.dispatch(command_action{&fname == &fnames.front() ? "load" : "open",
+                                   fname});
+    st.run_until_idle();
+
+    auto first = profile::clock_t::now();
+    auto count = std::size_t{};
+    for (auto& ev : events) {
+        if (done)
+            break;
+        // keys are told by the command they call before they do
+        auto tag   = profile_tag(st.current(), ev);
+        auto start = profile::clock_t::now();
+        // the background work of every action is waited for, so the
+        // next one always sees its results
+        st.dispatch(ev);
+        st.run_until_idle();
+        profile::record("replay", tag, start, profile::clock_t::now());
+        ++count;
+    }
+    auto last = profile::clock_t::now();
+    profile::stop();
+
+    // saves still in progress complete, like when quitting the editor
+    if (!done)
+        st.dispatch(command_action{"quit"});
+    serv.run();
+
+    auto total = std::chrono::duration<double, std::milli>(last - first);
+    return "replayed " + std::to_string(count) + " actions in "
+        + std::to_string(total.count()) + " ms\n" + profile::report();
+}
+
+} // namespace ewig
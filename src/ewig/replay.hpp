@@ -0,0 +1,64 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/application.hpp>
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace ewig {
+
+/**
+ * Editing sessions are recorded as the actions that come from the
+ * terminal, one per line:
+ *
+ *     key <modifier> <code>
+ *     resize <rows> <columns>
+ *     command <name> [c <character> | s <string> | t <text>]
+ *
+ * Strings and texts escape new lines and backslashes.
+ */
+using session = std::vector<action>;
+
+/**
+ * Appends `ev` to the session in `os`, unless it is not input.  The
+ * stream is not flushed, that is left to its buffering.
+ */
+void record_action(std::ostream& os, const action& ev);
+
+/** Reads a session, throwing `std::runtime_error` when malformed. */
+session read_session(std::istream& is);
+
+/**
+ * Replays `events` without a terminal, after loading `fnames`, with
+ * the same reducer as the editor but without drawing.  Returns the
+ * profile of the replay, where the `replay` phase is the latency of
+ * every action, from dispatching it until the work in the background
+ * that it started is done.  The actions thus always see the results of
+ * the previous ones, and every replay gives the same results.
+ */
+std::string replay(const session& events,
+                   const std::vector<std::string>& fnames,
+                   key_map keys);
+
+} // namespace ewig
@@ -0,0 +1,240 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/scan.hpp"
+
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define EWIG_SIMD 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define EWIG_SIMD 1
+#endif
+
+namespace ewig {
+
+namespace {
+
+#if EWIG_SIMD
+
+// Minimal abstraction over the vector instructions of the target.
+// Comparisons produce a bit-mask where every byte of the block
+// contributes `mask_bits` bits, so we can find the first match by
+// counting trailing zeroes.
+#if defined(__AVX2__)
+
+using block_t = __m256i;
+using mask_t  = std::uint32_t;
+constexpr auto block_size = std::size_t{32};
+constexpr auto mask_bits  = 1;
+
+block_t load(const char* p)
+{ return _mm256_loadu_si256(reinterpret_cast<const block_t*>(p)); }
+
+mask_t eq(block_t v, char c)
+{ return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))); }
+
+mask_t high(block_t v)
+{ return _mm256_movemask_epi8(v); }
+
+#elif defined(__SSE2__)
+
+using block_t = __m128i;
+using mask_t  = std::uint32_t;
+constexpr auto block_size = std::size_t{16};
+constexpr auto mask_bits  = 1;
+
+block_t load(const char* p)
+{ return _mm_loadu_si128(reinterpret_cast<const block_t*>(p)); }
+
+mask_t eq(block_t v, char c)
+{ return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))); }
+
+mask_t high(block_t v)
+{ return _mm_movemask_epi8(v); }
+
+#else // NEON
+
+using block_t = uint8x16_t;
+using mask_t  = std::uint64_t;
+constexpr auto block_size = std::size_t{16};
+constexpr auto mask_bits  = 4;
+
+block_t load(const char* p)
+{ return vld1q_u8(reinterpret_cast<const std::uint8_t*>(p)); }
+
+mask_t to_mask(uint8x16_t m)
+{
+    auto narrowed = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+mask_t eq(block_t v, char c)
+{ return to_mask(vceqq_u8(v, vdupq_n_u8(c))); }
+
+mask_t high(block_t v)
+{ return to_mask(vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(0))); }
+
+#endif
+
+std::size_t first_byte(mask_t m)
+{ return __builtin_ctzll(m) / mask_bits; }
+
+mask_t bytes_before(std::size_t n)
+{ return (mask_t{1} << (n * mask_bits)) - 1; }
+
+#endif // EWIG_SIMD
+
+bool is_continuation(unsigned char c)
+{
+    return (c & 0xc0) == 0x80;
+}
+
+// Returns the size of the valid UTF-8 sequence at `p`, or zero if it
+// is not valid.  Rejects overlong forms, surrogates and code points
+// beyond U+10FFFF, like `utf8::find_invalid` does.
+std::size_t valid_sequence(const unsigned char* p, const unsigned char* last)
+{
+    auto avail = last - p;
+    auto c     = p[0];
+    if (c < 0x80)
+        return 1;
+    else if (c >= 0xc2 && c <= 0xdf)
+        return avail >= 2 && is_continuation(p[1]) ? 2 : 0;
+    else if (c >= 0xe0 && c <= 0xef) {
+        if (avail < 3 || !is_continuation(p[1]) || !is_continuation(p[2]))
+            return 0;
+        if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] > 0x9f))
+            return 0;
+        return 3;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        if (avail < 4 || !is_continuation(p[1]) ||
+            !is_continuation(p[2]) || !is_continuation(p[3]))
+            return 0;
+        if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] > 0x8f))
+            return 0;
+        return 4;
+    } else
+        return 0;
+}
+
+} // anonymous
+
+line_scan scan_line(const char* first, const char* last)
+{
+#if EWIG_SIMD
+    auto high_bits = mask_t{};
+    for (; std::size_t(last - first) >= block_size; first += block_size) {
+        auto v  = load(first);
+        auto nl = eq(v, '\n');
+        if (nl) {
+            auto pos = first_byte(nl);
+            high_bits |= high(v) & bytes_before(pos);
+            return { first + pos, high_bits == 0 };
+        }
+        high_bits |= high(v);
+    }
+    auto ascii = high_bits == 0;
+#else
+    auto ascii = true;
+#endif
+    for (; first != last && *first != '\n'; ++first)
+        ascii = ascii && static_cast<unsigned char>(*first) < 0x80;
+    return { first, ascii };
+}
+
+const char* skip_plain_ascii(const char* first, const char* last)
+{
+#if EWIG_SIMD
+    for (; std::size_t(last - first) >= block_size; first += block_size) {
+        auto v = load(first);
+        auto m = high(v) | eq(v, '\t');
+        if (m)
+            return first + first_byte(m);
+    }
+#endif
+    for (; first != last; ++first) {
+        auto c = static_cast<unsigned char>(*first);
+        if (c >= 0x80 || c == '\t')
+            break;
+    }
+    return first;
+}
+
+wchar_t* widen_ascii(const char* first, const char* last, wchar_t* out)
+{
+    // zero extending every byte twice makes four blocks of code points
+    if constexpr (sizeof(wchar_t) == 4) {
+#if defined(__SSE2__)
+        auto zero = _mm_setzero_si128();
+        for (; last - first >= 16; first += 16, out += 16) {
+            auto v   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+            auto lo  = _mm_unpacklo_epi8(v, zero);
+            auto hi  = _mm_unpackhi_epi8(v, zero);
+            auto dst = reinterpret_cast<__m128i*>(out);
+            _mm_storeu_si128(dst,     _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        for (; last - first >= 16; first += 16, out += 16) {
+            auto v   = vld1q_u8(reinterpret_cast<const std::uint8_t*>(first));
+            auto lo  = vmovl_u8(vget_low_u8(v));
+            auto hi  = vmovl_u8(vget_high_u8(v));
+            auto dst = reinterpret_cast<std::uint32_t*>(out);
+            vst1q_u32(dst,      vmovl_u16(vget_low_u16(lo)));
+            vst1q_u32(dst + 4,  vmovl_u16(vget_high_u16(lo)));
+            vst1q_u32(dst + 8,  vmovl_u16(vget_low_u16(hi)));
+            vst1q_u32(dst + 12, vmovl_u16(vget_high_u16(hi)));
+        }
+#endif
+    }
+    for (; first != last; ++first)
+        *out++ = static_cast<unsigned char>(*first);
+    return out;
+}
+
+const char* find_invalid_utf8(const char* first, const char* last)
+{
+    auto p = reinterpret_cast<const unsigned char*>(first);
+    auto l = reinterpret_cast<const unsigned char*>(last);
+    while (p != l) {
+#if EWIG_SIMD
+        if (std::size_t(l - p) >= block_size) {
+            auto m = high(load(reinterpret_cast<const char*>(p)));
+            if (!m) {
+                p += block_size;
+                continue;
+            }
+            p += first_byte(m);
+        }
+#endif
+        auto n = valid_sequence(p, l);
+        if (!n)
+            break;
+        p += n;
+    }
+    return reinterpret_cast<const char*>(p);
+}
+
+} // namespace ewig
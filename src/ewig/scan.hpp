@@ -0,0 +1,65 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <cstddef>
+
+namespace ewig {
+
+/**
+ * Result of `scan_line`: `end` points to the new line character that
+ * terminates the line, or the end of the scanned range when there is
+ * none, and `ascii` tells whether all the bytes before it are ASCII.
+ */
+struct line_scan
+{
+    const char* end;
+    bool ascii;
+};
+
+/**
+ * Finds the end of the line starting at `first`, checking whether it
+ * is ASCII as it goes.  Uses SIMD instructions when available.
+ */
+line_scan scan_line(const char* first, const char* last);
+
+/**
+ * Returns the first byte in `[first, last)` that is not ASCII or that
+ * is a tab, or `last` if there is none.  Uses SIMD instructions when
+ * available.
+ */
+const char* skip_plain_ascii(const char* first, const char* last);
+
+/**
+ * Copies the ASCII bytes in `[first, last)` to the wide characters at
+ * `out`, returning the end of the copied ones.  Uses SIMD instructions
+ * when available.
+ */
+wchar_t* widen_ascii(const char* first, const char* last, wchar_t* out);
+
+/**
+ * Returns the first byte in `[first, last)` that does not belong to a
+ * valid UTF-8 sequence, or `last` if there is none.  ASCII blocks are
+ * skipped using SIMD instructions when available.
+ */
+const char* find_invalid_utf8(const char* first, const char* last);
+
+} // namespace ewig
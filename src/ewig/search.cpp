@@ -0,0 +1,710 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/search.hpp"
+
+#include <utf8.h>
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+namespace ewig {
+
+struct pattern::program
+{
+    using byte_set = std::bitset<256>;
+
+    // A Thompson NFA.  Split nodes have epsilon transitions to `out`
+    // and `out1`, when they are not negative, byte nodes go to `out`
+    // on any byte in `bytes`.
+    struct node
+    {
+        enum kind_t { bytes, split, match } kind;
+        byte_set set;
+        int out  = -1;
+        int out1 = -1;
+    };
+
+    std::vector<node> nodes;
+    int start = -1;
+    bool anchor_start = false;
+    bool anchor_end   = false;
+};
+
+namespace {
+
+using program  = pattern::program;
+using byte_set = program::byte_set;
+using node     = program::node;
+
+byte_set byte_range(unsigned lo, unsigned hi)
+{
+    auto set = byte_set{};
+    for (auto c = lo; c <= hi; ++c)
+        set.set(c);
+    return set;
+}
+
+// A piece of NFA under construction, with the transitions that still
+// have to be connected to whatever follows it.
+struct fragment
+{
+    int start;
+    std::vector<std::pair<int, bool>> outs;
+};
+
+struct builder
+{
+    program& prog;
+
+    int add(node n)
+    {
+        prog.nodes.push_back(std::move(n));
+        return prog.nodes.size() - 1;
+    }
+
+    void patch(const fragment& f, int target)
+    {
+        for (auto [n, second] : f.outs)
+            (second ? prog.nodes[n].out1 : prog.nodes[n].out) = target;
+    }
+
+    fragment empty()
+    {
+        auto n = add({node::split, {}});
+        return {n, {{n, false}}};
+    }
+
+    fragment bytes(byte_set set)
+    {
+        auto n = add({node::bytes, set});
+        return {n, {{n, false}}};
+    }
+
+    fragment sequence(const std::string& str)
+    {
+        if (str.empty())
+            return empty();
+        auto f = bytes(byte_set{}.set((unsigned char)str[0]));
+        for (auto c : str.substr(1))
+            f = concat(f, bytes(byte_set{}.set((unsigned char)c)));
+        return f;
+    }
+
+    fragment concat(fragment a, fragment b)
+    {
+        patch(a, b.start);
+        return {a.start, std::move(b.outs)};
+    }
+
+    fragment alt(fragment a, fragment b)
+    {
+        auto n = add({node::split, {}, a.start, b.start});
+        a.outs.insert(a.outs.end(), b.outs.begin(), b.outs.end());
+        return {n, std::move(a.outs)};
+    }
+
+    fragment star(fragment a)
+    {
+        auto n = add({node::split, {}, a.start});
+        patch(a, n);
+        return {n, {{n, true}}};
+    }
+
+    fragment plus(fragment a)
+    {
+        auto n = add({node::split, {}, a.start});
+        patch(a, n);
+        return {a.start, {{n, true}}};
+    }
+
+    fragment quest(fragment a)
+    {
+        auto n = add({node::split, {}, a.start});
+        a.outs.push_back({n, true});
+        return {n, std::move(a.outs)};
+    }
+
+    // Any UTF-8 encoded character, matching the lead byte and the
+    // right number of continuation bytes.
+    fragment any_multibyte()
+    {
+        auto cont = byte_range(0x80, 0xbf);
+        auto two   = concat(bytes(byte_range(0xc0, 0xdf)), bytes(cont));
+        auto three = concat(concat(bytes(byte_range(0xe0, 0xef)), bytes(cont)),
+                            bytes(cont));
+        auto four  = concat(concat(concat(bytes(byte_range(0xf0, 0xf7)),
+                                          bytes(cont)),
+                                   bytes(cont)),
+                            bytes(cont));
+        return alt(alt(two, three), four);
+    }
+
+    fragment any_char()
+    {
+        return alt(bytes(byte_range(0x00, 0x7f)), any_multibyte());
+    }
+};
+
+// Recursive descent parser of regular expressions into an NFA.
+struct parser
+{
+    builder build;
+    const std::string& str;
+    std::size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string& what)
+    {
+        throw std::runtime_error{"invalid regexp: " + what};
+    }
+
+    bool at_end(std::size_t end) const { return pos >= end; }
+
+    // Reads the code point at `pos`, returning its encoding
+    std::string next_char(std::size_t end)
+    {
+        auto first = str.begin() + pos;
+        auto last  = str.begin() + end;
+        auto it    = first;
+        try {
+            utf8::next(it, last);
+        } catch (const utf8::exception&) {
+            fail("malformed UTF-8");
+        }
+        pos += it - first;
+        return {first, it};
+    }
+
+    static byte_set class_escape(char c)
+    {
+        switch (c) {
+        case 'd': return byte_range('0', '9');
+        case 'w': return byte_range('a', 'z') | byte_range('A', 'Z')
+                       | byte_range('0', '9') | byte_set{}.set('_');
+        case 's': return byte_set{}.set(' ').set('\t').set('\r')
+                       .set('\f').set('\v');
+        default:  return {};
+        }
+    }
+
+    fragment alternation(std::size_t end)
+    {
+        auto f = concatenation(end);
+        while (!at_end(end) && str[pos] == '|') {
+            ++pos;
+            f = build.alt(f, concatenation(end));
+        }
+        return f;
+    }
+
+    fragment concatenation(std::size_t end)
+    {
+        auto f = std::optional<fragment>{};
+        while (!at_end(end) && str[pos] != '|' && str[pos] != ')') {
+            auto r = repetition(end);
+            f = f ? build.concat(*f, r) : r;
+        }
+        return f ? *f : build.empty();
+    }
+
+    fragment repetition(std::size_t end)
+    {
+        auto f = atom(end);
+        while (!at_end(end)) {
+            switch (str[pos]) {
+            case '*': f = build.star(f); break;
+            case '+': f = build.plus(f); break;
+            case '?': f = build.quest(f); break;
+            default:  return f;
+            }
+            ++pos;
+        }
+        return f;
+    }
+
+    fragment atom(std::size_t end)
+    {
+        auto c = str[pos];
+        switch (c) {
+        case '(': {
+            ++pos;
+            auto f = alternation(end);
+            if (at_end(end) || str[pos] != ')')
+                fail("missing )");
+            ++pos;
+            return f;
+        }
+        case '[':
+            ++pos;
+            return bracket(end);
+        case '.':
+            ++pos;
+            return build.any_char();
+        case '*': case '+': case '?':
+            fail("nothing to repeat");
+        case '\\': {
+            if (++pos == end)
+                fail("trailing \\");
+            auto set = class_escape(std::tolower(str[pos]));
+            if (set.any()) {
+                if (std::isupper(str[pos])) {
+                    ++pos;
+                    return build.alt(build.bytes(~set & byte_range(0, 0x7f)),
+                                     build.any_multibyte());
+                }
+                ++pos;
+                return build.bytes(set);
+            }
+            if (str[pos] == 't') {
+                ++pos;
+                return build.sequence("\t");
+            }
+            return build.sequence(next_char(end));
+        }
+        default:
+            return build.sequence(next_char(end));
+        }
+    }
+
+    fragment bracket(std::size_t end)
+    {
+        auto negated = !at_end(end) && str[pos] == '^';
+        if (negated)
+            ++pos;
+        auto ascii = byte_set{};
+        auto multibyte = std::vector<std::string>{};
+        auto first = true;
+        while (true) {
+            if (at_end(end))
+                fail("missing ]");
+            if (str[pos] == ']' && !first)
+                break;
+            first = false;
+            if (str[pos] == '\\' && pos + 1 < end) {
+                ++pos;
+                auto set = class_escape(str[pos]);
+                if (set.any()) {
+                    ++pos;
+                    ascii |= set;
+                    continue;
+                }
+            }
+            auto lo = next_char(end);
+            if (pos + 1 < end && str[pos] == '-' && str[pos + 1] != ']') {
+                ++pos;
+                auto hi = next_char(end);
+                if (lo.size() > 1 || hi.size() > 1 || lo[0] > hi[0])
+                    fail("bad range");
+                ascii |= byte_range(lo[0], hi[0]);
+            } else if (lo.size() == 1) {
+                ascii.set((unsigned char)lo[0]);
+            } else {
+                multibyte.push_back(lo);
+            }
+        }
+        ++pos;
+        if (negated)
+            return build.alt(build.bytes(~ascii & byte_range(0, 0x7f)),
+                             build.any_multibyte());
+        auto f = std::optional<fragment>{};
+        if (ascii.any())
+            f = build.bytes(ascii);
+        for (auto& c : multibyte)
+            f = f ? build.alt(*f, build.sequence(c)) : build.sequence(c);
+        if (!f)
+            fail("empty []");
+        return *f;
+    }
+};
+
+void finish(program& prog, builder& build, fragment f)
+{
+    auto m = build.add({node::match, {}});
+    build.patch(f, m);
+    prog.start = f.start;
+}
+
+// Adds to `set` the byte and match nodes reachable from `n` through
+// epsilon transitions.
+void closure(const program& prog, int n,
+             std::vector<int>& set, std::vector<char>& seen)
+{
+    if (n < 0 || seen[n])
+        return;
+    seen[n] = true;
+    auto& nd = prog.nodes[n];
+    if (nd.kind == node::split) {
+        closure(prog, nd.out, set, seen);
+        closure(prog, nd.out1, set, seen);
+    } else {
+        set.push_back(n);
+    }
+}
+
+// A DFA built lazily from the NFA, one transition at a time, as the
+// input requires them.  When `unanchored`, the start state is added
+// after every byte, such that it finds matches starting anywhere.
+class dfa
+{
+public:
+    static constexpr auto max_states = 4096;
+
+    dfa(const program& prog, bool unanchored)
+        : prog_{prog}
+        , unanchored_{unanchored}
+        , start_set_{closure_of({prog.start})}
+    {
+        reset_();
+    }
+
+    static constexpr int start() { return 0; }
+
+    int step(int s, unsigned char c)
+    {
+        auto t = trans_[s * 256 + c];
+        return t >= 0 ? t : compute_(s, c);
+    }
+
+    bool accepting(int s) const { return accept_[s]; }
+    bool dead(int s) const { return sets_[s].empty(); }
+
+    // The bytes that can start a match
+    byte_set first_bytes() const
+    {
+        auto set = byte_set{};
+        for (auto n : start_set_)
+            if (prog_.nodes[n].kind == node::bytes)
+                set |= prog_.nodes[n].set;
+        return set;
+    }
+
+private:
+    std::vector<int> closure_of(const std::vector<int>& targets) const
+    {
+        auto set  = std::vector<int>{};
+        auto seen = std::vector<char>(prog_.nodes.size());
+        for (auto n : targets)
+            closure(prog_, n, set, seen);
+        std::sort(set.begin(), set.end());
+        return set;
+    }
+
+    void reset_()
+    {
+        ids_.clear();
+        sets_.clear();
+        trans_.clear();
+        accept_.clear();
+        intern_(start_set_);
+    }
+
+    int intern_(std::vector<int> set)
+    {
+        auto it = ids_.find(set);
+        if (it != ids_.end())
+            return it->second;
+        auto id = (int) sets_.size();
+        auto accepts = std::any_of(set.begin(), set.end(), [&] (auto n) {
+            return prog_.nodes[n].kind == node::match;
+        });
+        ids_.emplace(set, id);
+        sets_.push_back(std::move(set));
+        accept_.push_back(accepts);
+        trans_.resize(trans_.size() + 256, -1);
+        return id;
+    }
+
+    int compute_(int s, unsigned char c)
+    {
+        auto targets = std::vector<int>{};
+        for (auto n : sets_[s]) {
+            auto& nd = prog_.nodes[n];
+            if (nd.kind == node::bytes && nd.set[c])
+                targets.push_back(nd.out);
+        }
+        if (unanchored_)
+            targets.push_back(prog_.start);
+        auto next = closure_of(targets);
+        if (sets_.size() >= max_states) {
+            // too many states, start caching again from scratch
+            reset_();
+            return intern_(std::move(next));
+        }
+        auto id = intern_(std::move(next));
+        trans_[s * 256 + c] = id;
+        return id;
+    }
+
+    const program& prog_;
+    bool unanchored_;
+    std::vector<int> start_set_;
+    std::map<std::vector<int>, int> ids_;
+    std::vector<std::vector<int>> sets_;
+    std::vector<int> trans_;
+    std::vector<bool> accept_;
+};
+
+// Finds matches of a pattern in lines.  A first DFA finds out whether
+// a line has a match at all, skipping the bytes that can not start a
+// match with `memchr` when possible.  Only on lines that do, a second
+// DFA finds the longest match at every candidate position, which may
+// each read up to the end of the line.
+class matcher
+{
+public:
+    matcher(const program& prog)
+        : prog_{prog}
+        , scan_{prog, !prog.anchor_start}
+        , anchored_{prog, false}
+    {
+        auto first = scan_.first_bytes();
+        for (auto c = 0; c < 256; ++c)
+            first_[c] = first[c];
+        if (first.count() == 1)
+            for (auto c = 0; c < 256; ++c)
+                if (first[c])
+                    single_first_ = c;
+    }
+
+    bool contains(const line& ln)
+    {
+        auto s     = scan_.start();
+        auto found = scan_.accepting(s) && !prog_.anchor_end;
+        auto dead  = false;
+        ln.for_each_chunk([&] (const char* first, const char* last) {
+            while (!found && !dead && first != last) {
+                if (s == scan_.start() && !prog_.anchor_start) {
+                    first = skip_(first, last);
+                    if (first == last)
+                        break;
+                }
+                s = scan_.step(s, *first++);
+                found = scan_.accepting(s) && !prog_.anchor_end;
+                dead  = scan_.dead(s);
+            }
+        });
+        return found || (prog_.anchor_end && !dead && scan_.accepting(s));
+    }
+
+    // Returns the end of the longest non-empty match at `pos`
+    std::optional<std::size_t> match_at(const std::string& str, std::size_t pos)
+    {
+        if ((prog_.anchor_start && pos > 0) ||
+            !first_[(unsigned char) str[pos]])
+            return std::nullopt;
+        auto s    = anchored_.start();
+        auto best = std::optional<std::size_t>{};
+        for (auto i = pos; i < str.size() && !anchored_.dead(s); ) {
+            s = anchored_.step(s, str[i++]);
+            if (anchored_.accepting(s) &&
+                (!prog_.anchor_end || i == str.size()))
+                best = i;
+        }
+        return best;
+    }
+
+    // Finds the first, or the last when not `forward`, match starting
+    // within the bytes `[lo, hi)` of `ln`.
+    std::optional<std::pair<std::size_t, std::size_t>>
+    find(const line& ln, std::size_t lo, std::size_t hi, bool forward)
+    {
+        hi = std::min(hi, ln.size());
+        if (lo >= hi || !contains(ln))
+            return std::nullopt;
+        auto str = std::string{};
+        str.reserve(ln.size());
+        ln.for_each_chunk([&] (auto first, auto last) {
+            str.append(first, last);
+        });
+        auto try_at = [&] (std::size_t pos)
+            -> std::optional<std::pair<std::size_t, std::size_t>> {
+            if (((unsigned char) str[pos] & 0xc0) == 0x80)
+                return std::nullopt; // not the start of a character
+            if (auto end = match_at(str, pos))
+                return std::pair{pos, *end};
+            return std::nullopt;
+        };
+        if (forward) {
+            for (auto pos = lo; pos < hi; ++pos)
+                if (auto m = try_at(pos))
+                    return m;
+        } else {
+            for (auto pos = hi; pos-- > lo; )
+                if (auto m = try_at(pos))
+                    return m;
+        }
+        return std::nullopt;
+    }
+
+private:
+    const char* skip_(const char* first, const char* last) const
+    {
+        if (single_first_ >= 0) {
+            auto p = std::memchr(first, single_first_, last - first);
+            return p ? static_cast<const char*>(p) : last;
+        }
+        while (first != last && !first_[(unsigned char) *first])
+            ++first;
+        return first;
+    }
+
+    const program& prog_;
+    dfa scan_;
+    dfa anchored_;
+    std::array<bool, 256> first_ {};
+    int single_first_ = -1;
+};
+
+} // anonymous namespace
+
+pattern pattern::literal(const std::string& str)
+{
+    auto prog  = std::make_shared<program>();
+    auto build = builder{*prog};
+    finish(*prog, build, build.sequence(str));
+    return {prog};
+}
+
+pattern pattern::regex(const std::string& str)
+{
+    auto prog = std::make_shared<program>();
+    auto p    = parser{{*prog}, str};
+    auto end  = str.size();
+    if (end > 0 && str[0] == '^') {
+        prog->anchor_start = true;
+        p.pos = 1;
+    }
+    if (end > p.pos && str[end - 1] == '$') {
+        // the $ is escaped when an odd number of backslashes precede it
+        auto escapes = std::size_t{};
+        while (end - 1 - escapes > p.pos && str[end - 2 - escapes] == '\\')
+            ++escapes;
+        if (escapes % 2 == 0) {
+            prog->anchor_end = true;
+            --end;
+        }
+    }
+    auto f = p.alternation(end);
+    if (!p.at_end(end))
+        p.fail("unmatched )");
+    finish(*prog, p.build, f);
+    return {prog};
+}
+
+search_result search(const text& txt,
+                     const pattern& pat,
+                     coord from,
+                     bool forward,
+                     bool inclusive,
+                     const cancellation& token,
+                     const search_progress& progress)
+{
+    using clock_t = std::chrono::steady_clock;
+    constexpr auto block_rows = std::size_t{1} << 12;
+    constexpr auto progress_interval = std::chrono::milliseconds{100};
+    constexpr auto end = std::numeric_limits<std::size_t>::max();
+
+    if (txt.empty())
+        return {};
+
+    auto m    = matcher{pat.get()};
+    auto rows = (index) txt.size();
+    if (from.row >= rows)
+        from = {rows - 1, line_length(txt.back())};
+    auto from_ln   = txt[from.row];
+    auto from_byte = line_char(from_ln, from.col);
+    auto split     = forward || !inclusive ? from_byte : from_byte + 1;
+
+    auto result = search_result{};
+    auto found  = [&] (index row, const line& ln,
+                       std::pair<std::size_t, std::size_t> bytes) {
+        result.match = search_match{
+            {row, line_char_index(ln, bytes.first)},
+            {row, line_char_index(ln, bytes.second)}};
+        return true;
+    };
+
+    auto searched   = std::size_t{};
+    auto last_report = clock_t::now();
+    // Searches the rows `[first, last)`, in the direction of the
+    // search, block by block
+    auto search_rows = [&] (index first, index last) {
+        auto lines = std::vector<const line*>{};
+        for (auto i = 0; i < last - first; i += block_rows) {
+            if (token.cancelled())
+                return true;
+            auto n = std::min<index>(block_rows, last - first - i);
+            auto block = forward
+                ? txt.drop(first + i).take(n)
+                : txt.drop(last - i - n).take(n);
+            lines.clear();
+            immer::for_each_chunk(block, [&] (auto f, auto l) {
+                for (; f != l; ++f)
+                    lines.push_back(&*f);
+            });
+            for (auto k = index{}; k < n; ++k) {
+                auto j   = forward ? k : n - 1 - k;
+                auto row = forward ? first + i + j : last - i - n + j;
+                if (auto r = m.find(*lines[j], 0, end, forward))
+                    return found(row, *lines[j], *r);
+            }
+            searched += n;
+            if (progress && clock_t::now() - last_report > progress_interval) {
+                progress(float(searched) / rows);
+                last_report = clock_t::now();
+            }
+        }
+        return false;
+    };
+
+    auto done = false;
+    if (forward) {
+        if (auto r = m.find(from_ln, split, end, true))
+            done = found(from.row, from_ln, *r);
+        done = done || search_rows(from.row + 1, rows);
+        result.wrapped = !done;
+        done = done || search_rows(0, from.row);
+        if (!done)
+            if (auto r = m.find(from_ln, 0, split, true))
+                done = found(from.row, from_ln, *r);
+    } else {
+        if (auto r = m.find(from_ln, 0, split, false))
+            done = found(from.row, from_ln, *r);
+        done = done || search_rows(0, from.row);
+        result.wrapped = !done;
+        done = done || search_rows(from.row + 1, rows);
+        if (!done)
+            if (auto r = m.find(from_ln, split, end, false))
+                done = found(from.row, from_ln, *r);
+    }
+    if (token.cancelled() || !result.match)
+        return {};
+    return result;
+}
+
+} // namespace ewig
@@ -0,0 +1,93 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/buffer.hpp>
+#include <ewig/executor.hpp>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace ewig {
+
+/**
+ * A compiled search pattern, that matches within lines.  Regular
+ * expressions support alternation `|`, grouping, the repetitions `*`,
+ * `+` and `?`, `.`, the classes `\d`, `\w` and `\s`, bracket
+ * expressions with ASCII ranges, and the anchors `^` and `$` at the
+ * beginning and the end of the pattern.  Negated bracket expressions
+ * match every non-ASCII character.  Patterns are matched by a lazily
+ * built DFA, so the lines without a match are skipped in linear time.
+ * Within the lines that have one, it is looked for at every position in
+ * turn, which takes quadratic time in the length of the line at worst.
+ */
+class pattern
+{
+public:
+    // Throws `std::runtime_error` when `str` is not a valid pattern.
+    static pattern literal(const std::string& str);
+    static pattern regex(const std::string& str);
+
+    struct program;
+    const program& get() const { return *program_; }
+
+private:
+    pattern(std::shared_ptr<const program> p) : program_{std::move(p)} {}
+
+    std::shared_ptr<const program> program_;
+};
+
+/** A non-empty match between the columns `first` and `last`. */
+struct search_match
+{
+    coord first;
+    coord last;
+};
+
+struct search_result
+{
+    std::optional<search_match> match;
+    // the search went past the end of the text, or its beginning when
+    // searching backwards, and continued from the other side
+    bool wrapped = false;
+};
+
+using search_progress = std::function<void(float)>;
+
+/**
+ * Finds the next match of `pat` in `txt` that starts at `from` or
+ * after, or the previous match that starts before `from` when not
+ * `forward`, or at `from` too when `inclusive`.  The search wraps
+ * around the text once.  It checks `token` and calls `progress` with
+ * the fraction of the text searched every now and then.  When
+ * cancelled, it returns no match.
+ */
+search_result search(const text& txt,
+                     const pattern& pat,
+                     coord from,
+                     bool forward,
+                     bool inclusive,
+                     const cancellation& token = {},
+                     const search_progress& progress = {});
+
+} // namespace ewig
@@ -0,0 +1,762 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "ewig/state_file.hpp"
+#include "ewig/file_writer.hpp"
+#include "ewig/mapped_file.hpp"
+
+#include <immer/algorithm.hpp>
+#include <immer/flex_vector_transient.hpp>
+
+#include <scelta.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace ewig {
+
+namespace {
+
+// The file starts with `magic`, followed by the bytes of the lines that
+// are kept in it, each one followed by a new line.  Then comes the
+// description of the state, which the trailer, the last 16 bytes, says
+// where it starts and how long it is.  Numbers are LEB128 varints, but
+// for the hashes and the trailer, that are 8 bytes little-endian.
+constexpr char magic[]         = "ewig-state-3\n\n\n\n";
+constexpr auto magic_size      = sizeof(magic) - 1;
+constexpr auto trailer_size    = std::size_t{16};
+// the table of lines is restored in blocks of this many concurrently
+constexpr auto lines_per_block = std::size_t{1} << 16;
+
+void put_varint(std::string& out, std::uint64_t x)
+{
+    for (; x >= 0x80; x >>= 7)
+        out.push_back(char(x | 0x80));
+    out.push_back(char(x));
+}
+
+void put_fixed(std::string& out, std::uint64_t x)
+{
+    for (auto i = 0; i < 8; ++i)
+        out.push_back(char(x >> (8 * i)));
+}
+
+// Zigzag encoded, such that small negative numbers stay small
+void put_signed(std::string& out, std::int64_t x)
+{
+    put_varint(out, (std::uint64_t(x) << 1) ^ std::uint64_t(x >> 63));
+}
+
+void put_string(std::string& out, const std::string& str)
+{
+    put_varint(out, str.size());
+    out += str;
+}
+
+void put_coord(std::string& out, coord pos)
+{
+    put_signed(out, pos.row);
+    put_signed(out, pos.col);
+}
+
+void put_optional_coord(std::string& out, const std::optional<coord>& pos)
+{
+    put_varint(out, pos ? 1 : 0);
+    if (pos)
+        put_coord(out, *pos);
+}
+
+void put_cursors(std::string& out, const cursor_set& cursors)
+{
+    put_varint(out, cursors.size());
+    for (auto& pos : cursors)
+        put_coord(out, pos);
+}
+
+void put_stamp(std::string& out, const file_stamp& stamp)
+{
+    put_varint(out, stamp.device);
+    put_varint(out, stamp.inode);
+    put_varint(out, stamp.size);
+    put_signed(out, stamp.mtime);
+}
+
+[[noreturn]] void corrupt()
+{
+    throw std::runtime_error{"corrupt state file"};
+}
+
+// Reads what the `put_` functions write, in `[first, last)`
+struct reader
+{
+    const char* first;
+    const char* last;
+
+    std::uint64_t varint()
+    {
+        auto x = std::uint64_t{};
+        for (auto shift = 0; shift < 64; shift += 7) {
+            if (first == last)
+                corrupt();
+            auto b = static_cast<unsigned char>(*first++);
+            x |= std::uint64_t(b & 0x7f) << shift;
+            if (b < 0x80)
+                return x;
+        }
+        corrupt();
+    }
+
+    std::uint64_t fixed()
+    {
+        if (last - first < 8)
+            corrupt();
+        auto x = std::uint64_t{};
+        for (auto i = 0; i < 8; ++i)
+            x |= std::uint64_t(static_cast<unsigned char>(first[i])) << (8 * i);
+        first += 8;
+        return x;
+    }
+
+    std::int64_t integer()
+    {
+        auto x = varint();
+        return std::int64_t(x >> 1) ^ -std::int64_t(x & 1);
+    }
+
+    // Returns a reader of the next `size` bytes, skipping them
+    reader take(std::uint64_t size)
+    {
+        if (size > std::uint64_t(last - first))
+            corrupt();
+        auto result = reader{first, first + size};
+        first += size;
+        return result;
+    }
+
+    std::string string()
+    {
+        auto r = take(varint());
+        return {r.first, r.last};
+    }
+
+    coord position()
+    {
+        auto row = (index)integer();
+        auto col = (index)integer();
+        return {row, col};
+    }
+
+    std::optional<coord> optional_position()
+    {
+        return varint() ? std::optional<coord>{position()} : std::nullopt;
+    }
+
+    cursor_set cursors()
+    {
+        auto result = cursor_set{}.transient();
+        for (auto count = varint(); count > 0; --count)
+            result.push_back(position());
+        return result.persistent();
+    }
+
+    file_stamp stamp()
+    {
+        auto result   = file_stamp{};
+        result.device = varint();
+        result.inode  = varint();
+        result.size   = varint();
+        result.mtime  = integer();
+        return result;
+    }
+};
+
+// The runs of consecutive rows of the table of lines that make a text,
+// as the first row and the number of rows
+using runs = std::vector<std::pair<std::size_t, std::size_t>>;
+
+void push_run(runs& rs, std::size_t first, std::size_t count)
+{
+    if (count == 0)
+        return;
+    else if (!rs.empty() && rs.back().first + rs.back().second == first)
+        rs.back().second += count;
+    else
+        rs.push_back({first, count});
+}
+
+// Pushes the runs for the rows `[first, last)` of the text made of `from`
+void push_runs(runs& rs, const runs& from, std::size_t first, std::size_t last)
+{
+    auto row = std::size_t{};
+    for (auto [id, count] : from) {
+        if (row >= last)
+            break;
+        auto begin = std::max(first, row);
+        auto end   = std::min(last, row + count);
+        if (begin < end)
+            push_run(rs, id + (begin - row), end - begin);
+        row += count;
+    }
+}
+
+class state_writer
+{
+public:
+    // Writes to a new file next to `target`, to be moved over it
+    state_writer(const std::string& target,
+                 std::optional<file_stamp> replaced)
+        : out_{file_writer::next_to(target)}
+        , replaced_{replaced}
+    {
+        out_.write(magic, magic_size);
+        written_ = magic_size;
+    }
+
+    const std::string& name() const { return out_.name(); }
+
+    void put_application(const application& app)
+    {
+        auto buffers = std::vector<buffer>{};
+        if (!load_in_progress(app.current))
+            buffers.push_back(app.current);
+        immer::for_each(app.buffers, [&] (auto&& buf) {
+            if (!load_in_progress(buf))
+                buffers.push_back(buf);
+        });
+        put_varint(state_, buffers.size());
+        for (auto& buf : buffers)
+            put_buffer(buf);
+        put_varint(state_, app.last_buffer_id);
+        auto clips = std::vector<std::size_t>{};
+        immer::for_each(app.clipboard.entries, [&] (auto&& clip) {
+            clips.push_back(put_text(clip.content, line_index{clip.content}));
+        });
+        put_varint(state_, clips.size());
+        for (auto id : clips)
+            put_varint(state_, id);
+        put_string(state_, app.last_search.get());
+    }
+
+    // Writes the description of the state and closes the file
+    void close()
+    {
+        auto meta = std::string{};
+        put_varint(meta, num_sources_);
+        meta += sources_;
+        put_varint(meta, num_lines_);
+        put_varint(meta, blocks_.size());
+        for (auto offset : blocks_)
+            put_varint(meta, offset);
+        put_varint(meta, records_.size());
+        meta += records_;
+        put_varint(meta, num_texts_);
+        meta += texts_;
+        meta += state_;
+        auto trailer = std::string{};
+        put_fixed(trailer, written_);
+        put_fixed(trailer, meta.size());
+        out_.write(meta.data(), meta.size());
+        out_.write(trailer.data(), trailer.size());
+        out_.close();
+    }
+
+private:
+    struct written_text
+    {
+        text content;
+        line_index offsets;
+        runs rows;
+    };
+
+    void put_buffer(const buffer& buf)
+    {
+        auto content  = put_text(buf.content, buf.offsets);
+        // the snapshots are most alike to the ones next to them, so
+        // they are written from the most recent one
+        auto& entries = buf.history.entries;
+        auto history  = std::vector<std::size_t>(entries.size());
+        for (auto i = entries.size(); i-- > 0;)
+            history[i] = put_text(entries[i].content, entries[i].offsets);
+        auto saved = scelta::match([&] (auto&& f) {
+            return put_text(f.content, f.offsets);
+        })(buf.from);
+
+        put_varint(state_, buf.id);
+        put_varint(state_, std::holds_alternative<no_file>(buf.from) ? 0 : 1);
+        put_string(state_, buffer_name(buf).get());
+        // the stamp of the file tells whether it changed while we were
+        // not looking at it
+        auto file = std::get_if<existing_file>(&buf.from);
+        auto known = file ? file->stamp : std::nullopt;
+        put_varint(state_, known ? 1 : 0);
+        if (known)
+            put_stamp(state_, *known);
+        put_varint(state_, saved);
+        put_varint(state_, content);
+        put_coord(state_, buf.cursor);
+        put_coord(state_, buf.scroll);
+        put_optional_coord(state_, buf.selection_start);
+        put_cursors(state_, buf.cursors);
+        put_varint(state_, buf.history.budget);
+        put_varint(state_, buf.history.bytes);
+        put_varint(state_, buf.history.position ? 1 : 0);
+        if (buf.history.position)
+            put_varint(state_, *buf.history.position);
+        put_varint(state_, entries.size());
+        for (auto i = std::size_t{}; i < entries.size(); ++i) {
+            auto& entry = entries[i];
+            put_varint(state_, history[i]);
+            put_coord(state_, entry.cursor);
+            put_varint(state_, entry.bytes);
+            put_optional_coord(state_, entry.insert_run);
+            put_signed(state_, entry.inserts);
+            put_cursors(state_, entry.cursors);
+        }
+    }
+
+    // Writes the text `txt`, whose index is `offsets`, returning its id
+    std::size_t put_text(const text& txt, const line_index& offsets)
+    {
+        auto rows   = runs{};
+        auto size   = (index)txt.size();
+        auto prefix = index{};
+        auto suffix = index{};
+        if (last_) {
+            auto& prev   = *last_;
+            auto common  = std::min(size, prev.offsets.size());
+            prefix = common_prefix(offsets, prev.offsets, common);
+            suffix = common_suffix(offsets, prev.offsets, common - prefix);
+            push_runs(rows, prev.rows, 0, prefix);
+        }
+        put_lines(rows, txt, offsets, prefix, size - suffix);
+        if (last_) {
+            auto prev_size = std::size_t(last_->offsets.size());
+            push_runs(rows, last_->rows, prev_size - suffix, prev_size);
+        }
+
+        put_varint(texts_, rows.size());
+        for (auto [first, count] : rows) {
+            put_varint(texts_, first);
+            put_varint(texts_, count);
+        }
+        last_ = written_text{txt, offsets, std::move(rows)};
+        return num_texts_++;
+    }
+
+    void put_lines(runs& rows, const text& txt, const line_index& offsets,
+                   index first, index last)
+    {
+        if (first >= last)
+            return;
+        auto entries = offsets.entries(first, last);
+        auto entry   = entries.begin();
+        immer::for_each(txt.drop(first).take(last - first), [&] (auto&& ln) {
+            push_run(rows, put_line(ln, *entry++), 1);
+        });
+    }
+
+    // Returns the row of `ln` in the table of lines, adding it when it
+    // is not there yet.  Views of unchanged files are only looked up in
+    // them when the state is restored.
+    std::size_t put_line(const line& ln, const line_index::entry& entry)
+    {
+        if (auto& file = ln.viewed_file()) {
+            if (auto source = source_id(*file))
+                return put_record(source, ln.offset(), ln.size(), entry.hash);
+        }
+        auto key = ln.identity();
+        auto it  = lines_.find(key);
+        if (it != lines_.end())
+            return it->second;
+        static const char new_line = '\n';
+        auto offset = written_;
+        // the bytes of packed lines do not outlive the call
+        ln.for_each_chunk([&] (auto first, auto last) {
+            if (ln.is_packed())
+                out_.write_copy(first, last - first);
+            else
+                out_.write(first, last - first);
+        });
+        out_.write(&new_line, 1);
+        written_ += ln.size() + 1;
+        auto row = put_record(0, offset, ln.size(), entry.hash);
+        lines_.emplace(key, row);
+        return row;
+    }
+
+    // The lines of the state file are in the source 0.  Lines of the
+    // file that is replaced can not be left there.
+    std::size_t source_id(const mapped_file& file)
+    {
+        auto [it, inserted] = sources_ids_.emplace(&file, 0);
+        if (inserted) {
+            auto stamp = stamp_file(file.name());
+            auto replaced = replaced_
+                && stamp
+                && stamp->device == replaced_->device
+                && stamp->inode == replaced_->inode;
+            if (stamp && *stamp == file.stamp() && !replaced) {
+                put_string(sources_, file.name());
+                put_stamp(sources_, file.stamp());
+                it->second = ++num_sources_;
+            }
+        }
+        return it->second;
+    }
+
+    std::size_t put_record(std::size_t source, std::size_t offset,
+                           std::size_t size, std::uint64_t hash)
+    {
+        // every block starts afresh, so they can be read apart
+        if (num_lines_ % lines_per_block == 0) {
+            blocks_.push_back(records_.size());
+            next_offset_ = std::nullopt;
+        }
+        auto contiguous = source == last_source_ && offset == next_offset_;
+        put_varint(records_, source << 1 | (contiguous ? 1 : 0));
+        if (!contiguous)
+            put_varint(records_, offset);
+        put_varint(records_, size);
+        put_fixed(records_, hash);
+        last_source_ = source;
+        next_offset_ = offset + size + 1;
+        return num_lines_++;
+    }
+
+    file_writer out_;
+    std::optional<file_stamp> replaced_;
+    std::size_t written_ = 0;
+
+    std::string sources_;
+    std::size_t num_sources_ = 0;
+    std::unordered_map<const mapped_file*, std::size_t> sources_ids_;
+
+    std::string records_;
+    std::vector<std::size_t> blocks_;
+    std::size_t num_lines_ = 0;
+    std::size_t last_source_ = 0;
+    std::optional<std::size_t> next_offset_;
+    std::unordered_map<std::tuple<const void*, std::uintptr_t, std::size_t>,
+                       std::size_t> lines_;
+
+    std::string texts_;
+    std::size_t num_texts_ = 0;
+    std::optional<written_text> last_;
+
+    std::string state_;
+};
+
+// The files that lines are views of, null for those that changed
+using sources = std::vector<std::shared_ptr<const mapped_file>>;
+using lines_block = std::pair<text, line_index>;
+
+// Rows of the table of lines, with the rows, in order, of the lines of
+// files that changed, which are left empty
+struct lines_table
+{
+    lines_block block;
+    std::vector<std::size_t> missing;
+};
+
+// Reads `count` records of the table of lines, starting at `row`, as
+// views of `files`
+lines_table read_lines(reader in, std::size_t row, std::size_t count,
+                       const sources& files)
+{
+    auto lines   = text{}.transient();
+    auto entries = std::vector<line_index::entry>{};
+    auto missing = std::vector<std::size_t>{};
+    entries.reserve(count);
+    auto offset  = std::uint64_t{};
+    for (auto i = std::size_t{}; i < count; ++i) {
+        auto head   = in.varint();
+        auto source = head >> 1;
+        if (!(head & 1))
+            offset = in.varint();
+        auto size   = in.varint();
+        auto hash   = in.fixed();
+        if (source >= files.size())
+            corrupt();
+        if (auto& file = files[source]) {
+            if (offset > file->size() || size > file->size() - offset)
+                corrupt();
+            lines.push_back(line::view(file, offset, size));
+        } else {
+            lines.push_back(line{});
+            missing.push_back(row + i);
+        }
+        entries.push_back({size, hash});
+        offset += size + 1;
+    }
+    return {{lines.persistent(), line_index{entries}}, std::move(missing)};
+}
+
+// Reads the table of lines, decoding its blocks concurrently
+lines_table read_table(executor& workers, reader& in, const sources& files)
+{
+    auto num_lines  = in.varint();
+    auto num_blocks = in.varint();
+    if (num_blocks != (num_lines + lines_per_block - 1) / lines_per_block)
+        corrupt();
+    auto blocks = std::vector<std::uint64_t>{};
+    for (auto i = std::uint64_t{}; i < num_blocks; ++i)
+        blocks.push_back(in.varint());
+    auto records = in.take(in.varint());
+    auto size    = std::uint64_t(records.last - records.first);
+    blocks.push_back(size);
+
+    auto results = std::vector<std::future<lines_table>>{};
+    for (auto i = std::size_t{}; i < num_blocks; ++i) {
+        auto first = blocks[i];
+        auto last  = blocks[i + 1];
+        if (first > last || last > size)
+            corrupt();
+        auto row   = i * lines_per_block;
+        auto count = std::min<std::uint64_t>(lines_per_block, num_lines - row);
+        auto block = reader{records.first + first, records.first + last};
+        auto task  = std::make_shared<std::packaged_task<lines_table()>>(
+            [=] { return read_lines(block, row, count, files); });
+        results.push_back(task->get_future());
+        workers.post([task] { (*task)(); });
+    }
+    auto table = lines_table{};
+    for (auto& r : results) {
+        auto [block, missing] = workers.get(std::move(r));
+        table.block.first  = table.block.first + block.first;
+        table.block.second = table.block.second + block.second;
+        table.missing.insert(table.missing.end(),
+                             missing.begin(), missing.end());
+    }
+    return table;
+}
+
+// Reads a text, made of slices of the `table`, or nothing when some of
+// its lines are missing
+std::optional<lines_block> read_text(reader& in, const lines_table& table)
+{
+    auto& [lines, offsets] = table.block;
+    auto result   = lines_block{};
+    auto complete = true;
+    auto num_runs = in.varint();
+    for (auto i = std::uint64_t{}; i < num_runs; ++i) {
+        auto first = in.varint();
+        auto count = in.varint();
+        if (first > lines.size() || count > lines.size() - first)
+            corrupt();
+        auto last = (index)(first + count);
+        auto it   = std::lower_bound(table.missing.begin(),
+                                     table.missing.end(), first);
+        complete  = complete && (it == table.missing.end() || *it >= first + count);
+        result.first  = result.first + lines.take(last).drop(first);
+        result.second = result.second + offsets.take(last).drop((index)first);
+    }
+    return complete ? std::optional{result} : std::nullopt;
+}
+
+using restored_texts = std::vector<std::optional<lines_block>>;
+
+// A stale or corrupt state file may have positions past the end of the
+// text that they are in, which are moved to the nearest valid one
+coord clamp_position(const text& content, coord pos)
+{
+    pos.row = std::clamp(pos.row, index{}, (index)content.size());
+    pos.col = std::clamp(pos.col, index{},
+                         line_length(get_line(content, pos.row)));
+    return pos;
+}
+
+// Clamps the other cursors, sorted, without those at the cursor `main`
+cursor_set clamp_cursors(const text& content, coord main,
+                         const cursor_set& cursors)
+{
+    auto others = std::vector<coord>{};
+    others.reserve(cursors.size());
+    for (auto pos : cursors)
+        others.push_back(clamp_position(content, pos));
+    std::sort(others.begin(), others.end());
+    others.erase(std::unique(others.begin(), others.end()), others.end());
+    auto result = cursor_set{}.transient();
+    for (auto pos : others)
+        if (pos != main)
+            result.push_back(pos);
+    return result.persistent();
+}
+
+// Returns the buffer, and whether all of its texts were there.  The
+// ones that were not, are left empty.
+std::pair<buffer, bool> read_buffer(reader& in, const restored_texts& texts)
+{
+    auto complete = true;
+    auto text_at  = [&] {
+        auto id = in.varint();
+        if (id >= texts.size())
+            corrupt();
+        complete = complete && texts[id];
+        return texts[id].value_or(lines_block{});
+    };
+    auto buf   = buffer{};
+    buf.id     = in.varint();
+    auto kind  = in.varint();
+    auto name  = immer::box<std::string>{in.string()};
+    auto known = in.varint() ? std::optional<file_stamp>{in.stamp()}
+                             : std::nullopt;
+    auto [saved, saved_offsets] = text_at();
+    if (kind == 0)
+        buf.from = no_file{name, saved, saved_offsets};
+    else
+        buf.from = existing_file{name, saved, saved_offsets, known};
+    std::tie(buf.content, buf.offsets) = text_at();
+    auto clamp  = [&] (coord pos) { return clamp_position(buf.content, pos); };
+    buf.cursor  = clamp(in.position());
+    buf.scroll  = in.position();
+    buf.scroll  = {std::clamp(buf.scroll.row, index{}, buf.cursor.row),
+                   std::max(buf.scroll.col, index{})};
+    buf.selection_start = optional_map(in.optional_position(), clamp);
+    buf.cursors = clamp_cursors(buf.content, buf.cursor, in.cursors());
+    auto& history  = buf.history;
+    history.budget = in.varint();
+    history.bytes  = in.varint();
+    if (in.varint())
+        history.position = in.varint();
+    auto num_entries = in.varint();
+    for (auto i = std::uint64_t{}; i < num_entries; ++i) {
+        auto entry = snapshot{};
+        std::tie(entry.content, entry.offsets) = text_at();
+        auto clamp = [&] (coord pos) {
+            return clamp_position(entry.content, pos);
+        };
+        entry.cursor     = clamp(in.position());
+        entry.bytes      = in.varint();
+        entry.insert_run = optional_map(in.optional_position(), clamp);
+        entry.inserts    = std::max((int)in.integer(), 0);
+        entry.cursors    = clamp_cursors(entry.content, entry.cursor,
+                                         in.cursors());
+        history.entries  = history.entries.push_back(entry);
+    }
+    if (history.position && *history.position > history.entries.size())
+        history.position = std::nullopt;
+    return {buf, complete};
+}
+
+} // anonymous namespace
+
+void save_state(const std::string& fname, const application& app)
+{
+    auto temp_name = std::string{};
+    try {
+        auto writer = state_writer{fname, stamp_file(fname)};
+        temp_name   = writer.name();
+        writer.put_application(app);
+        writer.close();
+        replace_file(temp_name, fname);
+    } catch (...) {
+        if (!temp_name.empty())
+            std::remove(temp_name.c_str());
+        throw;
+    }
+}
+
+result<application, action> restore_state(executor& workers,
+                                          const std::string& fname,
+                                          application init)
+{
+    auto file = map_file(fname);
+    if (file->size() < magic_size + trailer_size ||
+        std::memcmp(file->data(), magic, magic_size) != 0)
+        throw std::runtime_error{"not a state file: " + fname};
+    auto trailer     = reader{file->end() - trailer_size, file->end()};
+    auto meta_offset = trailer.fixed();
+    auto meta_size   = trailer.fixed();
+    if (meta_offset < magic_size ||
+        meta_offset > file->size() - trailer_size ||
+        meta_size != file->size() - trailer_size - meta_offset)
+        corrupt();
+    auto in = reader{file->data() + meta_offset, file->end() - trailer_size};
+
+    // the lines of files that changed are not there anymore
+    auto files = sources{file};
+    auto num_files = in.varint();
+    for (auto i = std::uint64_t{}; i < num_files; ++i) {
+        auto name   = in.string();
+        auto stamp  = in.stamp();
+        auto source = std::shared_ptr<const mapped_file>{};
+        try {
+            source = map_file(name);
+        } catch (const std::system_error&) {}
+        if (source && source->stamp() != stamp)
+            source = nullptr;
+        files.push_back(std::move(source));
+    }
+
+    auto table     = read_table(workers, in, files);
+    auto num_texts = in.varint();
+    auto texts     = restored_texts{};
+    for (auto i = std::uint64_t{}; i < num_texts; ++i)
+        texts.push_back(read_text(in, table));
+
+    auto state       = init;
+    auto stale       = std::vector<buffer_id>{};
+    auto names       = std::string{};
+    auto num_buffers = in.varint();
+    for (auto i = std::uint64_t{}; i < num_buffers; ++i) {
+        auto [buf, complete] = read_buffer(in, texts);
+        if (!complete) {
+            stale.push_back(buf.id);
+            names += (names.empty() ? "" : ", ") + buffer_name(buf).get();
+        }
+        if (i == 0)
+            state.current = buf;
+        else
+            state.buffers = state.buffers.push_back(buf);
+    }
+    state.last_buffer_id = in.varint();
+    auto num_clips = in.varint();
+    for (auto i = std::uint64_t{}; i < num_clips; ++i) {
+        auto id = in.varint();
+        if (id >= texts.size())
+            corrupt();
+        if (texts[id])
+            state = put_clipboard(state, texts[id]->first);
+    }
+    state.last_search = in.string();
+
+    // the buffers with lines of files that changed are loaded again
+    auto reload = effect<action>{noop};
+    for (auto id : stale) {
+        auto [next, eff] = reload_buffer(state, id);
+        state  = next;
+        reload = [reload, eff = eff] (const context<action>& ctx) {
+            reload(ctx);
+            eff(ctx);
+        };
+    }
+    if (!stale.empty())
+        state = put_message(state, "changed since the state was saved, "
+                                   "loaded again: " + names);
+    return {state, reload};
+}
+
+} // namespace ewig
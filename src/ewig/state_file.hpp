@@ -0,0 +1,60 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <ewig/application.hpp>
+#include <ewig/executor.hpp>
+
+#include <string>
+
+namespace ewig {
+
+/**
+ * Writes the buffers of `app`, with their cursors and undo histories,
+ * and the clipboard to the state file `fname`, which is atomically
+ * replaced.  Buffers that are still loading are left out.
+ *
+ * Texts are written as runs of rows of a table of lines.  A text shares
+ * the rows at its beginning and at its end that have the same contents
+ * as the text written before it, which are found comparing the
+ * fingerprints of their indexes, so every snapshot of an undo history
+ * takes a few runs only.  The bytes of every line are written once, or
+ * not at all for views of files that did not change since they were
+ * mapped, which are written as where they are in them.
+ */
+void save_state(const std::string& fname, const application& app);
+
+/**
+ * Returns `init` with the buffers and the clipboard that `save_state`
+ * wrote to `fname`.  The file is mapped in memory and the lines become
+ * views of it, or views of their files again, so they are not read
+ * until they are needed, and the indexes are rebuilt from the hashes
+ * that were saved.  The table of lines is built by `workers`.  Throws
+ * `std::runtime_error` when the file is not a state file.  The buffers
+ * with lines of files that changed since it was written, or that are
+ * gone, are loaded again by the returned effect instead, and the rest
+ * are restored.
+ */
+result<application, action> restore_state(executor& workers,
+                                          const std::string& fname,
+                                          application init);
+
+} // namespace ewig
@@ -20,10 +20,21 @@
 
 #pragma once
 
+#include <ewig/executor.hpp>
+#include <ewig/io_scheduler.hpp>
+#include <ewig/profile.hpp>
+
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace ewig {
 
@@ -33,36 +44,82 @@ struct context
     using action_t      = Action;
     using service_t     = boost::asio::io_service;
     using service_ref_t = std::reference_wrapper<service_t>;
+    using executor_t    = ewig::executor;
+    using io_t          = ewig::io_scheduler;
     using finish_t      = std::function<void()>;
     using dispatch_t    = std::function<void(action_t)>;
 
     std::reference_wrapper<service_t> service;
+    std::reference_wrapper<executor_t> workers;
+    std::reference_wrapper<io_t> io;
     finish_t finish;
     dispatch_t dispatch;
+    // the effects still working in the background, for all the copies
+    std::shared_ptr<std::atomic<std::size_t>> running =
+        std::make_shared<std::atomic<std::size_t>>(0);
 
     context(const context& ctx) = default;
     context(context&& ctx) = default;
 
     template <typename Action_>
     context(const context<Action_>& ctx)
+        : context(ctx, ctx.dispatch)
+    {}
+
+    // Like `ctx`, but its actions go to `ds`
+    template <typename Action_>
+    context(const context<Action_>& ctx, dispatch_t ds)
         : service(ctx.service)
+        , workers(ctx.workers)
+        , io(ctx.io)
         , finish(ctx.finish)
-        , dispatch(ctx.dispatch)
+        , dispatch(std::move(ds))
+        , running(ctx.running)
     {}
 
-    context(service_t& serv, finish_t fn, dispatch_t ds)
+    context(service_t& serv, executor_t& ex, io_t& io,
+            finish_t fn, dispatch_t ds)
         : service(serv)
+        , workers(ex)
+        , io(io)
         , finish(std::move(fn))
         , dispatch(std::move(ds))
     {}
 
+    // Runs `fn` in the worker pool.  The event loop keeps running
+    // until it is done, so effects can still dispatch actions.
     template <typename Fn>
     void async(Fn&& fn) const
     {
-        std::thread([fn=std::move(fn),
-                   work=boost::asio::io_service::work(service)] {
-            fn();
-        }).detach();
+        workers.get().post([fn=std::move(fn), work=work_()] { fn(); });
+    }
+
+    // Like `async`, but waits for the I/O scheduler to let `fn` run,
+    // on behalf of `owner`.
+    template <typename Fn>
+    void async_io(std::size_t owner, bool write, Fn&& fn) const
+    {
+        io.get().post(owner, write,
+                      [fn=std::move(fn), work=work_()] { fn(); });
+    }
+
+private:
+    // Keeps the event loop running, and counts the effect as running,
+    // while some copy of it is alive
+    struct work_t
+    {
+        work_t(service_t& serv, std::shared_ptr<std::atomic<std::size_t>> n)
+            : work{serv}, running{std::move(n)}
+        { ++*running; }
+        ~work_t() { --*running; }
+
+        boost::asio::io_service::work work;
+        std::shared_ptr<std::atomic<std::size_t>> running;
+    };
+
+    std::shared_ptr<work_t> work_() const
+    {
+        return std::make_shared<work_t>(service, running);
     }
 };
 
@@ -89,39 +146,151 @@ struct store : context<Action>
     using reducer_t = std::function<result<model_t, action_t>
                                    (model_t, action_t)>;
     using view_t    = std::function<void(model_t)>;
+    using clock_t   = std::chrono::steady_clock;
 
     store(const store&) = delete;
     store& operator=(const store&) = delete;
 
     store(boost::asio::io_service& serv,
+          executor& ex,
+          io_scheduler& io,
           model_t init,
           reducer_t reducer,
           view_t view,
           finish_t finish)
         : base_t{serv,
+                 ex,
+                 io,
                  std::move(finish),
                  [this] (auto ev) { dispatch(ev); }}
         , model_{std::move(init)}
         , reducer_{std::move(reducer)}
         , view_{std::move(view)}
+        , frame_timer_{serv}
     {
-        view_(model_);
+        show_();
+    }
+
+    /**
+     * Enables batching.  All the actions that are queued by the time
+     * the event loop gets to them are reduced at once, and the view is
+     * only called after the last one.  When `frame_interval` is not
+     * zero, the view is called at most once per interval.  Still, the
+     * first action after a pause is drawn immediately, so coalescing
+     * frames never adds latency when typing at a normal pace.
+     */
+    void batch(clock_t::duration frame_interval = {})
+    {
+        batching_ = true;
+        frame_interval_ = frame_interval;
     }
 
     void dispatch(action_t action)
     {
-        base_t::service.get().post([=] {
-            auto [model, effect] = reducer_(model_, action);
-            model_ = model;
-            effect(*this);
-            view_(model_);
-        });
+        if (!batching_) {
+            base_t::service.get().post([=] {
+                reduce_(action);
+                show_();
+            });
+        } else {
+            auto lock = std::lock_guard<std::mutex>{queue_mutex_};
+            queue_.push_back(std::move(action));
+            if (!drain_posted_) {
+                drain_posted_ = true;
+                base_t::service.get().post([this] { drain_(); });
+            }
+        }
+    }
+
+    // The latest model, to be read from the event loop, or once it
+    // stopped running
+    const model_t& current() const { return model_; }
+
+    // Runs the event loop until no effect is left working in the
+    // background, nor any action waiting.  Timers that are still
+    // waiting are not run.
+    void run_until_idle()
+    {
+        auto& serv = base_t::service.get();
+        for (;;) {
+            auto idle = *base_t::running == 0;
+            serv.poll();
+            serv.reset();
+            if (idle && *base_t::running == 0)
+                return;
+            if (!idle)
+                std::this_thread::yield();
+        }
     }
 
 private:
+    // The reducer and the effects are timed apart, since the effects
+    // may do some work before leaving it to other threads
+    void reduce_(action_t action)
+    {
+        auto tag = profile::enabled() ? profile_tag(action)
+                                      : std::string_view{};
+        auto [model, effect] = [&] {
+            auto timing = profile::scope{"reduce", tag};
+            return reducer_(model_, std::move(action));
+        } ();
+        model_ = model;
+        auto timing = profile::scope{"effect", tag};
+        effect(*this);
+    }
+
+    void show_()
+    {
+        static const auto draw_tag = profile::tag{"view", "draw"};
+        auto timing = profile::scope{draw_tag};
+        view_(model_);
+    }
+
+    void drain_()
+    {
+        auto actions = std::vector<action_t>{};
+        {
+            auto lock = std::lock_guard<std::mutex>{queue_mutex_};
+            std::swap(actions, queue_);
+            drain_posted_ = false;
+        }
+        for (auto& action : actions)
+            reduce_(std::move(action));
+        render_();
+    }
+
+    void render_()
+    {
+        auto now = clock_t::now();
+        if (now - last_frame_ >= frame_interval_) {
+            last_frame_ = now;
+            show_();
+        } else if (!frame_pending_) {
+            frame_pending_ = true;
+            frame_timer_.expires_at(last_frame_ + frame_interval_);
+            frame_timer_.async_wait([this] (auto ec) {
+                frame_pending_ = false;
+                if (!ec) {
+                    last_frame_ = clock_t::now();
+                    show_();
+                }
+            });
+        }
+    }
+
     model_t model_;
     reducer_t reducer_;
     view_t view_;
+
+    bool batching_ = false;
+    clock_t::duration frame_interval_ = {};
+    clock_t::time_point last_frame_ = {};
+    bool frame_pending_ = false;
+    boost::asio::steady_timer frame_timer_;
+
+    std::mutex queue_mutex_;
+    std::vector<action_t> queue_;
+    bool drain_posted_ = false;
 };
 
 } // namespace ewig
@@ -23,6 +23,11 @@
 
 #include <boost/asio/read.hpp>
 
+#include <utf8.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 
 extern "C" {
@@ -34,10 +39,47 @@ using namespace std::string_literals;
 
 namespace ewig {
 
+namespace {
+
+// Terminals with support for bracketed paste mode surround the text
+// pasted into them with these sequences, so it can be inserted at
+// once instead of interpreting it as typed keys.
+const auto enable_bracketed_paste  = "\033[?2004h";
+const auto disable_bracketed_paste = "\033[?2004l";
+const auto paste_start = L"\033[200~"s;
+const auto paste_end   = L"\033[201~"s;
+
+// How long to wait for the rest of a paste start sequence before
+// taking its keys as typed, and for the rest of a paste before
+// inserting what arrived.  Pastes are inserted in pieces of at most
+// `max_paste_size` characters.
+constexpr auto paste_start_timeout = std::chrono::milliseconds{100};
+constexpr auto paste_timeout       = std::chrono::seconds{1};
+constexpr auto max_paste_size      = std::size_t{1} << 16;
+
+// Converts the pasted characters to UTF-8, normalizing the carriage
+// returns that terminals send in place of new lines.
+std::string encode_paste(const std::wstring& str)
+{
+    auto result = std::string{};
+    auto prev = wchar_t{};
+    for (auto c : str) {
+        if (c == '\r')
+            result.push_back('\n');
+        else if (c != '\n' || prev != '\r')
+            utf8::unchecked::append(c, std::back_inserter(result));
+        prev = c;
+    }
+    return result;
+}
+
+} // anonymous namespace
+
 terminal::terminal(boost::asio::io_service& serv)
     : win_{::initscr()}
     , input_{serv, ::dup(STDIN_FILENO)}
     , signal_{serv, SIGWINCH}
+    , input_timer_{serv}
 {
     if (win_.get() != ::stdscr)
         throw std::runtime_error{"error while initializing ncurses"};
@@ -52,6 +94,14 @@ terminal::terminal(boost::asio::io_service& serv)
     ::init_pair((int)color::message,   COLOR_YELLOW, -1);
     ::init_pair((int)color::selection, COLOR_BLACK, COLOR_YELLOW);
     ::init_pair((int)color::mode_line_message, COLOR_WHITE, COLOR_RED);
+    ::init_pair((int)color::keyword,      COLOR_CYAN, -1);
+    ::init_pair((int)color::string,       COLOR_GREEN, -1);
+    ::init_pair((int)color::comment,      COLOR_BLUE, -1);
+    ::init_pair((int)color::number,       COLOR_MAGENTA, -1);
+    ::init_pair((int)color::preprocessor, COLOR_RED, -1);
+
+    std::fputs(enable_bracketed_paste, stdout);
+    std::fflush(stdout);
 }
 
 coord terminal::size()
@@ -73,6 +123,7 @@ void terminal::stop()
 {
     input_.cancel();
     signal_.cancel();
+    input_timer_.cancel();
     handler_ = {};
 }
 
@@ -99,14 +150,92 @@ void terminal::next_key_()
         if (!ec) {
             auto key = wint_t{};
             auto res = int{};
-            while (ERR != (res = ::wget_wch(win_.get(), &key))) {
-                next_key_();
-                handler_(key_action{{res, key}});
+            while (ERR != (res = ::wget_wch(win_.get(), &key)))
+                input_key_({res, key});
+            wait_input_();
+            next_key_();
+        }
+    });
+}
+
+void terminal::wait_input_()
+{
+    // a paste may be split across reads, so an incomplete one waits
+    // for more input, but not forever: an incomplete paste start
+    // sequence is just keys typed by the user, like an escape, and a
+    // paste whose end never arrives is inserted as it is
+    if (!paste_ && pending_.empty()) {
+        input_timer_.cancel();
+        return;
+    }
+    input_timer_.expires_from_now(paste_ ? paste_timeout
+                                         : paste_start_timeout);
+    input_timer_.async_wait([this] (auto ec) {
+        if (!ec && handler_) {
+            if (paste_) {
+                flush_paste_(0);
+                paste_.reset();
             }
+            flush_pending_();
         }
     });
 }
 
+void terminal::input_key_(key_code k)
+{
+    auto [res, key] = k;
+    if (paste_) {
+        if (res == KEY_CODE_YES)
+            return;
+        paste_->push_back(key);
+        if (paste_->size() >= paste_end.size() &&
+            paste_->compare(paste_->size() - paste_end.size(),
+                            paste_end.size(), paste_end) == 0) {
+            paste_->resize(paste_->size() - paste_end.size());
+            auto content = encode_paste(*paste_);
+            paste_.reset();
+            handler_(command_action{"insert-text", to_text(content)});
+        } else if (paste_->size() >= max_paste_size) {
+            flush_paste_(paste_end.size());
+        }
+    } else if (res != KEY_CODE_YES &&
+               pending_.size() < paste_start.size() &&
+               paste_start[pending_.size()] == (wchar_t)key) {
+        pending_.push_back(key);
+        if (pending_ == paste_start) {
+            pending_.clear();
+            paste_ = std::wstring{};
+        }
+    } else if (!pending_.empty()) {
+        flush_pending_();
+        input_key_(k);
+    } else {
+        handler_(key_action{k});
+    }
+}
+
+void terminal::flush_pending_()
+{
+    for (auto c : pending_)
+        handler_(key_action{{OK, c}});
+    pending_.clear();
+}
+
+// Inserts the text pasted so far but the last `keep` characters, that
+// could be the start of the end sequence, or the new line following a
+// carriage return.
+void terminal::flush_paste_(std::size_t keep)
+{
+    auto split = paste_->size() - std::min(keep, paste_->size());
+    if (split > 0 && split < paste_->size() && (*paste_)[split - 1] == '\r')
+        --split;
+    if (split > 0) {
+        auto content = encode_paste(paste_->substr(0, split));
+        paste_->erase(0, split);
+        handler_(command_action{"insert-text", to_text(content)});
+    }
+}
+
 void terminal::cleanup_fn::operator() (WINDOW* win) const
 {
     if (win) {
@@ -116,6 +245,8 @@ void terminal::cleanup_fn::operator() (WINDOW* win) const
         auto key = wint_t{};
         while (::get_wch(&key) != ERR);
         ::endwin();
+        std::fputs(disable_bracketed_paste, stdout);
+        std::fflush(stdout);
     }
 }
 
@@ -24,8 +24,12 @@
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
 
+#include <optional>
+#include <string>
+
 struct _win_st;
 
 namespace ewig {
@@ -49,10 +53,21 @@ private:
 
     void next_key_();
     void next_resize_();
+    void input_key_(key_code key);
+    void flush_pending_();
+    void flush_paste_(std::size_t keep);
+    void wait_input_();
+
+    // keys read so far that could start a bracketed paste, and the
+    // text pasted so far while within one, which are given up on when
+    // the rest of the sequence does not arrive in time
+    std::wstring pending_;
+    std::optional<std::wstring> paste_;
 
     std::unique_ptr<_win_st, cleanup_fn> win_;
     boost::asio::posix::stream_descriptor input_;
     boost::asio::signal_set signal_;
+    boost::asio::steady_timer input_timer_;
     action_handler handler_;
 };
 
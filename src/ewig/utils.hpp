@@ -40,10 +40,10 @@ struct hash<tuple<T...>>
     }
 };
 
-template <typename T>
-struct hash<immer::vector<T>>
+template <typename T, typename MP, auto B, auto BL>
+struct hash<immer::vector<T, MP, B, BL>>
 {
-    size_t operator()(const immer::vector<T>& arg) const noexcept
+    size_t operator()(const immer::vector<T, MP, B, BL>& arg) const noexcept
     {
         return boost::hash_range(arg.begin(), arg.end()) ;
     }
@@ -59,4 +59,17 @@ std::optional<T> optional_map(std::optional<T> v, Fn&& fn)
     return v ? std::forward<Fn>(fn)(std::move(*v)) : v;
 }
 
+/**
+ * Returns whether the immer vectors `a` and `b` are the very same
+ * value, sharing all their nodes.  This is a constant time check: when
+ * it is false, the contents may still be equal.
+ */
+template <typename Vector>
+bool identical(const Vector& a, const Vector& b)
+{
+    return a.size() == b.size()
+        && a.impl().root == b.impl().root
+        && a.impl().tail == b.impl().tail;
+}
+
 } // namespace ewig
@@ -0,0 +1,130 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/diff.hpp>
+#include <ewig/buffer.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <random>
+#include <string>
+
+using namespace ewig;
+
+namespace {
+
+text make_text(std::mt19937& rng, int rows)
+{
+    auto result = text{};
+    for (auto i = 0; i < rows; ++i) {
+        auto str = std::string(1, char('a' + rng() % 6));
+        result = result.push_back(line{str.begin(), str.end()});
+    }
+    return result;
+}
+
+// Replaces the hunks of `a` by the rows of `b`, from the last one, so
+// the rows of the others do not move, like reverting does
+text apply(text a, const text& b, const std::vector<line_hunk>& hunks)
+{
+    for (auto h = hunks.rbegin(); h != hunks.rend(); ++h)
+        a = a.take(h->first)
+            + b.drop(h->new_first).take(h->added)
+            + a.drop(h->first + h->removed);
+    return a;
+}
+
+// Checks that the hunks are in order, apart, and turn `a` into `b`,
+// returning how many rows they insert or remove
+ewig::index check_diff(const text& a, const text& b,
+                       ewig::index max_edits = default_max_edits)
+{
+    auto hunks = diff_lines(line_index{a}, line_index{b}, max_edits);
+    auto edits = ewig::index{};
+    auto last  = ewig::index{};
+    auto delta = ewig::index{};
+    for (auto& h : hunks) {
+        CHECK(h.first >= last);
+        CHECK((h.removed > 0 || h.added > 0));
+        CHECK(h.new_first == h.first + delta);
+        last   = h.first + h.removed;
+        delta += h.added - h.removed;
+        edits += h.added + h.removed;
+    }
+    CHECK(last <= (ewig::index)a.size());
+    auto result = apply(a, b, hunks);
+    CHECK(line_index{result} == line_index{b});
+    return edits;
+}
+
+} // anonymous namespace
+
+TEST_CASE("equal texts have no hunks")
+{
+    auto rng = std::mt19937{1};
+    auto txt = make_text(rng, 100);
+    CHECK(diff_lines(line_index{txt}, line_index{txt}).empty());
+    CHECK(diff_lines(line_index{}, line_index{}).empty());
+}
+
+TEST_CASE("simple diffs")
+{
+    auto a = to_text("one\ntwo\nthree\nfour");
+    CHECK(check_diff(a, to_text("one\nthree\nfour")) == 1);
+    CHECK(check_diff(a, to_text("one\ntwo\n2.5\nthree\nfour")) == 1);
+    CHECK(check_diff(a, to_text("one\n2\nthree\nfour")) == 2);
+    CHECK(check_diff(a, to_text("zero\none\ntwo\nthree\nfour\nfive")) == 2);
+    CHECK(check_diff(a, text{}) == 4);
+    CHECK(check_diff(text{}, a) == 4);
+}
+
+TEST_CASE("applying the diff of random edits gives the edited text")
+{
+    auto rng = std::mt19937{7};
+    for (auto i = 0; i < 300; ++i) {
+        auto a = make_text(rng, rng() % 60);
+        auto b = a;
+        auto made = ewig::index{};
+        for (auto n = rng() % 6; n > 0; --n) {
+            auto row = ewig::index(rng() % (b.size() + 1));
+            if (rng() % 2 && row < (ewig::index)b.size()) {
+                b = b.erase(row);
+            } else {
+                auto str = std::string(1, char('a' + rng() % 6));
+                b = b.insert(row, line{str.begin(), str.end()});
+            }
+            ++made;
+        }
+        // Myers' algorithm finds the shortest edit script
+        CHECK(check_diff(a, b) <= made);
+        CHECK(check_diff(b, a) <= made);
+    }
+}
+
+TEST_CASE("too many edits give a single hunk")
+{
+    auto rng = std::mt19937{3};
+    auto a   = make_text(rng, 200);
+    auto b   = make_text(rng, 150);
+    auto hunks = diff_lines(line_index{a}, line_index{b}, 4);
+    CHECK(hunks.size() <= 1);
+    check_diff(a, b, 4);
+    check_diff(a, b);
+}
@@ -0,0 +1,83 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/highlight.hpp>
+#include <ewig/buffer.hpp>
+
+#include <catch2/catch.hpp>
+
+using namespace ewig;
+
+namespace {
+
+highlighting highlight(const text& content)
+{
+    return rehighlight({}, syntax::c_like, content, line_index{content},
+                       {}, [] (auto&&) {});
+}
+
+// Whether the whole line is shown as a comment
+bool all_comment(const lexed_line& lexed)
+{
+    auto& spans = lexed.spans.get();
+    return spans.size() == 1 && spans[0].first == 0
+        && spans[0].kind == face::comment;
+}
+
+} // anonymous namespace
+
+TEST_CASE("rows are reused when lexed the same way")
+{
+    auto txt = to_text("int a;\n/* open\nint c;");
+    auto hl  = highlight(txt);
+    REQUIRE(hl.rows.size() == 3);
+    CHECK(row_state(hl, 0) == lexer_state::normal);
+    CHECK(row_state(hl, 2) == lexer_state::block_comment);
+    auto row = highlighted_row(hl, 2, txt[2], row_state(hl, 2));
+    REQUIRE(row);
+    CHECK(&row->spans.get() == &hl.rows[2].spans.get());
+    CHECK(all_comment(*row));
+}
+
+TEST_CASE("rows reached in another state are lexed again")
+{
+    auto txt = to_text("int a;\nint b;\nint c;");
+    auto hl  = highlight(txt);
+    auto row = highlighted_row(hl, 2, txt[2], lexer_state::block_comment);
+    REQUIRE(row);
+    CHECK(all_comment(*row));
+    CHECK(row->out == lexer_state::block_comment);
+}
+
+TEST_CASE("edited rows are lexed again")
+{
+    auto txt    = to_text("int a;\nint b;");
+    auto hl     = highlight(txt);
+    auto edited = to_text("int a; /*\nint b;");
+    auto row    = highlighted_row(hl, 0, edited[0], lexer_state::normal);
+    REQUIRE(row);
+    CHECK(row->out == lexer_state::block_comment);
+    // equal lines that are not the same one are lexed again too
+    auto copy = to_text("int a;\nint b;");
+    row = highlighted_row(hl, 1, copy[1], lexer_state::normal);
+    REQUIRE(row);
+    CHECK(&row->spans.get() != &hl.rows[1].spans.get());
+    CHECK(!highlighted_row(hl, 2, copy[1], lexer_state::normal));
+}
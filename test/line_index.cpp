@@ -0,0 +1,141 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/line_index.hpp>
+#include <ewig/buffer.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace ewig;
+
+namespace {
+
+text make_text(const std::vector<std::string>& lines)
+{
+    auto result = text{};
+    for (auto& ln : lines)
+        result = result.push_back(line{ln.begin(), ln.end()});
+    return result;
+}
+
+// Checks every lookup of `idx` against the lines of `txt`
+void check_index(const line_index& idx, const text& txt)
+{
+    REQUIRE(idx.size() == (ewig::index)txt.size());
+    auto offset = std::size_t{};
+    for (auto row = ewig::index{}; row < idx.size(); ++row) {
+        CHECK(idx.offset(row) == offset);
+        auto size = txt[row].size();
+        for (auto pos = offset; pos <= offset + size; ++pos)
+            CHECK(idx.row(pos) == row);
+        offset += size + 1;
+    }
+    CHECK(idx.offset(idx.size()) == offset);
+    CHECK(idx.bytes() == offset);
+    CHECK(idx.row(offset) == idx.size());
+    CHECK(idx == line_index{txt});
+}
+
+} // anonymous namespace
+
+TEST_CASE("an index maps rows to offsets and back")
+{
+    auto txt = make_text({"hello", "", "world!", "x"});
+    auto idx = line_index{txt};
+    CHECK(idx.offset(0) == 0);
+    CHECK(idx.offset(1) == 6);
+    CHECK(idx.offset(2) == 7);
+    CHECK(idx.offset(3) == 14);
+    CHECK(idx.row(5) == 0);
+    CHECK(idx.row(6) == 1);
+    CHECK(idx.row(13) == 2);
+    check_index(idx, txt);
+    check_index(line_index{}, text{});
+}
+
+TEST_CASE("indexes of equal texts are equal")
+{
+    auto a = make_text({"a", "b", "c"});
+    auto b = make_text({"a", "b", "c"});
+    CHECK(line_index{a} == line_index{b});
+    CHECK(line_index{a}.hash() == line_index{b}.hash());
+    CHECK(line_index{a} != line_index{make_text({"a", "c", "b"})});
+    CHECK(line_index{a} != line_index{make_text({"a", "b"})});
+    CHECK(line_index{a} != line_index{make_text({"ab", "c"})});
+    // the shape of the tree does not matter
+    auto joined = line_index{make_text({"a"})} + line_index{make_text({"b", "c"})};
+    CHECK(joined == line_index{a});
+    CHECK(line_index{line_index{a}.entries(0, 3)} == line_index{a});
+}
+
+TEST_CASE("splitting and joining indexes")
+{
+    auto rng   = std::mt19937{42};
+    auto lines = std::vector<std::string>{};
+    for (auto i = 0; i < 300; ++i)
+        lines.push_back(std::string(rng() % 20, char('a' + rng() % 26)));
+    auto txt = make_text(lines);
+    auto idx = line_index{txt};
+    check_index(idx, txt);
+
+    SECTION("take and drop")
+    {
+        for (auto n : {0, 1, 17, 150, 299, 300}) {
+            check_index(idx.take(n), txt.take(n));
+            check_index(idx.drop(n), txt.drop(n));
+            CHECK(idx.take(n) + idx.drop(n) == idx);
+        }
+    }
+
+    SECTION("splice")
+    {
+        auto current = txt;
+        auto cidx    = idx;
+        for (auto i = 0; i < 200; ++i) {
+            auto row   = ewig::index(rng() % (current.size() + 1));
+            auto count = ewig::index(rng() % (current.size() - row + 1));
+            count      = std::min<ewig::index>(count, 5);
+            auto added = make_text({std::string(rng() % 8, 'z'),
+                                    std::to_string(i)})
+                .take(rng() % 3);
+            current = current.take(row) + added + current.drop(row + count);
+            cidx    = cidx.splice(row, count, added);
+            REQUIRE(cidx.size() == (ewig::index)current.size());
+            CHECK(cidx == line_index{current});
+        }
+        check_index(cidx, current);
+    }
+
+    SECTION("common prefix and suffix")
+    {
+        auto dash  = std::string{"-"};
+        auto other = txt.set(100, line{dash.begin(), dash.end()})
+                        .set(200, line{dash.begin(), dash.end()});
+        auto oidx  = line_index{other};
+        CHECK(common_prefix(idx, oidx, idx.size()) == 100);
+        CHECK(common_suffix(idx, oidx, idx.size()) == 99);
+        CHECK(common_prefix(idx, idx, idx.size()) == idx.size());
+        CHECK(common_prefix(idx, oidx, 50) == 50);
+    }
+}
@@ -0,0 +1,171 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/search.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <string>
+
+using namespace ewig;
+
+namespace {
+
+using cols = std::pair<ewig::index, ewig::index>;
+const auto none = cols{-1, -1};
+
+// The columns of the first match of `pat` in `str`, or `none`
+cols find(const pattern& pat, const std::string& str)
+{
+    auto result = search(to_text(str), pat, {0, 0}, true, true);
+    if (!result.match)
+        return none;
+    return {result.match->first.col, result.match->last.col};
+}
+
+cols find_regex(const std::string& re, const std::string& str)
+{
+    return find(pattern::regex(re), str);
+}
+
+} // anonymous namespace
+
+TEST_CASE("literal patterns match their bytes")
+{
+    auto pat = pattern::literal("a.b*");
+    CHECK(find(pat, "xxa.b*yy") == cols{2, 6});
+    CHECK(find(pat, "xxaxbbyy") == none);
+    CHECK(find(pattern::literal("ab"), "aab") == cols{1, 3});
+}
+
+TEST_CASE("regular expressions")
+{
+    SECTION("repetitions match the longest run")
+    {
+        CHECK(find_regex("ab*", "xabbbc") == cols{1, 5});
+        CHECK(find_regex("ab+c", "xac abbc") == cols{4, 8});
+        CHECK(find_regex("colou?r", "the color") == cols{4, 9});
+        CHECK(find_regex("colou?r", "the colour") == cols{4, 10});
+    }
+
+    SECTION("the leftmost match is found")
+    {
+        CHECK(find_regex("b+|a", "bba") == cols{0, 2});
+        CHECK(find_regex("a|b+", "xbba") == cols{1, 3});
+    }
+
+    SECTION("alternation and grouping")
+    {
+        CHECK(find_regex("(foo|bar)+", "a barfoo b") == cols{2, 8});
+        CHECK(find_regex("x(ab|cd)y", "xaby xcdy") == cols{0, 4});
+        CHECK(find_regex("x(ab|cd)y", "xacy") == none);
+    }
+
+    SECTION("classes and brackets")
+    {
+        CHECK(find_regex("\\d+", "abc 1234 x") == cols{4, 8});
+        CHECK(find_regex("\\w+", "  hello_1 ") == cols{2, 9});
+        CHECK(find_regex("a\\sb", "ab a b") == cols{3, 6});
+        CHECK(find_regex("[a-c]+", "xxcabd") == cols{2, 5});
+        CHECK(find_regex("[^a-z ]+", "abc DEF") == cols{4, 7});
+        CHECK(find_regex("a.c", "abc") == cols{0, 3});
+    }
+
+    SECTION("anchors")
+    {
+        CHECK(find_regex("^ab", "abab") == cols{0, 2});
+        CHECK(find_regex("^b", "ab") == none);
+        CHECK(find_regex("ab$", "abab") == cols{2, 4});
+        CHECK(find_regex("a$", "ab") == none);
+        CHECK(find_regex("a\\$", "xa$") == cols{1, 3});
+        CHECK(find_regex("a\\\\$", "a\\") == cols{0, 2});
+        CHECK(find_regex("a\\\\$", "a\\b") == none);
+    }
+
+    SECTION("non-ASCII characters are matched as a whole")
+    {
+        CHECK(find_regex("caf.", "un café") == cols{3, 7});
+        CHECK(find_regex("[^a-z]", "abé") == cols{2, 3});
+    }
+
+    SECTION("matches are never empty")
+    {
+        CHECK(find_regex("a*", "bbb") == none);
+        CHECK(find_regex("a*", "bba") == cols{2, 3});
+    }
+
+    SECTION("invalid patterns throw")
+    {
+        CHECK_THROWS_AS(pattern::regex("(ab"), std::runtime_error);
+        CHECK_THROWS_AS(pattern::regex("[ab"), std::runtime_error);
+        CHECK_THROWS_AS(pattern::regex("*a"), std::runtime_error);
+    }
+
+    SECTION("backtracking patterns finish")
+    {
+        auto str = std::string(2000, 'a');
+        CHECK(find_regex("(a*)*b", str) == none);
+        CHECK(find_regex("(a|aa)*c", str + "c") == cols{0, 2001});
+    }
+}
+
+TEST_CASE("searching a text")
+{
+    auto txt = to_text("one two\nthree two\nfour");
+    auto pat = pattern::literal("two");
+
+    SECTION("forward from a position")
+    {
+        auto r = search(txt, pat, {0, 5}, true, true);
+        REQUIRE(r.match);
+        CHECK(r.match->first == coord{1, 6});
+        CHECK(r.match->last == coord{1, 9});
+        CHECK(!r.wrapped);
+    }
+
+    SECTION("at the position when inclusive")
+    {
+        auto r = search(txt, pat, {0, 4}, true, true);
+        REQUIRE(r.match);
+        CHECK(r.match->first == coord{0, 4});
+    }
+
+    SECTION("backward")
+    {
+        auto r = search(txt, pat, {1, 6}, false, false);
+        REQUIRE(r.match);
+        CHECK(r.match->first == coord{0, 4});
+    }
+
+    SECTION("wrapping around")
+    {
+        auto r = search(txt, pat, {2, 0}, true, true);
+        REQUIRE(r.match);
+        CHECK(r.match->first == coord{0, 4});
+        CHECK(r.wrapped);
+    }
+
+    SECTION("cancelled")
+    {
+        auto token = cancellation{};
+        token.cancel();
+        CHECK(!search(txt, pat, {0, 0}, true, true, token).match);
+    }
+}
@@ -0,0 +1,249 @@
+//
+// ewig - an immutable text editor
+// Copyright (C) 2017 Juan Pedro Bolivar Puente
+//
+// This file is part of ewig.
+//
+// ewig is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// ewig is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with ewig.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <ewig/state_file.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glob.h>
+#include <unistd.h>
+
+using namespace ewig;
+
+namespace {
+
+// A state file that is removed at the end of the test
+struct temp_state
+{
+    std::string name;
+
+    temp_state()
+    {
+        auto dir = std::getenv("TMPDIR");
+        name = std::string{dir ? dir : "/tmp"} + "/ewig-test-state-"
+            + std::to_string(::getpid());
+    }
+    ~temp_state() { std::remove(name.c_str()); }
+
+    std::string read() const
+    {
+        auto file = std::ifstream{name, std::ios::binary};
+        return {std::istreambuf_iterator<char>{file}, {}};
+    }
+
+    void write(const std::string& data) const
+    {
+        auto file = std::ofstream{name, std::ios::binary | std::ios::trunc};
+        file.write(data.data(), data.size());
+    }
+};
+
+std::string to_string(const text& txt)
+{
+    auto result = std::string{};
+    for (auto& ln : txt) {
+        result.append(ln.begin(), ln.end());
+        result += '\n';
+    }
+    return result;
+}
+
+// An editor with two buffers, one of them edited twice
+application make_application()
+{
+    auto app = application{{24, 80}, key_map{}};
+    auto buf = set_content({}, to_text("first line\nsecond line\nthird"));
+    buf.id   = 1;
+    buf.from = existing_file{"some-file.txt", buf.content, buf.offsets};
+    auto edited = buf;
+    edited.cursor = {1, 6};
+    edited = insert_text(edited, to_text("ly\nnew"));
+    buf = record(buf, edited).first;
+    edited = buf;
+    edited.cursor = {0, 0};
+    edited = insert_char(edited, L'x');
+    buf = record(buf, edited).first;
+    buf.cursor = {2, 1};
+    buf.scroll = {1, 0};
+    buf.selection_start = coord{2, 3};
+    buf.cursors = cursor_set{}.push_back({0, 1}).push_back({3, 2});
+
+    auto other = set_content({}, to_text("scratch"));
+    other.id   = 2;
+    app.current = buf;
+    app.buffers = app.buffers.push_back(other);
+    app.last_buffer_id = 2;
+    app = put_clipboard(app, to_text("killed\ntext"));
+    app.last_search = "line";
+    return app;
+}
+
+} // anonymous namespace
+
+TEST_CASE("the state survives a round trip")
+{
+    auto workers = executor{2};
+    auto file    = temp_state{};
+    auto app     = make_application();
+    save_state(file.name, app);
+
+    auto init     = application{{24, 80}, key_map{}};
+    auto restored = restore_state(workers, file.name, init).first;
+    auto& buf     = restored.current;
+    auto& orig    = app.current;
+    CHECK(to_string(buf.content) == to_string(orig.content));
+    CHECK(buf.offsets == line_index{buf.content});
+    CHECK(buf.offsets == orig.offsets);
+    CHECK(buffer_name(buf).get() == "some-file.txt");
+    CHECK(buf.cursor == orig.cursor);
+    CHECK(buf.scroll == orig.scroll);
+    CHECK(buf.selection_start == orig.selection_start);
+    CHECK(std::vector<coord>(buf.cursors.begin(), buf.cursors.end())
+          == std::vector<coord>(orig.cursors.begin(), orig.cursors.end()));
+    REQUIRE(buf.history.entries.size() == orig.history.entries.size());
+    for (auto i = std::size_t{}; i < buf.history.entries.size(); ++i) {
+        auto& a = buf.history.entries[i];
+        auto& b = orig.history.entries[i];
+        CHECK(to_string(a.content) == to_string(b.content));
+        CHECK(a.offsets == b.offsets);
+        CHECK(a.cursor == b.cursor);
+    }
+    CHECK(is_dirty(buf) == is_dirty(orig));
+
+    REQUIRE(restored.buffers.size() == 1);
+    CHECK(to_string(restored.buffers[0].content) == "scratch\n");
+    CHECK(restored.last_buffer_id == 2);
+    REQUIRE(restored.clipboard.entries.size() == 1);
+    CHECK(to_string(restored.clipboard.entries[0].content) == "killed\ntext\n");
+    CHECK(restored.last_search.get() == "line");
+
+    SECTION("undo goes back to the saved snapshots")
+    {
+        auto undone = undo(undo(buf));
+        CHECK(to_string(undone.content)
+              == "first line\nsecond line\nthird\n");
+    }
+}
+
+TEST_CASE("positions past the end of the text are clamped")
+{
+    auto workers = executor{2};
+    auto file    = temp_state{};
+    auto app     = make_application();
+    app.current.cursor  = {100, 5};
+    app.current.scroll  = {200, -3};
+    app.current.selection_start = coord{1, 1000};
+    app.current.cursors = cursor_set{}.push_back({0, 50}).push_back({100, 0});
+    save_state(file.name, app);
+
+    auto init = application{{24, 80}, key_map{}};
+    auto buf  = restore_state(workers, file.name, init).first.current;
+    auto rows = (ewig::index)buf.content.size();
+    CHECK(buf.cursor == coord{rows, 0});
+    CHECK(buf.scroll == coord{rows, 0});
+    CHECK(buf.selection_start == coord{1, line_length(buf.content[1])});
+    CHECK(std::vector<coord>(buf.cursors.begin(), buf.cursors.end())
+          == std::vector<coord>{coord{0, line_length(buf.content[0])}});
+}
+
+TEST_CASE("saves at the same time do not get in each other's way")
+{
+    auto workers = executor{2};
+    auto file    = temp_state{};
+    auto app     = make_application();
+    auto errors  = std::atomic<int>{0};
+    auto savers  = std::vector<std::thread>{};
+    for (auto i = 0; i < 4; ++i)
+        savers.emplace_back([&] {
+            for (auto j = 0; j < 20; ++j) {
+                try {
+                    save_state(file.name, app);
+                } catch (...) {
+                    ++errors;
+                }
+            }
+        });
+    for (auto& saver : savers)
+        saver.join();
+    CHECK(errors == 0);
+
+    auto init = application{{24, 80}, key_map{}};
+    auto buf  = restore_state(workers, file.name, init).first.current;
+    CHECK(to_string(buf.content) == to_string(app.current.content));
+
+    // and no temporary file is left behind
+    auto found = ::glob_t{};
+    auto left  = ::glob((file.name + ".*").c_str(), 0, nullptr, &found);
+    CHECK(left == GLOB_NOMATCH);
+    ::globfree(&found);
+}
+
+TEST_CASE("corrupt state files are rejected")
+{
+    auto workers = executor{2};
+    auto file    = temp_state{};
+    save_state(file.name, make_application());
+    auto data = file.read();
+    auto init = application{{24, 80}, key_map{}};
+
+    SECTION("not a state file")
+    {
+        file.write("just some text\n");
+        CHECK_THROWS_AS(restore_state(workers, file.name, init),
+                        std::runtime_error);
+    }
+
+    SECTION("truncated")
+    {
+        for (auto size = std::size_t{}; size < data.size(); ++size) {
+            file.write(data.substr(0, size));
+            CHECK_THROWS_AS(restore_state(workers, file.name, init),
+                            std::runtime_error);
+        }
+    }
+
+    SECTION("with bytes changed")
+    {
+        // whatever the bytes, either it is rejected or it gives some
+        // buffers that can be used
+        for (auto pos = std::size_t{}; pos < data.size(); ++pos) {
+            for (auto flip : {0x01, 0x80, 0xff}) {
+                auto changed = data;
+                changed[pos] = char(changed[pos] ^ flip);
+                file.write(changed);
+                try {
+                    auto buf = restore_state(workers, file.name, init)
+                        .first.current;
+                    CHECK(buf.offsets.size() == (ewig::index)buf.content.size());
+                    CHECK(buf.cursor.row <= (ewig::index)buf.content.size());
+                } catch (const std::runtime_error&) {}
+            }
+        }
+    }
+}